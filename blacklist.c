@@ -0,0 +1,747 @@
+/*
+ * blacklist.c
+ *
+ * Offline tools for UrlBlacklist rule files
+ *
+ *   compile: parse a rule file once and write a binary image the proxy maps,
+ *            optionally without the rules that change no verdict
+ *   info: load a rule file or image and print its tables
+ *   classify: look up a file of hostnames on every core, per line or by rule
+ *   add, remove: change the blacklist of a running proxy
+ *   hits, unused: rules of a running proxy that block the most, or never
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "url_blacklist.h"
+
+/* Control socket the proxy listens on in its working directory */
+#define CONTROL_SOCKET "blacklist.sock"
+
+/* Hostnames a classify thread takes at once, lines are never split */
+#define CLASSIFY_SLICE (1 << 20)
+/* Longer names are not hostnames and are reported as allowed */
+#define CLASSIFY_HOST_MAX 256
+
+static double elapsed(struct timespec *start)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s compile [-O [-l]] [-r report] <blacklist.txt> <blacklist.bin>\n", name);
+  fprintf(stderr, "       %s info <blacklist.txt|blacklist.bin>\n", name);
+  fprintf(stderr, "       %s add|remove <rule> [socket]\n", name);
+  fprintf(stderr, "       %s hits [top [socket]]\n", name);
+  fprintf(stderr, "       %s unused [socket]\n", name);
+  fprintf(stderr, "       %s classify [-j threads] [-s] <blacklist> <hosts> [output]\n", name);
+  fprintf(stderr, "  compile -O drops rules that change no verdict, -r lists them with why\n");
+  fprintf(stderr, "  compile -l keeps whitelist rules for the lists layered under it\n");
+  fprintf(stderr, "  classify takes the first field of each line, -s counts hosts by rule instead\n");
+  exit(1);
+}
+
+static const char *redundancy_names[] = {
+    [URL_BLACKLIST_DUPLICATE] = "duplicate",
+    [URL_BLACKLIST_PARENT] = "parent",
+    [URL_BLACKLIST_WILDCARD] = "wildcard",
+    [URL_BLACKLIST_UNBLOCKS_NOTHING] = "unblocks-nothing",
+};
+
+/**
+ * Length of the rule at offset without a trailing comment
+ */
+static int rule_length(UrlBlacklist *bl, unsigned int offset)
+{
+  char *rule = bl->file + offset, *end = bl->file + bl->file_size, *p = rule;
+
+  while (p < end && *p != bl->delim && *p != ' ' && *p != '\t' && *p != '\r')
+    p++;
+
+  return p - rule;
+}
+
+/**
+ * Whether a host made from the rule at offset, and one under it, are
+ * blocked the same by bl and optimized. Wildcards become a label
+ */
+static char same_verdicts(UrlBlacklist *bl, UrlBlacklist *optimized, unsigned int offset)
+{
+  char host[CLASSIFY_HOST_MAX + 16] = "check.";
+  char *rule = bl->file + offset;
+  int length = rule_length(bl, offset);
+
+  rule += *rule == '!';
+  length -= rule != bl->file + offset;
+  if (length > CLASSIFY_HOST_MAX)
+    return 1;
+
+  for (int i = 0; i < length; i++)
+    host[6 + i] = rule[i] == '*' ? 'x' : rule[i];
+  host[6 + length] = '\0';
+
+  return !UrlBlacklist_exists(bl, host + 6) == !UrlBlacklist_exists(optimized, host + 6) &&
+         !UrlBlacklist_exists(bl, host) == !UrlBlacklist_exists(optimized, host);
+}
+
+/**
+ * Load bl without its redundant rules into optimized and report them, one
+ * per line with why and the rule deciding instead. Returns 0 on success
+ */
+static int optimize(UrlBlacklist *bl, UrlBlacklist *optimized, char alone, char *report)
+{
+  UrlBlacklistRedundant *redundant;
+  int count = UrlBlacklist_redundant(bl, alone, &redundant);
+  if (count < 0)
+  {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+
+  // the lines kept go through a file like any other list
+  char path[] = "/tmp/blacklist-XXXXXX";
+  int fd = mkstemp(path);
+  FILE *kept = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (!kept)
+  {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    free(redundant);
+    return 1;
+  }
+
+  char *file_end = bl->file + bl->file_size;
+  int next = 0;
+  for (char *line = bl->file; line < file_end;)
+  {
+    char *line_end = memchr(line, bl->delim, file_end - line);
+    line_end = line_end ? line_end + 1 : file_end;
+
+    if (next < count && bl->file + redundant[next].rule < line_end)
+      next++;
+    else
+      fwrite(line, 1, line_end - line, kept);
+
+    line = line_end;
+  }
+
+  int failed = fclose(kept) != 0 || !UrlBlacklist_new(optimized, path, bl->delim);
+  unlink(path);
+  if (failed)
+  {
+    fprintf(stderr, "Could not load the optimized rules\n");
+    free(redundant);
+    return 1;
+  }
+
+  FILE *out = report ? fopen(report, "w") : NULL;
+  if (report && !out)
+    perror(report);
+
+  unsigned int reasons[sizeof(redundancy_names) / sizeof(*redundancy_names)] = {0};
+  unsigned int mismatches = 0;
+  for (int i = 0; i < count; i++)
+  {
+    UrlBlacklistRedundant *item = &redundant[i];
+    reasons[item->reason]++;
+    mismatches += !same_verdicts(bl, optimized, item->rule);
+
+    if (out)
+      fprintf(out, "%s\t%.*s\t%.*s\n", redundancy_names[item->reason], rule_length(bl, item->rule), bl->file + item->rule,
+              rule_length(bl, item->by), bl->file + item->by);
+  }
+
+  if (out)
+    fclose(out);
+  free(redundant);
+
+  printf("dropped %d rules: %u duplicates, %u under a parent, %u under a wildcard, %u whitelists unblocking nothing\n", count,
+         reasons[URL_BLACKLIST_DUPLICATE], reasons[URL_BLACKLIST_PARENT], reasons[URL_BLACKLIST_WILDCARD], reasons[URL_BLACKLIST_UNBLOCKS_NOTHING]);
+
+  if (mismatches)
+  {
+    fprintf(stderr, "%u dropped rules change a verdict, not writing the image\n", mismatches);
+    UrlBlacklist_free(optimized);
+    return 1;
+  }
+
+  return 0;
+}
+
+static int compile(char *source, char *target, char optimized, char layered, char *report)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  UrlBlacklist bl, full;
+  if (!UrlBlacklist_new(optimized ? &full : &bl, source, '\n'))
+  {
+    fprintf(stderr, "Could not load %s\n", source);
+    return 1;
+  }
+
+  if (optimized)
+  {
+    int failed = optimize(&full, &bl, !layered, report);
+    UrlBlacklist_free(&full);
+
+    if (failed)
+      return 1;
+  }
+
+  double parsed = elapsed(&start);
+
+  if (UrlBlacklist_save(&bl, target))
+  {
+    perror(target);
+    UrlBlacklist_free(&bl);
+    return 1;
+  }
+
+  double saved = elapsed(&start);
+  UrlBlacklist_free(&bl);
+
+  // time what the proxy will pay at startup
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (!UrlBlacklist_new(&bl, target, '\n'))
+  {
+    fprintf(stderr, "Could not load the written image %s\n", target);
+    return 1;
+  }
+  double opened = elapsed(&start);
+
+  printf("%s: parsed in %.1fms, written in %.1fms\n", source, parsed * 1e3, (saved - parsed) * 1e3);
+  printf("%s: %zu bytes, %u nodes, %u glob rules, opens in %.1fus\n", target, bl.image_size, bl.node_count, bl.glob_count, opened * 1e6);
+
+  UrlBlacklist_free(&bl);
+
+  return 0;
+}
+
+static int info(char *filename)
+{
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  UrlBlacklist bl;
+  if (!UrlBlacklist_new(&bl, filename, '\n'))
+  {
+    fprintf(stderr, "Could not load %s\n", filename);
+    return 1;
+  }
+
+  printf("%s: %s, loaded in %.3fms\n", filename, bl.image ? "image" : "text", elapsed(&start) * 1e3);
+  UrlBlacklist_print_table(&bl);
+  UrlBlacklist_free(&bl);
+
+  return 0;
+}
+
+/**
+ * Connection to the control socket of a running proxy, -1 on failure
+ */
+static int control_connect(char *path)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un control = {AF_UNIX};
+  strncpy(control.sun_path, path, sizeof(control.sun_path) - 1);
+
+  if (fd < 0 || connect(fd, (struct sockaddr *)&control, sizeof(control)))
+  {
+    perror(path);
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Send one change to a running proxy and print its answer
+ */
+static int change(char sign, char *rule, char *path)
+{
+  int fd = control_connect(path);
+  if (fd < 0)
+    return 1;
+
+  char request[1024];
+  int length = snprintf(request, sizeof(request), "%c%s\n", sign, rule);
+  if (length >= sizeof(request) || write(fd, request, length) != length)
+  {
+    fprintf(stderr, "Could not send %s\n", rule);
+    close(fd);
+    return 1;
+  }
+
+  char reply[256];
+  ssize_t n = read(fd, reply, sizeof(reply) - 1);
+  close(fd);
+
+  if (n <= 0)
+  {
+    fprintf(stderr, "No answer from the proxy\n");
+    return 1;
+  }
+
+  reply[n] = '\0';
+  fputs(reply, stdout);
+
+  return strncmp(reply, "ok", 2) != 0;
+}
+
+/**
+ * Ask a running proxy for its rule hits and print them as they come
+ */
+static int hits(char *request, char *path)
+{
+  int fd = control_connect(path);
+  if (fd < 0)
+    return 1;
+
+  if (write(fd, request, strlen(request)) != strlen(request))
+  {
+    fprintf(stderr, "Could not send %s", request);
+    close(fd);
+    return 1;
+  }
+
+  char reply[4096];
+  ssize_t n, total = 0;
+  char error = 0;
+  while ((n = read(fd, reply, sizeof(reply))) > 0)
+  {
+    error |= !total && !strncmp(reply, "error", n < 5 ? n : 5);
+    fwrite(reply, 1, n, stdout);
+    total += n;
+  }
+  close(fd);
+
+  if (!total)
+    fprintf(stderr, "No answer from the proxy\n");
+
+  return !total || error;
+}
+
+/**
+ * Hosts blocked by one rule
+ */
+typedef struct RuleCount
+{
+  char *rule;
+  size_t count;
+} RuleCount;
+
+/**
+ * Open addressed by rule, rules are unique pointers into the blacklist
+ */
+typedef struct RuleCounts
+{
+  RuleCount *slots;
+  size_t mask;
+  size_t used;
+} RuleCounts;
+
+static size_t rule_slot(RuleCounts *counts, char *rule)
+{
+  return ((uintptr_t)rule * 0x9e3779b97f4a7c15ull >> 24) & counts->mask;
+}
+
+static char rule_counts_add(RuleCounts *counts, char *rule, size_t count)
+{
+  if ((counts->used + 1) * 2 > counts->mask + 1)
+  {
+    size_t mask = counts->mask ? counts->mask * 2 + 1 : 1023;
+    RuleCounts grown = {calloc(mask + 1, sizeof(*grown.slots)), mask, 0};
+    if (!grown.slots)
+      return 0;
+
+    for (size_t i = 0; counts->slots && i <= counts->mask; i++)
+    {
+      if (counts->slots[i].rule)
+        rule_counts_add(&grown, counts->slots[i].rule, counts->slots[i].count);
+    }
+
+    free(counts->slots);
+    *counts = grown;
+  }
+
+  size_t i = rule_slot(counts, rule);
+  for (; counts->slots[i].rule && counts->slots[i].rule != rule; i = (i + 1) & counts->mask)
+    ;
+
+  counts->used += !counts->slots[i].rule;
+  counts->slots[i].rule = rule;
+  counts->slots[i].count += count;
+
+  return 1;
+}
+
+static int rule_count_compare(const void *a, const void *b)
+{
+  const RuleCount *x = a, *y = b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+typedef struct Classify
+{
+  UrlBlacklist *bl;
+  char *hosts;
+  size_t size;
+  FILE *output;
+  char summary;
+
+  /**
+   * Next slice to take and next one to write, slices are written in order
+   */
+  size_t next_slice;
+  size_t next_write;
+  pthread_mutex_t mutex;
+  pthread_cond_t written;
+} Classify;
+
+typedef struct ClassifyArg
+{
+  pthread_t thread_id;
+  Classify *classify;
+  size_t lines;
+  size_t blocked;
+  RuleCounts counts;
+  char failed;
+} ClassifyArg;
+
+/**
+ * Start of the line at or after offset
+ */
+static char *line_start(Classify *classify, size_t offset)
+{
+  if (!offset)
+    return classify->hosts;
+  if (offset >= classify->size)
+    return classify->hosts + classify->size;
+
+  char *newline = memchr(classify->hosts + offset - 1, '\n', classify->size - offset + 1);
+  return newline ? newline + 1 : classify->hosts + classify->size;
+}
+
+static char *rule_end(UrlBlacklist *bl, char *rule)
+{
+  while (*rule && *rule != bl->delim)
+    rule++;
+
+  return rule;
+}
+
+static char append(char **buffer, size_t *length, size_t *capacity, const char *text, size_t size)
+{
+  if (*length + size > *capacity)
+  {
+    size_t grown = *capacity ? *capacity : 1 << 16;
+    while (grown < *length + size)
+      grown *= 2;
+
+    char *bigger = realloc(*buffer, grown);
+    if (!bigger)
+      return 0;
+
+    *buffer = bigger;
+    *capacity = grown;
+  }
+
+  memcpy(*buffer + *length, text, size);
+  *length += size;
+
+  return 1;
+}
+
+static void *classify_thread(ClassifyArg *arg)
+{
+  Classify *classify = arg->classify;
+  char names[URL_BLACKLIST_BATCH][CLASSIFY_HOST_MAX];
+  char *hosts[URL_BLACKLIST_BATCH], *rules[URL_BLACKLIST_BATCH];
+  char *output = NULL;
+  size_t output_capacity = 0;
+
+  for (size_t i = 0; i < URL_BLACKLIST_BATCH; i++)
+    hosts[i] = names[i];
+
+  for (;;)
+  {
+    size_t slice = __atomic_fetch_add(&classify->next_slice, 1, __ATOMIC_RELAXED);
+    if (slice * CLASSIFY_SLICE >= classify->size)
+      break;
+
+    char *cursor = line_start(classify, slice * CLASSIFY_SLICE);
+    char *end = line_start(classify, (slice + 1) * CLASSIFY_SLICE);
+    size_t output_length = 0;
+
+    while (cursor < end)
+    {
+      // copy a batch of hostnames out of the lines, lowercased and
+      // without the root dot
+      unsigned int count = 0;
+
+      for (; count < URL_BLACKLIST_BATCH && cursor < end; count++)
+      {
+        char *line_end = memchr(cursor, '\n', end - cursor);
+        line_end = line_end ? line_end : end;
+
+        // the last line may end the mapping without a newline
+        char *host = cursor, *host_end;
+        while (host < line_end && (*host == ' ' || *host == '\t'))
+          host++;
+        for (host_end = host; host_end < line_end && !isspace((unsigned char)*host_end); host_end++)
+          ;
+
+        size_t length = host_end - host;
+        if (length && host[length - 1] == '.')
+          length--;
+        if (length >= CLASSIFY_HOST_MAX)
+          length = 0;
+
+        memcpy(names[count], host, length);
+        names[count][length] = '\0';
+        UrlBlacklist_scan_host(names[count], 1, NULL);
+
+        cursor = line_end + 1;
+      }
+
+      UrlBlacklist_exists_batch(classify->bl, hosts, count, rules);
+      arg->lines += count;
+
+      for (unsigned int i = 0; i < count; i++)
+      {
+        arg->blocked += !!rules[i];
+
+        if (classify->summary)
+        {
+          arg->failed |= rules[i] && !rule_counts_add(&arg->counts, rules[i], 1);
+          continue;
+        }
+
+        char *rule = rules[i];
+        size_t length = strlen(names[i]);
+
+        arg->failed |= !append(&output, &output_length, &output_capacity, names[i], length);
+        if (rule)
+        {
+          arg->failed |= !append(&output, &output_length, &output_capacity, "\tblocked\t", 9);
+          arg->failed |= !append(&output, &output_length, &output_capacity, rule, rule_end(classify->bl, rule) - rule);
+          arg->failed |= !append(&output, &output_length, &output_capacity, "\n", 1);
+        }
+        else
+        {
+          arg->failed |= !append(&output, &output_length, &output_capacity, "\tallowed\n", 9);
+        }
+      }
+    }
+
+    if (classify->summary)
+      continue;
+
+    // slices go out in input order
+    pthread_mutex_lock(&classify->mutex);
+    while (classify->next_write != slice)
+      pthread_cond_wait(&classify->written, &classify->mutex);
+    pthread_mutex_unlock(&classify->mutex);
+
+    arg->failed |= fwrite(output, 1, output_length, classify->output) != output_length;
+
+    pthread_mutex_lock(&classify->mutex);
+    classify->next_write++;
+    pthread_cond_broadcast(&classify->written);
+    pthread_mutex_unlock(&classify->mutex);
+  }
+
+  free(output);
+
+  return NULL;
+}
+
+/**
+ * Verdict for every line of a file of hostnames, or hosts per rule with
+ * summary
+ */
+static int classify(char *blacklist, char *filename, char *output_name, long threads, char summary)
+{
+  struct timespec start;
+  UrlBlacklist bl;
+
+  if (!UrlBlacklist_new(&bl, blacklist, '\n'))
+  {
+    fprintf(stderr, "Could not load %s\n", blacklist);
+    return 1;
+  }
+
+  int fd = open(filename, O_RDONLY);
+  struct stat stat;
+  if (fd < 0 || fstat(fd, &stat))
+  {
+    perror(filename);
+    UrlBlacklist_free(&bl);
+    return 1;
+  }
+
+  char *hosts = stat.st_size ? mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (hosts == MAP_FAILED)
+  {
+    perror("mmap");
+    UrlBlacklist_free(&bl);
+    return 1;
+  }
+  madvise(hosts, stat.st_size, MADV_SEQUENTIAL);
+
+  FILE *output = output_name ? fopen(output_name, "w") : stdout;
+  if (!output)
+  {
+    perror(output_name);
+    munmap(hosts, stat.st_size);
+    UrlBlacklist_free(&bl);
+    return 1;
+  }
+
+  Classify shared = {&bl, hosts, stat.st_size, output, summary, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+  ClassifyArg *args = calloc(threads, sizeof(*args));
+  int failed = !args;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; !failed && i < threads; i++)
+  {
+    args[i].classify = &shared;
+    pthread_create(&args[i].thread_id, NULL, (void *(*)(void *))classify_thread, &args[i]);
+  }
+
+  size_t lines = 0, blocked = 0;
+  RuleCounts counts = {0};
+
+  for (long i = 0; !failed && i < threads; i++)
+  {
+    pthread_join(args[i].thread_id, NULL);
+    lines += args[i].lines;
+    blocked += args[i].blocked;
+    failed |= args[i].failed;
+
+    for (size_t j = 0; args[i].counts.slots && j <= args[i].counts.mask; j++)
+      failed |= args[i].counts.slots[j].rule && !rule_counts_add(&counts, args[i].counts.slots[j].rule, args[i].counts.slots[j].count);
+    free(args[i].counts.slots);
+  }
+  double seconds = elapsed(&start);
+
+  if (summary && !failed)
+  {
+    // most hits first
+    size_t used = 0;
+    for (size_t i = 0; counts.slots && i <= counts.mask; i++)
+    {
+      if (counts.slots[i].rule)
+        counts.slots[used++] = counts.slots[i];
+    }
+    qsort(counts.slots, used, sizeof(*counts.slots), rule_count_compare);
+
+    fprintf(output, "%zu\tallowed\n", lines - blocked);
+    for (size_t i = 0; i < used; i++)
+      fprintf(output, "%zu\t%.*s\n", counts.slots[i].count, (int)(rule_end(&bl, counts.slots[i].rule) - counts.slots[i].rule), counts.slots[i].rule);
+  }
+
+  if (output_name)
+    failed |= fclose(output) != 0;
+  else
+    fflush(stdout);
+
+  fprintf(stderr, "%s: %zu hosts, %zu blocked, %.3fs on %ld threads, %.1fM lookups/s\n",
+          filename, lines, blocked, seconds, threads, seconds > 0 ? lines / seconds / 1e6 : 0);
+
+  free(counts.slots);
+  free(args);
+  if (hosts)
+    munmap(hosts, stat.st_size);
+  UrlBlacklist_free(&bl);
+
+  return failed;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc >= 4 && !strcmp(argv[1], "compile"))
+  {
+    char optimized = 0, layered = 0;
+    char *report = NULL;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "Olr:")) != -1)
+    {
+      if (opt == 'O')
+        optimized = 1;
+      else if (opt == 'l')
+        layered = 1;
+      else if (opt == 'r')
+        report = optarg;
+      else
+        usage(argv[0]);
+    }
+
+    if (argc - optind != 2 || ((report || layered) && !optimized))
+      usage(argv[0]);
+
+    return compile(argv[optind], argv[optind + 1], optimized, layered, report);
+  }
+
+  if (argc == 3 && !strcmp(argv[1], "info"))
+    return info(argv[2]);
+
+  if (argc >= 2 && !strcmp(argv[1], "classify"))
+  {
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char summary = 0;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "j:s")) != -1)
+    {
+      if (opt == 'j')
+        threads = atoi(optarg);
+      else if (opt == 's')
+        summary = 1;
+      else
+        usage(argv[0]);
+    }
+
+    if (threads < 1 || argc - optind < 2 || argc - optind > 3)
+      usage(argv[0]);
+
+    return classify(argv[optind], argv[optind + 1], argc - optind == 3 ? argv[optind + 2] : NULL, threads, summary);
+  }
+
+  if ((argc == 3 || argc == 4) && (!strcmp(argv[1], "add") || !strcmp(argv[1], "remove")))
+    return change(*argv[1] == 'a' ? '+' : '-', argv[2], argc == 4 ? argv[3] : CONTROL_SOCKET);
+
+  if (argc >= 2 && argc <= 4 && !strcmp(argv[1], "hits"))
+  {
+    char request[32];
+    snprintf(request, sizeof(request), "hits %d\n", argc >= 3 ? atoi(argv[2]) : 20);
+    return hits(request, argc == 4 ? argv[3] : CONTROL_SOCKET);
+  }
+
+  if ((argc == 2 || argc == 3) && !strcmp(argv[1], "unused"))
+    return hits("unused\n", argc == 3 ? argv[2] : CONTROL_SOCKET);
+
+  usage(argv[0]);
+}
@@ -0,0 +1,532 @@
+/*
+ * cache_sim.c
+ *
+ * Replays the requests recorded in proxy.log against the cache eviction
+ * policies for a sweep of cache sizes
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache_policy.h"
+
+/* Same limits as the proxy */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+#define MAX_SIZES 32
+
+/**
+ * One request in the trace
+ */
+typedef struct Event
+{
+  unsigned long long hash;
+  /**
+   * Dense object id, assigned after parsing
+   */
+  unsigned int id;
+  /**
+   * 0 for range hits, the size of the object is not in the log
+   */
+  unsigned int size;
+} Event;
+
+typedef struct EventList
+{
+  Event *events;
+  size_t length;
+  size_t capacity;
+} EventList;
+
+typedef struct ParseArg
+{
+  pthread_t thread_id;
+  const char *start;
+  const char *end;
+  EventList list;
+  size_t lines;
+} ParseArg;
+
+typedef struct SimEntry
+{
+  CachePolicyNode node;
+  char resident;
+} SimEntry;
+
+typedef struct SimConfig
+{
+  cache_policy_t policy;
+  size_t capacity;
+
+  unsigned long hits;
+  unsigned long long bytes;
+  unsigned long long bytes_hit;
+  unsigned long evictions;
+} SimConfig;
+
+typedef struct Trace
+{
+  Event *events;
+  size_t length;
+  unsigned int objects;
+  size_t max_object_size;
+  unsigned long long mean_size;
+} Trace;
+
+typedef struct SimArg
+{
+  pthread_t thread_id;
+  Trace *trace;
+  SimConfig *configs;
+  unsigned int config_count;
+  unsigned int *next_config;
+  pthread_mutex_t *mutex;
+} SimArg;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t parse_size(const char *str)
+{
+  char *end;
+  size_t size = strtoull(str, &end, 10);
+
+  switch (*end)
+  {
+  case 'g':
+  case 'G':
+    size <<= 10;
+  case 'm':
+  case 'M':
+    size <<= 10;
+  case 'k':
+  case 'K':
+    size <<= 10;
+  }
+
+  return size;
+}
+
+static void EventList_push(EventList *list, Event event)
+{
+  if (list->length == list->capacity)
+  {
+    list->capacity = list->capacity ? list->capacity << 1 : 1024;
+    list->events = realloc(list->events, list->capacity * sizeof(Event));
+  }
+
+  list->events[list->length++] = event;
+}
+
+/**
+ * FNV-1a
+ */
+static inline unsigned long long hash_uri(const char *str, size_t len)
+{
+  unsigned long long hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)str[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+/**
+ * Picks request lines out of a log entry
+ *
+ * [date] ip uri [payload size: N] ...        relayed from the origin
+ * [date] ip uri served N bytes from cache ... served from the cache
+ */
+static inline void parse_line(EventList *list, const char *line, const char *end)
+{
+  if (*line != '[')
+    return;
+
+  const char *p = memchr(line, ']', end - line);
+  if (!p || p + 2 >= end)
+    return;
+
+  // ip
+  p += 2;
+  p = memchr(p, ' ', end - p);
+  if (!p)
+    return;
+
+  const char *uri = p + 1;
+  if (end - uri < 7 || memcmp(uri, "http", 4))
+    return;
+
+  const char *uri_end = memchr(uri, ' ', end - uri);
+  if (!uri_end)
+    return;
+
+  const char *rest = uri_end + 1;
+  size_t rest_len = end - rest;
+  Event event = {0};
+
+  if (rest_len > 15 && !memcmp(rest, "[payload size: ", 15))
+  {
+    event.size = strtoul(rest + 15, NULL, 10);
+  }
+  else if (rest_len > 7 && !memcmp(rest, "served ", 7))
+  {
+    event.size = memmem(rest, rest_len, "(range)", 7) ? 0 : strtoul(rest + 7, NULL, 10);
+  }
+  else
+  {
+    return;
+  }
+
+  event.hash = hash_uri(uri, uri_end - uri);
+  EventList_push(list, event);
+}
+
+void *parse_thread(ParseArg *arg)
+{
+  const char *line = arg->start;
+
+  while (line < arg->end)
+  {
+    const char *newline = memchr(line, '\n', arg->end - line);
+    if (!newline)
+      newline = arg->end;
+
+    parse_line(&arg->list, line, newline);
+    arg->lines++;
+
+    line = newline + 1;
+  }
+
+  return NULL;
+}
+
+/**
+ * Gives every distinct uri a dense id and fills in sizes of range hits
+ */
+static void intern(Trace *trace)
+{
+  size_t table_size = 1024;
+  while (table_size < trace->length * 2)
+    table_size <<= 1;
+
+  size_t mask = table_size - 1;
+  unsigned long long *keys = calloc(table_size, sizeof(*keys));
+  unsigned int *ids = malloc(table_size * sizeof(*ids));
+  unsigned int *sizes = NULL;
+  unsigned int sizes_capacity = 0;
+
+  unsigned int objects = 0;
+  unsigned long long total_size = 0;
+  size_t kept = 0;
+
+  for (size_t i = 0; i < trace->length; i++)
+  {
+    Event event = trace->events[i];
+
+    // 0 is the empty marker
+    unsigned long long key = event.hash ? event.hash : 1;
+    size_t index = key & mask;
+
+    while (keys[index] && keys[index] != key)
+      index = (index + 1) & mask;
+
+    if (!keys[index])
+    {
+      keys[index] = key;
+      ids[index] = objects++;
+
+      if (objects > sizes_capacity)
+      {
+        sizes_capacity = sizes_capacity ? sizes_capacity << 1 : 1024;
+        sizes = realloc(sizes, sizes_capacity * sizeof(*sizes));
+      }
+      sizes[objects - 1] = 0;
+    }
+
+    event.id = ids[index];
+
+    if (event.size)
+      sizes[event.id] = event.size;
+    else
+      event.size = sizes[event.id];
+
+    // range hit on an object we never saw in full
+    if (!event.size)
+      continue;
+
+    total_size += event.size;
+    trace->events[kept++] = event;
+  }
+
+  trace->length = kept;
+  trace->objects = objects;
+  trace->mean_size = kept ? total_size / kept : 0;
+
+  free(keys);
+  free(ids);
+  free(sizes);
+}
+
+static void evict(void *ctx, CachePolicyNode *node)
+{
+  ((SimEntry *)node)->resident = 0;
+}
+
+static void simulate(Trace *trace, SimConfig *config)
+{
+  SimEntry *entries = calloc(trace->objects, sizeof(SimEntry));
+
+  size_t expected_entries = config->capacity / (trace->mean_size ? trace->mean_size : 1);
+
+  CachePolicy policy;
+  CachePolicy_new(&policy, config->policy, config->capacity, expected_entries, evict, NULL);
+
+  for (size_t i = 0; i < trace->length; i++)
+  {
+    Event *event = &trace->events[i];
+    SimEntry *entry = &entries[event->id];
+
+    config->bytes += event->size;
+    CachePolicy_record(&policy, event->hash);
+
+    if (entry->resident)
+    {
+      config->hits++;
+      config->bytes_hit += event->size;
+      CachePolicy_hit(&policy, &entry->node);
+      continue;
+    }
+
+    if (event->size > trace->max_object_size || event->size > config->capacity)
+      continue;
+
+    entry->node.hash = event->hash;
+    entry->node.size = event->size;
+    entry->resident = 1;
+    CachePolicy_insert(&policy, &entry->node);
+  }
+
+  config->evictions = policy.evictions;
+
+  CachePolicy_free(&policy);
+  free(entries);
+}
+
+void *sim_thread(SimArg *arg)
+{
+  for (;;)
+  {
+    pthread_mutex_lock(arg->mutex);
+    unsigned int i = (*arg->next_config)++;
+    pthread_mutex_unlock(arg->mutex);
+
+    if (i >= arg->config_count)
+      break;
+
+    simulate(arg->trace, &arg->configs[i]);
+  }
+
+  return NULL;
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-j threads] [-o max_object_size] [-p lru|tinylfu|all] <proxy.log> [cache sizes...]\n", name);
+  fprintf(stderr, "  sizes accept K, M and G suffixes, default sweeps 128K to 32M\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t max_object_size = MAX_OBJECT_SIZE;
+  char policies[2] = {1, 1};
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:o:p:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'o':
+      max_object_size = parse_size(optarg);
+      break;
+    case 'p':
+      policies[CACHE_POLICY_LRU] = !strcmp(optarg, "lru") || !strcmp(optarg, "all");
+      policies[CACHE_POLICY_TINYLFU] = !strcmp(optarg, "tinylfu") || !strcmp(optarg, "all");
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || threads < 1)
+    usage(argv[0]);
+
+  size_t sizes[MAX_SIZES];
+  unsigned int size_count = 0;
+
+  for (int i = optind + 1; i < argc && size_count < MAX_SIZES; i++)
+    sizes[size_count++] = parse_size(argv[i]);
+
+  // powers of two around the size the proxy runs with
+  if (!size_count)
+  {
+    for (size_t size = 128 << 10; size <= 32 << 20; size <<= 1)
+    {
+      if (size > MAX_CACHE_SIZE && sizes[size_count - 1] < MAX_CACHE_SIZE)
+        sizes[size_count++] = MAX_CACHE_SIZE;
+      sizes[size_count++] = size;
+    }
+  }
+
+  // map the log
+  int fd = open(argv[optind], O_RDONLY);
+  if (fd < 0)
+  {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  struct stat stat;
+  fstat(fd, &stat);
+
+  if (!stat.st_size)
+  {
+    fprintf(stderr, "%s is empty\n", argv[optind]);
+    return 1;
+  }
+
+  char *file = mmap(NULL, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (file == MAP_FAILED)
+  {
+    perror("mmap");
+    return 1;
+  }
+  madvise(file, stat.st_size, MADV_SEQUENTIAL);
+
+  // parse, chunks are split on line boundaries
+  double parse_start = now();
+
+  ParseArg *parse_args = calloc(threads, sizeof(ParseArg));
+  const char *file_end = file + stat.st_size;
+  const char *chunk = file;
+
+  for (long i = 0; i < threads; i++)
+  {
+    const char *chunk_end = i == threads - 1 ? file_end : file + stat.st_size / threads * (i + 1);
+
+    if (chunk_end < chunk)
+      chunk_end = chunk;
+
+    const char *newline = memchr(chunk_end, '\n', file_end - chunk_end);
+    chunk_end = newline ? newline + 1 : file_end;
+
+    parse_args[i].start = chunk;
+    parse_args[i].end = chunk_end;
+    pthread_create(&parse_args[i].thread_id, NULL, (void *(*)(void *))parse_thread, &parse_args[i]);
+
+    chunk = chunk_end;
+  }
+
+  Trace trace = {0};
+  trace.max_object_size = max_object_size;
+  size_t lines = 0;
+
+  for (long i = 0; i < threads; i++)
+  {
+    pthread_join(parse_args[i].thread_id, NULL);
+    lines += parse_args[i].lines;
+    trace.length += parse_args[i].list.length;
+  }
+
+  trace.events = malloc((trace.length + 1) * sizeof(Event));
+  for (long i = 0, offset = 0; i < threads; i++)
+  {
+    memcpy(trace.events + offset, parse_args[i].list.events, parse_args[i].list.length * sizeof(Event));
+    offset += parse_args[i].list.length;
+    free(parse_args[i].list.events);
+  }
+  free(parse_args);
+
+  intern(&trace);
+
+  double parse_time = now() - parse_start;
+
+  munmap(file, stat.st_size);
+  close(fd);
+
+  printf("%zu lines, %zu requests, %u objects, mean size %llu bytes\n", lines, trace.length, trace.objects, trace.mean_size);
+  printf("parsed in %.3fs (%.1fM lines/s) with %ld threads\n\n", parse_time, lines / parse_time / 1e6, threads);
+
+  if (!trace.length)
+    return 0;
+
+  // simulate every policy and size
+  SimConfig configs[2 * MAX_SIZES];
+  unsigned int config_count = 0;
+
+  for (int policy = 0; policy < 2; policy++)
+  {
+    if (!policies[policy])
+      continue;
+
+    for (unsigned int i = 0; i < size_count; i++)
+      configs[config_count++] = (SimConfig){policy, sizes[i]};
+  }
+
+  double sim_start = now();
+
+  unsigned int next_config = 0;
+  pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  long sim_threads = threads < config_count ? threads : config_count;
+  SimArg *sim_args = calloc(sim_threads, sizeof(SimArg));
+
+  for (long i = 0; i < sim_threads; i++)
+  {
+    sim_args[i] = (SimArg){0, &trace, configs, config_count, &next_config, &mutex};
+    pthread_create(&sim_args[i].thread_id, NULL, (void *(*)(void *))sim_thread, &sim_args[i]);
+  }
+
+  for (long i = 0; i < sim_threads; i++)
+    pthread_join(sim_args[i].thread_id, NULL);
+
+  free(sim_args);
+
+  double sim_time = now() - sim_start;
+
+  printf("%-10s %12s %10s %10s %12s\n", "policy", "cache size", "hit ratio", "byte hit", "evictions");
+  for (unsigned int i = 0; i < config_count; i++)
+  {
+    SimConfig *config = &configs[i];
+    printf(
+        "%-10s %12zu %10.4f %10.4f %12lu%s\n",
+        CachePolicy_name(config->policy),
+        config->capacity,
+        (double)config->hits / trace.length,
+        config->bytes ? (double)config->bytes_hit / config->bytes : 0,
+        config->evictions,
+        config->capacity == MAX_CACHE_SIZE ? "  <- proxy" : "");
+  }
+
+  printf("\nreplayed %u configurations in %.3fs (%.1fM requests/s)\n", config_count, sim_time, (double)trace.length * config_count / sim_time / 1e6);
+
+  free(trace.events);
+
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blacklist_sources.h"
+
+/**
+ * A new list for source, NULL when it can't be loaded
+ */
+static UrlBlacklist *_source_load(BlacklistSource *source)
+{
+  UrlBlacklist *bl = malloc(sizeof(*bl));
+
+  if (!bl || !UrlBlacklist_new(bl, source->filename, '\n'))
+  {
+    fprintf(stderr, "Could not load the source %s\n", source->filename);
+    free(bl);
+    return NULL;
+  }
+
+  bl->whitelist_local = source->whitelist_local;
+
+  return bl;
+}
+
+BlacklistSources *BlacklistSources_new(BlacklistSources *set, char *filename)
+{
+  set->sources = NULL;
+  set->source_count = 0;
+  set->upper = NULL;
+
+  FILE *file = fopen(filename, "r");
+  if (!file)
+    return set;
+
+  if (!(set->sources = malloc(BLACKLIST_SOURCES_MAX * sizeof(*set->sources))))
+  {
+    fclose(file);
+    return NULL;
+  }
+
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned int line_number = 0;
+
+  while (getline(&line, &line_size, file) > 0)
+  {
+    line_number++;
+
+    // priority, rule file, then an optional local and comment
+    char *priority = line + strspn(line, " \t");
+    if (*priority == '#' || !priority[strspn(priority, " \t\r\n")])
+      continue;
+
+    char *name = priority;
+    long value = strtol(priority, &name, 10);
+    name += strspn(name, " \t");
+    unsigned int name_length = strcspn(name, " \t\r\n");
+    char *rest = name + name_length;
+    rest += strspn(rest, " \t");
+
+    char local = !strncmp(rest, "local", 5) && (!rest[5] || strchr(" \t\r\n#", rest[5]));
+    rest += local ? 5 : 0;
+    rest += strspn(rest, " \t\r\n");
+
+    if (name == priority || !name_length || (*rest && *rest != '#') || set->source_count == BLACKLIST_SOURCES_MAX)
+    {
+      fprintf(stderr, "%s:%u: expected a priority and a rule file\n", filename, line_number);
+      goto fail;
+    }
+
+    // after every source of a higher or the same priority
+    unsigned int index = set->source_count;
+    for (; index > 0 && set->sources[index - 1].priority < value; index--)
+      set->sources[index] = set->sources[index - 1];
+
+    BlacklistSource *source = &set->sources[index];
+    *source = (BlacklistSource){strndup(name, name_length), value, local, NULL};
+    set->source_count++;
+
+    if (!source->filename)
+      goto fail;
+  }
+
+  free(line);
+  fclose(file);
+
+  for (unsigned int i = 0; i < set->source_count; i++)
+  {
+    if (!(set->sources[i].bl = _source_load(&set->sources[i])))
+      goto fail_loaded;
+  }
+
+  for (unsigned int i = 1; i < set->source_count; i++)
+    set->sources[i - 1].bl->base = set->sources[i].bl;
+
+  return set;
+
+fail:
+  free(line);
+  fclose(file);
+
+fail_loaded:
+  BlacklistSources_free(set);
+
+  return NULL;
+}
+
+void BlacklistSources_free(BlacklistSources *set)
+{
+  for (unsigned int i = 0; i < set->source_count; i++)
+  {
+    if (set->sources[i].bl)
+    {
+      UrlBlacklist_free(set->sources[i].bl);
+      free(set->sources[i].bl);
+    }
+
+    free(set->sources[i].filename);
+  }
+
+  free(set->sources);
+}
+
+void BlacklistSources_attach(BlacklistSources *set, UrlBlacklist *upper)
+{
+  set->upper = upper;
+
+  if (upper)
+    __atomic_store_n(&upper->base, set->source_count ? set->sources[0].bl : NULL, __ATOMIC_RELEASE);
+}
+
+int BlacklistSources_find(BlacklistSources *set, const char *filename)
+{
+  for (unsigned int i = 0; i < set->source_count; i++)
+  {
+    if (!strcmp(set->sources[i].filename, filename))
+      return i;
+  }
+
+  return -1;
+}
+
+UrlBlacklist *BlacklistSources_reload(BlacklistSources *set, unsigned int index)
+{
+  BlacklistSource *source = &set->sources[index];
+  UrlBlacklist *bl = _source_load(source);
+  if (!bl)
+    return NULL;
+
+  UrlBlacklist *old = source->bl;
+  bl->base = old->base;
+
+  // lookups that already passed the link finish on the old list
+  UrlBlacklist *above = index ? set->sources[index - 1].bl : set->upper;
+  __atomic_store_n(&source->bl, bl, __ATOMIC_RELEASE);
+  if (above)
+    __atomic_store_n(&above->base, bl, __ATOMIC_RELEASE);
+
+  return old;
+}
+
+char *BlacklistSources_name(BlacklistSources *set, const char *rule)
+{
+  for (unsigned int i = 0; i < set->source_count; i++)
+  {
+    UrlBlacklist *bl = __atomic_load_n(&set->sources[i].bl, __ATOMIC_ACQUIRE);
+
+    if ((rule >= bl->file && rule < bl->file + bl->file_size) || (bl->added && rule >= bl->added && rule < bl->added + bl->added_size))
+      return set->sources[i].filename;
+  }
+
+  return NULL;
+}
+
+void BlacklistSources_print_table(BlacklistSources *set)
+{
+  printf("BlacklistSources: %u sources\n", set->source_count);
+
+  for (unsigned int i = 0; i < set->source_count; i++)
+  {
+    BlacklistSource *source = &set->sources[i];
+    unsigned int rules = 0;
+    for (unsigned int j = 0; j < source->bl->node_count; j++)
+      rules += !!source->bl->nodes[j];
+
+    printf("%5d %s%s: %u domain rules, %u glob rules, %s\n", source->priority, source->filename, source->whitelist_local ? " (local)" : "",
+           rules, source->bl->glob_count, source->bl->image ? "image" : "text");
+  }
+}
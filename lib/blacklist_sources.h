@@ -0,0 +1,95 @@
+/**
+ * Several upstream blacklists layered by priority, each loaded from its own
+ * file and reloadable on its own
+ *
+ * A sources file has a priority and a rule file per line, optionally
+ * followed by local:
+ *
+ *   # priority  rules                    whitelist
+ *   100         lists/internal.txt
+ *   50          lists/hostsVN.txt
+ *   10          lists/stevenblack.bin    local
+ *
+ * Every source is a UrlBlacklist of its own with the next lower priority
+ * behind it as base, equal priorities keep the file order. A source decides
+ * the hosts it has rules for, !rule unblocks what lower sources block
+ * unless the source is local. Then it only cancels the source's own rules
+ */
+#include "url_blacklist.h"
+
+#ifndef BLACKLIST_SOURCES_H
+#define BLACKLIST_SOURCES_H
+
+#define BLACKLIST_SOURCES_MAX 64
+
+typedef struct BlacklistSource
+{
+  /**
+   * The rule file as named in the sources file
+   */
+  char *filename;
+  int priority;
+  char whitelist_local;
+  /**
+   * Replaced on reload, load it with acquire
+   */
+  UrlBlacklist *bl;
+} BlacklistSource;
+
+typedef struct BlacklistSources
+{
+  /**
+   * Highest priority first
+   */
+  BlacklistSource *sources;
+  unsigned int source_count;
+  /**
+   * List the first source is the base of, NULL when there is none
+   */
+  UrlBlacklist *upper;
+} BlacklistSources;
+
+/**
+ * Create a new BlacklistSources and load every source, without sources
+ * when filename does not exist. Rule files are relative to the working
+ * directory and may be compiled images
+ *
+ * Returns NULL on a malformed line, a source that can't be loaded or when
+ * out of memory
+ */
+BlacklistSources *BlacklistSources_new(BlacklistSources *set, char *filename);
+
+/**
+ * Frees every source, not upper
+ */
+void BlacklistSources_free(BlacklistSources *set);
+
+/**
+ * Layer the sources under upper, its base becomes the first source
+ */
+void BlacklistSources_attach(BlacklistSources *set, UrlBlacklist *upper);
+
+/**
+ * Index of the source loaded from filename, -1 when there is none
+ */
+int BlacklistSources_find(BlacklistSources *set, const char *filename);
+
+/**
+ * Load source index again and link the new list in place of the old one
+ * while lookups go on. Reloads must come from one thread at a time
+ *
+ * Returns the old list, to be freed with UrlBlacklist_free and free once
+ * no lookup can still be using it. NULL when the file can't be loaded,
+ * the old list stays
+ */
+UrlBlacklist *BlacklistSources_reload(BlacklistSources *set, unsigned int index);
+
+/**
+ * Filename of the source rule is from, NULL when it is from none or the
+ * source was reloaded since the lookup that returned it
+ */
+char *BlacklistSources_name(BlacklistSources *set, const char *rule);
+
+void BlacklistSources_print_table(BlacklistSources *set);
+
+#endif
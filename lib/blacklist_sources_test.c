@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "blacklist_sources.h"
+
+static void write_file(char *filename, char *content)
+{
+  FILE *file = fopen(filename, "w");
+  fputs(content, file);
+  fclose(file);
+}
+
+typedef struct Case
+{
+  char *host;
+  char *source;
+} Case;
+
+/**
+ * Check every host is blocked by a rule of source, or allowed with NULL
+ */
+static int check(BlacklistSources *set, UrlBlacklist *upper, Case *cases, unsigned int count)
+{
+  int failed = 0;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    char *rule = UrlBlacklist_exists(upper, cases[i].host);
+    char *source = rule ? BlacklistSources_name(set, rule) : NULL;
+    char *expected = cases[i].source;
+
+    if (!source != !expected || (source && strcmp(source, expected)))
+    {
+      printf("%s: %s instead of %s\n", cases[i].host, source ? source : "allowed", expected ? expected : "allowed");
+      failed = 1;
+    }
+  }
+
+  return failed;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  write_file("blacklist_sources_test.low",
+             "ads.example\n"
+             "*.tracker.example\n"
+             "social.example\n"
+             "shared.example\n"
+             "203.0.113.0/24\n");
+  write_file("blacklist_sources_test.high",
+             "!social.example\n"
+             "games.example\n"
+             "!203.0.113.7\n");
+  write_file("blacklist_sources_test.local",
+             "!ads.example\n"
+             "games.example\n"
+             "!shared.example\n");
+  write_file("blacklist_sources_test.tie",
+             "!games.example\n"
+             "tie.example\n");
+  write_file("blacklist_sources_test.sources",
+             "# priority  rules\n"
+             "10  blacklist_sources_test.low\n"
+             "50\tblacklist_sources_test.local   local # only its own rules\n"
+             "\n"
+             "100 blacklist_sources_test.high\n"
+             "50  blacklist_sources_test.tie\n");
+
+  UrlBlacklist upper;
+  BlacklistSources set;
+  write_file("blacklist_sources_test.upper", "upper.example\n");
+  if (!UrlBlacklist_new(&upper, "blacklist_sources_test.upper", '\n') || !BlacklistSources_new(&set, "blacklist_sources_test.sources"))
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  BlacklistSources_attach(&set, &upper);
+  BlacklistSources_print_table(&set);
+
+  // highest first, ties in file order
+  failed |= set.source_count != 4 || set.sources[0].priority != 100 || BlacklistSources_find(&set, "blacklist_sources_test.local") != 1;
+  failed |= BlacklistSources_find(&set, "blacklist_sources_test.tie") != 2 || BlacklistSources_find(&set, "missing") != -1;
+  failed |= !set.sources[1].whitelist_local || set.sources[2].whitelist_local;
+
+  Case cases[] = {
+      {"upper.example", NULL},
+      {"games.example", "blacklist_sources_test.high"},
+      {"social.example", NULL},
+      {"ads.example", "blacklist_sources_test.low"},
+      {"x.tracker.example", "blacklist_sources_test.low"},
+      {"shared.example", "blacklist_sources_test.low"},
+      {"tie.example", "blacklist_sources_test.tie"},
+      {"203.0.113.9", "blacklist_sources_test.low"},
+      {"203.0.113.7", NULL},
+      {"nothing.example", NULL},
+  };
+  failed |= check(&set, &upper, cases, sizeof(cases) / sizeof(*cases));
+  failed |= BlacklistSources_name(&set, UrlBlacklist_exists(&upper, "upper.example")) != NULL;
+
+  // a reloaded source is linked where the old one was
+  write_file("blacklist_sources_test.high", "ads.example\n");
+  UrlBlacklist *old = BlacklistSources_reload(&set, 0);
+  failed |= !old || upper.base != set.sources[0].bl || set.sources[0].bl->base != set.sources[1].bl;
+  UrlBlacklist_free(old);
+  free(old);
+
+  write_file("blacklist_sources_test.low", "tie.example\n");
+  old = BlacklistSources_reload(&set, 3);
+  failed |= !old || set.sources[2].bl->base != set.sources[3].bl || set.sources[3].bl->base;
+  UrlBlacklist_free(old);
+  free(old);
+
+  Case reloaded[] = {
+      {"games.example", "blacklist_sources_test.local"},
+      {"ads.example", "blacklist_sources_test.high"},
+      {"social.example", NULL},
+      {"x.tracker.example", NULL},
+      {"tie.example", "blacklist_sources_test.tie"},
+  };
+  failed |= check(&set, &upper, reloaded, sizeof(reloaded) / sizeof(*reloaded));
+
+  // a file that can't be loaded keeps the old list
+  unlink("blacklist_sources_test.low");
+  UrlBlacklist *kept = set.sources[3].bl;
+  failed |= BlacklistSources_reload(&set, 3) || set.sources[3].bl != kept || set.sources[2].bl->base != kept;
+
+  BlacklistSources_free(&set);
+  UrlBlacklist_free(&upper);
+
+  // no sources file is no sources, bad lines and missing rule files fail
+  failed |= !BlacklistSources_new(&set, "blacklist_sources_test.none") || set.source_count;
+  BlacklistSources_free(&set);
+
+  write_file("blacklist_sources_test.sources", "blacklist_sources_test.high\n");
+  failed |= !!BlacklistSources_new(&set, "blacklist_sources_test.sources");
+  write_file("blacklist_sources_test.sources", "10 blacklist_sources_test.high shared\n");
+  failed |= !!BlacklistSources_new(&set, "blacklist_sources_test.sources");
+  write_file("blacklist_sources_test.sources", "10 blacklist_sources_test.low\n");
+  failed |= !!BlacklistSources_new(&set, "blacklist_sources_test.sources");
+
+  unlink("blacklist_sources_test.sources");
+  unlink("blacklist_sources_test.upper");
+  unlink("blacklist_sources_test.high");
+  unlink("blacklist_sources_test.local");
+  unlink("blacklist_sources_test.tie");
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
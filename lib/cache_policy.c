@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cache_policy.h"
+
+#define SEGMENT_WINDOW 0
+#define SEGMENT_PROBATION 1
+#define SEGMENT_PROTECTED 2
+
+#define SKETCH_ROWS 4
+#define SKETCH_MAX 15
+
+static const unsigned long long SKETCH_SEEDS[SKETCH_ROWS] = {
+    0x9e3779b97f4a7c15ULL,
+    0xbf58476d1ce4e5b9ULL,
+    0x94d049bb133111ebULL,
+    0x2545f4914f6cdd1dULL,
+};
+
+static inline unsigned int _sketch_index(CachePolicy *policy, unsigned long long hash, int row)
+{
+  hash = (hash ^ SKETCH_SEEDS[row]) * 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+
+  return row * (policy->sketch_mask + 1) + (hash & policy->sketch_mask);
+}
+
+static unsigned int _frequency(CachePolicy *policy, unsigned long long hash)
+{
+  unsigned int frequency = SKETCH_MAX;
+
+  for (int row = 0; row < SKETCH_ROWS; row++)
+  {
+    unsigned char count = policy->sketch[_sketch_index(policy, hash, row)];
+    if (count < frequency)
+      frequency = count;
+  }
+
+  return frequency;
+}
+
+static inline void _list_unlink(CachePolicyList *list, CachePolicyNode *node)
+{
+  if (node->prev)
+    node->prev->next = node->next;
+  else
+    list->head = node->next;
+
+  if (node->next)
+    node->next->prev = node->prev;
+  else
+    list->tail = node->prev;
+
+  node->prev = node->next = NULL;
+  list->size -= node->size;
+}
+
+static inline void _list_push_front(CachePolicyList *list, CachePolicyNode *node)
+{
+  node->prev = NULL;
+  node->next = list->head;
+
+  if (list->head)
+    list->head->prev = node;
+  else
+    list->tail = node;
+
+  list->head = node;
+  list->size += node->size;
+}
+
+static inline CachePolicyList *_segment(CachePolicy *policy, CachePolicyNode *node)
+{
+  switch (node->segment)
+  {
+  case SEGMENT_WINDOW:
+    return &policy->window;
+  case SEGMENT_PROTECTED:
+    return &policy->protected;
+  default:
+    return &policy->probation;
+  }
+}
+
+static inline void _move(CachePolicy *policy, CachePolicyNode *node, unsigned char segment)
+{
+  _list_unlink(_segment(policy, node), node);
+  node->segment = segment;
+  _list_push_front(_segment(policy, node), node);
+}
+
+static void _evict(CachePolicy *policy, CachePolicyNode *node)
+{
+  _list_unlink(_segment(policy, node), node);
+  policy->evictions++;
+  policy->evict(policy->ctx, node);
+}
+
+CachePolicy *CachePolicy_new(
+    CachePolicy *policy,
+    cache_policy_t type,
+    size_t capacity,
+    size_t expected_entries,
+    void (*evict)(void *ctx, CachePolicyNode *node),
+    void *ctx)
+{
+  memset(policy, 0, sizeof(*policy));
+
+  policy->type = type;
+  policy->capacity = capacity;
+  policy->evict = evict;
+  policy->ctx = ctx;
+
+  if (type == CACHE_POLICY_LRU)
+  {
+    policy->probation.capacity = capacity;
+    return policy;
+  }
+
+  // 1% window, the rest is main split 20/80 between probation and protected
+  policy->window.capacity = capacity / 100 ? capacity / 100 : 1;
+  size_t main = capacity - policy->window.capacity;
+  policy->protected.capacity = main / 5 * 4;
+  policy->probation.capacity = main - policy->protected.capacity;
+
+  unsigned int width = 64;
+  while (width < expected_entries)
+    width <<= 1;
+
+  policy->sketch = calloc(SKETCH_ROWS, width);
+  if (!policy->sketch)
+    return NULL;
+
+  policy->sketch_mask = width - 1;
+  policy->sample_size = 10 * width;
+
+  return policy;
+}
+
+void CachePolicy_free(CachePolicy *policy)
+{
+  free(policy->sketch);
+}
+
+void CachePolicy_record(CachePolicy *policy, unsigned long long hash)
+{
+  if (!policy->sketch)
+    return;
+
+  for (int row = 0; row < SKETCH_ROWS; row++)
+  {
+    unsigned char *count = &policy->sketch[_sketch_index(policy, hash, row)];
+    if (*count < SKETCH_MAX)
+      (*count)++;
+  }
+
+  // age everything so old popularity fades
+  if (++policy->additions < policy->sample_size)
+    return;
+
+  unsigned int sketch_size = SKETCH_ROWS * (policy->sketch_mask + 1);
+  for (unsigned int i = 0; i < sketch_size; i++)
+    policy->sketch[i] >>= 1;
+
+  policy->additions >>= 1;
+}
+
+void CachePolicy_hit(CachePolicy *policy, CachePolicyNode *node)
+{
+  if (node->segment != SEGMENT_PROBATION || policy->type == CACHE_POLICY_LRU)
+  {
+    _move(policy, node, node->segment);
+    return;
+  }
+
+  // second hit in main, promote and push the coldest protected entry back
+  _move(policy, node, SEGMENT_PROTECTED);
+
+  while (policy->protected.size > policy->protected.capacity && policy->protected.tail != node)
+    _move(policy, policy->protected.tail, SEGMENT_PROBATION);
+}
+
+/**
+ * Shrink main until it fits, candidate competes with the probation victim
+ */
+static void _admit(CachePolicy *policy, CachePolicyNode *candidate)
+{
+  size_t main_capacity = policy->probation.capacity + policy->protected.capacity;
+
+  while (policy->probation.size + policy->protected.size > main_capacity)
+  {
+    CachePolicyNode *victim = policy->probation.tail;
+
+    if (victim == candidate)
+      victim = policy->protected.tail;
+
+    if (!victim || _frequency(policy, candidate->hash) <= _frequency(policy, victim->hash))
+    {
+      _evict(policy, candidate);
+      return;
+    }
+
+    _evict(policy, victim);
+  }
+}
+
+void CachePolicy_insert(CachePolicy *policy, CachePolicyNode *node)
+{
+  if (policy->type == CACHE_POLICY_LRU)
+  {
+    node->segment = SEGMENT_PROBATION;
+    _list_push_front(&policy->probation, node);
+
+    while (policy->probation.size > policy->probation.capacity)
+      _evict(policy, policy->probation.tail);
+
+    return;
+  }
+
+  node->segment = SEGMENT_WINDOW;
+  _list_push_front(&policy->window, node);
+
+  while (policy->window.size > policy->window.capacity)
+  {
+    CachePolicyNode *candidate = policy->window.tail;
+    _move(policy, candidate, SEGMENT_PROBATION);
+    _admit(policy, candidate);
+  }
+}
+
+void CachePolicy_remove(CachePolicy *policy, CachePolicyNode *node)
+{
+  _list_unlink(_segment(policy, node), node);
+}
+
+const char *CachePolicy_name(cache_policy_t type)
+{
+  return type == CACHE_POLICY_TINYLFU ? "W-TinyLFU" : "LRU";
+}
@@ -0,0 +1,89 @@
+/**
+ * Eviction policies shared by ObjectCache and the offline cache simulator
+ *
+ * Nodes are intrusive, the owner embeds a CachePolicyNode and gets it back in
+ * the evict callback
+ */
+#include <stddef.h>
+
+#ifndef CACHE_POLICY_H
+#define CACHE_POLICY_H
+
+typedef enum cache_policy_t
+{
+  CACHE_POLICY_LRU,
+  /**
+   * Window LRU in front of a segmented LRU, admission decided by a
+   * count-min sketch of recent access frequency
+   */
+  CACHE_POLICY_TINYLFU,
+} cache_policy_t;
+
+typedef struct CachePolicyNode
+{
+  struct CachePolicyNode *prev;
+  struct CachePolicyNode *next;
+  unsigned long long hash;
+  size_t size;
+  unsigned char segment;
+} CachePolicyNode;
+
+typedef struct CachePolicyList
+{
+  CachePolicyNode *head;
+  CachePolicyNode *tail;
+  size_t size;
+  size_t capacity;
+} CachePolicyList;
+
+typedef struct CachePolicy
+{
+  cache_policy_t type;
+  size_t capacity;
+
+  /**
+   * LRU keeps everything in probation
+   */
+  CachePolicyList window;
+  CachePolicyList probation;
+  CachePolicyList protected;
+
+  unsigned char *sketch;
+  unsigned int sketch_mask;
+  unsigned int additions;
+  unsigned int sample_size;
+
+  void (*evict)(void *ctx, CachePolicyNode *node);
+  void *ctx;
+
+  unsigned long evictions;
+} CachePolicy;
+
+/**
+ * Create a new CachePolicy
+ *
+ * @param capacity Total size of all nodes
+ * @param expected_entries Sizes the frequency sketch, ignored by LRU
+ * @param evict Called with every node the policy drops, including rejected
+ * insertions. The node is already unlinked from the policy
+ */
+CachePolicy *CachePolicy_new(
+    CachePolicy *policy,
+    cache_policy_t type,
+    size_t capacity,
+    size_t expected_entries,
+    void (*evict)(void *ctx, CachePolicyNode *node),
+    void *ctx);
+void CachePolicy_free(CachePolicy *policy);
+
+/**
+ * Count an access, hit or miss
+ */
+void CachePolicy_record(CachePolicy *policy, unsigned long long hash);
+void CachePolicy_hit(CachePolicy *policy, CachePolicyNode *node);
+void CachePolicy_insert(CachePolicy *policy, CachePolicyNode *node);
+void CachePolicy_remove(CachePolicy *policy, CachePolicyNode *node);
+
+const char *CachePolicy_name(cache_policy_t type);
+
+#endif
@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cache_policy.h"
+
+#define KEYS 4096
+
+typedef struct Entry
+{
+  CachePolicyNode node;
+  char resident;
+} Entry;
+
+static Entry entries[KEYS];
+
+void evict(void *ctx, CachePolicyNode *node)
+{
+  ((Entry *)node)->resident = 0;
+}
+
+static int access(CachePolicy *policy, unsigned int key)
+{
+  Entry *entry = &entries[key];
+
+  CachePolicy_record(policy, key);
+
+  if (entry->resident)
+  {
+    CachePolicy_hit(policy, &entry->node);
+    return 1;
+  }
+
+  entry->node.hash = key;
+  entry->node.size = 1;
+  entry->resident = 1;
+  CachePolicy_insert(policy, &entry->node);
+
+  return 0;
+}
+
+/**
+ * A small hot set competing with a long scan of one-hit wonders
+ */
+static double hot_hit_ratio(cache_policy_t type)
+{
+  for (int i = 0; i < KEYS; i++)
+    entries[i].resident = 0;
+
+  CachePolicy policy;
+  CachePolicy_new(&policy, type, 100, 100, evict, NULL);
+
+  unsigned int hot_hits = 0, hot_accesses = 0;
+  unsigned int scan = 100;
+
+  for (int round = 0; round < 200; round++)
+  {
+    for (unsigned int key = 0; key < 50; key++)
+    {
+      hot_hits += access(&policy, key);
+      hot_accesses++;
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+      access(&policy, scan++);
+      if (scan == KEYS)
+        scan = 100;
+    }
+  }
+
+  printf("%-10s hot hit ratio %.3f evictions %lu\n", CachePolicy_name(type), (double)hot_hits / hot_accesses, policy.evictions);
+
+  CachePolicy_free(&policy);
+
+  return (double)hot_hits / hot_accesses;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  // plain LRU order
+  CachePolicy lru;
+  CachePolicy_new(&lru, CACHE_POLICY_LRU, 3, 0, evict, NULL);
+  for (int i = 0; i < KEYS; i++)
+    entries[i].resident = 0;
+
+  access(&lru, 1);
+  access(&lru, 2);
+  access(&lru, 3);
+  access(&lru, 1);
+  access(&lru, 4);
+
+  printf("LRU after 1 2 3 1 4: %d %d %d %d\n", entries[1].resident, entries[2].resident, entries[3].resident, entries[4].resident);
+  failed |= !entries[1].resident || entries[2].resident || !entries[3].resident || !entries[4].resident;
+  CachePolicy_free(&lru);
+
+  double lru_ratio = hot_hit_ratio(CACHE_POLICY_LRU);
+  double tinylfu_ratio = hot_hit_ratio(CACHE_POLICY_TINYLFU);
+
+  failed |= tinylfu_ratio < 0.9 || tinylfu_ratio <= lru_ratio;
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
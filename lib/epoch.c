@@ -0,0 +1,72 @@
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include "epoch.h"
+
+Epoch *Epoch_new(Epoch *epoch, unsigned int slots)
+{
+  epoch->slots = aligned_alloc(64, slots * sizeof(EpochSlot));
+  if (!epoch->slots)
+    return NULL;
+
+  for (unsigned int i = 0; i < slots; i++)
+    epoch->slots[i].epoch = 0;
+
+  epoch->slot_count = slots;
+  epoch->global = 1;
+
+  return epoch;
+}
+
+void Epoch_free(Epoch *epoch)
+{
+  free(epoch->slots);
+}
+
+void Epoch_enter(Epoch *epoch, unsigned int slot)
+{
+  __atomic_store_n(&epoch->slots[slot].epoch, __atomic_load_n(&epoch->global, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+  // the announcement has to be visible before the reader loads anything
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void Epoch_exit(Epoch *epoch, unsigned int slot)
+{
+  __atomic_store_n(&epoch->slots[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+void Epoch_synchronize(Epoch *epoch)
+{
+  unsigned long target = __atomic_add_fetch(&epoch->global, 1, __ATOMIC_SEQ_CST);
+
+  // pairs with the fence in Epoch_enter, a reader we miss here loads the
+  // new pointer
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  for (unsigned int i = 0; i < epoch->slot_count; i++)
+  {
+    for (unsigned int spins = 0;; spins++)
+    {
+      unsigned long entered = __atomic_load_n(&epoch->slots[i].epoch, __ATOMIC_ACQUIRE);
+
+      if (!entered || entered >= target)
+        break;
+
+      // readers hold sections for a request at most, back off to 1ms
+      if (spins < 64)
+        sched_yield();
+      else
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+  }
+}
+
+void *Epoch_swap(Epoch *epoch, void **published, void *value)
+{
+  void *old = __atomic_exchange_n(published, value, __ATOMIC_SEQ_CST);
+
+  Epoch_synchronize(epoch);
+
+  return old;
+}
@@ -0,0 +1,54 @@
+/**
+ * Epoch based reclamation for pointers readers use without locks
+ *
+ * A reader brackets its use with Epoch_enter and Epoch_exit on its own
+ * slot. A writer publishes a new pointer, waits in Epoch_synchronize until
+ * every reader that could still hold the old one has left, then frees it
+ */
+#include <stddef.h>
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+typedef struct EpochSlot
+{
+  /**
+   * Epoch the reader entered in, 0 while outside
+   */
+  unsigned long epoch;
+} __attribute__((aligned(64))) EpochSlot;
+
+typedef struct Epoch
+{
+  unsigned long global;
+  EpochSlot *slots;
+  unsigned int slot_count;
+} Epoch;
+
+/**
+ * Create a new Epoch
+ *
+ * @param slots Number of readers, each uses its own slot
+ */
+Epoch *Epoch_new(Epoch *epoch, unsigned int slots);
+void Epoch_free(Epoch *epoch);
+
+/**
+ * Pointers loaded (with acquire or stronger) after entering stay valid until
+ * the reader exits. Sections don't nest
+ */
+void Epoch_enter(Epoch *epoch, unsigned int slot);
+void Epoch_exit(Epoch *epoch, unsigned int slot);
+
+/**
+ * Wait until every reader inside a section when this was called has left
+ */
+void Epoch_synchronize(Epoch *epoch);
+
+/**
+ * Publish value in *published, returns the old pointer once no reader can
+ * still be using it
+ */
+void *Epoch_swap(Epoch *epoch, void **published, void *value);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "epoch.h"
+
+#define READERS 4
+#define SWAPS 200
+
+#define ALIVE 0x600d
+#define RETIRED 0xdead
+
+typedef struct Object
+{
+  int state;
+  int value;
+} Object;
+
+static Epoch epoch;
+static Object *published;
+static int done;
+
+struct Reader
+{
+  unsigned int slot;
+  unsigned long reads;
+  unsigned long stale;
+};
+
+void *reader(struct Reader *reader)
+{
+  while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE))
+  {
+    Epoch_enter(&epoch, reader->slot);
+
+    Object *object = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+    for (int i = 0; i < 100; i++)
+      reader->stale += __atomic_load_n(&object->state, __ATOMIC_RELAXED) != ALIVE;
+
+    Epoch_exit(&epoch, reader->slot);
+    reader->reads++;
+  }
+
+  return NULL;
+}
+
+void *holder(int *released)
+{
+  Epoch_enter(&epoch, READERS);
+  usleep(200 * 1000);
+  __atomic_store_n(released, 1, __ATOMIC_RELEASE);
+  Epoch_exit(&epoch, READERS);
+
+  return NULL;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  Epoch_new(&epoch, READERS + 1);
+
+  published = malloc(sizeof(*published));
+  *published = (Object){ALIVE, 0};
+
+  pthread_t threads[READERS];
+  struct Reader readers[READERS];
+  for (int i = 0; i < READERS; i++)
+  {
+    readers[i] = (struct Reader){i};
+    pthread_create(&threads[i], NULL, (void *(*)(void *))reader, &readers[i]);
+  }
+
+  // retired objects are poisoned, a reader must never see one
+  for (int i = 1; i <= SWAPS; i++)
+  {
+    Object *next = malloc(sizeof(*next));
+    *next = (Object){ALIVE, i};
+
+    Object *old = Epoch_swap(&epoch, (void **)&published, next);
+    __atomic_store_n(&old->state, RETIRED, __ATOMIC_RELAXED);
+    free(old);
+  }
+
+  __atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+  unsigned long reads = 0, stale = 0;
+  for (int i = 0; i < READERS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    reads += readers[i].reads;
+    stale += readers[i].stale;
+  }
+
+  printf("%d swaps, %lu reads, %lu stale\n", SWAPS, reads, stale);
+  failed |= stale || published->value != SWAPS;
+
+  // synchronize has to wait for a reader that is still inside
+  int released = 0;
+  pthread_t holder_pt;
+  pthread_create(&holder_pt, NULL, (void *(*)(void *))holder, &released);
+  usleep(50 * 1000);
+
+  Epoch_synchronize(&epoch);
+  printf("synchronize returned %s the reader left\n", __atomic_load_n(&released, __ATOMIC_ACQUIRE) ? "after" : "before");
+  failed |= !__atomic_load_n(&released, __ATOMIC_ACQUIRE);
+
+  pthread_join(holder_pt, NULL);
+
+  free(published);
+  Epoch_free(&epoch);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
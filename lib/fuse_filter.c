@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fuse_filter.h"
+
+/**
+ * Attempts with different seeds before giving up
+ */
+#define MAX_ATTEMPTS 100
+
+__extension__ typedef unsigned __int128 u_int128_t;
+
+static inline u_int64_t _mix(u_int64_t hash)
+{
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdull;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ull;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static inline unsigned char _fingerprint(u_int64_t hash)
+{
+  return hash ^ hash >> 32;
+}
+
+/**
+ * Slot i of the three a hash has, one per segment
+ */
+static inline unsigned int _slot(FuseFilter *filter, u_int64_t hash, unsigned int i)
+{
+  u_int64_t slot = ((u_int128_t)hash * filter->segment_count_length) >> 64;
+  slot += i * filter->segment_length;
+
+  // slot 0 keeps its place, the others move within their segment
+  return slot ^ ((hash & ((1ull << 36) - 1)) >> (36 - 18 * i) & (filter->segment_length - 1));
+}
+
+/**
+ * Good enough for sizing, the fraction is linear between powers of two
+ */
+static double _log2(u_int64_t x)
+{
+  int exponent = 63 - __builtin_clzll(x);
+  return exponent + ((double)x / (1ull << exponent) - 1);
+}
+
+static int _key_compare(const void *a, const void *b)
+{
+  u_int64_t x = *(const u_int64_t *)a, y = *(const u_int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Sort keys and drop duplicates, returns the new count
+ */
+static unsigned int _unique(u_int64_t *keys, unsigned int count)
+{
+  if (!count)
+    return 0;
+
+  qsort(keys, count, sizeof(*keys), _key_compare);
+
+  unsigned int unique = 1;
+  for (unsigned int i = 1; i < count; i++)
+  {
+    if (keys[i] != keys[unique - 1])
+      keys[unique++] = keys[i];
+  }
+
+  return unique;
+}
+
+FuseFilter *FuseFilter_new(FuseFilter *filter, u_int64_t *keys, unsigned int count)
+{
+  // segments get longer and the array relatively shorter as count grows
+  filter->segment_length = count > 1 ? 1u << (int)(_log2(count) / 1.7355 + 2.25) : 4;
+  if (filter->segment_length > 1 << 18)
+    filter->segment_length = 1 << 18;
+
+  double factor = count > 1 ? 0.875 + 0.25 * 19.93 / _log2(count) : 0;
+  if (factor < 1.125 && count > 1)
+    factor = 1.125;
+
+  long long segment_count = ((long long)(count * factor + 0.5) + filter->segment_length - 1) / filter->segment_length - 2;
+  if (segment_count < 1)
+    segment_count = 1;
+
+  filter->segment_count_length = segment_count * filter->segment_length;
+  filter->size = (segment_count + 2) * filter->segment_length;
+  filter->key_count = count;
+  filter->fingerprints = calloc(filter->size, 1);
+
+  // hashes in the order they are peeled, with a sentinel for the sort below
+  u_int64_t *order = calloc(count + 1, sizeof(*order));
+  unsigned char *order_slot = malloc(count + 1);
+  // per slot the number of keys times 4 plus the xor of which of their
+  // three slots it is, and the xor of their hashes
+  unsigned char *slot_count = calloc(filter->size, 1);
+  u_int64_t *slot_hash = calloc(filter->size, sizeof(*slot_hash));
+  unsigned int *alone = malloc(filter->size * sizeof(*alone));
+
+  // keys are placed roughly by their first slot so filling is sequential
+  unsigned int block_bits = 1;
+  while (1ll << block_bits < segment_count)
+    block_bits++;
+  unsigned int *block_start = malloc((1u << block_bits) * sizeof(*block_start));
+
+  if (!filter->fingerprints || !order || !order_slot || !slot_count || !slot_hash || !alone || !block_start)
+    goto fail;
+
+  u_int64_t seed = 0x726b2b9d438b9d4dull;
+  for (int attempt = 0;; attempt++)
+  {
+    if (attempt == MAX_ATTEMPTS)
+      goto fail;
+
+    // splitmix64
+    seed += 0x9e3779b97f4a7c15ull;
+    filter->seed = _mix(seed);
+
+    memset(order, 0, count * sizeof(*order));
+    memset(slot_count, 0, filter->size);
+    memset(slot_hash, 0, filter->size * sizeof(*slot_hash));
+    order[count] = 1;
+
+    for (unsigned int i = 0; i < 1u << block_bits; i++)
+      block_start[i] = ((u_int64_t)i * count) >> block_bits;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+      u_int64_t hash = _mix(keys[i] + filter->seed);
+      unsigned int block = hash >> (64 - block_bits);
+
+      while (order[block_start[block]])
+        block = (block + 1) & ((1u << block_bits) - 1);
+
+      order[block_start[block]++] = hash;
+    }
+
+    char overflow = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+      u_int64_t hash = order[i];
+
+      for (unsigned int j = 0; j < 3; j++)
+      {
+        unsigned int slot = _slot(filter, hash, j);
+        slot_count[slot] = (slot_count[slot] + 4) ^ j;
+        slot_hash[slot] ^= hash;
+        overflow |= slot_count[slot] < 4;
+      }
+    }
+
+    if (overflow)
+      continue;
+
+    // peel slots with a single key until none are left
+    unsigned int queued = 0;
+    for (unsigned int i = 0; i < filter->size; i++)
+    {
+      alone[queued] = i;
+      queued += slot_count[i] >> 2 == 1;
+    }
+
+    unsigned int peeled = 0;
+    while (queued)
+    {
+      unsigned int index = alone[--queued];
+      if (slot_count[index] >> 2 != 1)
+        continue;
+
+      u_int64_t hash = slot_hash[index];
+      unsigned int found = slot_count[index] & 3;
+      order[peeled] = hash;
+      order_slot[peeled++] = found;
+
+      for (unsigned int j = 1; j < 3; j++)
+      {
+        unsigned int other = (found + j) % 3;
+        unsigned int slot = _slot(filter, hash, other);
+
+        alone[queued] = slot;
+        queued += slot_count[slot] >> 2 == 2;
+        slot_count[slot] = (slot_count[slot] - 4) ^ other;
+        slot_hash[slot] ^= hash;
+      }
+    }
+
+    if (peeled == count)
+      break;
+
+    // the same key twice never peels
+    count = filter->key_count = _unique(keys, count);
+  }
+
+  // in reverse, every key is the only one left to decide its slot
+  for (unsigned int i = count; i-- > 0;)
+  {
+    u_int64_t hash = order[i];
+    unsigned int found = order_slot[i];
+
+    filter->fingerprints[_slot(filter, hash, found)] = _fingerprint(hash) ^
+                                                        filter->fingerprints[_slot(filter, hash, (found + 1) % 3)] ^
+                                                        filter->fingerprints[_slot(filter, hash, (found + 2) % 3)];
+  }
+
+  free(order);
+  free(order_slot);
+  free(slot_count);
+  free(slot_hash);
+  free(alone);
+  free(block_start);
+
+  return filter;
+
+fail:
+  free(filter->fingerprints);
+  filter->fingerprints = NULL;
+  free(order);
+  free(order_slot);
+  free(slot_count);
+  free(slot_hash);
+  free(alone);
+  free(block_start);
+
+  return NULL;
+}
+
+void FuseFilter_free(FuseFilter *filter)
+{
+  free(filter->fingerprints);
+}
+
+char FuseFilter_contains(FuseFilter *filter, u_int64_t key)
+{
+  if (!filter->key_count)
+    return 0;
+
+  u_int64_t hash = _mix(key + filter->seed);
+
+  return !(_fingerprint(hash) ^
+           filter->fingerprints[_slot(filter, hash, 0)] ^
+           filter->fingerprints[_slot(filter, hash, 1)] ^
+           filter->fingerprints[_slot(filter, hash, 2)]);
+}
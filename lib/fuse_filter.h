@@ -0,0 +1,42 @@
+/**
+ * Binary fuse filter, a static set of 64 bit keys that answers "maybe in
+ * the set" or "certainly not" in about 9 bits per key with 1/256 false
+ * positives
+ *
+ * Every key has three slots in three consecutive segments of the array, the
+ * xor of their fingerprints is the fingerprint of the key. A lookup reads
+ * three bytes close together
+ */
+#include <sys/types.h>
+
+#ifndef FUSE_FILTER_H
+#define FUSE_FILTER_H
+
+typedef struct FuseFilter
+{
+  u_int64_t seed;
+  unsigned int segment_length;
+  unsigned int segment_count_length;
+  unsigned int key_count;
+  /**
+   * Number of fingerprints
+   */
+  unsigned int size;
+  unsigned char *fingerprints;
+} FuseFilter;
+
+/**
+ * Create a new FuseFilter over count keys, duplicates are allowed but keys
+ * may be reordered
+ *
+ * Returns NULL when out of memory or when no seed gives a filter
+ */
+FuseFilter *FuseFilter_new(FuseFilter *filter, u_int64_t *keys, unsigned int count);
+void FuseFilter_free(FuseFilter *filter);
+
+/**
+ * 0 when key is certainly not in the set
+ */
+char FuseFilter_contains(FuseFilter *filter, u_int64_t key);
+
+#endif
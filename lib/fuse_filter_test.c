@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "fuse_filter.h"
+
+static u_int64_t next(u_int64_t *state)
+{
+  // xorshift64
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+/**
+ * Build over count keys, returns non zero when a key is missing or there
+ * are too many false positives
+ */
+static int run(unsigned int count, unsigned int duplicates)
+{
+  u_int64_t *keys = malloc((count + duplicates + 1) * sizeof(*keys));
+  u_int64_t state = 88172645463325252ull + count;
+
+  for (unsigned int i = 0; i < count; i++)
+    keys[i] = next(&state);
+  for (unsigned int i = 0; i < duplicates; i++)
+    keys[count + i] = keys[i % count];
+
+  FuseFilter filter;
+  if (!FuseFilter_new(&filter, keys, count + duplicates))
+  {
+    printf("%u keys: no filter\n", count);
+    free(keys);
+    return 1;
+  }
+
+  unsigned int missing = 0;
+  for (unsigned int i = 0; i < count + duplicates; i++)
+    missing += !FuseFilter_contains(&filter, keys[i]);
+
+  // other keys from the same generator
+  unsigned int probes = 1000000, false_positives = 0;
+  for (unsigned int i = 0; i < probes; i++)
+    false_positives += FuseFilter_contains(&filter, next(&state));
+
+  double rate = (double)false_positives / probes;
+  double bits = count ? 8.0 * filter.size / count : 0;
+  printf("%u keys (%u duplicates): %u missing, %.4f%% false positives, %.2f bits per key\n", count, duplicates, missing, rate * 100, bits);
+
+  int failed = missing || filter.key_count != count || (count && rate > 0.006) || (count >= 100000 && bits > 10);
+
+  FuseFilter_free(&filter);
+  free(keys);
+
+  return failed;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  failed |= run(0, 0);
+  for (unsigned int count = 1; count <= 1000; count *= 3)
+    failed |= run(count, 0);
+  failed |= run(100000, 0);
+  failed |= run(1000000, 0);
+  failed |= run(50000, 1000);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
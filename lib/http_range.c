@@ -0,0 +1,294 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "http_range.h"
+
+static inline const char *_skip_space(const char *p)
+{
+  while (*p == ' ' || *p == '\t')
+    p++;
+  return p;
+}
+
+int HttpRange_parse(const char *value, size_t length, HttpRange *ranges, int max)
+{
+  value = _skip_space(value);
+
+  if (strncasecmp(value, "bytes=", 6))
+    return 0;
+
+  const char *p = value + 6;
+  int specs = 0;
+  int n = 0;
+
+  for (;;)
+  {
+    p = _skip_space(p);
+
+    // empty list elements are allowed
+    if (*p == ',')
+    {
+      p++;
+      continue;
+    }
+
+    if (!*p || *p == '\r' || *p == '\n')
+      break;
+
+    char *end;
+    size_t first, last;
+
+    if (*p == '-')
+    {
+      if (!isdigit(p[1]))
+        return 0;
+
+      size_t suffix = strtoull(p + 1, &end, 10);
+      specs++;
+
+      if (!suffix || !length)
+        goto next;
+
+      first = suffix < length ? length - suffix : 0;
+      last = length - 1;
+    }
+    else if (isdigit(*p))
+    {
+      first = strtoull(p, &end, 10);
+
+      if (*end != '-')
+        return 0;
+
+      if (isdigit(end[1]))
+      {
+        last = strtoull(end + 1, &end, 10);
+        if (last < first)
+          return 0;
+      }
+      else
+      {
+        end++;
+        last = (size_t)-1;
+      }
+
+      specs++;
+
+      if (first >= length)
+        goto next;
+
+      if (last >= length)
+        last = length - 1;
+    }
+    else
+    {
+      return 0;
+    }
+
+    if (n == max)
+      return 0;
+
+    ranges[n++] = (HttpRange){first, last};
+
+  next:
+    p = _skip_space(end);
+
+    if (*p == ',')
+      p++;
+    else if (*p && *p != '\r' && *p != '\n')
+      return 0;
+  }
+
+  if (!specs)
+    return 0;
+
+  return n ? n : -1;
+}
+
+/**
+ * write() everything, with MSG_MORE so headers leave in the same segment as
+ * the body that follows
+ */
+static ssize_t _send_all(int connfd, const char *buf, size_t len, int flags)
+{
+  for (size_t sent = 0; sent < len;)
+  {
+    ssize_t n = send(connfd, buf + sent, len - sent, flags);
+
+    if (n < 0 && errno == ENOTSOCK)
+      n = write(connfd, buf + sent, len - sent);
+
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    sent += n;
+  }
+
+  return len;
+}
+
+ssize_t HttpRange_sendfile(int connfd, int fd, off_t offset, size_t len)
+{
+  for (size_t sent = 0; sent < len;)
+  {
+    ssize_t n = sendfile(connfd, fd, &offset, len - sent);
+
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return -1;
+    }
+
+    sent += n;
+  }
+
+  return len;
+}
+
+static int _part_header(
+    char *buf,
+    size_t buf_len,
+    const char *boundary,
+    const char *content_type,
+    const HttpRange *range,
+    size_t length)
+{
+  return snprintf(
+      buf, buf_len,
+      "\r\n--%s\r\n"
+      "Content-Type: %s\r\n"
+      "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+      boundary,
+      content_type,
+      range->first, range->last, length);
+}
+
+ssize_t HttpRange_send(
+    int connfd,
+    int fd,
+    off_t body_offset,
+    size_t length,
+    const char *content_type,
+    const HttpRange *ranges,
+    int n)
+{
+  char header[512];
+  int header_len;
+
+  if (n < 0)
+  {
+    header_len = snprintf(
+        header, sizeof(header),
+        "HTTP/1.0 416 Range Not Satisfiable\r\n"
+        "Content-Range: bytes */%zu\r\n"
+        "Content-Length: 0\r\n\r\n",
+        length);
+
+    return _send_all(connfd, header, header_len, 0);
+  }
+
+  if (!content_type)
+    content_type = "application/octet-stream";
+
+  if (n == 1)
+  {
+    size_t part_len = ranges->last - ranges->first + 1;
+    char *single;
+
+    // the content type comes from the origin, the header is as long as it needs
+    header_len = asprintf(
+        &single,
+        "HTTP/1.0 206 Partial Content\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Range: bytes %zu-%zu/%zu\r\n"
+        "Content-Length: %zu\r\n\r\n",
+        content_type,
+        ranges->first, ranges->last, length,
+        part_len);
+
+    if (header_len < 0)
+      return -1;
+
+    ssize_t sent = _send_all(connfd, single, header_len, MSG_MORE);
+    free(single);
+    if (sent < 0)
+      return -1;
+
+    if (HttpRange_sendfile(connfd, fd, body_offset + ranges->first, part_len) < 0)
+      return -1;
+
+    return header_len + part_len;
+  }
+
+  // multipart/byteranges, Content-Length has to be known up front
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  char boundary[40];
+  snprintf(boundary, sizeof(boundary), "proxy-%08lx%08lx", (unsigned long)ts.tv_sec, (unsigned long)ts.tv_nsec);
+
+  // part headers are measured first, then written into a buffer that fits
+  // the longest
+  size_t body_len = 0, part_size = 0;
+  for (int i = 0; i < n; i++)
+  {
+    size_t part_len = _part_header(NULL, 0, boundary, content_type, &ranges[i], length);
+    part_size = part_len + 1 > part_size ? part_len + 1 : part_size;
+    body_len += part_len + ranges[i].last - ranges[i].first + 1;
+  }
+
+  char *part = malloc(part_size);
+  if (!part)
+    return -1;
+
+  char trailer[64];
+  int trailer_len = snprintf(trailer, sizeof(trailer), "\r\n--%s--\r\n", boundary);
+  body_len += trailer_len;
+
+  header_len = snprintf(
+      header, sizeof(header),
+      "HTTP/1.0 206 Partial Content\r\n"
+      "Content-Type: multipart/byteranges; boundary=%s\r\n"
+      "Content-Length: %zu\r\n\r\n",
+      boundary,
+      body_len);
+
+  if (_send_all(connfd, header, header_len, MSG_MORE) < 0)
+    goto fail;
+
+  for (int i = 0; i < n; i++)
+  {
+    int part_len = _part_header(part, part_size, boundary, content_type, &ranges[i], length);
+
+    if (_send_all(connfd, part, part_len, MSG_MORE) < 0)
+      goto fail;
+
+    if (HttpRange_sendfile(connfd, fd, body_offset + ranges[i].first, ranges[i].last - ranges[i].first + 1) < 0)
+      goto fail;
+  }
+
+  free(part);
+
+  if (_send_all(connfd, trailer, trailer_len, 0) < 0)
+    return -1;
+
+  return header_len + body_len;
+
+fail:
+  free(part);
+  return -1;
+}
@@ -0,0 +1,52 @@
+/**
+ * Range request parsing and partial responses served straight from a file
+ */
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef HTTP_RANGE_H
+#define HTTP_RANGE_H
+
+/**
+ * More ranges than this and the whole object is sent instead
+ */
+#define HTTP_RANGE_MAX 16
+
+/**
+ * Inclusive byte range, already resolved against the object length
+ */
+typedef struct HttpRange
+{
+  size_t first;
+  size_t last;
+} HttpRange;
+
+/**
+ * Parse the value of a Range header e.g. "bytes=0-99,-500"
+ *
+ * Returns the number of satisfiable ranges, 0 if the header should be ignored
+ * and the full object sent, -1 if nothing in it can be satisfied (416)
+ */
+int HttpRange_parse(const char *value, size_t length, HttpRange *ranges, int max);
+
+/**
+ * Writes a 206 (or 416 when n is -1) response for the body stored in fd at
+ * body_offset. Bodies are sent with sendfile, nothing is copied to user space
+ *
+ * Returns the number of bytes written or -1
+ */
+ssize_t HttpRange_send(
+    int connfd,
+    int fd,
+    off_t body_offset,
+    size_t length,
+    const char *content_type,
+    const HttpRange *ranges,
+    int n);
+
+/**
+ * sendfile() the whole [offset, offset + len) region of fd
+ */
+ssize_t HttpRange_sendfile(int connfd, int fd, off_t offset, size_t len);
+
+#endif
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include "http_range.h"
+
+static int check_parse(const char *value, size_t length, int expected, size_t first, size_t last)
+{
+  HttpRange ranges[HTTP_RANGE_MAX];
+  int n = HttpRange_parse(value, length, ranges, HTTP_RANGE_MAX);
+
+  printf("%-28s /%-4zu -> %2d", value, length, n);
+  if (n > 0)
+    printf(" [%zu-%zu]", ranges[0].first, ranges[0].last);
+  printf("\n");
+
+  if (n != expected)
+    return 1;
+
+  if (n > 0 && (ranges[0].first != first || ranges[0].last != last))
+    return 1;
+
+  return 0;
+}
+
+static char *send_and_read(int fd, size_t length, const char *value, const char *content_type)
+{
+  int sv[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, sv);
+
+  HttpRange ranges[HTTP_RANGE_MAX];
+  int n = HttpRange_parse(value, length, ranges, HTTP_RANGE_MAX);
+  HttpRange_send(sv[0], fd, 0, length, content_type, ranges, n);
+  close(sv[0]);
+
+  char *buf = calloc(8192, 1);
+  size_t total = 0;
+  for (ssize_t r; (r = read(sv[1], buf + total, 8191 - total)) > 0;)
+    total += r;
+  close(sv[1]);
+
+  return buf;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  failed |= check_parse("bytes=0-99", 1000, 1, 0, 99);
+  failed |= check_parse("bytes=500-", 1000, 1, 500, 999);
+  failed |= check_parse("bytes=-100", 1000, 1, 900, 999);
+  failed |= check_parse("bytes=-5000", 1000, 1, 0, 999);
+  failed |= check_parse("bytes=900-5000", 1000, 1, 900, 999);
+  failed |= check_parse("BYTES = 1-2", 1000, 0, 0, 0);
+  failed |= check_parse("bytes=0-0, 5-9,,", 1000, 2, 0, 0);
+  failed |= check_parse("bytes=1000-", 1000, -1, 0, 0);
+  failed |= check_parse("bytes=2000-3000,-0", 1000, -1, 0, 0);
+  failed |= check_parse("bytes=5-1", 1000, 0, 0, 0);
+  failed |= check_parse("bytes=", 1000, 0, 0, 0);
+  failed |= check_parse("items=0-1", 1000, 0, 0, 0);
+  failed |= check_parse("bytes=0-1\r\n", 1000, 1, 0, 1);
+
+  int fd = memfd_create("http_range_test", 0);
+  const char *body = "0123456789abcdefghijklmnopqrstuvwxyz";
+  write(fd, body, strlen(body));
+
+  char *res = send_and_read(fd, strlen(body), "bytes=10-15", "text/plain");
+  printf("%s\n", res);
+  failed |= !strstr(res, "206 Partial Content");
+  failed |= !strstr(res, "Content-Range: bytes 10-15/36\r\n");
+  failed |= strcmp(res + strlen(res) - 6, "abcdef") != 0;
+  free(res);
+
+  res = send_and_read(fd, strlen(body), "bytes=0-1,-2", "text/plain");
+  printf("%s\n", res);
+  failed |= !strstr(res, "multipart/byteranges");
+  failed |= !strstr(res, "Content-Range: bytes 0-1/36\r\n\r\n01\r\n");
+  failed |= !strstr(res, "Content-Range: bytes 34-35/36\r\n\r\nyz\r\n");
+
+  // advertised length must match what was written
+  char *body_start = strstr(res, "\r\n\r\n") + 4;
+  size_t content_length = strtoul(strstr(res, "Content-Length: ") + 16, NULL, 10);
+  failed |= strlen(body_start) != content_length;
+  free(res);
+
+  res = send_and_read(fd, strlen(body), "bytes=100-", "text/plain");
+  printf("%s\n", res);
+  failed |= !strstr(res, "416 Range Not Satisfiable");
+  failed |= !strstr(res, "Content-Range: bytes */36");
+  free(res);
+
+  // a Content-Type longer than any fixed buffer is sent whole and counted
+  char content_type[1025];
+  memset(content_type, 't', 1024);
+  content_type[1024] = '\0';
+
+  res = send_and_read(fd, strlen(body), "bytes=10-15", content_type);
+  failed |= !strstr(res, content_type) || strcmp(res + strlen(res) - 6, "abcdef") != 0;
+  free(res);
+
+  res = send_and_read(fd, strlen(body), "bytes=0-1,-2", content_type);
+  body_start = strstr(res, "\r\n\r\n") + 4;
+  content_length = strtoul(strstr(res, "Content-Length: ") + 16, NULL, 10);
+  failed |= strlen(body_start) != content_length || !strstr(res, "Content-Range: bytes 34-35/36\r\n\r\nyz\r\n");
+  printf("long content type: %zu byte multipart body\n", content_length);
+  free(res);
+
+  close(fd);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "ip_radix.h"
+
+/**
+ * Leading bits a and b share, at most limit
+ */
+static inline unsigned int _common(const u_int64_t a[2], const u_int64_t b[2], unsigned int limit)
+{
+  u_int64_t high = a[0] ^ b[0], low = a[1] ^ b[1];
+  unsigned int common = high ? __builtin_clzll(high) : low ? 64 + __builtin_clzll(low) : 128;
+
+  return common < limit ? common : limit;
+}
+
+/**
+ * Bit at position of address, 0 being the most significant. position < 128
+ */
+static inline unsigned int _bit(const u_int64_t address[2], unsigned int position)
+{
+  return position < 64 ? address[0] >> (63 - position) & 1 : address[1] >> (127 - position) & 1;
+}
+
+static void _mask(u_int64_t address[2], unsigned int length)
+{
+  if (length < 64)
+  {
+    address[0] &= length ? ~0ull << (64 - length) : 0;
+    address[1] = 0;
+  }
+  else if (length < 128)
+  {
+    address[1] &= length > 64 ? ~0ull << (128 - length) : 0;
+  }
+}
+
+static u_int64_t _load_be64(const unsigned char *bytes)
+{
+  u_int64_t value = 0;
+  for (int i = 0; i < 8; i++)
+    value = value << 8 | bytes[i];
+
+  return value;
+}
+
+IpRadix *IpRadix_new(IpRadix *radix)
+{
+  radix->node_capacity = 16;
+  radix->nodes = malloc(radix->node_capacity * sizeof(*radix->nodes));
+  if (!radix->nodes)
+    return NULL;
+
+  radix->nodes[0] = (IpRadixNode){0};
+  radix->node_count = 1;
+  radix->jumps = NULL;
+  radix->jump_bits = 0;
+
+  return radix;
+}
+
+void IpRadix_free(IpRadix *radix)
+{
+  free(radix->nodes);
+  free(radix->jumps);
+}
+
+char IpRadix_parse(const char *text, unsigned int length, u_int64_t address[2], unsigned int *prefix_length)
+{
+  char buf[INET6_ADDRSTRLEN + sizeof("/128")];
+
+  if (!length || length >= sizeof(buf))
+    return 0;
+
+  // most domains stop here on their first letter past f
+  for (unsigned int i = 0; i < length; i++)
+  {
+    char c = text[i];
+    if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F') || c == '.' || c == ':' || c == '/'))
+      return 0;
+  }
+
+  memcpy(buf, text, length);
+  buf[length] = '\0';
+
+  unsigned int bits = ~0u;
+  char *slash = strchr(buf, '/');
+  if (slash)
+  {
+    *slash = '\0';
+
+    char *end;
+    unsigned long parsed = strtoul(slash + 1, &end, 10);
+    if (end == slash + 1 || *end || end - slash > 4)
+      return 0;
+
+    bits = parsed;
+  }
+
+  unsigned char bytes[16];
+  if (inet_pton(AF_INET, buf, bytes) == 1)
+  {
+    if (bits != ~0u && bits > 32)
+      return 0;
+
+    address[0] = 0;
+    address[1] = 0xffff00000000ull | (u_int64_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3];
+    *prefix_length = bits == ~0u ? 128 : 96 + bits;
+  }
+  else if (inet_pton(AF_INET6, buf, bytes) == 1)
+  {
+    if (bits != ~0u && bits > 128)
+      return 0;
+
+    address[0] = _load_be64(bytes);
+    address[1] = _load_be64(bytes + 8);
+    *prefix_length = bits == ~0u ? 128 : bits;
+  }
+  else
+  {
+    return 0;
+  }
+
+  _mask(address, *prefix_length);
+
+  return 1;
+}
+
+char IpRadix_sockaddr(const struct sockaddr *sockaddr, u_int64_t address[2])
+{
+  if (sockaddr->sa_family == AF_INET)
+  {
+    address[0] = 0;
+    address[1] = 0xffff00000000ull | ntohl(((const struct sockaddr_in *)sockaddr)->sin_addr.s_addr);
+    return 1;
+  }
+
+  if (sockaddr->sa_family == AF_INET6)
+  {
+    const unsigned char *bytes = ((const struct sockaddr_in6 *)sockaddr)->sin6_addr.s6_addr;
+    address[0] = _load_be64(bytes);
+    address[1] = _load_be64(bytes + 8);
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Index of a new node, 0 when out of memory
+ */
+static unsigned int _node(IpRadix *radix, const u_int64_t address[2], unsigned int length, unsigned int value)
+{
+  if (radix->node_count == radix->node_capacity)
+  {
+    IpRadixNode *grown = realloc(radix->nodes, radix->node_capacity * 2 * sizeof(*grown));
+    if (!grown)
+      return 0;
+
+    radix->nodes = grown;
+    radix->node_capacity *= 2;
+  }
+
+  IpRadixNode *node = &radix->nodes[radix->node_count];
+  *node = (IpRadixNode){{address[0], address[1]}, {0, 0}, value, length};
+  _mask(node->address, length);
+
+  return radix->node_count++;
+}
+
+int IpRadix_insert(IpRadix *radix, const u_int64_t address[2], unsigned int length, unsigned int value)
+{
+  unsigned int index = 0;
+
+  free(radix->jumps);
+  radix->jumps = NULL;
+  radix->jump_bits = 0;
+
+  // the network of index is always a prefix of address
+  for (;;)
+  {
+    if (radix->nodes[index].length == length)
+    {
+      radix->nodes[index].value = value;
+      return 0;
+    }
+
+    unsigned int side = _bit(address, radix->nodes[index].length);
+    unsigned int child = radix->nodes[index].child[side];
+
+    if (!child)
+    {
+      unsigned int leaf = _node(radix, address, length, value);
+      if (!leaf)
+        return -1;
+
+      radix->nodes[index].child[side] = leaf;
+      return 0;
+    }
+
+    IpRadixNode *next = &radix->nodes[child];
+    unsigned int common = _common(address, next->address, length < next->length ? length : next->length);
+
+    if (common == next->length)
+    {
+      index = child;
+      continue;
+    }
+
+    // the new network goes between index and child
+    unsigned int child_side = _bit(next->address, common);
+    unsigned int added = _node(radix, address, common, common == length ? value : 0);
+    if (!added)
+      return -1;
+
+    radix->nodes[added].child[child_side] = child;
+
+    // or both hang from a node where they part
+    if (common < length)
+    {
+      unsigned int leaf = _node(radix, address, length, value);
+      if (!leaf)
+        return -1;
+
+      radix->nodes[added].child[!child_side] = leaf;
+    }
+
+    radix->nodes[index].child[side] = added;
+    return 0;
+  }
+}
+
+IpRadix *IpRadix_index(IpRadix *radix)
+{
+  // about a slot per node, small trees get a small table
+  unsigned int bits = 8;
+  while (bits < 16 && 1u << bits < radix->node_count)
+    bits++;
+
+  IpRadixJump *jumps = malloc((1u << bits) * sizeof(*jumps));
+  if (!jumps)
+    return NULL;
+
+  for (unsigned int i = 0; i < 1u << bits; i++)
+  {
+    u_int64_t address[2] = {0, 0xffff00000000ull | (u_int64_t)i << (32 - bits)};
+    unsigned int index = 0, value = 0;
+
+    // networks shorter than the bits branch the same for every address of
+    // the slot
+    while (radix->nodes[index].length < 96 + bits)
+    {
+      IpRadixNode *node = &radix->nodes[index];
+
+      if (_common(address, node->address, node->length) < node->length)
+      {
+        index = 0;
+        break;
+      }
+
+      if (node->value)
+        value = node->value;
+
+      if (!(index = node->child[_bit(address, node->length)]))
+        break;
+    }
+
+    jumps[i] = (IpRadixJump){index, value};
+  }
+
+  free(radix->jumps);
+  radix->jumps = jumps;
+  radix->jump_bits = bits;
+
+  return radix;
+}
+
+unsigned int IpRadix_find(IpRadix *radix, const u_int64_t address[2])
+{
+  unsigned int found = 0;
+  IpRadixNode *node = radix->nodes;
+
+  if (radix->jumps && !address[0] && address[1] >> 32 == 0xffff)
+  {
+    IpRadixJump jump = radix->jumps[(unsigned int)address[1] >> (32 - radix->jump_bits)];
+
+    found = jump.value;
+    if (!jump.node)
+      return found;
+
+    node = &radix->nodes[jump.node];
+  }
+
+  for (;;)
+  {
+    // compressed nodes skip bits, they have to match too
+    if (_common(address, node->address, node->length) < node->length)
+      return found;
+
+    if (node->value)
+      found = node->value;
+
+    unsigned int child;
+    if (node->length == 128 || !(child = node->child[_bit(address, node->length)]))
+      return found;
+
+    node = &radix->nodes[child];
+  }
+}
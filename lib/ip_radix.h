@@ -0,0 +1,103 @@
+/**
+ * Longest prefix match over IPv4 and IPv6 networks, a binary radix tree
+ * with the nodes that have a single child and no value compressed away.
+ * IPv4 networks live under ::ffff:0:0/96 like mapped addresses do
+ *
+ * Nodes are in one array and refer to each other by index, so a tree can
+ * be written out and used from a mapping as is. Once indexed, IPv4 lookups
+ * start from a table over the first bits of the address instead of the
+ * root and skip the top of the tree
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifndef IP_RADIX_H
+#define IP_RADIX_H
+
+typedef struct IpRadixNode
+{
+  /**
+   * The network, most significant half first. Bits past length are 0
+   */
+  u_int64_t address[2];
+  /**
+   * By the bit after the network, 0 when there is none. The root is never
+   * a child
+   */
+  unsigned int child[2];
+  /**
+   * 0 for a node that only branches
+   */
+  unsigned int value;
+  unsigned int length;
+} IpRadixNode;
+
+/**
+ * Where a lookup for the IPv4 addresses with the same first bits resumes
+ */
+typedef struct IpRadixJump
+{
+  /**
+   * First node deeper than the bits, 0 when there is none
+   */
+  unsigned int node;
+  /**
+   * Value of the longest network on the way there
+   */
+  unsigned int value;
+} IpRadixJump;
+
+typedef struct IpRadix
+{
+  /**
+   * Node 0 is the root, ::/0
+   */
+  IpRadixNode *nodes;
+  unsigned int node_count;
+  unsigned int node_capacity;
+  /**
+   * By the first jump_bits of an IPv4 address, NULL until indexed
+   */
+  IpRadixJump *jumps;
+  unsigned int jump_bits;
+} IpRadix;
+
+/**
+ * Create a new IpRadix with only the root, NULL when out of memory
+ */
+IpRadix *IpRadix_new(IpRadix *radix);
+void IpRadix_free(IpRadix *radix);
+
+/**
+ * Parse an IPv4 or IPv6 address with an optional /length from text, which
+ * need not be null terminated. Bits past the length are cleared
+ *
+ * Returns 0 when text is not an address
+ */
+char IpRadix_parse(const char *text, unsigned int length, u_int64_t address[2], unsigned int *prefix_length);
+
+/**
+ * Address of an AF_INET or AF_INET6 sockaddr, returns 0 for other families
+ */
+char IpRadix_sockaddr(const struct sockaddr *sockaddr, u_int64_t address[2]);
+
+/**
+ * Set the value of a network, replacing the one it had. value is not 0.
+ * Drops the index
+ *
+ * Returns 0 on success, -1 when out of memory
+ */
+int IpRadix_insert(IpRadix *radix, const u_int64_t address[2], unsigned int length, unsigned int value);
+
+/**
+ * Build the IPv4 jump table, sized by the number of nodes. Returns NULL
+ * when out of memory, lookups work without one
+ */
+IpRadix *IpRadix_index(IpRadix *radix);
+
+/**
+ * Value of the longest network address is in, 0 when it is in none
+ */
+unsigned int IpRadix_find(IpRadix *radix, const u_int64_t address[2]);
+
+#endif
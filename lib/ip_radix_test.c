@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "ip_radix.h"
+
+#define NETWORKS 20000
+
+static u_int64_t next(u_int64_t *state)
+{
+  // xorshift64
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+typedef struct Network
+{
+  u_int64_t address[2];
+  unsigned int length;
+  unsigned int value;
+} Network;
+
+static Network networks[NETWORKS];
+
+static char in_network(Network *network, const u_int64_t address[2])
+{
+  for (unsigned int bit = 0; bit < network->length; bit++)
+  {
+    unsigned int half = bit / 64, shift = 63 - bit % 64;
+    if ((address[half] >> shift & 1) != (network->address[half] >> shift & 1))
+      return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Value of the longest network, the later one on ties, by looking at all
+ */
+static unsigned int slow_find(unsigned int count, const u_int64_t address[2])
+{
+  unsigned int found = 0, found_length = 0;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (in_network(&networks[i], address) && (!found || networks[i].length >= found_length))
+    {
+      found = networks[i].value;
+      found_length = networks[i].length;
+    }
+  }
+
+  return found;
+}
+
+static int parse(char *text, char expected, unsigned int expected_length, u_int64_t high, u_int64_t low)
+{
+  u_int64_t address[2] = {0};
+  unsigned int length = 0;
+  char parsed = IpRadix_parse(text, strlen(text), address, &length);
+
+  int failed = parsed != expected || (parsed && (length != expected_length || address[0] != high || address[1] != low));
+  if (failed)
+    printf("parse %s: %d /%u %016llx%016llx\n", text, parsed, length, (unsigned long long)address[0], (unsigned long long)address[1]);
+
+  return failed;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  failed |= parse("1.2.3.4", 1, 128, 0, 0xffff01020304ull);
+  failed |= parse("10.1.2.3/8", 1, 104, 0, 0xffff0a000000ull);
+  failed |= parse("0.0.0.0/0", 1, 96, 0, 0xffff00000000ull);
+  failed |= parse("2001:db8::1/32", 1, 32, 0x20010db800000000ull, 0);
+  failed |= parse("::1", 1, 128, 0, 1);
+  failed |= parse("::ffff:1.2.3.4", 1, 128, 0, 0xffff01020304ull);
+  failed |= parse("1.2.3.4/33", 0, 0, 0, 0);
+  failed |= parse("1.2.3.4/", 0, 0, 0, 0);
+  failed |= parse("1.2.3", 0, 0, 0, 0);
+  failed |= parse("dead.beef", 0, 0, 0, 0);
+  failed |= parse("example.com", 0, 0, 0, 0);
+  failed |= parse("1password.com", 0, 0, 0, 0);
+
+  IpRadix radix;
+  IpRadix_new(&radix);
+
+  // a mix of short and long IPv4 and IPv6 networks, with repeats
+  u_int64_t state = 88172645463325252ull;
+  for (unsigned int i = 0; i < NETWORKS; i++)
+  {
+    Network *network = &networks[i];
+    u_int64_t random = next(&state);
+
+    if (i % 7 == 6)
+    {
+      *network = networks[random % i];
+    }
+    else if (random & 1)
+    {
+      network->address[0] = 0;
+      network->address[1] = 0xffff00000000ull | (next(&state) & 0xff0fffffull);
+      network->length = 96 + random % 33;
+    }
+    else
+    {
+      network->address[0] = 0x2001000000000000ull | (next(&state) >> 20);
+      network->address[1] = next(&state);
+      network->length = 16 + random % 113;
+    }
+
+    // clear the host bits like parsing does
+    for (unsigned int bit = network->length; bit < 128; bit++)
+      network->address[bit / 64] &= ~(1ull << (63 - bit % 64));
+
+    network->value = i + 1;
+    failed |= IpRadix_insert(&radix, network->address, network->length, network->value);
+  }
+
+  unsigned int wrong = 0, matched = 0;
+  for (unsigned int i = 0; i < 20000; i++)
+  {
+    // the second half starts IPv4 lookups from the jump table
+    if (i == 10000)
+      failed |= !IpRadix_index(&radix);
+
+    u_int64_t address[2];
+    if (i & 1)
+    {
+      // addresses inside networks and next to them
+      Network *network = &networks[next(&state) % NETWORKS];
+      address[0] = network->address[0] ^ (next(&state) & (network->length < 64 ? ~0ull >> network->length : 0));
+      address[1] = network->address[1] ^ (next(&state) & (network->length < 128 ? ~0ull >> (network->length > 64 ? network->length - 64 : 0) : 0) & (i & 2 ? ~0ull : 0xff));
+    }
+    else
+    {
+      address[0] = 0;
+      address[1] = 0xffff00000000ull | (next(&state) & 0xff0fffffull);
+    }
+
+    unsigned int expected = slow_find(NETWORKS, address);
+    unsigned int found = IpRadix_find(&radix, address);
+    wrong += found != expected;
+    matched += !!expected;
+  }
+
+  printf("%u networks, %u nodes: %u of 20000 lookups wrong, %u matched\n", NETWORKS, radix.node_count, wrong, matched);
+  failed |= wrong || !matched;
+
+  // an empty tree and the whole address space
+  IpRadix empty;
+  IpRadix_new(&empty);
+  u_int64_t any[2] = {0x20010db800000000ull, 1};
+  failed |= IpRadix_find(&empty, any) != 0;
+  IpRadix_insert(&empty, any, 0, 7);
+  failed |= IpRadix_find(&empty, any) != 7;
+  IpRadix_free(&empty);
+
+  struct sockaddr_in in = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(0x0a000001)};
+  u_int64_t address[2];
+  failed |= !IpRadix_sockaddr((struct sockaddr *)&in, address) || address[0] || address[1] != 0xffff0a000001ull;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned int sum = 0;
+  for (unsigned int i = 0; i < 1000000; i++)
+  {
+    address[0] = 0;
+    address[1] = 0xffff00000000ull | (next(&state) & 0xff0fffffull);
+    sum += IpRadix_find(&radix, address);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("%.1f ns per IPv4 lookup (%u)\n", ((end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec) / 1e6, sum & 1);
+
+  IpRadix_free(&radix);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
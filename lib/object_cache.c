@@ -0,0 +1,599 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <sys/mman.h>
+#include "object_cache.h"
+#include "url_blacklist.h"
+
+/**
+ * Largest response header the cache will look at
+ */
+#define HEADER_SCAN_SIZE 8192
+/**
+ * Longer Content-Type values are dropped, ranged replies then send
+ * application/octet-stream
+ */
+#define CONTENT_TYPE_MAX 256
+
+static unsigned int _hash(const char *str)
+{
+  unsigned int hash = 5381;
+
+  for (; *str; str++)
+    hash += (hash << 5) + *str;
+
+  return hash;
+}
+
+/**
+ * Lowercased hostname of a key e.g. "http://Example.com:80/a" -> "example.com"
+ */
+static size_t _key_host(const char *key, char *dest, size_t dest_len)
+{
+  const char *scheme_end = strstr(key, "://");
+  if (scheme_end)
+    key = scheme_end + 3;
+
+  size_t len = 0;
+  for (; key[len] && key[len] != ':' && key[len] != '/' && len + 1 < dest_len; len++)
+    dest[len] = tolower(key[len]);
+
+  dest[len] = '\0';
+
+  return len;
+}
+
+static CacheHost **_find_host_slot(ObjectCache *cache, const char *name)
+{
+  CacheHost **slot = &cache->hosts[_hash(name) & cache->mask];
+
+  for (; *slot; slot = &(*slot)->chain)
+  {
+    if (!strcmp((*slot)->name, name))
+      break;
+  }
+
+  return slot;
+}
+
+static void _host_link(ObjectCache *cache, CacheObject *object)
+{
+  char name[256];
+  _key_host(object->key, name, sizeof(name));
+
+  CacheHost **slot = _find_host_slot(cache, name);
+
+  if (!*slot)
+  {
+    *slot = calloc(1, sizeof(CacheHost));
+    (*slot)->name = strdup(name);
+  }
+
+  CacheHost *host = *slot;
+
+  object->host = host;
+  object->host_prev = NULL;
+  object->host_next = host->objects;
+  if (host->objects)
+    host->objects->host_prev = object;
+  host->objects = object;
+}
+
+static void _host_unlink(ObjectCache *cache, CacheObject *object)
+{
+  CacheHost *host = object->host;
+
+  if (object->host_prev)
+    object->host_prev->host_next = object->host_next;
+  else
+    host->objects = object->host_next;
+
+  if (object->host_next)
+    object->host_next->host_prev = object->host_prev;
+
+  object->host = NULL;
+  object->host_prev = object->host_next = NULL;
+
+  if (host->objects)
+    return;
+
+  CacheHost **slot = _find_host_slot(cache, host->name);
+  *slot = host->chain;
+  free(host->name);
+  free(host);
+}
+
+static void _CacheObject_destroy(CacheObject *object)
+{
+  close(object->fd);
+  free(object->content_type);
+  free(object->key);
+  free(object);
+}
+
+/**
+ * Returns the slot pointing at the object with key, or the empty slot at the
+ * end of the bucket
+ */
+static CacheObject **_find_slot(ObjectCache *cache, const char *key)
+{
+  CacheObject **slot = &cache->table[_hash(key) & cache->mask];
+
+  for (; *slot; slot = &(*slot)->chain)
+  {
+    if (!strcmp((*slot)->key, key))
+      break;
+  }
+
+  return slot;
+}
+
+/**
+ * Caller holds the mutex. The object is destroyed once the last reader
+ * releases it
+ */
+static void _unlink(ObjectCache *cache, CacheObject *object)
+{
+  CacheObject **slot = _find_slot(cache, object->key);
+  *slot = object->chain;
+  object->chain = NULL;
+
+  _host_unlink(cache, object);
+  cache->size -= object->size;
+  object->evicted = 1;
+
+  if (!object->refs)
+    _CacheObject_destroy(object);
+}
+
+static void _remove(ObjectCache *cache, CacheObject *object)
+{
+  CachePolicy_remove(&cache->policy, &object->node);
+  _unlink(cache, object);
+}
+
+/**
+ * Policy callback, the node is already out of the policy
+ */
+static void _evict(void *ctx, CachePolicyNode *node)
+{
+  ObjectCache *cache = ctx;
+
+  cache->evictions++;
+  _unlink(cache, (CacheObject *)node);
+}
+
+ObjectCache *ObjectCache_new(
+    ObjectCache *cache,
+    size_t capacity,
+    size_t max_object_size,
+    u_int8_t table_size_2,
+    cache_policy_t policy)
+{
+  cache->table = calloc(1 << table_size_2, sizeof(CacheObject *));
+  cache->hosts = calloc(1 << table_size_2, sizeof(CacheHost *));
+
+  if (!cache->table || !cache->hosts)
+  {
+    free(cache->table);
+    free(cache->hosts);
+    return NULL;
+  }
+
+  cache->mask = (1 << table_size_2) - 1;
+
+  // assume objects average a tenth of the maximum size
+  size_t expected_entries = capacity / (max_object_size / 10 + 1);
+  if (!CachePolicy_new(&cache->policy, policy, capacity, expected_entries, _evict, cache))
+  {
+    free(cache->table);
+    free(cache->hosts);
+    return NULL;
+  }
+
+  cache->size = 0;
+  cache->capacity = capacity;
+  cache->max_object_size = max_object_size;
+
+  cache->hits = cache->misses = cache->evictions = cache->purges = 0;
+
+  pthread_mutex_init(&cache->mutex, NULL);
+
+  return cache;
+}
+
+void ObjectCache_free(ObjectCache *cache)
+{
+  pthread_mutex_lock(&cache->mutex);
+  for (unsigned int i = 0; i <= cache->mask; i++)
+  {
+    while (cache->table[i])
+      _remove(cache, cache->table[i]);
+  }
+  pthread_mutex_unlock(&cache->mutex);
+
+  pthread_mutex_destroy(&cache->mutex);
+  CachePolicy_free(&cache->policy);
+  free(cache->table);
+  free(cache->hosts);
+}
+
+/**
+ * Returns the object with a reference held, or NULL on a miss
+ *
+ * The object stays valid until ObjectCache_release even if it gets evicted
+ */
+CacheObject *ObjectCache_get(ObjectCache *cache, const char *key)
+{
+  unsigned int hash = _hash(key);
+
+  pthread_mutex_lock(&cache->mutex);
+
+  CacheObject *object = *_find_slot(cache, key);
+  CachePolicy_record(&cache->policy, hash);
+
+  if (object)
+  {
+    object->refs++;
+    CachePolicy_hit(&cache->policy, &object->node);
+    cache->hits++;
+  }
+  else
+  {
+    cache->misses++;
+  }
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return object;
+}
+
+void ObjectCache_release(ObjectCache *cache, CacheObject *object)
+{
+  pthread_mutex_lock(&cache->mutex);
+
+  if (!--object->refs && object->evicted)
+    _CacheObject_destroy(object);
+
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * Looks at the stored response and decides if it can be served to other
+ * clients. Fills in header_length and content_type
+ */
+static int _parse_response(CacheObject *object)
+{
+  char buf[HEADER_SCAN_SIZE + 1];
+  size_t want = object->size < HEADER_SCAN_SIZE ? object->size : HEADER_SCAN_SIZE;
+  ssize_t n = pread(object->fd, buf, want, 0);
+
+  if (n <= 0)
+    return -1;
+
+  buf[n] = '\0';
+
+  // only full responses are worth keeping, partial content is never cached
+  int major, minor, status;
+  if (sscanf(buf, "HTTP/%d.%d %d", &major, &minor, &status) != 3 || status != 200)
+    return -1;
+
+  char *header_end = strstr(buf, "\r\n\r\n");
+  if (!header_end)
+    return -1;
+
+  object->header_length = header_end + 4 - buf;
+  *header_end = '\0';
+
+  for (char *line = strstr(buf, "\r\n"); line; line = strstr(line, "\r\n"))
+  {
+    line += 2;
+
+    if (!strncasecmp(line, "Cache-Control:", 14))
+    {
+      char *end = strstr(line, "\r\n");
+      char *value = strndup(line + 14, end ? end - line - 14 : strlen(line + 14));
+      int uncacheable = strcasestr(value, "no-store") || strcasestr(value, "private");
+      free(value);
+
+      if (uncacheable)
+        return -1;
+    }
+    else if (!strncasecmp(line, "Content-Type:", 13) && !object->content_type)
+    {
+      char *value = line + 13;
+      while (*value == ' ' || *value == '\t')
+        value++;
+
+      char *end = strstr(value, "\r\n");
+      size_t length = end ? end - value : strlen(value);
+      if (length <= CONTENT_TYPE_MAX)
+        object->content_type = strndup(value, length);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * Insert a complete response stored in fd. The cache takes ownership of fd
+ *
+ * Returns -1 if the response was rejected (fd is closed)
+ */
+int ObjectCache_put(ObjectCache *cache, const char *key, int fd, size_t size)
+{
+  if (size > cache->max_object_size || size > cache->capacity)
+  {
+    close(fd);
+    return -1;
+  }
+
+  CacheObject *object = calloc(1, sizeof(*object));
+  object->fd = fd;
+  object->size = size;
+  object->node.hash = _hash(key);
+  object->node.size = size;
+
+  if (_parse_response(object))
+  {
+    _CacheObject_destroy(object);
+    return -1;
+  }
+
+  object->key = strdup(key);
+
+  pthread_mutex_lock(&cache->mutex);
+
+  CacheObject *existing = *_find_slot(cache, key);
+  if (existing)
+    _remove(cache, existing);
+
+  *_find_slot(cache, key) = object;
+  _host_link(cache, object);
+  cache->size += size;
+
+  // the policy may turn the object away right here, hold it until we know
+  object->refs++;
+  CachePolicy_insert(&cache->policy, &object->node);
+  char rejected = object->evicted;
+  object->refs--;
+
+  if (rejected)
+    _CacheObject_destroy(object);
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return rejected ? -1 : 0;
+}
+
+unsigned int ObjectCache_purge(ObjectCache *cache, const char *key)
+{
+  pthread_mutex_lock(&cache->mutex);
+
+  CacheObject *object = *_find_slot(cache, key);
+  if (object)
+    _remove(cache, object);
+
+  cache->purges += !!object;
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return !!object;
+}
+
+/**
+ * Caller holds the mutex. prefix of NULL removes every object of the host
+ */
+static unsigned int _purge_host_objects(ObjectCache *cache, CacheHost *host, const char *prefix)
+{
+  unsigned int purged = 0;
+  size_t prefix_len = prefix ? strlen(prefix) : 0;
+
+  // removing the last object frees the host, so look ahead first
+  for (CacheObject *object = host->objects, *next; object; object = next)
+  {
+    next = object->host_next;
+
+    if (prefix && strncmp(object->key, prefix, prefix_len))
+      continue;
+
+    _remove(cache, object);
+    purged++;
+  }
+
+  return purged;
+}
+
+unsigned int ObjectCache_purge_host(ObjectCache *cache, const char *host)
+{
+  char name[256];
+  _key_host(host, name, sizeof(name));
+
+  pthread_mutex_lock(&cache->mutex);
+
+  unsigned int purged = 0;
+  CacheHost *entry = *_find_host_slot(cache, name);
+  if (entry)
+    purged = _purge_host_objects(cache, entry, NULL);
+
+  cache->purges += purged;
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return purged;
+}
+
+/**
+ * Removes every key starting with prefix. Only the objects of the prefix's
+ * host are looked at
+ */
+unsigned int ObjectCache_purge_prefix(ObjectCache *cache, const char *prefix)
+{
+  char name[256];
+  _key_host(prefix, name, sizeof(name));
+
+  pthread_mutex_lock(&cache->mutex);
+
+  unsigned int purged = 0;
+  CacheHost *entry = *_find_host_slot(cache, name);
+  if (entry)
+    purged = _purge_host_objects(cache, entry, prefix);
+
+  cache->purges += purged;
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return purged;
+}
+
+/**
+ * Removes every object whose host matches glob, same semantics as UrlBlacklist
+ * rules e.g. "*.example.com" or "*cdn*.*"
+ *
+ * Walks the hosts index, never the objects of hosts that don't match
+ */
+unsigned int ObjectCache_purge_glob(ObjectCache *cache, const char *glob)
+{
+  char pattern[256];
+  unsigned int pattern_len = _key_host(glob, pattern, sizeof(pattern));
+
+  // rules end in a delimiter, never in a character of the host
+  pattern[pattern_len] = '\n';
+
+  pthread_mutex_lock(&cache->mutex);
+
+  unsigned int purged = 0;
+  for (unsigned int i = 0; i <= cache->mask; i++)
+  {
+    for (CacheHost *host = cache->hosts[i], *next; host; host = next)
+    {
+      next = host->chain;
+
+      if (_glob_match(host->name, pattern, pattern_len))
+        purged += _purge_host_objects(cache, host, NULL);
+    }
+  }
+
+  cache->purges += purged;
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return purged;
+}
+
+int ObjectCache_hosts(ObjectCache *cache, char ***names)
+{
+  pthread_mutex_lock(&cache->mutex);
+
+  unsigned int count = 0;
+  for (unsigned int i = 0; i <= cache->mask; i++)
+  {
+    for (CacheHost *host = cache->hosts[i]; host; host = host->chain)
+      count++;
+  }
+
+  *names = malloc((count + 1) * sizeof(**names));
+  unsigned int copied = 0;
+  for (unsigned int i = 0; *names && i <= cache->mask; i++)
+  {
+    for (CacheHost *host = cache->hosts[i]; host; host = host->chain)
+    {
+      if (!((*names)[copied] = strdup(host->name)))
+        goto fail;
+      copied++;
+    }
+  }
+
+  pthread_mutex_unlock(&cache->mutex);
+
+  return *names ? (int)count : -1;
+
+fail:
+  pthread_mutex_unlock(&cache->mutex);
+
+  while (copied)
+    free((*names)[--copied]);
+  free(*names);
+  *names = NULL;
+
+  return -1;
+}
+
+void ObjectCache_print_stats(ObjectCache *cache)
+{
+  pthread_mutex_lock(&cache->mutex);
+
+  printf("ObjectCache %s [%zu/%zu bytes]: %p\n", CachePolicy_name(cache->policy.type), cache->size, cache->capacity, (void *)cache);
+  printf("  hits: %lu misses: %lu evictions: %lu purges: %lu\n", cache->hits, cache->misses, cache->evictions, cache->purges);
+
+  pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * A max_size of 0 starts an already aborted fill
+ */
+CacheFill *CacheFill_begin(CacheFill *fill, size_t max_size)
+{
+  fill->fd = max_size ? memfd_create("proxy-cache", MFD_CLOEXEC) : -1;
+  fill->size = 0;
+  fill->max_size = max_size;
+  fill->aborted = fill->fd < 0;
+
+  return fill;
+}
+
+void CacheFill_abort(CacheFill *fill)
+{
+  if (fill->aborted)
+    return;
+
+  close(fill->fd);
+  fill->fd = -1;
+  fill->aborted = 1;
+}
+
+void CacheFill_append(CacheFill *fill, const char *buf, size_t len)
+{
+  if (fill->aborted)
+    return;
+
+  if (fill->size + len > fill->max_size)
+  {
+    CacheFill_abort(fill);
+    return;
+  }
+
+  for (size_t written = 0; written < len;)
+  {
+    ssize_t n = write(fill->fd, buf + written, len - written);
+
+    if (n < 0)
+    {
+      CacheFill_abort(fill);
+      return;
+    }
+
+    written += n;
+  }
+
+  fill->size += len;
+}
+
+/**
+ * Hand the filled object to the cache. The fill is finished afterwards
+ */
+int CacheFill_commit(CacheFill *fill, ObjectCache *cache, const char *key)
+{
+  if (fill->aborted)
+    return -1;
+
+  fill->aborted = 1;
+
+  return ObjectCache_put(cache, key, fill->fd, fill->size);
+}
@@ -0,0 +1,144 @@
+/**
+ * Thread-safe cache of complete origin responses
+ *
+ * Every object lives in its own memfd so it can be served with sendfile()
+ * without copying it back through user space
+ */
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "cache_policy.h"
+
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+struct CacheObject;
+
+/**
+ * Secondary index entry, every cached object of a host
+ */
+typedef struct CacheHost
+{
+  char *name;
+  struct CacheObject *objects;
+  struct CacheHost *chain;
+} CacheHost;
+
+typedef struct CacheObject
+{
+  /**
+   * Must stay first, the policy hands nodes back to the cache
+   */
+  CachePolicyNode node;
+
+  char *key;
+  /**
+   * memfd holding the raw response (status line, headers and body)
+   */
+  int fd;
+  /**
+   * Total number of bytes in fd
+   */
+  size_t size;
+  /**
+   * Bytes up to and including the blank line that ends the headers
+   */
+  size_t header_length;
+  /**
+   * Content-Type of the response. Can be NULL
+   */
+  char *content_type;
+
+  /**
+   * Readers currently holding the object. Guarded by the cache mutex
+   */
+  unsigned int refs;
+  /**
+   * Removed from the cache but still held by a reader
+   */
+  char evicted;
+
+  struct CacheObject *chain;
+
+  CacheHost *host;
+  struct CacheObject *host_prev;
+  struct CacheObject *host_next;
+} CacheObject;
+
+typedef struct ObjectCache
+{
+  CacheObject **table;
+  unsigned int mask;
+
+  /**
+   * Hosts index, shares mask with table
+   */
+  CacheHost **hosts;
+
+  CachePolicy policy;
+
+  size_t size;
+  size_t capacity;
+  size_t max_object_size;
+
+  unsigned long hits;
+  unsigned long misses;
+  unsigned long evictions;
+  unsigned long purges;
+
+  pthread_mutex_t mutex;
+} ObjectCache;
+
+/**
+ * Fills a memfd while a response is relayed to the client
+ *
+ * Appending past the maximum object size aborts the fill, further appends
+ * are ignored
+ */
+typedef struct CacheFill
+{
+  int fd;
+  size_t size;
+  size_t max_size;
+  char aborted;
+} CacheFill;
+
+/**
+ * Create a new ObjectCache
+ *
+ * @param capacity Total bytes the cache may hold
+ * @param max_object_size Largest single object that will be admitted
+ * @param table_size_2 The number of hash buckets (2^table_size_2)
+ * @param policy Eviction policy
+ */
+ObjectCache *ObjectCache_new(ObjectCache *cache, size_t capacity, size_t max_object_size, u_int8_t table_size_2, cache_policy_t policy);
+void ObjectCache_free(ObjectCache *cache);
+
+CacheObject *ObjectCache_get(ObjectCache *cache, const char *key);
+void ObjectCache_release(ObjectCache *cache, CacheObject *object);
+
+int ObjectCache_put(ObjectCache *cache, const char *key, int fd, size_t size);
+
+/**
+ * Purge functions return the number of objects removed. Objects that are
+ * still being streamed stay alive until their reader releases them
+ */
+unsigned int ObjectCache_purge(ObjectCache *cache, const char *key);
+unsigned int ObjectCache_purge_host(ObjectCache *cache, const char *host);
+unsigned int ObjectCache_purge_prefix(ObjectCache *cache, const char *prefix);
+unsigned int ObjectCache_purge_glob(ObjectCache *cache, const char *glob);
+
+/**
+ * Copies of the names of every host with cached objects, the caller frees
+ * each name and *names. Returns the number of names, -1 when out of memory
+ */
+int ObjectCache_hosts(ObjectCache *cache, char ***names);
+
+void ObjectCache_print_stats(ObjectCache *cache);
+
+CacheFill *CacheFill_begin(CacheFill *fill, size_t max_size);
+void CacheFill_append(CacheFill *fill, const char *buf, size_t len);
+void CacheFill_abort(CacheFill *fill);
+int CacheFill_commit(CacheFill *fill, ObjectCache *cache, const char *key);
+
+#endif
@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "object_cache.h"
+
+static int fill(ObjectCache *cache, const char *key, const char *response)
+{
+  CacheFill fill;
+  CacheFill_begin(&fill, cache->max_object_size);
+  CacheFill_append(&fill, response, strlen(response));
+  return CacheFill_commit(&fill, cache, key);
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  ObjectCache cache;
+  ObjectCache_new(&cache, 150, 100, 4, CACHE_POLICY_LRU);
+
+  const char *ok = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n0123456789";
+
+  failed |= fill(&cache, "http://a/", ok) != 0;
+  failed |= fill(&cache, "http://b/", ok) != 0;
+  failed |= fill(&cache, "http://c/", "HTTP/1.0 404 Not Found\r\n\r\n") != -1;
+  failed |= fill(&cache, "http://d/", "HTTP/1.0 200 OK\r\nCache-Control: no-store\r\n\r\n") != -1;
+
+  char big[256];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  memcpy(big, "HTTP/1.0 200 OK\r\n\r\n", 19);
+  failed |= fill(&cache, "http://e/", big) != -1;
+
+  CacheObject *a = ObjectCache_get(&cache, "http://a/");
+  failed |= !a;
+  if (a)
+  {
+    printf("a: size %zu header %zu type %s\n", a->size, a->header_length, a->content_type);
+    failed |= a->header_length != strlen(ok) - 10;
+    failed |= strcmp(a->content_type, "text/plain") != 0;
+  }
+
+  failed |= ObjectCache_get(&cache, "http://c/") != NULL;
+
+  // b is least recently used, adding c evicts it while a is still being read
+  failed |= fill(&cache, "http://c/", ok) != 0;
+  failed |= ObjectCache_get(&cache, "http://b/") != NULL;
+
+  // a survives a replacement while held
+  failed |= fill(&cache, "http://a/", ok) != 0;
+  if (a)
+  {
+    char buf[11] = {0};
+    pread(a->fd, buf, 10, a->header_length);
+    printf("a body while evicted: %s\n", buf);
+    failed |= strcmp(buf, "0123456789") != 0;
+    ObjectCache_release(&cache, a);
+  }
+
+  ObjectCache_print_stats(&cache);
+  failed |= cache.size > cache.capacity;
+
+  ObjectCache_free(&cache);
+
+  // purging
+  ObjectCache_new(&cache, 1 << 16, 100, 4, CACHE_POLICY_LRU);
+
+  const char *keys[] = {
+      "http://example.com/",
+      "http://example.com/img/a.png",
+      "http://example.com/img/b.png",
+      "http://www.example.com/",
+      "http://cdn.example.com:8080/x",
+      "http://other.org/",
+  };
+  for (int i = 0; i < sizeof(keys) / sizeof(*keys); i++)
+    fill(&cache, keys[i], ok);
+
+  CacheObject *streaming = ObjectCache_get(&cache, "http://www.example.com/");
+
+  // every host once, whatever its port
+  char **names;
+  int host_count = ObjectCache_hosts(&cache, &names);
+  printf("hosts: %d\n", host_count);
+  failed |= host_count != 4;
+  for (int i = 0; i < host_count; i++)
+    free(names[i]);
+  if (host_count >= 0)
+    free(names);
+
+  unsigned int purged;
+  purged = ObjectCache_purge(&cache, "http://other.org/");
+  printf("purge url: %u\n", purged);
+  failed |= purged != 1;
+
+  purged = ObjectCache_purge_prefix(&cache, "http://example.com/img/");
+  printf("purge prefix: %u\n", purged);
+  failed |= purged != 2;
+  CacheObject *kept = ObjectCache_get(&cache, "http://example.com/");
+  failed |= !kept;
+  if (kept)
+    ObjectCache_release(&cache, kept);
+
+  purged = ObjectCache_purge_glob(&cache, "*.example.com");
+  printf("purge glob: %u\n", purged);
+  failed |= purged != 2;
+  failed |= ObjectCache_get(&cache, "http://cdn.example.com:8080/x") != NULL;
+
+  // still readable after being purged
+  char buf[11] = {0};
+  pread(streaming->fd, buf, 10, streaming->header_length);
+  failed |= strcmp(buf, "0123456789") != 0;
+  ObjectCache_release(&cache, streaming);
+
+  purged = ObjectCache_purge_host(&cache, "EXAMPLE.com");
+  printf("purge host: %u\n", purged);
+  failed |= purged != 1;
+  failed |= cache.size != 0;
+
+  ObjectCache_print_stats(&cache);
+  ObjectCache_free(&cache);
+
+  // an origin's Content-Type is only kept when it is of a sane length
+  char long_type[2048];
+  ObjectCache_new(&cache, 8192, 4096, 4, CACHE_POLICY_LRU);
+  int type_length = sprintf(long_type, "HTTP/1.0 200 OK\r\nContent-Type: ");
+  memset(long_type + type_length, 't', 1024);
+  strcpy(long_type + type_length + 1024, "\r\n\r\nbody");
+  failed |= fill(&cache, "http://long/", long_type) != 0;
+  CacheObject *long_object = ObjectCache_get(&cache, "http://long/");
+  failed |= !long_object || long_object->content_type;
+  if (long_object)
+    ObjectCache_release(&cache, long_object);
+  ObjectCache_free(&cache);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
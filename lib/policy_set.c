@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "policy_set.h"
+
+/**
+ * Index of the profile for the overlay in name, loaded on first use. -1 when
+ * it can't be loaded
+ */
+static int _profile(PolicySet *set, char *name, unsigned int length)
+{
+  for (unsigned int i = 0; i < set->profile_count; i++)
+  {
+    if (strlen(set->profiles[i].name) == length && !memcmp(set->profiles[i].name, name, length))
+      return i;
+  }
+
+  PolicyProfile *grown = realloc(set->profiles, (set->profile_count + 1) * sizeof(*grown));
+  if (!grown)
+    return -1;
+  set->profiles = grown;
+
+  PolicyProfile *profile = &set->profiles[set->profile_count];
+  if (!(profile->name = strndup(name, length)))
+    return -1;
+
+  if (!UrlBlacklist_new(&profile->overlay, profile->name, '\n'))
+  {
+    fprintf(stderr, "Could not load the overlay %s\n", profile->name);
+    free(profile->name);
+    return -1;
+  }
+
+  profile->overlay.base = set->base;
+  profile->overlay.uncached = 1;
+
+  return set->profile_count++;
+}
+
+PolicySet *PolicySet_new(PolicySet *set, UrlBlacklist *base, char *filename)
+{
+  set->base = base;
+  set->profiles = NULL;
+  set->profile_count = 0;
+
+  if (!IpRadix_new(&set->clients))
+    return NULL;
+
+  FILE *file = fopen(filename, "r");
+  if (!file)
+    return set;
+
+  char *line = NULL;
+  size_t line_size = 0;
+  unsigned int line_number = 0;
+
+  while (getline(&line, &line_size, file) > 0)
+  {
+    line_number++;
+
+    // client network, overlay, then an optional comment
+    char *network = line + strspn(line, " \t");
+    if (*network == '#' || !network[strspn(network, " \t\r\n")])
+      continue;
+
+    unsigned int network_length = strcspn(network, " \t\r\n");
+    char *name = network + network_length;
+    name += strspn(name, " \t");
+    unsigned int name_length = strcspn(name, " \t\r\n");
+    char *rest = name + name_length;
+    rest += strspn(rest, " \t\r\n");
+
+    u_int64_t address[2];
+    unsigned int prefix_length;
+    int profile;
+
+    if (!name_length || (*rest && *rest != '#') || !IpRadix_parse(network, network_length, address, &prefix_length))
+    {
+      fprintf(stderr, "%s:%u: expected a client network and an overlay file\n", filename, line_number);
+      goto fail;
+    }
+
+    if ((profile = _profile(set, name, name_length)) < 0 || IpRadix_insert(&set->clients, address, prefix_length, profile + 1))
+      goto fail;
+  }
+
+  free(line);
+  fclose(file);
+
+  // a lookup per request, skip the top of the tree
+  if (set->profile_count)
+    IpRadix_index(&set->clients);
+
+  return set;
+
+fail:
+  free(line);
+  fclose(file);
+  PolicySet_free(set);
+
+  return NULL;
+}
+
+void PolicySet_free(PolicySet *set)
+{
+  for (unsigned int i = 0; i < set->profile_count; i++)
+  {
+    UrlBlacklist_free(&set->profiles[i].overlay);
+    free(set->profiles[i].name);
+  }
+
+  free(set->profiles);
+  IpRadix_free(&set->clients);
+}
+
+UrlBlacklist *PolicySet_select(PolicySet *set, const struct sockaddr *client)
+{
+  u_int64_t address[2];
+  unsigned int profile;
+
+  if (!set->profile_count || !IpRadix_sockaddr(client, address) || !(profile = IpRadix_find(&set->clients, address)))
+    return set->base;
+
+  return &set->profiles[profile - 1].overlay;
+}
+
+void PolicySet_print_table(PolicySet *set)
+{
+  printf("PolicySet: %u profiles\n", set->profile_count);
+
+  for (unsigned int i = 0; i < set->profile_count; i++)
+  {
+    unsigned int rules = 0;
+    for (unsigned int j = 0; j < set->profiles[i].overlay.node_count; j++)
+      rules += !!set->profiles[i].overlay.nodes[j];
+
+    printf("%5u %s: %u host and path rules, %u glob rules\n", i, set->profiles[i].name, rules, set->profiles[i].overlay.glob_count);
+  }
+}
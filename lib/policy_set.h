@@ -0,0 +1,65 @@
+/**
+ * Blacklist profiles picked by client address, each a small overlay of
+ * rules over one shared base
+ *
+ * A profiles file has a client network and an overlay file per line:
+ *
+ *   # client network   overlay
+ *   10.1.0.0/16        profiles/engineering.txt
+ *   10.2.0.0/16        profiles/sales.txt
+ *
+ * Overlays are UrlBlacklists of their own with base behind them, a host
+ * without a rule in the overlay is looked up in the base. Networks naming
+ * the same file share one overlay, the longest network of a client wins
+ */
+#include "url_blacklist.h"
+#include "ip_radix.h"
+
+#ifndef POLICY_SET_H
+#define POLICY_SET_H
+
+typedef struct PolicyProfile
+{
+  /**
+   * The overlay file as named in the profiles file
+   */
+  char *name;
+  UrlBlacklist overlay;
+} PolicyProfile;
+
+typedef struct PolicySet
+{
+  /**
+   * Used for clients in no network, outlives the set
+   */
+  UrlBlacklist *base;
+  /**
+   * Client network -> 1 + the index in profiles
+   */
+  IpRadix clients;
+  PolicyProfile *profiles;
+  unsigned int profile_count;
+} PolicySet;
+
+/**
+ * Create a new PolicySet over base, without profiles when filename does not
+ * exist. Overlay files are relative to the working directory
+ *
+ * Returns NULL on a malformed line, an overlay that can't be loaded or
+ * when out of memory
+ */
+PolicySet *PolicySet_new(PolicySet *set, UrlBlacklist *base, char *filename);
+
+/**
+ * Frees the overlays, not base
+ */
+void PolicySet_free(PolicySet *set);
+
+/**
+ * Blacklist for requests from client, an overlay or the base
+ */
+UrlBlacklist *PolicySet_select(PolicySet *set, const struct sockaddr *client);
+
+void PolicySet_print_table(PolicySet *set);
+
+#endif
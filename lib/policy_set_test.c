@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "policy_set.h"
+#include "verdict_cache.h"
+
+static void write_file(char *filename, char *content)
+{
+  FILE *file = fopen(filename, "w");
+  fputs(content, file);
+  fclose(file);
+}
+
+static struct sockaddr_in client(char *address)
+{
+  struct sockaddr_in in = {.sin_family = AF_INET};
+  inet_pton(AF_INET, address, &in.sin_addr);
+  return in;
+}
+
+typedef struct Case
+{
+  char *client;
+  char *host;
+  char *path;
+  char blocked;
+} Case;
+
+int main(void)
+{
+  int failed = 0;
+
+  write_file("policy_set_test.base",
+             "ads.example\n"
+             "social.example\n"
+             "*.tracker.example\n"
+             "203.0.113.0/24\n");
+  write_file("policy_set_test.engineering",
+             "!social.example\n"
+             "games.example\n"
+             "news.example/sports\n");
+  write_file("policy_set_test.sales",
+             "!203.0.113.7\n"
+             "!x.tracker.example\n");
+  write_file("policy_set_test.profiles",
+             "# client network   overlay\n"
+             "10.1.0.0/16  policy_set_test.engineering\n"
+             "10.1.2.0/24  policy_set_test.sales # the sales floor\n"
+             "\n"
+             "10.2.0.0/16\tpolicy_set_test.sales\n");
+
+  UrlBlacklist base;
+  PolicySet set;
+  if (!UrlBlacklist_new(&base, "policy_set_test.base", '\n') || !PolicySet_new(&set, &base, "policy_set_test.profiles"))
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  PolicySet_print_table(&set);
+  failed |= set.profile_count != 2;
+
+  Case cases[] = {
+      {"192.0.2.1", "ads.example", "/", 1},
+      {"192.0.2.1", "social.example", "/", 1},
+      {"192.0.2.1", "games.example", "/", 0},
+      {"10.1.9.9", "social.example", "/", 0},
+      {"10.1.9.9", "www.social.example", "/", 0},
+      {"10.1.9.9", "games.example", "/", 1},
+      {"10.1.9.9", "ads.example", "/", 1},
+      {"10.1.9.9", "news.example", "/sports/1", 1},
+      {"10.1.9.9", "news.example", "/", 0},
+      {"10.1.9.9", "203.0.113.7", "/", 1},
+      {"10.1.2.3", "social.example", "/", 1},
+      {"10.1.2.3", "203.0.113.7", "/", 0},
+      {"10.1.2.3", "203.0.113.8", "/", 1},
+      {"10.2.0.1", "x.tracker.example", "/", 0},
+      {"10.2.0.1", "y.tracker.example", "/", 1},
+      {"192.0.2.1", "x.tracker.example", "/", 1},
+  };
+
+  VerdictCache vc;
+  VerdictCache_new(&vc, 2, 6);
+
+  // twice so the second round answers from the cache
+  for (int round = 0; round < 2; round++)
+  {
+    for (int i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+    {
+      struct sockaddr_in in = client(cases[i].client);
+      UrlBlacklist *bl = PolicySet_select(&set, (struct sockaddr *)&in);
+
+      char blocked = !!UrlBlacklist_exists_path(bl, cases[i].host, cases[i].path, NULL);
+      char cached = !!VerdictCache_exists(&vc, bl, cases[i].host, cases[i].path);
+
+      if (blocked != cases[i].blocked || cached != cases[i].blocked)
+      {
+        printf("%s %s%s: %s, cached %s\n", cases[i].client, cases[i].host, cases[i].path, blocked ? "blocked" : "allowed", cached ? "blocked" : "allowed");
+        failed = 1;
+      }
+    }
+  }
+
+  // resolved addresses go through the overlay too
+  struct sockaddr_in sales = client("10.2.0.1"), other = client("192.0.2.1"), origin = client("203.0.113.7");
+  failed |= !!UrlBlacklist_exists_address(PolicySet_select(&set, (struct sockaddr *)&sales), (struct sockaddr *)&origin);
+  failed |= !UrlBlacklist_exists_address(PolicySet_select(&set, (struct sockaddr *)&other), (struct sockaddr *)&origin);
+
+  VerdictCache_free(&vc);
+  PolicySet_free(&set);
+
+  // no profiles file, everyone gets the base
+  failed |= !PolicySet_new(&set, &base, "policy_set_test.missing") || set.profile_count || PolicySet_select(&set, (struct sockaddr *)&sales) != &base;
+  PolicySet_free(&set);
+
+  // a line without an overlay, or with an overlay that isn't there
+  write_file("policy_set_test.profiles", "10.1.0.0/16\n");
+  failed |= !!PolicySet_new(&set, &base, "policy_set_test.profiles");
+  write_file("policy_set_test.profiles", "10.1.0.0/16 policy_set_test.missing\n");
+  failed |= !!PolicySet_new(&set, &base, "policy_set_test.profiles");
+  write_file("policy_set_test.profiles", "engineering policy_set_test.engineering\n");
+  failed |= !!PolicySet_new(&set, &base, "policy_set_test.profiles");
+
+  UrlBlacklist_free(&base);
+
+  unlink("policy_set_test.base");
+  unlink("policy_set_test.engineering");
+  unlink("policy_set_test.sales");
+  unlink("policy_set_test.profiles");
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,250 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rule_hits.h"
+
+RuleHits *RuleHits_new(RuleHits *hits, UrlBlacklist *bl, unsigned int shards)
+{
+  hits->bl = bl;
+  hits->shard_count = shards;
+
+  int count = UrlBlacklist_rule_offsets(bl, &hits->offsets);
+  if (count < 0)
+    return NULL;
+
+  unsigned int *offsets = realloc(hits->offsets, (count + RULE_HITS_ADDED_MAX + 1) * sizeof(*offsets));
+  if (!offsets || !(hits->shards = calloc(shards, sizeof(*hits->shards))))
+  {
+    free(offsets ? offsets : hits->offsets);
+    return NULL;
+  }
+
+  hits->offsets = offsets;
+  hits->rule_count = count;
+  hits->rule_capacity = count + RULE_HITS_ADDED_MAX;
+  hits->end = bl->file_size;
+  hits->added_size = 0;
+
+  // the change log is replayed before anyone counts
+  RuleHits_sync(hits);
+
+  return hits;
+}
+
+void RuleHits_free(RuleHits *hits)
+{
+  for (unsigned int i = 0; i < hits->shard_count; i++)
+    free(hits->shards[i]);
+
+  free(hits->shards);
+  free(hits->offsets);
+}
+
+int RuleHits_sync(RuleHits *hits)
+{
+  UrlBlacklist *bl = hits->bl;
+  unsigned int count = hits->rule_count;
+  unsigned int end = hits->end;
+  int missing = 0;
+
+  // rules are only ever appended, a line each
+  while (hits->added_size < bl->added_size)
+  {
+    char *rule = bl->added + hits->added_size;
+    char *delim = memchr(rule, bl->delim, bl->added_size - hits->added_size);
+    unsigned int length = delim ? delim - rule + 1 : bl->added_size - hits->added_size;
+
+    // past the last id a rule would count for the one before it
+    if (count < hits->rule_capacity && !missing)
+    {
+      hits->offsets[count++] = rule - bl->file;
+      end = rule - bl->file + length;
+    }
+    else
+      missing++;
+
+    hits->added_size += length;
+  }
+
+  // a counter that sees the new end sees the ids under it
+  __atomic_store_n(&hits->rule_count, count, __ATOMIC_RELEASE);
+  __atomic_store_n(&hits->end, end, __ATOMIC_RELEASE);
+
+  return missing;
+}
+
+/**
+ * Id of the last of the first count rules starting at or before offset
+ */
+static unsigned int _rule_id(RuleHits *hits, unsigned int count, unsigned int offset)
+{
+  unsigned int low = 0, high = count;
+
+  while (high - low > 1)
+  {
+    unsigned int mid = (low + high) / 2;
+    if (hits->offsets[mid] <= offset)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  return low;
+}
+
+int RuleHits_count(RuleHits *hits, unsigned int shard, const char *rule)
+{
+  UrlBlacklist *bl = hits->bl;
+
+  // every id below end is published before end is
+  unsigned int end = __atomic_load_n(&hits->end, __ATOMIC_ACQUIRE);
+  unsigned int count = __atomic_load_n(&hits->rule_count, __ATOMIC_ACQUIRE);
+
+  if (shard >= hits->shard_count || !count || rule < bl->file + hits->offsets[0] || rule >= bl->file + end)
+    return -1;
+
+  unsigned int id = _rule_id(hits, count, rule - bl->file);
+
+  // only this thread writes its shard, readers may see a count late
+  unsigned int *counters = hits->shards[shard];
+  if (!counters)
+  {
+    if (!(counters = calloc(hits->rule_capacity, sizeof(*counters))))
+      return -1;
+
+    __atomic_store_n(&hits->shards[shard], counters, __ATOMIC_RELEASE);
+  }
+
+  __atomic_store_n(&counters[id], counters[id] + 1, __ATOMIC_RELAXED);
+
+  return id;
+}
+
+unsigned long RuleHits_total(RuleHits *hits, unsigned int id)
+{
+  unsigned long total = 0;
+
+  for (unsigned int i = 0; i < hits->shard_count; i++)
+  {
+    unsigned int *counters = __atomic_load_n(&hits->shards[i], __ATOMIC_ACQUIRE);
+    if (counters)
+      total += __atomic_load_n(&counters[id], __ATOMIC_RELAXED);
+  }
+
+  return total;
+}
+
+/**
+ * Hits of every rule summed one shard at a time, NULL when out of memory
+ */
+static unsigned long *_totals(RuleHits *hits)
+{
+  unsigned long *totals = calloc(hits->rule_count + 1, sizeof(*totals));
+  if (!totals)
+    return NULL;
+
+  for (unsigned int i = 0; i < hits->shard_count; i++)
+  {
+    unsigned int *counters = __atomic_load_n(&hits->shards[i], __ATOMIC_ACQUIRE);
+    if (!counters)
+      continue;
+
+    for (unsigned int id = 0; id < hits->rule_count; id++)
+      totals[id] += __atomic_load_n(&counters[id], __ATOMIC_RELAXED);
+  }
+
+  return totals;
+}
+
+static unsigned int _top(RuleHits *hits, unsigned long *totals, unsigned int *ids, unsigned int count)
+{
+  unsigned int found = 0;
+
+  if (!count)
+    return 0;
+
+  // ids stays sorted, a rule only goes in when it beats the last one
+  for (unsigned int id = 0; id < hits->rule_count; id++)
+  {
+    if (!totals[id] || (found == count && totals[id] <= totals[ids[found - 1]]))
+      continue;
+
+    unsigned int i = found < count ? found++ : found - 1;
+    for (; i > 0 && totals[ids[i - 1]] < totals[id]; i--)
+      ids[i] = ids[i - 1];
+    ids[i] = id;
+  }
+
+  return found;
+}
+
+int RuleHits_top(RuleHits *hits, unsigned int *ids, unsigned int count)
+{
+  unsigned long *totals = _totals(hits);
+  if (!totals)
+    return -1;
+
+  int found = _top(hits, totals, ids, count);
+  free(totals);
+
+  return found;
+}
+
+/**
+ * Length of rule id without a trailing comment
+ */
+static int _rule_length(RuleHits *hits, unsigned int id)
+{
+  UrlBlacklist *bl = hits->bl;
+  char *rule = bl->file + hits->offsets[id];
+  char *end = hits->offsets[id] < bl->file_size ? bl->file + bl->file_size : bl->added + bl->added_size;
+  char *p = rule;
+
+  while (p < end && *p != bl->delim && *p != ' ' && *p != '\t' && *p != '\r')
+    p++;
+
+  return p - rule;
+}
+
+void RuleHits_dump(RuleHits *hits, int fd, unsigned int top, char unused)
+{
+  if (top > hits->rule_count)
+    top = hits->rule_count;
+
+  unsigned long *totals = _totals(hits);
+  unsigned int *ids = malloc((top + 1) * sizeof(*ids));
+
+  if (!totals || !ids)
+  {
+    dprintf(fd, "RuleHits: out of memory\n");
+    goto done;
+  }
+
+  unsigned long total = 0;
+  unsigned int never = 0;
+  for (unsigned int id = 0; id < hits->rule_count; id++)
+  {
+    total += totals[id];
+    never += !totals[id] && hits->bl->file[hits->offsets[id]] != '!';
+  }
+
+  dprintf(fd, "RuleHits: %lu hits on %u rules, %u blocking rules never hit\n", total, hits->rule_count, never);
+
+  unsigned int found = _top(hits, totals, ids, top);
+  for (unsigned int i = 0; i < found; i++)
+    dprintf(fd, "%10lu %.*s\n", totals[ids[i]], _rule_length(hits, ids[i]), hits->bl->file + hits->offsets[ids[i]]);
+
+  if (!unused)
+    goto done;
+
+  // whitelist rules never block, how often they matched is not known
+  for (unsigned int id = 0; id < hits->rule_count; id++)
+  {
+    if (!totals[id] && hits->bl->file[hits->offsets[id]] != '!')
+      dprintf(fd, "%10u %.*s\n", 0, _rule_length(hits, id), hits->bl->file + hits->offsets[id]);
+  }
+
+done:
+  free(totals);
+  free(ids);
+}
@@ -0,0 +1,88 @@
+/**
+ * How often each rule of a UrlBlacklist blocked something
+ *
+ * Rules are numbered in file order. Every thread counts into a shard of its
+ * own, allocated on its first hit, so counting never writes to a cache line
+ * another thread writes to. Totals are summed over the shards when asked for
+ *
+ * Rules added at runtime get the ids after the ones of the file as they are
+ * synced, up to RULE_HITS_ADDED_MAX of them
+ */
+#include "url_blacklist.h"
+
+#ifndef RULE_HITS_H
+#define RULE_HITS_H
+
+#define RULE_HITS_ADDED_MAX 4096
+
+typedef struct RuleHits
+{
+  /**
+   * Only rules of this list are counted, outlives the hits
+   */
+  UrlBlacklist *bl;
+  /**
+   * File offset of every rule by id, ascending, with room for the added
+   * ones
+   */
+  unsigned int *offsets;
+  unsigned int rule_count;
+  unsigned int rule_capacity;
+  /**
+   * Offset right after the last rule with an id
+   */
+  unsigned int end;
+  /**
+   * Bytes of the added rules of bl that have ids
+   */
+  unsigned int added_size;
+  /**
+   * A counter per rule for each thread, NULL until the thread counts
+   */
+  unsigned int **shards;
+  unsigned int shard_count;
+} RuleHits;
+
+/**
+ * Create a new RuleHits for the rules of bl, added ones included
+ *
+ * @param shards Number of threads counting, each uses its own shard
+ */
+RuleHits *RuleHits_new(RuleHits *hits, UrlBlacklist *bl, unsigned int shards);
+void RuleHits_free(RuleHits *hits);
+
+/**
+ * Give ids to the rules added to bl since, call from the thread that adds
+ * them. Returns the number of rules without an id, 0 unless there was no
+ * room
+ */
+int RuleHits_sync(RuleHits *hits);
+
+/**
+ * Count a block by rule, as returned by a lookup on bl, from the thread of
+ * shard. Rules of other blacklists and ones not synced yet are ignored
+ *
+ * Returns the id of the rule, -1 when it was not counted
+ */
+int RuleHits_count(RuleHits *hits, unsigned int shard, const char *rule);
+
+/**
+ * Hits of rule id over every shard, may miss counts still being made
+ */
+unsigned long RuleHits_total(RuleHits *hits, unsigned int id);
+
+/**
+ * Ids of the at most count rules with the most hits, most first. Rules
+ * never hit are left out
+ *
+ * Returns the number of ids written, -1 when out of memory
+ */
+int RuleHits_top(RuleHits *hits, unsigned int *ids, unsigned int count);
+
+/**
+ * Write the top rules with their hits to fd, then with unused set every
+ * blocking rule that never hit. One rule per line
+ */
+void RuleHits_dump(RuleHits *hits, int fd, unsigned int top, char unused);
+
+#endif
@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "rule_hits.h"
+
+#define THREADS 4
+#define ROUNDS 10000
+
+static void write_file(char *filename, char *content)
+{
+  FILE *file = fopen(filename, "w");
+  fputs(content, file);
+  fclose(file);
+}
+
+static char *hosts[] = {
+    "ads.example",
+    "www.ads.example",
+    "x.tracker.example",
+    "ads.example",
+    "203.0.113.9",
+    "allowed.ads.example",
+    "nothing.example",
+};
+
+#define HOSTS (sizeof(hosts) / sizeof(*hosts))
+
+static UrlBlacklist bl;
+static RuleHits hits;
+
+typedef struct Worker
+{
+  pthread_t thread;
+  unsigned int shard;
+  unsigned int counted;
+} Worker;
+
+void *worker(Worker *arg)
+{
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    char *rule = UrlBlacklist_exists(&bl, hosts[round % HOSTS]);
+    arg->counted += rule && RuleHits_count(&hits, arg->shard, rule) >= 0;
+  }
+
+  return NULL;
+}
+
+/**
+ * Rule id of the first line of the file starting with text
+ */
+static int rule_id(char *text)
+{
+  for (unsigned int i = 0; i < hits.rule_count; i++)
+  {
+    if (!strncmp(bl.file + hits.offsets[i], text, strlen(text)))
+      return i;
+  }
+
+  return -1;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  write_file("rule_hits_test.txt",
+             "# comment\n"
+             "ads.example\n"
+             "\n"
+             "0.0.0.0 *.tracker.example # hosts file style\n"
+             "!allowed.ads.example\n"
+             "203.0.113.0/24\n"
+             "unused.example\n"
+             "also-unused.example\n");
+
+  if (!UrlBlacklist_new(&bl, "rule_hits_test.txt", '\n') || !RuleHits_new(&hits, &bl, THREADS))
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  failed |= hits.rule_count != 6;
+
+  Worker workers[THREADS] = {0};
+  for (int i = 0; i < THREADS; i++)
+  {
+    workers[i].shard = i;
+    pthread_create(&workers[i].thread, NULL, (void *(*)(void *))worker, &workers[i]);
+  }
+
+  unsigned int counted = 0;
+  for (int i = 0; i < THREADS; i++)
+  {
+    pthread_join(workers[i].thread, NULL);
+    counted += workers[i].counted;
+  }
+
+  // 4 of 7 hosts are blocked by ads.example, tracker and the network
+  unsigned long ads = RuleHits_total(&hits, rule_id("ads.example"));
+  unsigned long tracker = RuleHits_total(&hits, rule_id("*.tracker.example"));
+  unsigned long network = RuleHits_total(&hits, rule_id("203.0.113.0/24"));
+  printf("%u counted: ads %lu, tracker %lu, network %lu\n", counted, ads, tracker, network);
+  failed |= ads + tracker + network != counted || ads < tracker || tracker < network || !network;
+  failed |= RuleHits_total(&hits, rule_id("unused.example")) || RuleHits_total(&hits, rule_id("!allowed"));
+
+  unsigned int ids[4];
+  int found = RuleHits_top(&hits, ids, 4);
+  failed |= found != 3 || ids[0] != rule_id("ads.example") || ids[1] != rule_id("*.tracker.example") || ids[2] != rule_id("203.0.113.0/24");
+  failed |= RuleHits_top(&hits, ids, 1) != 1 || ids[0] != rule_id("ads.example");
+
+  // out of range shards, rules of other lists and added ones not synced
+  // yet are not counted
+  UrlBlacklist other;
+  UrlBlacklist_new(&other, "rule_hits_test.txt", '\n');
+  failed |= RuleHits_count(&hits, THREADS, UrlBlacklist_exists(&bl, "ads.example")) != -1;
+  failed |= RuleHits_count(&hits, 0, UrlBlacklist_exists(&other, "ads.example")) != -1;
+  failed |= UrlBlacklist_apply(&bl, "+added.example") || RuleHits_count(&hits, 0, UrlBlacklist_exists(&bl, "added.example")) != -1;
+
+  // a layered list is told apart by its rules
+  other.base = &bl;
+  failed |= UrlBlacklist_layer(&other, UrlBlacklist_exists(&bl, "ads.example")) != &bl;
+  failed |= UrlBlacklist_layer(&other, UrlBlacklist_exists(&other, "ads.example")) != &other;
+  failed |= UrlBlacklist_layer(&other, UrlBlacklist_exists(&bl, "added.example")) != &bl || UrlBlacklist_layer(&bl, "added.example");
+  UrlBlacklist_free(&other);
+
+  // synced, added rules count like the others
+  failed |= RuleHits_sync(&hits) || hits.rule_count != 7;
+  failed |= UrlBlacklist_apply(&bl, "+second.example") || RuleHits_sync(&hits) || hits.rule_count != 8;
+  failed |= RuleHits_count(&hits, 0, UrlBlacklist_exists(&bl, "added.example")) != 6;
+  failed |= RuleHits_count(&hits, 1, UrlBlacklist_exists(&bl, "second.example")) != 7 || RuleHits_total(&hits, 7) != 1;
+
+  int pipefd[2];
+  char dump[4096] = {0};
+  pipe(pipefd);
+  RuleHits_dump(&hits, pipefd[1], 2, 1);
+  close(pipefd[1]);
+  read(pipefd[0], dump, sizeof(dump) - 1);
+  close(pipefd[0]);
+  printf("%s", dump);
+
+  char *top = strstr(dump, " ads.example\n"), *second = strstr(dump, " *.tracker.example\n");
+  failed |= !strstr(dump, "blocking rules never hit") || !top || !second || top > second;
+  failed |= strstr(dump, "203.0.113.0/24") || !strstr(dump, "0 unused.example\n") || !strstr(dump, "0 also-unused.example\n") || strstr(dump, "allowed");
+  failed |= !strstr(dump, " on 8 rules, 2 blocking rules never hit");
+
+  RuleHits_free(&hits);
+
+  // images keep the rules in order, only comments and prefixes go
+  failed |= UrlBlacklist_save(&bl, "rule_hits_test.bin");
+  UrlBlacklist_free(&bl);
+  if (!UrlBlacklist_new(&bl, "rule_hits_test.bin", '\n') || !RuleHits_new(&hits, &bl, 1))
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  failed |= hits.rule_count != 8 || RuleHits_count(&hits, 0, UrlBlacklist_exists(&bl, "a.tracker.example")) != rule_id("*.tracker.example");
+  failed |= RuleHits_total(&hits, rule_id("*.tracker.example")) != 1;
+
+  RuleHits_free(&hits);
+  UrlBlacklist_free(&bl);
+
+  unlink("rule_hits_test.txt");
+  unlink("rule_hits_test.bin");
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,192 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "splice_relay.h"
+
+SpliceRelay *SpliceRelay_new(SpliceRelay *relay)
+{
+  if (pipe2(relay->pipe, O_CLOEXEC))
+    return NULL;
+
+  if (pipe2(relay->cache_pipe, O_CLOEXEC))
+  {
+    close(relay->pipe[0]);
+    close(relay->pipe[1]);
+    return NULL;
+  }
+
+  // tee() can only duplicate what fits in the cache pipe
+  int size = fcntl(relay->pipe[1], F_GETPIPE_SZ);
+  int cache_size = fcntl(relay->cache_pipe[1], F_GETPIPE_SZ);
+  relay->chunk_size = size < cache_size ? size : cache_size;
+
+  return relay;
+}
+
+void SpliceRelay_free(SpliceRelay *relay)
+{
+  close(relay->pipe[0]);
+  close(relay->pipe[1]);
+  close(relay->cache_pipe[0]);
+  close(relay->cache_pipe[1]);
+}
+
+/**
+ * Move len bytes out of a pipe
+ *
+ * Returns the number of bytes left in the pipe, 0 on success
+ */
+static size_t _drain(int pipe_out, int to, size_t len)
+{
+  while (len)
+  {
+    ssize_t n = splice(pipe_out, NULL, to, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      break;
+    }
+
+    len -= n;
+  }
+
+  return len;
+}
+
+/**
+ * Throw away len bytes of a pipe when the cache copy is no longer wanted
+ */
+static void _discard(int pipe_out, size_t len)
+{
+  char buf[4096];
+
+  while (len)
+  {
+    ssize_t n = read(pipe_out, buf, len < sizeof(buf) ? len : sizeof(buf));
+
+    if (n <= 0)
+    {
+      if (n < 0 && errno == EINTR)
+        continue;
+      return;
+    }
+
+    len -= n;
+  }
+}
+
+/**
+ * read()/write() relay for descriptors splice() doesn't support
+ */
+static ssize_t _copy(int from, int to, CacheFill *fill)
+{
+  char buf[8192];
+  ssize_t total = 0;
+
+  for (;;)
+  {
+    ssize_t n = read(from, buf, sizeof(buf));
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    if (!n)
+      return total;
+
+    if (fill)
+      CacheFill_append(fill, buf, n);
+
+    for (ssize_t written = 0; written < n;)
+    {
+      ssize_t w = write(to, buf + written, n - written);
+
+      if (w < 0 && errno == EINTR)
+        continue;
+      if (w < 0)
+        return -1;
+
+      written += w;
+    }
+
+    total += n;
+  }
+}
+
+ssize_t SpliceRelay_run(SpliceRelay *relay, int from, int to, CacheFill *fill)
+{
+  ssize_t total = 0;
+
+  for (;;)
+  {
+    ssize_t n = splice(from, NULL, relay->pipe[1], NULL, relay->chunk_size, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0 && errno == EINVAL && !total)
+      return _copy(from, to, fill);
+
+    if (n < 0)
+      return -1;
+
+    if (!n)
+      return total;
+
+    if (fill && !fill->aborted)
+    {
+      if (fill->size + n > fill->max_size)
+        CacheFill_abort(fill);
+    }
+
+    ssize_t teed = 0;
+    if (fill && !fill->aborted)
+    {
+      do
+        teed = tee(relay->pipe[0], relay->cache_pipe[1], n, 0);
+      while (teed < 0 && errno == EINTR);
+
+      // tee() can't be resumed halfway, a short copy is useless to the cache
+      if (teed != n)
+      {
+        if (teed > 0)
+          _discard(relay->cache_pipe[0], teed);
+
+        teed = 0;
+        CacheFill_abort(fill);
+      }
+    }
+
+    // client first, the cache copy can wait. Pipes are reused so anything
+    // left in them has to go before returning
+    size_t left = _drain(relay->pipe[0], to, n);
+    if (left)
+    {
+      _discard(relay->pipe[0], left);
+      _discard(relay->cache_pipe[0], teed);
+      return -1;
+    }
+
+    if (teed)
+    {
+      left = _drain(relay->cache_pipe[0], fill->fd, teed);
+      if (left)
+      {
+        _discard(relay->cache_pipe[0], left);
+        CacheFill_abort(fill);
+      }
+      else
+      {
+        fill->size += teed;
+      }
+    }
+
+    total += n;
+  }
+}
@@ -0,0 +1,43 @@
+/**
+ * Zero-copy socket to socket relay built on splice()
+ *
+ * While a cache fill is active the stream is duplicated with tee() so one
+ * copy goes to the client and the other into the fill's memfd, the bytes never
+ * pass through user space
+ */
+#include <sys/types.h>
+#include "object_cache.h"
+
+#ifndef SPLICE_RELAY_H
+#define SPLICE_RELAY_H
+
+typedef struct SpliceRelay
+{
+  /**
+   * Origin -> client
+   */
+  int pipe[2];
+  /**
+   * tee()'d copy -> cache
+   */
+  int cache_pipe[2];
+  size_t chunk_size;
+} SpliceRelay;
+
+/**
+ * Pipes are reused across requests, create one relay per worker thread
+ */
+SpliceRelay *SpliceRelay_new(SpliceRelay *relay);
+void SpliceRelay_free(SpliceRelay *relay);
+
+/**
+ * Relay from until EOF. fill may be NULL or aborted
+ *
+ * A fill that grows past its max size is aborted without disturbing the
+ * client transfer
+ *
+ * Returns the number of bytes relayed or -1
+ */
+ssize_t SpliceRelay_run(SpliceRelay *relay, int from, int to, CacheFill *fill);
+
+#endif
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "splice_relay.h"
+
+#define PAYLOAD_SIZE (300 * 1024)
+
+static char payload[PAYLOAD_SIZE];
+
+struct Peer
+{
+  int fd;
+  char *buf;
+  size_t len;
+};
+
+void *origin(struct Peer *peer)
+{
+  for (size_t sent = 0; sent < PAYLOAD_SIZE;)
+  {
+    ssize_t n = write(peer->fd, payload + sent, PAYLOAD_SIZE - sent);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+
+  close(peer->fd);
+  return NULL;
+}
+
+void *client(struct Peer *peer)
+{
+  peer->buf = malloc(PAYLOAD_SIZE);
+  peer->len = 0;
+
+  for (ssize_t n; (n = read(peer->fd, peer->buf + peer->len, PAYLOAD_SIZE - peer->len)) > 0;)
+    peer->len += n;
+
+  return NULL;
+}
+
+/**
+ * Relay the payload with a fill of max_size, returns non zero on a corrupted transfer
+ */
+static int run(SpliceRelay *relay, CacheFill *fill, size_t max_size)
+{
+  int from[2], to[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, from);
+  socketpair(AF_UNIX, SOCK_STREAM, 0, to);
+
+  struct Peer origin_peer = {from[1]};
+  struct Peer client_peer = {to[1]};
+
+  pthread_t origin_pt, client_pt;
+  pthread_create(&origin_pt, NULL, (void *(*)(void *))origin, &origin_peer);
+  pthread_create(&client_pt, NULL, (void *(*)(void *))client, &client_peer);
+
+  CacheFill_begin(fill, max_size);
+  ssize_t relayed = SpliceRelay_run(relay, from[0], to[0], fill);
+  close(from[0]);
+  close(to[0]);
+
+  pthread_join(origin_pt, NULL);
+  pthread_join(client_pt, NULL);
+  close(to[1]);
+
+  int failed = relayed != PAYLOAD_SIZE || client_peer.len != PAYLOAD_SIZE || memcmp(client_peer.buf, payload, PAYLOAD_SIZE);
+  printf("relayed %zd, client got %zu, fill %s with %zu bytes\n", relayed, client_peer.len, fill->aborted ? "aborted" : "complete", fill->size);
+
+  free(client_peer.buf);
+
+  return failed;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  for (int i = 0; i < PAYLOAD_SIZE; i++)
+    payload[i] = rand();
+
+  SpliceRelay relay;
+  SpliceRelay_new(&relay);
+
+  // fits, the cache copy must be identical
+  CacheFill fill;
+  failed |= run(&relay, &fill, 1 << 20);
+  failed |= fill.aborted || fill.size != PAYLOAD_SIZE;
+  if (!fill.aborted)
+  {
+    char *cached = malloc(PAYLOAD_SIZE);
+    failed |= pread(fill.fd, cached, PAYLOAD_SIZE, 0) != PAYLOAD_SIZE || memcmp(cached, payload, PAYLOAD_SIZE);
+    free(cached);
+    CacheFill_abort(&fill);
+  }
+
+  // too large, the client still gets everything
+  failed |= run(&relay, &fill, 100 * 1024);
+  failed |= !fill.aborted;
+
+  // no cache at all
+  failed |= run(&relay, &fill, 0);
+
+  SpliceRelay_free(&relay);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -1,11 +1,22 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include "url_blacklist.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static unsigned int generations;
 
 char is_whitespace(char *start, char *end)
 {
@@ -41,48 +52,6 @@ unsigned int digest(const char *str, unsigned const int len)
   return mutate(hash);
 }
 
-/**
- * turns *sex*.com
- * into *.com
- */
-unsigned int _get_glob_group(char *const dest, char *str, unsigned const int len)
-{
-  char *tail = dest;
-  char *head = str;
-  char *const end = str + len;
-
-  char should_glob = 0;
-
-  for (;;)
-  {
-    for (; !(*head == '.' || head == end);)
-    {
-      if (*head == '*')
-        should_glob = 1;
-      head++;
-    }
-
-    if (should_glob)
-      *tail++ = '*';
-    else
-    {
-      for (; str < head;)
-        *tail++ = *str++;
-    }
-
-    if (head == end)
-      break;
-
-    *tail++ = *head++;
-    str = head;
-    should_glob = 0;
-  }
-
-  *tail = '\0';
-
-  return tail - dest;
-}
-
 /**
  * str is null terminated
  *
@@ -131,400 +100,3063 @@ char _glob_match(char *str, char *glob, unsigned const int glob_len)
     if (!*head_str || !expanding)
       return head_glob >= glob_end;
 
-    str++;
+    // only where the next literal starts can a match start, libc finds it
+    // with the widest vectors the CPU has
+    str = strchrnul(str + 1, *glob);
   }
 }
 
-static inline unsigned int _item_length(UrlBlacklist *bl, char *item)
+// the loads may read past the terminating null, never past its page
+__attribute__((no_sanitize("address", "thread")))
+unsigned int UrlBlacklist_scan_host(char *host, char lower, u_int64_t *dots)
 {
-  char *end = memchr(item, bl->delim, bl->file_size);
-  return end - item;
-}
+  if (dots)
+    memset(dots, 0, URL_BLACKLIST_HOST_MAX / 8);
 
-UrlBlacklist *UrlBlacklist_new(
-    UrlBlacklist *bl,
-    char *filename,
-    const char delim,
-    u_int8_t table_size_2)
-{
-  bl->table = calloc(1 << table_size_2, sizeof(char *));
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128(), dot = _mm_set1_epi8('.');
+  const __m128i after_a = _mm_set1_epi8('A' - 1), before_z = _mm_set1_epi8('Z' + 1), case_bit = _mm_set1_epi8(0x20);
 
-  if (!bl->table)
-    return NULL;
+  // aligned so a load never crosses into the next page, bytes before host
+  // are masked off
+  unsigned int skip = (uintptr_t)host & 15;
+  char *p = host - skip;
 
-  // create memory mapped file
-  int fd = open(filename, O_RDONLY, 0);
-  bl->fd = fd;
-  struct stat stat;
-  fstat(fd, &stat);
-  bl->file_size = stat.st_size;
-  bl->file = mmap(NULL, bl->file_size, PROT_READ, MAP_SHARED, fd, 0);
+  for (;; p += 16, skip = 0)
+  {
+    __m128i chunk = _mm_load_si128((const __m128i *)p);
+    unsigned int inside = 0xffff << skip & 0xffff;
+    unsigned int ends = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero)) & inside;
+
+    if (ends)
+      inside &= (ends & -ends) - 1;
+
+    long offset = p - host;
+    if (dots && offset < URL_BLACKLIST_HOST_MAX)
+    {
+      u_int64_t found = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, dot)) & inside;
+
+      // the first chunk starts before host
+      if (offset < 0)
+      {
+        found >>= -offset;
+        offset = 0;
+      }
+
+      dots[offset / 64] |= found << offset % 64;
+      if (offset % 64 > 48 && offset / 64 + 1 < URL_BLACKLIST_HOST_MAX / 64)
+        dots[offset / 64 + 1] |= found >> (64 - offset % 64);
+    }
+
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(chunk, after_a), _mm_cmpgt_epi8(before_z, chunk));
+    unsigned int uppers = lower ? _mm_movemask_epi8(upper) & inside : 0;
+
+    // only bytes of host are written, most hostnames have nothing to write
+    if (uppers && inside == 0xffff)
+      _mm_store_si128((__m128i *)p, _mm_or_si128(chunk, _mm_and_si128(upper, case_bit)));
+    else
+      for (; uppers; uppers &= uppers - 1)
+        p[__builtin_ctz(uppers)] |= 0x20;
 
-  if (bl->file == MAP_FAILED)
+    if (ends)
+      return p - host + __builtin_ctz(ends);
+  }
+#else
+  char *p = host;
+
+  for (; *p; p++)
   {
-    free(bl->table);
-    return NULL;
+    if (lower && *p >= 'A' && *p <= 'Z')
+      *p |= 0x20;
+
+    if (dots && *p == '.' && p - host < URL_BLACKLIST_HOST_MAX)
+      dots[(p - host) / 64] |= 1ull << (p - host) % 64;
   }
 
-  bl->delim = delim;
+  return p - host;
+#endif
+}
+
+/**
+ * Start of the label that ends at end, label boundaries come from dots
+ * when it is not NULL
+ */
+static inline char *_label_start(char *url, char *end, const u_int64_t *dots)
+{
+  if (!dots)
+  {
+    while (end > url && end[-1] != '.')
+      end--;
 
-  // create mask
-  bl->mask = (1 << table_size_2) - 1;
+    return end;
+  }
 
-  char *start = bl->file;
-  char *delim_pos = strchr(bl->file, delim);
-  for (; delim_pos; start = delim_pos + 1, delim_pos = strchr(start, delim))
+  // the closest dot before end, a word of the bitmap at a time
+  for (unsigned int i = end - url; i;)
   {
-    // skip empty lines
-    if (delim_pos - start == 0)
-      continue;
+    unsigned int word = (i - 1) / 64;
+    u_int64_t before = dots[word] & (~0ull >> (63 - (i - 1) % 64));
 
-    // ignore lines that are only whitespace
-    if (is_whitespace(start, delim_pos))
-      continue;
+    if (before)
+      return url + word * 64 + 64 - __builtin_clzll(before);
 
-    // ignore comment lines starting with #
-    if (*start == '#')
-      continue;
+    i = word * 64;
+  }
 
-    // ignore starting host e.g. "0.0.0.0 " by skipping to next space
-    // maximum length of IP address is 15 characters
-    char *space_pos = memchr(start, ' ', 16);
-    if (space_pos && space_pos < delim_pos)
-      start = space_pos + 1;
+  return url;
+}
 
-    char *generic_rule = NULL;
-    int generic_rule_len = 0;
-    char should_free_generic_rule = 0;
-    if (memchr(start, '*', delim_pos - start))
-    {
-      should_free_generic_rule = 1;
-      generic_rule = malloc((delim_pos - start) * sizeof(char) + 1);
-      generic_rule_len = _get_glob_group(generic_rule, start, delim_pos - start);
-    }
-    else
-    {
-      generic_rule = start;
-      generic_rule_len = delim_pos - start;
-    }
+/**
+ * Hash of an edge, the label a word at a time mixed with the parent node.
+ * The low bits pick the slot and the high bits are the fingerprint
+ */
+static inline u_int64_t _edge_hash(unsigned int parent, const char *label, unsigned int length)
+{
+  u_int64_t hash = (parent ^ (u_int64_t)length << 32) * 0x9e3779b97f4a7c15ull;
+  u_int64_t word;
 
-    // whitelist rule consume character
-    char whitelist = 0;
-    if (*start == '!')
+  // the last read overlaps the one before, the length is mixed in already
+  if (length >= 8)
+  {
+    for (unsigned int i = 0; i + 8 < length; i += 8)
     {
-      whitelist = 1;
-      start++;
-      generic_rule++;
-      generic_rule_len--;
+      memcpy(&word, label + i, 8);
+      hash = (hash ^ word) * 0xbf58476d1ce4e5b9ull;
+      hash ^= hash >> 32;
     }
 
-    unsigned int hash = digest(generic_rule, generic_rule_len);
-    unsigned int index = hash & bl->mask;
+    memcpy(&word, label + length - 8, 8);
+  }
+  else if (length >= 4)
+  {
+    u_int32_t low, high;
+    memcpy(&low, label, 4);
+    memcpy(&high, label + length - 4, 4);
+    word = (u_int64_t)high << 32 | low;
+  }
+  else
+  {
+    word = length ? (unsigned char)label[0] << 16 | (unsigned char)label[length / 2] << 8 | (unsigned char)label[length - 1] : 0;
+  }
 
-    // #ifdef DEBUG
-    //     printf("%-20.*s %-20.*s: %08x -> %04x %6d\n", (int)(delim_pos - start), start, generic_rule_len, generic_rule, hash, index, index);
-    // #endif
+  // the multiply only carries upward, the shifts bring the top bytes of
+  // the word down to the slot bits
+  hash = (hash ^ word) * 0x94d049bb133111ebull;
+  hash = (hash ^ hash >> 32) * 0xbf58476d1ce4e5b9ull;
 
-    // got the hash
-    if (should_free_generic_rule)
-      free(generic_rule);
+  return hash ^ hash >> 29;
+}
 
-    unsigned int oi = index;
+/**
+ * Slot an edge hash starts probing at, the low half scaled to the table so
+ * tables can be any size
+ */
+static inline unsigned int _edge_slot(u_int64_t hash, unsigned int slots)
+{
+  return (u_int32_t)hash * (u_int64_t)slots >> 32;
+}
 
-    for (; bl->table[index];)
-    {
-      // #ifdef DEBUG
-      //       char *rule = UrlBlacklist_get_rule(bl, bl->table[index]);
-      //       printf("Collision with: %s\n", rule);
-      //       free(rule);
-      // #endif
-      // check if same item
-      if (strncmp(bl->table[index], start, delim_pos - start) == 0)
-        break;
+static inline unsigned int _edge_next(unsigned int index, unsigned int slots)
+{
+  return ++index == slots ? 0 : index;
+}
 
-      hash = mutate(hash);
-      index = hash & bl->mask;
+/**
+ * Slots for an edge table of nodes, at most 40% full. Inserts let it fill to
+ * half before doubling
+ */
+static inline unsigned int _edge_slots(unsigned int nodes)
+{
+  return (nodes / 2 * 5 + 8) & ~3u;
+}
 
-      if (index == oi)
-        goto too_many_coll;
-    }
+/**
+ * Find the child of parent over label given the edge hash, 0 if there is
+ * none
+ */
+static unsigned int _trie_probe(UrlBlacklist *bl, unsigned int parent, const char *label, unsigned int length, u_int64_t hash)
+{
+  if (length > 0xffff)
+    return 0;
 
-    // #ifdef DEBUG
-    //     printf("Adding rule: %5x %.*s\n", index, (int)(delim_pos - start), start);
-    // #endif
+  u_int16_t fingerprint = hash >> 48;
+  unsigned int child;
+
+  // linear probing stays within a cache line or two. Acquire pairs with
+  // _trie_place, the rest of the edge is complete once child is set
+  for (unsigned int index = _edge_slot(hash, bl->edge_slots); (child = __atomic_load_n(&bl->edges[index].child, __ATOMIC_ACQUIRE)); index = _edge_next(index, bl->edge_slots))
+  {
+    UrlBlacklistEdge *edge = &bl->edges[index];
 
-    bl->table[index] = start - whitelist;
+    if (edge->fingerprint == fingerprint && edge->parent == parent && edge->length == length && !memcmp(bl->file + edge->label, label, length))
+      return child;
   }
 
-  return bl;
+  return 0;
+}
 
-too_many_coll:
-  fprintf(stderr, "Too many collisions. Increase table size\n");
-  free(bl->table);
-  munmap(bl->file, bl->file_size);
-  return NULL;
+/**
+ * Find the child of parent over label, 0 if there is none
+ */
+static unsigned int _trie_child(UrlBlacklist *bl, unsigned int parent, const char *label, unsigned int length)
+{
+  return _trie_probe(bl, parent, label, length, _edge_hash(parent, label, length));
 }
 
-void UrlBlacklist_free(UrlBlacklist *bl)
+/**
+ * Place an edge known not to exist yet. Edges are never moved once placed,
+ * lookups may be running
+ */
+static void _trie_place(UrlBlacklistEdge *edges, unsigned int slots, UrlBlacklistEdge *edge, u_int64_t hash)
 {
-  munmap(bl->file, bl->file_size);
-  close(bl->fd);
-  free(bl->table);
+  unsigned int index = _edge_slot(hash, slots);
+
+  for (; edges[index].child; index = _edge_next(index, slots))
+    ;
+
+  edges[index].parent = edge->parent;
+  edges[index].fingerprint = hash >> 48;
+  edges[index].length = edge->length;
+  edges[index].label = edge->label;
+  __atomic_store_n(&edges[index].child, edge->child, __ATOMIC_RELEASE);
 }
 
-char *UrlBlacklist_exists(UrlBlacklist *bl, char *_url)
+/**
+ * Move every edge to a table of slots, nothing may look up meanwhile
+ */
+static char _trie_resize(UrlBlacklist *bl, unsigned int slots)
 {
+  UrlBlacklistEdge *edges = calloc(slots, sizeof(*edges));
 
-  // count number of dots
-  int num_dots = 0;
+  if (!edges)
+    return 0;
 
-  char *end = _url;
-  for (; *end; end++)
+  for (unsigned int i = 0; i < bl->edge_slots; i++)
   {
-    if (*end == '.')
-      num_dots++;
+    UrlBlacklistEdge *edge = &bl->edges[i];
+
+    if (edge->child)
+      _trie_place(edges, slots, edge, _edge_hash(edge->parent, bl->file + edge->label, edge->length));
   }
 
-  char *url = malloc(sizeof(*url) * (end - _url) + 1);
-  memcpy(url, _url, ((end - _url) + 1) * sizeof(*_url));
+  free(bl->edges);
+  bl->edges = edges;
+  bl->edge_slots = slots;
 
-  end += url - _url;
+  return 1;
+}
 
-  // get segment locations
-  //  www.google.com
-  // ^   ^      ^   ^
-  char **segment_locations = malloc((num_dots + 2) * sizeof(char *));
-  segment_locations[0] = url - 1;
-  segment_locations[num_dots + 1] = end;
+/**
+ * Child of parent over label, added if there is none. 0 when out of memory
+ *
+ * label points into the file
+ */
+static unsigned int _trie_add(UrlBlacklist *bl, unsigned int parent, char *label, unsigned int length)
+{
+  unsigned int child = _trie_child(bl, parent, label, length);
+  if (child)
+    return child;
 
-  char *url_left, *url_right;
+  // keep the edge table at most half full
+  if (bl->node_count * 2 >= bl->edge_slots && !_trie_resize(bl, bl->edge_slots * 2))
+    return 0;
 
-  end = url;
-  for (int i = 0; *end; end++)
+  if (bl->node_count == bl->node_capacity)
   {
-    if (*end == '.')
-      segment_locations[++i] = end;
+    unsigned int *nodes = realloc(bl->nodes, bl->node_capacity * 2 * sizeof(*nodes));
+    if (!nodes)
+      return 0;
+
+    bl->nodes = nodes;
+    bl->node_capacity *= 2;
   }
 
-  // attempt to find exact match
-  {
-    unsigned int hash = digest(url, end - url);
-    unsigned int index = hash & bl->mask;
+  child = bl->node_count++;
+  bl->nodes[child] = 0;
 
-    while (bl->table[index])
-    {
-      char *rule = bl->table[index];
+  UrlBlacklistEdge edge = {.parent = parent, .length = length, .child = child, .label = label - bl->file};
+  _trie_place(bl->edges, bl->edge_slots, &edge, _edge_hash(parent, label, length));
 
-      char whitelist = 0;
-      if (*rule == '!')
-      {
-        whitelist = 1;
-        rule++;
-      }
+  return child;
+}
 
-      // do pattern matching
-      if (!strncmp(url, rule, end - url))
-      {
-        free(url);
-        free(segment_locations);
+/**
+ * Node of a domain without wildcards, added with its parents as needed,
+ * labels are walked from the last one inward. 0 when out of memory or
+ * when a label is too long for any hostname
+ */
+static unsigned int _trie_path(UrlBlacklist *bl, char *rule, char *rule_end)
+{
+  unsigned int node = 0;
 
-        return whitelist ? NULL : bl->table[index];
-      }
+  for (char *label_end = rule_end;;)
+  {
+    char *label_start = label_end;
+    while (label_start > rule && label_start[-1] != '.')
+      label_start--;
 
-      hash = mutate(hash);
-      index = hash & bl->mask;
-    }
+    if (label_end - label_start > 0xffff || !(node = _trie_add(bl, node, label_start, label_end - label_start)))
+      return 0;
 
-    // exact match wasn't block_reason_rule
+    if (label_start == rule)
+      return node;
+
+    label_end = label_start - 1;
   }
+}
+
+/**
+ * Add a rule without wildcards
+ *
+ * entry points at the rule in the file including a leading !
+ */
+static char _trie_insert(UrlBlacklist *bl, char *rule, char *rule_end, char *entry)
+{
+  unsigned int node = _trie_path(bl, rule, rule_end);
+  if (!node)
+    return 0;
 
-  char *block_reason_rule = NULL;
-  char found = 0;
+  // later lines win, like in the table
+  __atomic_store_n(&bl->nodes[node], entry - bl->file + 1, __ATOMIC_RELEASE);
 
-  // <end> <.> <\0> plus user error ex: x..com
-  char *permutation = malloc((end - url) + 2 + num_dots);
-  char *perm_mem = permutation;
-  char *permutation_end;
+  return 1;
+}
 
-  char **segments = malloc(sizeof(char *) * (num_dots + 1));
+/**
+ * Size the node and edge tables for exactly spare more nodes, growing or
+ * shrinking them. Nothing may look up meanwhile
+ */
+static char _trie_reserve(UrlBlacklist *bl, unsigned int spare)
+{
+  unsigned int count = bl->node_count + spare;
 
-  char *start = url;
-  for (int i = 0; i < num_dots; i++)
+  if (count != bl->node_capacity)
   {
-    char *dot = strchr(start, '.');
-    segments[i] = malloc(dot - start + 1);
-    strncpy(segments[i], start, dot - start);
-    segments[i][dot - start] = '\0';
-    start = dot + 1;
+    unsigned int *nodes = realloc(bl->nodes, count * sizeof(*nodes));
+    if (!nodes)
+      return 0;
+
+    bl->nodes = nodes;
+    bl->node_capacity = count;
   }
 
-  segments[num_dots] = malloc((end - start) + 1);
-  strcpy(segments[num_dots], start);
+  return _edge_slots(count) == bl->edge_slots || _trie_resize(bl, _edge_slots(count));
+}
+
+/**
+ * Slot of a domain with path rules, NULL if node has none
+ */
+static UrlBlacklistPathHost *_path_host(UrlBlacklist *bl, unsigned int node)
+{
+  for (unsigned int index = ((u_int64_t)node * 0x9e3779b97f4a7c15ull) >> 32 & bl->path_host_mask;; index = (index + 1) & bl->path_host_mask)
+  {
+    UrlBlacklistPathHost *host = &bl->path_hosts[index];
 
-  // print all segments
-  // for (int i = 0; i < num_dots + 1; i++)
-  // {
-  //   printf("%s\n", segments[i]);
-  // }
+    if (host->host == node)
+      return host;
+    if (!host->host)
+      return NULL;
+  }
+}
+
+/**
+ * Whether pattern matches the start of path, * matches any run of
+ * characters
+ */
+static char _path_glob_match(const char *pattern, const char *pattern_end, const char *path, const char *path_end)
+{
+  const char *star = NULL, *resume = NULL;
 
-  for (int width = 0; width <= num_dots; width++)
+  while (pattern < pattern_end)
   {
-    int offset = num_dots - width;
-    url_left = segment_locations[offset] + 1;
-    url_right = segment_locations[offset + width + 1];
+    if (*pattern == '*')
+    {
+      star = ++pattern;
+      resume = path;
+      continue;
+    }
 
-    int limit = 1 << width;
-    for (int i = 0; i < limit; i++)
+    if (path < path_end && *path == *pattern)
     {
-      unsigned int bits = i << (sizeof(int) - 1 - width);
-      unsigned int HIGH = 1 << (sizeof(int) - 1);
-      permutation_end = permutation;
+      pattern++;
+      path++;
+      continue;
+    }
 
-      for (int j = 0; j <= width; j++)
-      {
-        // check for high bit
-        if (bits & HIGH)
-          permutation_end += sprintf(permutation_end, "%s.", segments[offset + j]);
-        else
-          permutation_end += sprintf(permutation_end, "*.");
+    // let the last * take one more character
+    if (!star || resume == path_end)
+      return 0;
 
-        bits <<= 1;
-      }
+    pattern = star;
+    path = ++resume;
+  }
+
+  return 1;
+}
+
+/**
+ * Best rule of host for path, 1 + the file offset of the entry or 0
+ */
+static unsigned int _path_find(UrlBlacklist *bl, UrlBlacklistPathHost *host, char *path, char *end)
+{
+  // plain paths match whole segments before the query
+  char *segments_end = memchr(path, '?', end - path);
+  if (!segments_end)
+    segments_end = end;
+
+  unsigned int node = host->root;
+  unsigned int found = __atomic_load_n(&bl->nodes[node], __ATOMIC_ACQUIRE);
+  // lengths of the rules' paths, / alone is 1
+  unsigned int found_length = 1;
+  unsigned int length = 0;
+
+  for (char *segment = path + (path < end && *path == '/'); segment < segments_end;)
+  {
+    char *segment_end = memchr(segment, '/', segments_end - segment);
+    if (!segment_end)
+      segment_end = segments_end;
 
-      *--permutation_end = '\0';
+    if (!(node = _trie_child(bl, node, segment, segment_end - segment)))
+      break;
 
-      // printf("%s\n", permutation);
+    length += segment_end - segment + 1;
 
-      goto permutation_yield;
-    permutation_continue:
+    unsigned int entry = __atomic_load_n(&bl->nodes[node], __ATOMIC_ACQUIRE);
+    if (entry)
+    {
+      found = entry;
+      found_length = length;
     }
-  }
 
-  // first run
-  if (permutation != url && !found)
-  {
-    permutation = url;
-    permutation_end = end;
-    url_left = url;
-    url_right = end;
-    goto permutation_yield;
+    segment = segment_end + 1;
   }
 
-prepare_return:
-  // free all segments
-  for (unsigned int i = 0; i < num_dots + 1; i++)
+  // the first wildcard that matches is the longest, it has to be longer
+  // than the plain path to win
+  for (unsigned int i = host->glob_first; i < host->glob_first + host->glob_count; i++)
   {
-    free(segments[i]);
-  }
+    UrlBlacklistPathGlob *glob = &bl->path_globs[i];
 
-  free(segments);
-  free(perm_mem);
-  free(segment_locations);
-  free(url);
-
-  return block_reason_rule;
+    if (found && glob->length < found_length)
+      break;
 
-permutation_yield:
+    if (_path_glob_match(bl->file + glob->pattern, bl->file + glob->pattern + glob->length, path, end))
+      return glob->entry + 1;
+  }
 
-  // #ifdef DEBUG
-  //   printf("Checking for subset match: %s\n", permutation);
-  // #endif
+  return found;
+}
 
-  unsigned int hash = digest(permutation, permutation_end - permutation);
-  unsigned int index = hash & bl->mask;
+/**
+ * Deepest rule on the path of url, the rule entry including a leading !
+ * or NULL. Rules for path count when it is set, *paths is set when a
+ * domain on the way has any
+ */
+static char *_trie_find(UrlBlacklist *bl, char *url, char *end, const u_int64_t *dots, char *path, char *path_end, char *paths)
+{
+  unsigned int node = 0;
+  unsigned int found = 0;
+  char *label_end = end;
 
-  while (bl->table[index])
+  for (;;)
   {
-    char *rule = bl->table[index];
-    char whitelist = 0;
-    if (*rule == '!')
-    {
-      whitelist = 1;
-      rule++;
-    }
+    char *label_start = _label_start(url, label_end, dots);
 
-    char tmp = *url_right;
-    *url_right = '\0';
-#ifdef DEBUG
-    char *r = UrlBlacklist_get_rule(bl, bl->table[index]);
-    printf("Checking %s against %s\n", url_left, r);
-    free(r);
-#endif
-    char match = _glob_match(url_left, rule, _item_length(bl, rule));
-    *url_right = tmp;
+    if (!(node = _trie_child(bl, node, label_start, label_end - label_start)))
+      break;
 
-    if (match)
+    unsigned int entry = __atomic_load_n(&bl->nodes[node], __ATOMIC_ACQUIRE);
+    if (entry)
+      found = entry;
+
+    // a rule for a path beats the one for its domain
+    UrlBlacklistPathHost *host;
+    if (bl->path_host_count && (host = _path_host(bl, node)))
     {
-      found = 1;
-      block_reason_rule = whitelist ? NULL : rule;
-      goto prepare_return;
+      *paths = 1;
+
+      if (path && (entry = _path_find(bl, host, path, path_end)))
+        found = entry;
     }
 
-    hash = mutate(hash);
-    index = hash & bl->mask;
-  }
+    if (label_start == url)
+      break;
 
-  // #ifdef DEBUG
-  //   printf("Subset match not block_reason_rule: %s\n", permutation);
-  // #endif
+    label_end = label_start - 1;
+  }
 
-  // fail
-  goto permutation_continue;
+  return found ? bl->file + found - 1 : NULL;
 }
 
 /**
- * Returns an allocated string that is the copy of the rule but null terminated
+ * A wildcard rule while the blacklist loads
  */
-char *UrlBlacklist_get_rule(UrlBlacklist *bl, char *rule)
+typedef struct GlobRule
 {
-  unsigned int len = strchr(rule, bl->delim) - rule;
-  char *copy = malloc(len + 1);
-  strncpy(copy, rule, len);
-  copy[len] = '\0';
-  return copy;
+  /**
+   * Rule in the file including a leading !
+   */
+  char *entry;
+  char *text;
+  unsigned int length;
+  /**
+   * Offset of the line in the file, orders rules like line numbers
+   */
+  unsigned int line;
+  /**
+   * Labels without a wildcard, the leftmost label is the highest bit
+   */
+  unsigned long long mask;
+} GlobRule;
+
+static int _glob_text_compare(const void *a, const void *b)
+{
+  const GlobRule *x = a, *y = b;
+  int order = memcmp(x->text, y->text, x->length < y->length ? x->length : y->length);
+
+  if (order)
+    return order;
+  if (x->length != y->length)
+    return x->length < y->length ? -1 : 1;
+
+  return x->line < y->line ? -1 : x->line > y->line;
 }
 
-void UrlBlacklist_print_table(UrlBlacklist *bl)
+/**
+ * Fewer literal labels first, the more specific label on the left decides
+ * ties and the file order after that
+ */
+static int _glob_priority_compare(const void *a, const void *b)
 {
-  const unsigned int MAX_ENTRIES = 0xf;
+  const GlobRule *x = a, *y = b;
+
+  if (x->mask != y->mask)
+    return x->mask < y->mask ? -1 : 1;
 
-  printf("UrlBlacklist table [%d]: %p\n", bl->mask + 1, (void *)bl);
+  return x->line < y->line ? -1 : x->line > y->line;
+}
 
-  unsigned int entry_count = 0;
+/**
+ * Sets of pattern positions turned into DFA states
+ */
+typedef struct GlobStates
+{
+  unsigned int *pool;
+  unsigned int pool_size;
+  unsigned int pool_capacity;
+  /**
+   * State s owns pool[offsets[s]] up to pool[offsets[s + 1]]
+   */
+  unsigned int *offsets;
+  unsigned int count;
+  unsigned int capacity;
+  /**
+   * Open addressed set -> state, 0 is empty
+   */
+  unsigned int *map;
+  unsigned int map_mask;
+} GlobStates;
+
+static unsigned int _glob_set_hash(unsigned int *set, unsigned int length)
+{
+  return digest((char *)set, length * sizeof(*set));
+}
 
-  for (unsigned int i = 0; i < bl->mask + 1; i++)
+static unsigned int _glob_state_find(GlobStates *states, unsigned int *set, unsigned int length, unsigned int hash)
+{
+  for (unsigned int index = hash & states->map_mask; states->map[index]; hash = mutate(hash), index = hash & states->map_mask)
   {
-    if (!bl->table[i])
-      continue;
+    unsigned int state = states->map[index];
+    unsigned int *other = states->pool + states->offsets[state];
 
-    entry_count++;
+    if (states->offsets[state + 1] - states->offsets[state] == length && !memcmp(other, set, length * sizeof(*set)))
+      return state;
+  }
 
-    if (entry_count > MAX_ENTRIES)
-      continue;
+  return 0;
+}
 
-    char *rule = UrlBlacklist_get_rule(bl, bl->table[i]);
-    printf("%5x %p %s", i, (void *)rule, rule);
+static void _glob_state_place(GlobStates *states, unsigned int state, unsigned int hash)
+{
+  unsigned int index = hash & states->map_mask;
 
-    unsigned int hash = mutate(digest(rule, strlen(rule)));
-    unsigned int index = hash & bl->mask;
+  for (; states->map[index]; hash = mutate(hash), index = hash & states->map_mask)
+    ;
 
-    free(rule);
+  states->map[index] = state;
+}
 
-    while (bl->table[index])
-    {
-      rule = UrlBlacklist_get_rule(bl, bl->table[index]);
-      printf(" -> %s", rule);
-      free(rule);
+/**
+ * Returns the new state or 0 when out of memory
+ */
+static unsigned int _glob_state_add(GlobStates *states, unsigned int *set, unsigned int length, unsigned int hash)
+{
+  if (states->count + 1 >= states->capacity)
+  {
+    unsigned int *offsets = realloc(states->offsets, states->capacity * 2 * sizeof(*offsets));
+    if (!offsets)
+      return 0;
 
-      hash = mutate(hash);
-      index = hash & bl->mask;
-    }
+    states->offsets = offsets;
+    states->capacity *= 2;
+  }
+
+  if (states->pool_size + length > states->pool_capacity)
+  {
+    unsigned int capacity = states->pool_capacity * 2 + length;
+    unsigned int *pool = realloc(states->pool, capacity * sizeof(*pool));
+    if (!pool)
+      return 0;
 
-    printf("\n");
+    states->pool = pool;
+    states->pool_capacity = capacity;
   }
 
-  if (entry_count > MAX_ENTRIES)
-    printf("... %d more entries\n", entry_count - MAX_ENTRIES);
+  // keep the map at most half full
+  if (states->count * 2 > states->map_mask)
+  {
+    unsigned int size = (states->map_mask + 1) * 2;
+    unsigned int *map = calloc(size, sizeof(*map));
+    if (!map)
+      return 0;
 
-  printf("- end of table -\n");
+    free(states->map);
+    states->map = map;
+    states->map_mask = size - 1;
+
+    for (unsigned int state = 1; state < states->count; state++)
+      _glob_state_place(states, state, _glob_set_hash(states->pool + states->offsets[state], states->offsets[state + 1] - states->offsets[state]));
+  }
+
+  unsigned int state = states->count++;
+  memcpy(states->pool + states->pool_size, set, length * sizeof(*set));
+  states->pool_size += length;
+  states->offsets[state + 1] = states->pool_size;
+
+  _glob_state_place(states, state, hash);
+
+  return state;
+}
+
+/**
+ * Add a position and everything a * there can skip to
+ */
+static inline void _glob_closure(char *patterns, unsigned int position, unsigned int *stamps, unsigned int stamp, unsigned int *set, unsigned int *length)
+{
+  for (; stamps[position] != stamp; position++)
+  {
+    stamps[position] = stamp;
+    set[(*length)++] = position;
+
+    if (patterns[position] != '*')
+      break;
+  }
+}
+
+static int _position_compare(const void *a, const void *b)
+{
+  unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Compile every wildcard rule into one DFA that reads the hostname from the
+ * end. Rules are reversed, * matches anything but a dot and a state accepts
+ * a rule once the rule is exhausted, which only counts at a label boundary
+ */
+static char _glob_compile(UrlBlacklist *bl, GlobRule *rules, unsigned int count)
+{
+  char ok = 0;
+  char *patterns = NULL;
+  unsigned int *starts = NULL, *accepts = NULL, *stamps = NULL, *set = NULL;
+  GlobStates states = {0};
+
+  // identical rules, the later line replaces the earlier one
+  qsort(rules, count, sizeof(*rules), _glob_text_compare);
+  unsigned int unique = 0;
+  for (unsigned int i = 0; i < count; i++)
+  {
+    if (i + 1 < count && rules[i].length == rules[i + 1].length && !memcmp(rules[i].text, rules[i + 1].text, rules[i].length))
+      continue;
+
+    rules[unique++] = rules[i];
+  }
+  count = unique;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    char literal = 1;
+    rules[i].mask = 0;
+
+    for (unsigned int j = 0; j <= rules[i].length; j++)
+    {
+      if (j == rules[i].length || rules[i].text[j] == '.')
+      {
+        rules[i].mask = rules[i].mask << 1 | literal;
+        literal = 1;
+      }
+      else if (rules[i].text[j] == '*')
+      {
+        literal = 0;
+      }
+    }
+  }
+
+  qsort(rules, count, sizeof(*rules), _glob_priority_compare);
+
+  bl->globs = malloc((count ? count : 1) * sizeof(*bl->globs));
+  if (!bl->globs)
+    return 0;
+  bl->glob_count = count;
+
+  // reversed patterns back to back, each closed by a 0
+  unsigned int size = 0;
+  for (unsigned int i = 0; i < count; i++)
+    size += rules[i].length + 1;
+
+  patterns = malloc(size + 1);
+  starts = malloc((count + 1) * sizeof(*starts));
+  accepts = calloc(size + 1, sizeof(*accepts));
+  stamps = calloc(size + 1, sizeof(*stamps));
+  set = malloc((size + 1) * sizeof(*set));
+  bl->glob_transitions = NULL;
+  bl->glob_accepts = NULL;
+  if (!patterns || !starts || !accepts || !stamps || !set)
+    goto cleanup;
+
+  memset(bl->glob_classes, 0, sizeof(bl->glob_classes));
+  bl->glob_classes['.'] = 1;
+  bl->glob_class_count = 2;
+
+  char *tail = patterns;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    bl->globs[i] = rules[i].entry - bl->file;
+    starts[i] = tail - patterns;
+
+    for (char *c = rules[i].text + rules[i].length; c > rules[i].text;)
+    {
+      c--;
+
+      if (*c == '*' && tail > patterns + starts[i] && tail[-1] == '*')
+        continue;
+
+      if (*c != '*' && !bl->glob_classes[(unsigned char)*c])
+        bl->glob_classes[(unsigned char)*c] = bl->glob_class_count++;
+
+      *tail++ = *c;
+    }
+
+    // reaching the end of rule i accepts it
+    accepts[tail - patterns] = i + 1;
+    *tail++ = '\0';
+  }
+
+  unsigned int length = 0;
+  for (unsigned int i = 0; i < count; i++)
+    _glob_closure(patterns, starts[i], stamps, 1, set, &length);
+  qsort(set, length, sizeof(*set), _position_compare);
+
+  states.capacity = 64;
+  states.offsets = malloc(states.capacity * sizeof(*states.offsets));
+  states.pool_capacity = 256;
+  states.pool = malloc(states.pool_capacity * sizeof(*states.pool));
+  states.map_mask = 64 - 1;
+  states.map = calloc(states.map_mask + 1, sizeof(*states.map));
+  if (!states.offsets || !states.pool || !states.map)
+    goto cleanup;
+
+  // state 0 is the dead state, 1 the start
+  states.offsets[0] = states.offsets[1] = 0;
+  states.count = 1;
+  if (!_glob_state_add(&states, set, length, _glob_set_hash(set, length)))
+    goto cleanup;
+
+  unsigned int classes = bl->glob_class_count;
+  unsigned int transitions_capacity = 0;
+
+  unsigned int stamp = 1;
+  for (unsigned int state = 1; state < states.count; state++)
+  {
+    if (states.count > URL_BLACKLIST_MAX_GLOB_STATES)
+    {
+      fprintf(stderr, "Too many glob states. Simplify the wildcard rules\n");
+      goto cleanup;
+    }
+
+    if (states.capacity > transitions_capacity)
+    {
+      transitions_capacity = states.capacity;
+
+      unsigned int *transitions = realloc(bl->glob_transitions, transitions_capacity * classes * sizeof(*transitions));
+      if (!transitions)
+        goto cleanup;
+      bl->glob_transitions = transitions;
+
+      unsigned int *state_accepts = realloc(bl->glob_accepts, transitions_capacity * sizeof(*state_accepts));
+      if (!state_accepts)
+        goto cleanup;
+      bl->glob_accepts = state_accepts;
+
+      // the dead state goes nowhere
+      bl->glob_accepts[0] = 0;
+      memset(bl->glob_transitions, 0, classes * sizeof(*transitions));
+    }
+
+    unsigned int *positions = states.pool + states.offsets[state];
+    unsigned int position_count = states.offsets[state + 1] - states.offsets[state];
+
+    // patterns are in priority order, the first accepting position is the best rule
+    bl->glob_accepts[state] = 0;
+    for (unsigned int i = 0; i < position_count; i++)
+    {
+      if (!patterns[positions[i]])
+      {
+        bl->glob_accepts[state] = accepts[positions[i]];
+        break;
+      }
+    }
+
+    for (unsigned int class = 0; class < classes; class++)
+    {
+      length = 0;
+      stamp++;
+
+      // the pool may move while adding, positions are reloaded per class
+      positions = states.pool + states.offsets[state];
+
+      for (unsigned int i = 0; i < position_count; i++)
+      {
+        char c = patterns[positions[i]];
+
+        if (c == '*')
+        {
+          if (class != 1)
+            _glob_closure(patterns, positions[i], stamps, stamp, set, &length);
+        }
+        else if (c && bl->glob_classes[(unsigned char)c] == class)
+        {
+          _glob_closure(patterns, positions[i] + 1, stamps, stamp, set, &length);
+        }
+      }
+
+      unsigned int next = 0;
+      if (length)
+      {
+        qsort(set, length, sizeof(*set), _position_compare);
+
+        unsigned int hash = _glob_set_hash(set, length);
+        if (!(next = _glob_state_find(&states, set, length, hash)) && !(next = _glob_state_add(&states, set, length, hash)))
+          goto cleanup;
+      }
+
+      bl->glob_transitions[state * classes + class] = next;
+    }
+  }
+
+  bl->glob_state_count = states.count;
+  ok = 1;
+
+cleanup:
+  if (!ok)
+  {
+    free(bl->globs);
+    free(bl->glob_transitions);
+    free(bl->glob_accepts);
+  }
+
+  free(patterns);
+  free(starts);
+  free(accepts);
+  free(stamps);
+  free(set);
+  free(states.pool);
+  free(states.offsets);
+  free(states.map);
+
+  return ok;
+}
+
+/**
+ * Best wildcard rule for url, the rule entry including a leading ! or NULL
+ *
+ * The hostname is read from the end, the first label boundary with an
+ * accepting state wins since it has the fewest labels
+ */
+static char *_glob_find(UrlBlacklist *bl, char *url, char *end)
+{
+  unsigned int state = 1;
+
+  for (char *c = end; c > url;)
+  {
+    c--;
+
+    if (*c == '.' && bl->glob_accepts[state])
+      break;
+
+    if (!(state = bl->glob_transitions[state * bl->glob_class_count + bl->glob_classes[(unsigned char)*c]]))
+      return NULL;
+  }
+
+  return bl->glob_accepts[state] ? bl->file + bl->globs[bl->glob_accepts[state] - 1] : NULL;
+}
+
+/**
+ * First space, tab or \r in [start, end), end if there is none
+ */
+static inline char *_rule_end(char *start, char *end)
+{
+#ifdef __SSE2__
+  const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t'), cr = _mm_set1_epi8('\r');
+
+  // 16 bytes at a time while they are inside the line
+  for (; end - start >= 16; start += 16)
+  {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)start);
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)), _mm_cmpeq_epi8(chunk, cr));
+    int mask = _mm_movemask_epi8(hits);
+
+    if (mask)
+      return start + __builtin_ctz(mask);
+  }
+#endif
+
+  while (start < end && *start != ' ' && *start != '\t' && *start != '\r')
+    start++;
+
+  return start;
+}
+
+/**
+ * Advance cursor to the next rule, returns 0 at file_end
+ *
+ * entry is the rule including a leading !, rule to rule_end the rule itself
+ */
+static char _next_rule(UrlBlacklist *bl, char **cursor, char *file_end, char **entry, char **rule, char **rule_end)
+{
+  char *start = *cursor;
+
+  for (char *delim_pos; start < file_end && (delim_pos = memchr(start, bl->delim, file_end - start)); start = delim_pos + 1)
+  {
+    // skip empty lines
+    if (delim_pos - start == 0)
+      continue;
+
+    // ignore lines that are only whitespace
+    if (is_whitespace(start, delim_pos))
+      continue;
+
+    // ignore comment lines starting with #
+    if (*start == '#')
+      continue;
+
+    // ignore starting host e.g. "0.0.0.0 " by skipping to next space
+    // maximum length of IP address is 15 characters, a short rule with a
+    // comment after it is not a host
+    char *space_pos = memchr(start, ' ', delim_pos - start < 16 ? delim_pos - start : 16);
+    if (space_pos && space_pos + 1 < delim_pos && space_pos[1] != '#')
+      start = space_pos + 1;
+
+    // whitelist rule consume character
+    *entry = start;
+    *rule = start + (*start == '!');
+
+    // anything after whitespace is a trailing comment
+    *rule_end = _rule_end(*rule, delim_pos);
+
+    *cursor = delim_pos + 1;
+    return 1;
+  }
+
+  return 0;
+}
+
+/**
+ * Hash of a whole domain for the filter
+ */
+static inline u_int64_t _domain_hash(const char *domain, unsigned int length)
+{
+  return _edge_hash(0, domain, length);
+}
+
+/**
+ * Build a filter over the domain of every rule in the trie, domains with
+ * only path rules included. Every domain goes in once
+ */
+static FuseFilter *_filter_new(UrlBlacklist *bl, FuseFilter *filter)
+{
+  u_int64_t *keys = malloc((bl->node_count + bl->path_host_count + 1) * sizeof(*keys));
+  if (!keys)
+    return NULL;
+
+  unsigned int count = 0;
+  for (unsigned int i = 1; i < bl->node_count; i++)
+  {
+    if (!bl->nodes[i])
+      continue;
+
+    char *rule = bl->file + bl->nodes[i] - 1;
+    char *limit = rule < bl->file + bl->file_size ? bl->file + bl->file_size : bl->added + bl->added_size;
+    char *delim_pos = memchr(rule, bl->delim, limit - rule);
+
+    rule += *rule == '!';
+    char *rule_end = _rule_end(rule, delim_pos ? delim_pos : limit);
+
+    if (!memchr(rule, '/', rule_end - rule))
+      keys[count++] = _domain_hash(rule, rule_end - rule);
+  }
+
+  for (unsigned int i = 0; bl->path_host_count && i <= bl->path_host_mask; i++)
+  {
+    UrlBlacklistPathHost *host = &bl->path_hosts[i];
+    if (!host->host || bl->nodes[host->host])
+      continue;
+
+    char *rule = bl->file + host->rule;
+    rule += *rule == '!';
+    keys[count++] = _domain_hash(rule, (char *)memchr(rule, '/', bl->file + bl->file_size - rule) - rule);
+  }
+
+  filter = FuseFilter_new(filter, keys, count);
+  free(keys);
+
+  return filter;
+}
+
+/**
+ * A filter inside an image goes with the mapping
+ */
+static void _filter_free(UrlBlacklist *bl)
+{
+  char *fingerprints = (char *)bl->filter.fingerprints;
+
+  if (!bl->image || fingerprints < bl->image || fingerprints >= bl->image + bl->image_size)
+    FuseFilter_free(&bl->filter);
+}
+
+/**
+ * Replace the filter with one that has every rule, a list without one
+ * still works
+ */
+static void _filter_build(UrlBlacklist *bl)
+{
+  FuseFilter filter;
+
+  if (!_filter_new(bl, &filter))
+    return;
+
+  _filter_free(bl);
+  bl->filter = filter;
+  bl->filtered = 1;
+}
+
+/**
+ * 0 when no suffix of url starting at a label is the domain of a rule in
+ * the trie
+ */
+static char _filter_maybe(UrlBlacklist *bl, char *url, char *end, const u_int64_t *dots)
+{
+  if (dots)
+  {
+    if (FuseFilter_contains(&bl->filter, _domain_hash(url, end - url)))
+      return 1;
+
+    // every suffix after a dot, shortest last
+    for (unsigned int word = 0; word < (end - url + 63) / 64; word++)
+    {
+      for (u_int64_t bits = dots[word]; bits; bits &= bits - 1)
+      {
+        char *start = url + word * 64 + __builtin_ctzll(bits) + 1;
+
+        if (FuseFilter_contains(&bl->filter, _domain_hash(start, end - start)))
+          return 1;
+      }
+    }
+
+    return 0;
+  }
+
+  for (char *start = url;; start++)
+  {
+    if (FuseFilter_contains(&bl->filter, _domain_hash(start, end - start)))
+      return 1;
+
+    if (!(start = memchr(start, '.', end - start)))
+      return 0;
+  }
+}
+
+/**
+ * Marks an edge slot a loader thread has taken but not filled in yet
+ */
+#define CLAIMED 0xffffffffu
+
+/**
+ * Find or add the child of parent over label while other loader threads do
+ * the same, 0 when the node table is full
+ */
+static unsigned int _trie_claim(UrlBlacklist *bl, unsigned int parent, const char *label, unsigned int length)
+{
+  u_int64_t hash = _edge_hash(parent, label, length);
+  u_int16_t fingerprint = hash >> 48;
+  unsigned int node = 0;
+
+  for (unsigned int index = _edge_slot(hash, bl->edge_slots);;)
+  {
+    UrlBlacklistEdge *edge = &bl->edges[index];
+    unsigned int child = __atomic_load_n(&edge->child, __ATOMIC_ACQUIRE);
+
+    if (!child)
+    {
+      // the node table is at most half the edge table, a free slot always exists
+      if (!node && (node = __atomic_fetch_add(&bl->node_count, 1, __ATOMIC_RELAXED)) >= bl->node_capacity)
+        return 0;
+
+      if (!__atomic_compare_exchange_n(&edge->child, &child, CLAIMED, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE))
+        continue;
+
+      edge->parent = parent;
+      edge->fingerprint = fingerprint;
+      edge->length = length;
+      edge->label = label - bl->file;
+      __atomic_store_n(&edge->child, node, __ATOMIC_RELEASE);
+
+      return node;
+    }
+
+    // taken by a thread that is still writing it
+    if (child == CLAIMED)
+    {
+      sched_yield();
+      continue;
+    }
+
+    // a node taken for a slot another thread filled stays empty
+    if (edge->fingerprint == fingerprint && edge->parent == parent && edge->length == length && !memcmp(bl->file + edge->label, label, length))
+      return child;
+
+    index = _edge_next(index, bl->edge_slots);
+  }
+}
+
+/**
+ * Rules of one kind that are indexed once the domains are in
+ */
+typedef struct RuleList
+{
+  GlobRule *rules;
+  unsigned int count;
+  unsigned int capacity;
+} RuleList;
+
+#define LOAD_GLOBS 0
+#define LOAD_PATHS 1
+#define LOAD_ADDRESSES 2
+#define LOAD_KINDS 3
+
+/**
+ * One share of the file for a loader thread
+ */
+typedef struct LoadArg
+{
+  pthread_t thread_id;
+  UrlBlacklist *bl;
+  /**
+   * Next line to load, where to carry on once the tables have grown
+   */
+  char *cursor;
+  char *end;
+  /**
+   * By LOAD_ kind
+   */
+  RuleList later[LOAD_KINDS];
+  /**
+   * 0 done, 1 out of nodes, -1 out of memory
+   */
+  int status;
+  /**
+   * Whether thread_id runs the share, the caller does otherwise
+   */
+  char started;
+} LoadArg;
+
+static char _rule_push(RuleList *list, GlobRule rule)
+{
+  if (list->count == list->capacity)
+  {
+    unsigned int grown_capacity = list->capacity ? list->capacity * 2 : 16;
+    GlobRule *grown = realloc(list->rules, grown_capacity * sizeof(*grown));
+    if (!grown)
+      return 0;
+
+    list->rules = grown;
+    list->capacity = grown_capacity;
+  }
+
+  list->rules[list->count++] = rule;
+
+  return 1;
+}
+
+/**
+ * The rules of a kind from every share in file order, rules is NULL when
+ * out of memory
+ */
+static RuleList _rules_merge(LoadArg *args, long threads, int kind)
+{
+  RuleList merged = {0};
+  for (long i = 0; i < threads; i++)
+    merged.capacity += args[i].later[kind].count;
+
+  merged.rules = malloc((merged.capacity + 1) * sizeof(*merged.rules));
+
+  for (long i = 0; i < threads; i++)
+  {
+    RuleList *share = &args[i].later[kind];
+
+    if (merged.rules && share->count)
+      memcpy(merged.rules + merged.count, share->rules, share->count * sizeof(*share->rules));
+
+    merged.count += share->count;
+    free(share->rules);
+  }
+
+  return merged;
+}
+
+static void *_load_chunk(LoadArg *arg)
+{
+  UrlBlacklist *bl = arg->bl;
+  char *entry, *rule, *rule_end;
+
+  for (char *next = arg->cursor; _next_rule(bl, &next, arg->end, &entry, &rule, &rule_end); arg->cursor = next)
+  {
+    // addresses, paths and wildcards are added once all domains are known
+    GlobRule later = {entry, rule, rule_end - rule, entry - bl->file};
+    u_int64_t address[2];
+    unsigned int prefix_length;
+    int kind = IpRadix_parse(rule, rule_end - rule, address, &prefix_length) ? LOAD_ADDRESSES
+               : memchr(rule, '/', rule_end - rule)                           ? LOAD_PATHS
+               : memchr(rule, '*', rule_end - rule)                           ? LOAD_GLOBS
+                                                                              : -1;
+
+    if (kind >= 0)
+    {
+      if (!_rule_push(&arg->later[kind], later))
+      {
+        arg->status = -1;
+        return NULL;
+      }
+      continue;
+    }
+
+    unsigned int node = 0;
+    for (char *label_end = rule_end;;)
+    {
+      char *label_start = label_end;
+      while (label_start > rule && label_start[-1] != '.')
+        label_start--;
+
+      // no hostname has a label that long, the rule can never match and
+      // must not land on the parent claimed so far
+      if (label_end - label_start > 0xffff)
+      {
+        node = 0;
+        break;
+      }
+
+      if (!(node = _trie_claim(bl, node, label_start, label_end - label_start)))
+      {
+        arg->status = 1;
+        return NULL;
+      }
+
+      if (label_start == rule)
+        break;
+
+      label_end = label_start - 1;
+    }
+
+    // lines land out of order, the later one wins like in the file
+    unsigned int value = entry - bl->file + 1;
+    unsigned int current = __atomic_load_n(&bl->nodes[node], __ATOMIC_RELAXED);
+    while (node && current < value && !__atomic_compare_exchange_n(&bl->nodes[node], &current, value, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+
+  arg->cursor = arg->end;
+  arg->status = 0;
+
+  return NULL;
+}
+
+/**
+ * Load every rule of the text with a thread per core, each inserting its
+ * share of the lines into the shared trie. The other rules end up in later
+ * by LOAD_ kind, in file order
+ */
+static char _load(UrlBlacklist *bl, RuleList *later)
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > bl->file_size / URL_BLACKLIST_LOAD_CHUNK)
+    threads = bl->file_size / URL_BLACKLIST_LOAD_CHUNK;
+  if (threads < 1)
+    threads = 1;
+
+  LoadArg *args = calloc(threads, sizeof(*args));
+  if (!args)
+    return 0;
+
+  // shares are split on line boundaries
+  char *file_end = bl->file + bl->file_size;
+  char *chunk = bl->file;
+
+  for (long i = 0; i < threads; i++)
+  {
+    char *chunk_end = i == threads - 1 ? file_end : bl->file + bl->file_size / threads * (i + 1);
+    if (chunk_end < chunk)
+      chunk_end = chunk;
+
+    char *delim = memchr(chunk_end, bl->delim, file_end - chunk_end);
+    chunk_end = delim ? delim + 1 : file_end;
+
+    args[i] = (LoadArg){0, bl, chunk, chunk_end};
+    chunk = chunk_end;
+  }
+
+  char status = 1;
+  while (status > 0)
+  {
+    for (long i = 1; i < threads; i++)
+      args[i].started = !pthread_create(&args[i].thread_id, NULL, (void *(*)(void *))_load_chunk, &args[i]);
+    _load_chunk(&args[0]);
+
+    // a share no thread could be started for is still loaded
+    for (long i = 1; i < threads; i++)
+    {
+      if (!args[i].started)
+        _load_chunk(&args[i]);
+    }
+
+    for (long i = 1; i < threads; i++)
+    {
+      if (args[i].started)
+        pthread_join(args[i].thread_id, NULL);
+    }
+
+    status = 0;
+    for (long i = 0; i < threads; i++)
+    {
+      if (args[i].status < 0)
+        status = -1;
+      else if (args[i].status && !status)
+        status = 1;
+    }
+
+    if (status <= 0)
+      break;
+
+    // out of nodes, grow by what the rest of the file looks like it needs
+    // and carry on where every thread stopped
+    if (bl->node_count > bl->node_capacity)
+      bl->node_count = bl->node_capacity;
+
+    size_t left = 0;
+    for (long i = 0; i < threads; i++)
+      left += args[i].end - args[i].cursor;
+
+    size_t spare = (size_t)bl->node_count * left / (bl->file_size - left + 1) + bl->node_count / 8 + URL_BLACKLIST_SPARE_NODES;
+
+    if (!_trie_reserve(bl, spare))
+      status = -1;
+    else
+      memset(bl->nodes + bl->node_count, 0, (bl->node_capacity - bl->node_count) * sizeof(*bl->nodes));
+  }
+
+  if (bl->node_count > bl->node_capacity)
+    bl->node_count = bl->node_capacity;
+
+  char merged = 1;
+  for (int kind = 0; kind < LOAD_KINDS; kind++)
+  {
+    later[kind] = _rules_merge(args, threads, kind);
+    merged &= !!later[kind].rules;
+  }
+
+  free(args);
+
+  return !status && merged;
+}
+
+/**
+ * A path rule with wildcards while the blacklist loads
+ */
+typedef struct PathGlob
+{
+  unsigned int host;
+  unsigned int line;
+  UrlBlacklistPathGlob glob;
+} PathGlob;
+
+/**
+ * By domain, the longest first and the later line on ties
+ */
+static int _path_glob_compare(const void *a, const void *b)
+{
+  const PathGlob *x = a, *y = b;
+
+  if (x->host != y->host)
+    return x->host < y->host ? -1 : 1;
+  if (x->glob.length != y->glob.length)
+    return x->glob.length > y->glob.length ? -1 : 1;
+
+  return x->line > y->line ? -1 : x->line < y->line;
+}
+
+/**
+ * Index rules with a path under their domains, in file order
+ */
+static char _path_compile(UrlBlacklist *bl, GlobRule *rules, unsigned int count)
+{
+  unsigned int size = 2;
+  while (size < count * 2)
+    size *= 2;
+
+  bl->path_hosts = calloc(size, sizeof(*bl->path_hosts));
+  bl->path_host_mask = size - 1;
+  bl->path_host_count = 0;
+  bl->path_globs = NULL;
+  bl->path_glob_count = 0;
+
+  PathGlob *globs = malloc((count + 1) * sizeof(*globs));
+  unsigned int glob_count = 0;
+
+  if (!bl->path_hosts || !globs)
+    goto fail;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    GlobRule *rule = &rules[i];
+    char *slash = memchr(rule->text, '/', rule->length);
+    char *end = rule->text + rule->length;
+
+    // no path segment or domain label is that long
+    if (slash == rule->text || rule->length > 0xffff || memchr(rule->text, '*', slash - rule->text))
+      continue;
+
+    unsigned int node = _trie_path(bl, rule->text, slash);
+    unsigned int root = node ? _trie_add(bl, node, slash, 1) : 0;
+    if (!root)
+      goto fail;
+
+    UrlBlacklistPathHost *host = _path_host(bl, node);
+    if (!host)
+    {
+      host = &bl->path_hosts[((u_int64_t)node * 0x9e3779b97f4a7c15ull) >> 32 & bl->path_host_mask];
+      while (host->host)
+        host = &bl->path_hosts[(host - bl->path_hosts + 1) & bl->path_host_mask];
+
+      *host = (UrlBlacklistPathHost){node, root, rule->entry - bl->file};
+      bl->path_host_count++;
+    }
+
+    if (memchr(slash, '*', end - slash) || memchr(slash, '?', end - slash))
+    {
+      globs[glob_count++] = (PathGlob){node, rule->line, {rule->entry - bl->file, slash - bl->file, end - slash}};
+      continue;
+    }
+
+    // a trailing / changes nothing, segments match whole anyway
+    while (end > slash + 1 && end[-1] == '/')
+      end--;
+
+    for (char *segment = slash + 1; segment < end && root;)
+    {
+      char *segment_end = memchr(segment, '/', end - segment);
+      if (!segment_end)
+        segment_end = end;
+
+      root = _trie_add(bl, root, segment, segment_end - segment);
+      segment = segment_end + 1;
+    }
+
+    if (!root)
+      goto fail;
+
+    // later lines win, like for domains
+    bl->nodes[root] = rule->entry - bl->file + 1;
+  }
+
+  qsort(globs, glob_count, sizeof(*globs), _path_glob_compare);
+
+  bl->path_globs = malloc((glob_count + 1) * sizeof(*bl->path_globs));
+  if (!bl->path_globs)
+    goto fail;
+
+  for (unsigned int i = 0; i < glob_count; i++)
+  {
+    UrlBlacklistPathHost *host = _path_host(bl, globs[i].host);
+    if (!host->glob_count)
+      host->glob_first = i;
+
+    host->glob_count++;
+    bl->path_globs[i] = globs[i].glob;
+  }
+
+  bl->path_glob_count = glob_count;
+  free(globs);
+
+  return 1;
+
+fail:
+  free(globs);
+  free(bl->path_hosts);
+  free(bl->path_globs);
+  bl->path_hosts = NULL;
+  bl->path_globs = NULL;
+  bl->path_host_count = 0;
+
+  return 0;
+}
+
+/**
+ * Index address rules by network, in file order so later lines win
+ */
+static char _address_compile(UrlBlacklist *bl, GlobRule *rules, unsigned int count)
+{
+  if (!IpRadix_new(&bl->addresses))
+    return 0;
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    u_int64_t address[2];
+    unsigned int prefix_length;
+
+    IpRadix_parse(rules[i].text, rules[i].length, address, &prefix_length);
+    if (IpRadix_insert(&bl->addresses, address, prefix_length, rules[i].entry - bl->file + 1))
+      return 0;
+  }
+
+  // without networks there is nothing to jump over
+  if (count && !IpRadix_index(&bl->addresses))
+    return 0;
+
+  return 1;
+}
+
+/**
+ * Map size bytes of fd, or of zeroes when fd is -1, followed by
+ * URL_BLACKLIST_ADDED_SIZE writable bytes in *added
+ */
+static char *_map_with_room(int fd, size_t size, char **added)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped = (size + page - 1) & ~(page - 1);
+
+  // reserve both at once so the file can be mapped over the start
+  char *base = mmap(NULL, mapped + URL_BLACKLIST_ADDED_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED)
+    return NULL;
+
+  if (fd >= 0 && size && mmap(base, size, PROT_READ, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+  {
+    munmap(base, mapped + URL_BLACKLIST_ADDED_SIZE);
+    return NULL;
+  }
+
+  *added = base + mapped;
+
+  return base;
+}
+
+/**
+ * Whether every table of image starts aligned for its type and every index
+ * read from one is inside the table it points into, so lookups never leave
+ * the mapping. Sections are known to be inside the file
+ */
+static char _image_check(UrlBlacklistImage *image, char *data)
+{
+  if (image->nodes_offset % __alignof__(unsigned int) || image->edges_offset % __alignof__(UrlBlacklistEdge) ||
+      image->transitions_offset % __alignof__(unsigned int) || image->accepts_offset % __alignof__(unsigned int) ||
+      image->globs_offset % __alignof__(unsigned int) || image->path_hosts_offset % __alignof__(UrlBlacklistPathHost) ||
+      image->path_globs_offset % __alignof__(UrlBlacklistPathGlob) || image->address_nodes_offset % __alignof__(IpRadixNode) ||
+      image->address_jumps_offset % __alignof__(IpRadixJump))
+    return 0;
+
+  // rules are read up to the delimiter
+  char *pool = data + image->pool_offset;
+  unsigned int pool_size = image->pool_size;
+  if (pool_size && pool[pool_size - 1] != image->delim)
+    return 0;
+
+  // node values are 1 + the offset of a rule
+  unsigned int *nodes = (unsigned int *)(data + image->nodes_offset);
+  for (unsigned int i = 0; i < image->node_count; i++)
+  {
+    if (nodes[i] > pool_size)
+      return 0;
+  }
+
+  // probing stops at an empty slot, there has to be one
+  UrlBlacklistEdge *edges = (UrlBlacklistEdge *)(data + image->edges_offset);
+  unsigned int used = 0;
+  for (unsigned int i = 0; i < image->edge_slots; i++)
+  {
+    if (!edges[i].child)
+      continue;
+
+    used++;
+    if (edges[i].child >= image->node_count || edges[i].parent >= image->node_count || (unsigned long long)edges[i].label + edges[i].length > pool_size)
+      return 0;
+  }
+  if (used >= image->edge_slots)
+    return 0;
+
+  // the DFA reads class 1 for a dot
+  if (image->glob_class_count < 2)
+    return 0;
+  for (unsigned int i = 0; i < 256; i++)
+  {
+    if (image->glob_classes[i] >= image->glob_class_count)
+      return 0;
+  }
+
+  unsigned int *transitions = (unsigned int *)(data + image->transitions_offset);
+  for (unsigned long long i = 0; i < (unsigned long long)image->glob_state_count * image->glob_class_count; i++)
+  {
+    if (transitions[i] >= image->glob_state_count)
+      return 0;
+  }
+
+  unsigned int *accepts = (unsigned int *)(data + image->accepts_offset);
+  for (unsigned int i = 0; i < image->glob_state_count; i++)
+  {
+    if (accepts[i] > image->glob_count)
+      return 0;
+  }
+
+  unsigned int *globs = (unsigned int *)(data + image->globs_offset);
+  for (unsigned int i = 0; i < image->glob_count; i++)
+  {
+    if (globs[i] >= pool_size)
+      return 0;
+  }
+
+  UrlBlacklistPathHost *path_hosts = (UrlBlacklistPathHost *)(data + image->path_hosts_offset);
+  used = 0;
+  for (unsigned int i = 0; i <= image->path_host_mask; i++)
+  {
+    UrlBlacklistPathHost *host = &path_hosts[i];
+    if (!host->host)
+      continue;
+
+    used++;
+    if (host->host >= image->node_count || host->root >= image->node_count || host->rule >= pool_size ||
+        (unsigned long long)host->glob_first + host->glob_count > image->path_glob_count)
+      return 0;
+  }
+  if (used > image->path_host_mask)
+    return 0;
+
+  UrlBlacklistPathGlob *path_globs = (UrlBlacklistPathGlob *)(data + image->path_globs_offset);
+  for (unsigned int i = 0; i < image->path_glob_count; i++)
+  {
+    if (path_globs[i].entry >= pool_size || (unsigned long long)path_globs[i].pattern + path_globs[i].length > pool_size)
+      return 0;
+  }
+
+  // a child is always a longer network, walks can't loop
+  IpRadixNode *address_nodes = (IpRadixNode *)(data + image->address_nodes_offset);
+  for (unsigned int i = 0; i < image->address_node_count; i++)
+  {
+    IpRadixNode *node = &address_nodes[i];
+    if (node->value > pool_size || node->length > 128)
+      return 0;
+
+    for (int bit = 0; bit < 2; bit++)
+    {
+      unsigned int child = node->child[bit];
+      if (child && (child >= image->address_node_count || address_nodes[child].length <= node->length))
+        return 0;
+    }
+  }
+
+  IpRadixJump *jumps = (IpRadixJump *)(data + image->address_jumps_offset);
+  for (unsigned int i = 0; image->address_jump_bits && i < 1u << image->address_jump_bits; i++)
+  {
+    if (jumps[i].node >= image->address_node_count || jumps[i].value > pool_size)
+      return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Use a compiled image, every table points into the mapping
+ */
+static UrlBlacklist *_image_open(UrlBlacklist *bl)
+{
+  UrlBlacklistImage *image = (UrlBlacklistImage *)bl->file;
+  unsigned long long size = bl->file_size;
+
+  if (size < sizeof(*image) || image->version != URL_BLACKLIST_IMAGE_VERSION || image->byte_order != URL_BLACKLIST_IMAGE_BYTE_ORDER)
+  {
+    fprintf(stderr, "Unsupported blacklist image version\n");
+    return NULL;
+  }
+
+  // sections have to be inside the file
+  if ((unsigned long long)image->pool_offset + image->pool_size > size ||
+      (unsigned long long)image->nodes_offset + image->node_count * 4ull > size ||
+      (unsigned long long)image->edges_offset + (unsigned long long)image->edge_slots * sizeof(UrlBlacklistEdge) > size ||
+      (unsigned long long)image->transitions_offset + image->glob_state_count * 4ull * image->glob_class_count > size ||
+      (unsigned long long)image->accepts_offset + image->glob_state_count * 4ull > size ||
+      (unsigned long long)image->globs_offset + image->glob_count * 4ull > size ||
+      (unsigned long long)image->filter_offset + image->filter_size > size ||
+      (image->filter_segment_length & (image->filter_segment_length - 1)) ||
+      image->filter_segment_count_length + 2ull * image->filter_segment_length > image->filter_size ||
+      (unsigned long long)image->path_hosts_offset + (image->path_host_mask + 1ull) * sizeof(UrlBlacklistPathHost) > size ||
+      (unsigned long long)image->path_globs_offset + image->path_glob_count * sizeof(UrlBlacklistPathGlob) > size ||
+      (image->path_host_mask & (image->path_host_mask + 1)) || image->path_host_count > image->path_host_mask ||
+      (unsigned long long)image->address_nodes_offset + image->address_node_count * sizeof(IpRadixNode) > size ||
+      (unsigned long long)image->address_jumps_offset + (image->address_jump_bits ? 1ull << image->address_jump_bits : 0) * sizeof(IpRadixJump) > size ||
+      !image->address_node_count || image->address_jump_bits > 16 ||
+      image->edge_slots < image->node_count || !image->node_count || image->glob_state_count < 2 ||
+      !_image_check(image, bl->file))
+  {
+    fprintf(stderr, "Corrupt blacklist image\n");
+    return NULL;
+  }
+
+  bl->image = bl->file;
+  bl->image_size = bl->file_size;
+  bl->delim = image->delim;
+
+  bl->file = bl->image + image->pool_offset;
+  bl->file_size = image->pool_size;
+
+  bl->nodes = (unsigned int *)(bl->image + image->nodes_offset);
+  bl->node_count = bl->node_capacity = image->node_count;
+  bl->edges = (UrlBlacklistEdge *)(bl->image + image->edges_offset);
+  bl->edge_slots = image->edge_slots;
+
+  memcpy(bl->glob_classes, image->glob_classes, sizeof(bl->glob_classes));
+  bl->glob_class_count = image->glob_class_count;
+  bl->glob_state_count = image->glob_state_count;
+  bl->glob_transitions = (unsigned int *)(bl->image + image->transitions_offset);
+  bl->glob_accepts = (unsigned int *)(bl->image + image->accepts_offset);
+  bl->globs = (unsigned int *)(bl->image + image->globs_offset);
+  bl->glob_count = image->glob_count;
+
+  bl->path_hosts = (UrlBlacklistPathHost *)(bl->image + image->path_hosts_offset);
+  bl->path_host_mask = image->path_host_mask;
+  bl->path_host_count = image->path_host_count;
+  bl->path_globs = (UrlBlacklistPathGlob *)(bl->image + image->path_globs_offset);
+  bl->path_glob_count = image->path_glob_count;
+
+  bl->addresses = (IpRadix){
+      (IpRadixNode *)(bl->image + image->address_nodes_offset),
+      image->address_node_count,
+      image->address_node_count,
+      image->address_jump_bits ? (IpRadixJump *)(bl->image + image->address_jumps_offset) : NULL,
+      image->address_jump_bits};
+
+  bl->filter = (FuseFilter){
+      image->filter_seed,
+      image->filter_segment_length,
+      image->filter_segment_count_length,
+      image->filter_key_count,
+      image->filter_size,
+      (unsigned char *)bl->image + image->filter_offset};
+  bl->filtered = 1;
+
+  bl->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+
+  return bl;
+}
+
+UrlBlacklist *UrlBlacklist_new(
+    UrlBlacklist *bl,
+    char *filename,
+    const char delim)
+{
+  RuleList later[LOAD_KINDS] = {0};
+
+  bl->image = NULL;
+  bl->added = NULL;
+  bl->added_size = 0;
+  bl->nodes = NULL;
+  bl->edges = NULL;
+  bl->path_hosts = NULL;
+  bl->path_globs = NULL;
+  bl->addresses = (IpRadix){0};
+  bl->filter = (FuseFilter){0};
+  bl->filtered = 0;
+  bl->base = NULL;
+  bl->whitelist_local = 0;
+  bl->uncached = 0;
+  bl->hits = NULL;
+
+  // create memory mapped file
+  int fd = open(filename, O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+
+  bl->fd = fd;
+  struct stat stat;
+  fstat(fd, &stat);
+  bl->file_size = stat.st_size;
+
+  char magic[sizeof(URL_BLACKLIST_IMAGE_MAGIC)];
+  if (pread(fd, magic, sizeof(magic), 0) == sizeof(magic) && !memcmp(magic, URL_BLACKLIST_IMAGE_MAGIC, sizeof(magic)))
+  {
+    bl->file = mmap(NULL, bl->file_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (bl->file != MAP_FAILED && _image_open(bl))
+      return bl;
+
+    if (bl->file != MAP_FAILED)
+      munmap(bl->file, bl->file_size);
+    close(fd);
+    return NULL;
+  }
+
+  if (!(bl->file = _map_with_room(fd, bl->file_size, &bl->added)))
+  {
+    close(fd);
+    return NULL;
+  }
+
+  bl->delim = delim;
+
+  // every line makes a node at most, labels shared between rules make up
+  // for the few more a long rule adds
+  unsigned int lines = 0;
+  for (char *c = bl->file, *end = bl->file + bl->file_size; (c = memchr(c, delim, end - c)); c++)
+    lines++;
+
+  // node 0 is the root
+  bl->node_count = 1;
+  bl->node_capacity = lines + lines / 4 + URL_BLACKLIST_SPARE_NODES;
+  bl->nodes = calloc(bl->node_capacity, sizeof(*bl->nodes));
+
+  // trimmed to the nodes the rules took once they are in
+  bl->edge_slots = _edge_slots(bl->node_capacity);
+  bl->edges = calloc(bl->edge_slots, sizeof(*bl->edges));
+
+  if (!bl->nodes || !bl->edges || !_load(bl, later))
+    goto free_index;
+
+  if (!_glob_compile(bl, later[LOAD_GLOBS].rules, later[LOAD_GLOBS].count) ||
+      !_path_compile(bl, later[LOAD_PATHS].rules, later[LOAD_PATHS].count) ||
+      !_address_compile(bl, later[LOAD_ADDRESSES].rules, later[LOAD_ADDRESSES].count) ||
+      !_trie_reserve(bl, URL_BLACKLIST_SPARE_NODES))
+    goto free_index;
+
+  for (int kind = 0; kind < LOAD_KINDS; kind++)
+    free(later[kind].rules);
+  _filter_build(bl);
+
+  bl->generation = __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED);
+
+  return bl;
+
+free_index:
+  for (int kind = 0; kind < LOAD_KINDS; kind++)
+    free(later[kind].rules);
+  free(bl->path_hosts);
+  free(bl->path_globs);
+  IpRadix_free(&bl->addresses);
+  _filter_free(bl);
+  free(bl->nodes);
+  free(bl->edges);
+  munmap(bl->file, bl->added - bl->file + URL_BLACKLIST_ADDED_SIZE);
+  close(bl->fd);
+  return NULL;
+}
+
+void UrlBlacklist_free(UrlBlacklist *bl)
+{
+  close(bl->fd);
+  _filter_free(bl);
+
+  if (bl->added)
+    munmap(bl->file, bl->added - bl->file + URL_BLACKLIST_ADDED_SIZE);
+
+  if (bl->image)
+  {
+    munmap(bl->image, bl->image_size);
+
+    // a changed image owns copies of the trie
+    if (bl->added)
+    {
+      free(bl->nodes);
+      free(bl->edges);
+    }
+    return;
+  }
+
+  free(bl->nodes);
+  free(bl->edges);
+  free(bl->globs);
+  free(bl->glob_transitions);
+  free(bl->glob_accepts);
+  free(bl->path_hosts);
+  free(bl->path_globs);
+  IpRadix_free(&bl->addresses);
+}
+
+/**
+ * Where a rule line of the file ends up in the image pool
+ */
+typedef struct ImageLine
+{
+  unsigned int file_offset;
+  unsigned int pool_offset;
+} ImageLine;
+
+static unsigned int _image_remap(ImageLine *lines, unsigned int count, unsigned int offset)
+{
+  unsigned int low = 0, high = count;
+
+  // last line starting at or before offset
+  while (high - low > 1)
+  {
+    unsigned int mid = (low + high) / 2;
+    if (lines[mid].file_offset <= offset)
+      low = mid;
+    else
+      high = mid;
+  }
+
+  return lines[low].pool_offset + offset - lines[low].file_offset;
+}
+
+static char _image_write(int fd, const void *data, size_t size, unsigned int *offset)
+{
+  static const char padding[URL_BLACKLIST_IMAGE_ALIGN];
+
+  for (size_t written = 0; written < size;)
+  {
+    ssize_t n = write(fd, (const char *)data + written, size - written);
+    if (n <= 0)
+      return 0;
+    written += n;
+  }
+
+  *offset += size;
+
+  // every section starts aligned
+  size_t pad = -*offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  if (pad && write(fd, padding, pad) != pad)
+    return 0;
+
+  *offset += pad;
+
+  return 1;
+}
+
+int UrlBlacklist_save(UrlBlacklist *bl, char *filename)
+{
+  int status = -1;
+  char *pool = malloc(bl->file_size + bl->added_size + 1);
+  ImageLine *lines = malloc(((bl->file_size + bl->added_size) / 2 + 2) * sizeof(*lines));
+  unsigned int *nodes = malloc(bl->node_count * sizeof(*nodes));
+  // the edge table is rebuilt as small as the load factor allows
+  // nothing is added to an image in place
+  unsigned int edge_size = _edge_slots(bl->node_count);
+
+  UrlBlacklistEdge *edges = calloc(edge_size, sizeof(*edges));
+  unsigned int *globs = malloc((bl->glob_count + 1) * sizeof(*globs));
+  UrlBlacklistPathHost *path_hosts = malloc((bl->path_host_mask + 1) * sizeof(*path_hosts));
+  UrlBlacklistPathGlob *path_globs = malloc((bl->path_glob_count + 1) * sizeof(*path_globs));
+  unsigned int jump_count = bl->addresses.jumps ? 1u << bl->addresses.jump_bits : 0;
+  IpRadixNode *address_nodes = malloc(bl->addresses.node_count * sizeof(*address_nodes));
+  IpRadixJump *address_jumps = malloc((jump_count + 1) * sizeof(*address_jumps));
+  char *tmp = NULL;
+  int fd = -1;
+
+  // filters only hash domains, a current one is written as is
+  FuseFilter built = {0};
+  FuseFilter *filter = bl->filtered ? &bl->filter : _filter_new(bl, &built);
+
+  size_t tmp_size = strlen(filename) + sizeof(".tmp");
+  tmp = malloc(tmp_size);
+
+  if (!pool || !lines || !nodes || !edges || !globs || !path_hosts || !path_globs || !address_nodes || !address_jumps || !tmp || !filter)
+    goto cleanup;
+
+  snprintf(tmp, tmp_size, "%s.tmp", filename);
+
+  // only the rules are kept, one per line, added ones after the file
+  unsigned int pool_size = 0, line_count = 0;
+  char *ranges[][2] = {{bl->file, bl->file + bl->file_size}, {bl->added, bl->added + bl->added_size}};
+  for (int i = 0; i < 2; i++)
+  {
+    char *cursor = ranges[i][0];
+    char *entry, *rule, *rule_end;
+    while (cursor && _next_rule(bl, &cursor, ranges[i][1], &entry, &rule, &rule_end))
+    {
+      lines[line_count++] = (ImageLine){entry - bl->file, pool_size};
+      memcpy(pool + pool_size, entry, rule_end - entry);
+      pool_size += rule_end - entry;
+      pool[pool_size++] = bl->delim;
+    }
+  }
+
+  if (!line_count)
+    lines[line_count++] = (ImageLine){0, 0};
+
+  for (unsigned int i = 0; i < bl->node_count; i++)
+    nodes[i] = bl->nodes[i] ? _image_remap(lines, line_count, bl->nodes[i] - 1) + 1 : 0;
+
+  for (unsigned int i = 0; i < bl->edge_slots; i++)
+  {
+    UrlBlacklistEdge edge = bl->edges[i];
+    if (!edge.child)
+      continue;
+
+    u_int64_t hash = _edge_hash(edge.parent, bl->file + edge.label, edge.length);
+    edge.label = _image_remap(lines, line_count, edge.label);
+    _trie_place(edges, edge_size, &edge, hash);
+  }
+
+  for (unsigned int i = 0; i < bl->glob_count; i++)
+    globs[i] = _image_remap(lines, line_count, bl->globs[i]);
+
+  // node numbers stay, only offsets into the file move
+  for (unsigned int i = 0; i <= bl->path_host_mask; i++)
+  {
+    path_hosts[i] = bl->path_host_count ? bl->path_hosts[i] : (UrlBlacklistPathHost){0};
+    if (path_hosts[i].host)
+      path_hosts[i].rule = _image_remap(lines, line_count, path_hosts[i].rule);
+  }
+
+  for (unsigned int i = 0; i < bl->path_glob_count; i++)
+  {
+    path_globs[i] = bl->path_globs[i];
+    path_globs[i].entry = _image_remap(lines, line_count, path_globs[i].entry);
+    path_globs[i].pattern = _image_remap(lines, line_count, path_globs[i].pattern);
+  }
+
+  for (unsigned int i = 0; i < bl->addresses.node_count; i++)
+  {
+    address_nodes[i] = bl->addresses.nodes[i];
+    if (address_nodes[i].value)
+      address_nodes[i].value = _image_remap(lines, line_count, address_nodes[i].value - 1) + 1;
+  }
+
+  for (unsigned int i = 0; i < jump_count; i++)
+  {
+    address_jumps[i] = bl->addresses.jumps[i];
+    if (address_jumps[i].value)
+      address_jumps[i].value = _image_remap(lines, line_count, address_jumps[i].value - 1) + 1;
+  }
+
+  UrlBlacklistImage image = {URL_BLACKLIST_IMAGE_MAGIC, URL_BLACKLIST_IMAGE_VERSION, URL_BLACKLIST_IMAGE_BYTE_ORDER};
+  image.delim = bl->delim;
+  image.node_count = bl->node_count;
+  image.edge_slots = edge_size;
+  image.glob_class_count = bl->glob_class_count;
+  image.glob_state_count = bl->glob_state_count;
+  image.glob_count = bl->glob_count;
+  memcpy(image.glob_classes, bl->glob_classes, sizeof(image.glob_classes));
+  image.filter_seed = filter->seed;
+  image.filter_segment_length = filter->segment_length;
+  image.filter_segment_count_length = filter->segment_count_length;
+  image.filter_key_count = filter->key_count;
+  image.filter_size = filter->size;
+  image.path_host_mask = bl->path_host_mask;
+  image.path_host_count = bl->path_host_count;
+  image.path_glob_count = bl->path_glob_count;
+  image.address_node_count = bl->addresses.node_count;
+  image.address_jump_bits = jump_count ? bl->addresses.jump_bits : 0;
+
+  // sections follow the header in this order
+  unsigned int offset = sizeof(image) + (-sizeof(image) & (URL_BLACKLIST_IMAGE_ALIGN - 1));
+  image.pool_offset = offset;
+  image.pool_size = pool_size;
+  offset += pool_size + (-pool_size & (URL_BLACKLIST_IMAGE_ALIGN - 1));
+  image.nodes_offset = offset;
+  offset += bl->node_count * sizeof(*nodes);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.edges_offset = offset;
+  offset += edge_size * sizeof(*edges);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.transitions_offset = offset;
+  offset += bl->glob_state_count * bl->glob_class_count * sizeof(*bl->glob_transitions);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.accepts_offset = offset;
+  offset += bl->glob_state_count * sizeof(*bl->glob_accepts);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.globs_offset = offset;
+  offset += bl->glob_count * sizeof(*globs);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.filter_offset = offset;
+  offset += filter->size;
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.path_hosts_offset = offset;
+  offset += (bl->path_host_mask + 1) * sizeof(*path_hosts);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.path_globs_offset = offset;
+  offset += bl->path_glob_count * sizeof(*path_globs);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.address_nodes_offset = offset;
+  offset += bl->addresses.node_count * sizeof(*address_nodes);
+  offset += -offset & (URL_BLACKLIST_IMAGE_ALIGN - 1);
+  image.address_jumps_offset = offset;
+
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    goto cleanup;
+
+  offset = 0;
+  if (!_image_write(fd, &image, sizeof(image), &offset) ||
+      !_image_write(fd, pool, pool_size, &offset) ||
+      !_image_write(fd, nodes, bl->node_count * sizeof(*nodes), &offset) ||
+      !_image_write(fd, edges, edge_size * sizeof(*edges), &offset) ||
+      !_image_write(fd, bl->glob_transitions, bl->glob_state_count * bl->glob_class_count * sizeof(*bl->glob_transitions), &offset) ||
+      !_image_write(fd, bl->glob_accepts, bl->glob_state_count * sizeof(*bl->glob_accepts), &offset) ||
+      !_image_write(fd, globs, bl->glob_count * sizeof(*globs), &offset) ||
+      !_image_write(fd, filter->fingerprints, filter->size, &offset) ||
+      !_image_write(fd, path_hosts, (bl->path_host_mask + 1) * sizeof(*path_hosts), &offset) ||
+      !_image_write(fd, path_globs, bl->path_glob_count * sizeof(*path_globs), &offset) ||
+      !_image_write(fd, address_nodes, bl->addresses.node_count * sizeof(*address_nodes), &offset) ||
+      !_image_write(fd, address_jumps, jump_count * sizeof(*address_jumps), &offset))
+    goto cleanup;
+
+  // readers never see a half written image
+  if (fsync(fd) || rename(tmp, filename))
+    goto cleanup;
+
+  status = 0;
+
+cleanup:
+  if (fd >= 0)
+    close(fd);
+  if (status && tmp)
+    unlink(tmp);
+
+  free(tmp);
+  free(pool);
+  free(lines);
+  free(nodes);
+  free(edges);
+  free(globs);
+  free(path_hosts);
+  free(path_globs);
+  free(address_nodes);
+  free(address_jumps);
+  FuseFilter_free(&built);
+
+  return status;
+}
+
+/**
+ * Give an image backed bl writable copies of the trie and room to add rules
+ */
+static char _thaw(UrlBlacklist *bl)
+{
+  char *added;
+  char *file = _map_with_room(-1, bl->file_size, &added);
+  unsigned int *nodes = malloc(bl->node_count * sizeof(*nodes));
+  UrlBlacklistEdge *edges = malloc(bl->edge_slots * sizeof(*edges));
+
+  if (!file || !nodes || !edges)
+  {
+    if (file)
+      munmap(file, added - file + URL_BLACKLIST_ADDED_SIZE);
+    free(nodes);
+    free(edges);
+    return 0;
+  }
+
+  memcpy(file, bl->file, bl->file_size);
+  memcpy(nodes, bl->nodes, bl->node_count * sizeof(*nodes));
+  memcpy(edges, bl->edges, bl->edge_slots * sizeof(*edges));
+
+  bl->file = file;
+  bl->added = added;
+  bl->added_size = 0;
+  bl->nodes = nodes;
+  bl->node_capacity = bl->node_count;
+  bl->edges = edges;
+
+  return _trie_reserve(bl, URL_BLACKLIST_SPARE_NODES);
+}
+
+/**
+ * Node of exactly rule, 0 if there is none
+ */
+static unsigned int _trie_node(UrlBlacklist *bl, char *rule, char *rule_end)
+{
+  unsigned int node = 0;
+  char *label_end = rule_end;
+
+  for (;;)
+  {
+    char *label_start = label_end;
+    while (label_start > rule && label_start[-1] != '.')
+      label_start--;
+
+    if (!(node = _trie_child(bl, node, label_start, label_end - label_start)))
+      return 0;
+
+    if (label_start == rule)
+      return node;
+
+    label_end = label_start - 1;
+  }
+}
+
+/**
+ * Split change into the entry, ! included, and the domain rule ending at
+ * end. Returns -1 when it is not a domain change
+ */
+static int _change_parse(UrlBlacklist *bl, char *change, char **entry, char **rule, char **end)
+{
+  *end = change + strlen(change);
+  while (*end > change && ((*end)[-1] == '\n' || (*end)[-1] == '\r' || (*end)[-1] == ' ' || (*end)[-1] == '\t'))
+    (*end)--;
+
+  if (*end - change < 2 || (*change != '+' && *change != '-'))
+    return -1;
+
+  *entry = change + 1;
+  *rule = *entry + (**entry == '!');
+
+  u_int64_t address[2];
+  unsigned int prefix_length;
+  if (*rule == *end || **rule == '#' || IpRadix_parse(*rule, *end - *rule, address, &prefix_length))
+    return -1;
+
+  // wildcards live in the DFA and paths in their own index, both are only
+  // built on load
+  for (char *c = *rule; c < *end; c++)
+  {
+    if (*c == '*' || *c == '/' || *c == ' ' || *c == '\t' || *c == bl->delim)
+      return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * End of the rule at offset value of the file
+ */
+static char *_value_end(UrlBlacklist *bl, unsigned int value)
+{
+  char *end = bl->file + value - 1;
+  while (*end != bl->delim && *end != ' ' && *end != '\t' && *end != '\r')
+    end++;
+
+  return end;
+}
+
+/**
+ * Whether the rule of node is entry, whitelisted or not
+ */
+static char _node_is(UrlBlacklist *bl, unsigned int node, char *entry, char *end)
+{
+  unsigned int found = node ? bl->nodes[node] : 0;
+  if (!found)
+    return 0;
+
+  char *current = bl->file + found - 1;
+  return _value_end(bl, found) - current == end - entry && !memcmp(current, entry, end - entry);
+}
+
+/**
+ * grow is only set while no other thread can see bl
+ */
+static int _apply(UrlBlacklist *bl, char *change, char grow)
+{
+  char *entry, *rule, *end;
+  if (_change_parse(bl, change, &entry, &rule, &end))
+    return -1;
+
+  unsigned int length = end - entry;
+  unsigned int labels = 1;
+  for (char *c = rule; c < end; c++)
+    labels += *c == '.';
+
+  if (*change == '-')
+  {
+    unsigned int node = _trie_node(bl, rule, end);
+    if (!_node_is(bl, node, entry, end))
+      return -1;
+
+    if (!bl->added && (!grow || !_thaw(bl)))
+      return grow ? -1 : 1;
+
+    __atomic_store_n(&bl->nodes[node], 0, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    if (!bl->added && (!grow || !_thaw(bl)))
+      return grow ? -1 : 1;
+
+    if (bl->added_size + length + 1 > URL_BLACKLIST_ADDED_SIZE)
+      return grow ? -1 : 1;
+
+    // every new label may need a node, none of the tables can move under readers
+    if (!grow && (bl->node_count + labels > bl->node_capacity || (bl->node_count + labels) * 2 >= bl->edge_slots))
+      return 1;
+
+    // lookups would skip a domain the filter doesn't know
+    if (bl->filtered && !FuseFilter_contains(&bl->filter, _domain_hash(rule, end - rule)))
+      __atomic_store_n(&bl->filtered, 0, __ATOMIC_RELEASE);
+
+    char *added = bl->added + bl->added_size;
+    memcpy(added, entry, length);
+    added[length] = bl->delim;
+
+    if (!_trie_insert(bl, added + (rule - entry), added + length, added))
+      return -1;
+
+    bl->added_size += length + 1;
+  }
+
+  // cached verdicts go stale
+  __atomic_store_n(&bl->generation, __atomic_add_fetch(&generations, 1, __ATOMIC_RELAXED), __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+int UrlBlacklist_apply(UrlBlacklist *bl, char *change)
+{
+  return _apply(bl, change, 0);
+}
+
+int UrlBlacklist_check(UrlBlacklist *bl, char *change)
+{
+  char *entry, *rule, *end;
+  if (_change_parse(bl, change, &entry, &rule, &end))
+    return -1;
+
+  return *change == '-' && !_node_is(bl, _trie_node(bl, rule, end), entry, end) ? -1 : 0;
+}
+
+char UrlBlacklist_in_effect(UrlBlacklist *bl, char *change)
+{
+  char *entry, *rule, *end;
+  if (_change_parse(bl, change, &entry, &rule, &end))
+    return 0;
+
+  return _node_is(bl, _trie_node(bl, rule, end), entry, end) == (*change == '+');
+}
+
+/**
+ * A node changed by the log and its rule before the first change
+ */
+typedef struct ChangedNode
+{
+  unsigned int node;
+  unsigned int value;
+} ChangedNode;
+
+/**
+ * Replace filename with one change for every node whose rule differs from
+ * the one it had before the log. Returns 0 on success
+ */
+static int _compact(UrlBlacklist *bl, char *filename, ChangedNode *changed, unsigned int changed_count)
+{
+  int status = -1;
+  size_t tmp_size = strlen(filename) + sizeof(".tmp");
+  char *tmp = malloc(tmp_size);
+  if (!tmp)
+    return -1;
+
+  snprintf(tmp, tmp_size, "%s.tmp", filename);
+  FILE *file = fopen(tmp, "w");
+  if (!file)
+  {
+    free(tmp);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < changed_count; i++)
+  {
+    unsigned int value = bl->nodes[changed[i].node];
+    if (value == changed[i].value)
+      continue;
+
+    // the rule that is there now, or the one that was removed
+    char sign = value ? '+' : '-';
+    if (!value)
+      value = changed[i].value;
+
+    fprintf(file, "%c%.*s\n", sign, (int)(_value_end(bl, value) - (bl->file + value - 1)), bl->file + value - 1);
+  }
+
+  // the log is never replaced by a half written one
+  int written = !fflush(file) && !ferror(file) && !fsync(fileno(file));
+  if (fclose(file) || !written || rename(tmp, filename))
+    goto cleanup;
+
+  status = 0;
+
+cleanup:
+  if (status)
+    unlink(tmp);
+
+  free(tmp);
+  return status;
+}
+
+int UrlBlacklist_replay(UrlBlacklist *bl, char *filename, char compact)
+{
+  FILE *file = fopen(filename, "r");
+  if (!file)
+    return 0;
+
+  ChangedNode *changed = NULL;
+  unsigned int changed_count = 0, changed_capacity = 0;
+  char *seen = NULL;
+  unsigned int seen_size = 0;
+
+  int applied = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), file))
+  {
+    char *entry, *rule, *end;
+    unsigned int node = 0, value = 0;
+    if (compact && !_change_parse(bl, line, &entry, &rule, &end) && (node = _trie_node(bl, rule, end)))
+      value = bl->nodes[node];
+
+    if (_apply(bl, line, 1))
+      continue;
+
+    applied++;
+    if (!compact)
+      continue;
+
+    // only the rule before the first change of a node counts
+    node = _trie_node(bl, rule, end);
+    if (node >= seen_size)
+    {
+      unsigned int size = bl->node_count > node ? bl->node_count : node + 1;
+      char *grown = realloc(seen, size);
+      if (!grown)
+      {
+        compact = 0;
+        continue;
+      }
+
+      memset(grown + seen_size, 0, size - seen_size);
+      seen = grown;
+      seen_size = size;
+    }
+
+    if (seen[node])
+      continue;
+
+    if (changed_count == changed_capacity)
+    {
+      unsigned int capacity = changed_capacity ? changed_capacity * 2 : 64;
+      ChangedNode *grown = realloc(changed, capacity * sizeof(*changed));
+      if (!grown)
+      {
+        compact = 0;
+        continue;
+      }
+
+      changed = grown;
+      changed_capacity = capacity;
+    }
+
+    seen[node] = 1;
+    changed[changed_count++] = (ChangedNode){node, value};
+  }
+
+  // a log cut short by an error is left as it is
+  if (compact && !ferror(file))
+    _compact(bl, filename, changed, changed_count);
+
+  fclose(file);
+  free(changed);
+  free(seen);
+
+  // leave room for changes in place again
+  _trie_reserve(bl, URL_BLACKLIST_SPARE_NODES);
+
+  if (!bl->filtered)
+    _filter_build(bl);
+
+  return applied;
+}
+
+char *UrlBlacklist_exists(UrlBlacklist *bl, char *url)
+{
+  return UrlBlacklist_exists_path(bl, url, NULL, NULL);
+}
+
+char *UrlBlacklist_exists_path(UrlBlacklist *bl, char *url, char *path, char *paths)
+{
+  char layer_paths = 0;
+  if (paths)
+    *paths = 0;
+
+  for (; bl; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+  {
+    char *rule = UrlBlacklist_find_path(bl, url, path, &layer_paths);
+
+    if (paths)
+      *paths |= layer_paths;
+
+    if (rule && (*rule != '!' || !bl->whitelist_local))
+      return *rule == '!' ? NULL : rule;
+  }
+
+  return NULL;
+}
+
+char *UrlBlacklist_find_path(UrlBlacklist *bl, char *url, char *path, char *paths)
+{
+  // one pass for the length and the label boundaries
+  u_int64_t dots[URL_BLACKLIST_HOST_MAX / 64];
+  char *end = url + UrlBlacklist_scan_host(url, 0, dots);
+  const u_int64_t *labels = end - url <= URL_BLACKLIST_HOST_MAX ? dots : NULL;
+  char has_paths = 0;
+
+  // an address decides by its networks when one has a rule
+  u_int64_t address[2];
+  unsigned int prefix_length;
+  unsigned int found;
+  if (bl->addresses.node_count > 1 && IpRadix_parse(url, end - url, address, &prefix_length) && prefix_length == 128 &&
+      (found = IpRadix_find(&bl->addresses, address)))
+  {
+    if (paths)
+      *paths = 0;
+
+    return bl->file + found - 1;
+  }
+
+  // the domain or the closest parent domain with a rule decides first,
+  // most hostnames have none and the filter tells without the trie
+  char *rule = NULL;
+  if (!__atomic_load_n(&bl->filtered, __ATOMIC_ACQUIRE) || _filter_maybe(bl, url, end, labels))
+    rule = _trie_find(bl, url, end, labels, path, path ? path + strlen(path) : NULL, &has_paths);
+
+  if (paths)
+    *paths = has_paths;
+
+  if (!rule)
+    rule = _glob_find(bl, url, end);
+
+  return rule;
+}
+
+typedef struct BatchLookup
+{
+  char *url;
+  char *end;
+  /**
+   * Next label to walk, label_end is NULL once it was the first label
+   */
+  char *label_start;
+  char *label_end;
+  /**
+   * Label boundaries of url, NULL when it is too long for them
+   */
+  const u_int64_t *labels;
+  u_int64_t dots[URL_BLACKLIST_HOST_MAX / 64];
+  u_int64_t hash;
+  /**
+   * Node reached, its entry is read the round after it was prefetched
+   */
+  unsigned int node;
+  unsigned int found;
+  char walking;
+} BatchLookup;
+
+/**
+ * UrlBlacklist_find_path without a path for count urls at once on bl
+ * alone. Every url takes one step down the trie per round, the edge and
+ * node the next step reads are prefetched for all of them before the
+ * first one takes it
+ */
+static void _find_batch(UrlBlacklist *bl, char **urls, unsigned int count, char **rules)
+{
+  BatchLookup lookups[URL_BLACKLIST_BATCH];
+  char filtered = __atomic_load_n(&bl->filtered, __ATOMIC_ACQUIRE);
+
+  for (unsigned int i = 0; i < count; i++)
+  {
+    BatchLookup *lookup = &lookups[i];
+    lookup->url = urls[i];
+    lookup->end = urls[i] + UrlBlacklist_scan_host(urls[i], 0, lookup->dots);
+    lookup->labels = lookup->end - lookup->url <= URL_BLACKLIST_HOST_MAX ? lookup->dots : NULL;
+    lookup->node = 0;
+    lookup->found = 0;
+    lookup->walking = 0;
+
+    // addresses are rare, look them up as is
+    u_int64_t address[2];
+    unsigned int prefix_length;
+    if (bl->addresses.node_count > 1 && IpRadix_parse(lookup->url, lookup->end - lookup->url, address, &prefix_length) && prefix_length == 128 &&
+        (lookup->found = IpRadix_find(&bl->addresses, address)))
+      continue;
+
+    // the filter is small enough to stay cached and turns most urls away,
+    // the rest start at their last label
+    if (filtered && !_filter_maybe(bl, lookup->url, lookup->end, lookup->labels))
+      continue;
+
+    lookup->walking = 1;
+    lookup->label_end = lookup->end;
+    lookup->label_start = _label_start(lookup->url, lookup->end, lookup->labels);
+
+    lookup->hash = _edge_hash(0, lookup->label_start, lookup->label_end - lookup->label_start);
+    __builtin_prefetch(&bl->edges[_edge_slot(lookup->hash, bl->edge_slots)]);
+  }
+
+  for (unsigned int walking = count; walking;)
+  {
+    walking = 0;
+
+    for (unsigned int i = 0; i < count; i++)
+    {
+      BatchLookup *lookup = &lookups[i];
+      if (!lookup->walking)
+        continue;
+
+      if (lookup->node)
+      {
+        unsigned int entry = __atomic_load_n(&bl->nodes[lookup->node], __ATOMIC_ACQUIRE);
+        if (entry)
+          lookup->found = entry;
+      }
+
+      if (!lookup->label_end || !(lookup->node = _trie_probe(bl, lookup->node, lookup->label_start, lookup->label_end - lookup->label_start, lookup->hash)))
+      {
+        lookup->walking = 0;
+        continue;
+      }
+
+      __builtin_prefetch(&bl->nodes[lookup->node]);
+      walking++;
+
+      if (lookup->label_start == lookup->url)
+      {
+        lookup->label_end = NULL;
+        continue;
+      }
+
+      lookup->label_end = lookup->label_start - 1;
+      lookup->label_start = _label_start(lookup->url, lookup->label_end, lookup->labels);
+
+      lookup->hash = _edge_hash(lookup->node, lookup->label_start, lookup->label_end - lookup->label_start);
+      __builtin_prefetch(&bl->edges[_edge_slot(lookup->hash, bl->edge_slots)]);
+    }
+  }
+
+  for (unsigned int i = 0; i < count; i++)
+    rules[i] = lookups[i].found ? bl->file + lookups[i].found - 1 : _glob_find(bl, lookups[i].url, lookups[i].end);
+}
+
+void UrlBlacklist_exists_batch(UrlBlacklist *bl, char **urls, unsigned int count, char **results)
+{
+  for (unsigned int first = 0; first < count; first += URL_BLACKLIST_BATCH)
+  {
+    char *pending[URL_BLACKLIST_BATCH];
+    unsigned int where[URL_BLACKLIST_BATCH];
+    unsigned int left = count - first < URL_BLACKLIST_BATCH ? count - first : URL_BLACKLIST_BATCH;
+
+    for (unsigned int i = 0; i < left; i++)
+    {
+      pending[i] = urls[first + i];
+      where[i] = first + i;
+      results[first + i] = NULL;
+    }
+
+    // urls without a rule in a layer go on to its base
+    for (UrlBlacklist *layer = bl; layer && left; layer = __atomic_load_n(&layer->base, __ATOMIC_ACQUIRE))
+    {
+      char *rules[URL_BLACKLIST_BATCH];
+      unsigned int undecided = 0;
+
+      _find_batch(layer, pending, left, rules);
+
+      for (unsigned int i = 0; i < left; i++)
+      {
+        if (rules[i] && (*rules[i] != '!' || !layer->whitelist_local))
+        {
+          results[where[i]] = *rules[i] == '!' ? NULL : rules[i];
+          continue;
+        }
+
+        pending[undecided] = pending[i];
+        where[undecided++] = where[i];
+      }
+
+      left = undecided;
+    }
+  }
+}
+
+char *UrlBlacklist_exists_address(UrlBlacklist *bl, const struct sockaddr *address)
+{
+  u_int64_t key[2];
+  if (!IpRadix_sockaddr(address, key))
+    return NULL;
+
+  for (; bl; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+  {
+    unsigned int found = IpRadix_find(&bl->addresses, key);
+
+    if (found && (bl->file[found - 1] != '!' || !bl->whitelist_local))
+      return bl->file[found - 1] == '!' ? NULL : bl->file + found - 1;
+  }
+
+  return NULL;
+}
+
+int UrlBlacklist_rule_offsets(UrlBlacklist *bl, unsigned int **offsets)
+{
+  char *end = bl->file + bl->file_size, *entry, *rule, *rule_end;
+  unsigned int count = 0;
+
+  for (char *cursor = bl->file; _next_rule(bl, &cursor, end, &entry, &rule, &rule_end);)
+    count++;
+
+  if (!(*offsets = malloc((count + 1) * sizeof(**offsets))))
+    return -1;
+
+  count = 0;
+  for (char *cursor = bl->file; _next_rule(bl, &cursor, end, &entry, &rule, &rule_end);)
+    (*offsets)[count++] = entry - bl->file;
+
+  return count;
+}
+
+/**
+ * Whether no wildcard rule matches domain or any host under it
+ */
+static char _glob_never(UrlBlacklist *bl, char *domain, char *end)
+{
+  unsigned int state = 1;
+
+  if (!bl->glob_count)
+    return 1;
+
+  for (char *c = end; c > domain;)
+  {
+    c--;
+
+    if (*c == '.' && bl->glob_accepts[state])
+      return 0;
+
+    if (!(state = bl->glob_transitions[state * bl->glob_class_count + bl->glob_classes[(unsigned char)*c]]))
+      return 1;
+  }
+
+  // a host under domain carries on with the dot in front of it
+  return !bl->glob_accepts[state] && !bl->glob_transitions[state * bl->glob_class_count + 1];
+}
+
+typedef struct RedundantList
+{
+  UrlBlacklistRedundant *items;
+  unsigned int count;
+  unsigned int capacity;
+} RedundantList;
+
+static char _redundant_push(RedundantList *list, unsigned int rule, unsigned int by, UrlBlacklistRedundancy reason)
+{
+  if (list->count == list->capacity)
+  {
+    unsigned int grown_capacity = list->capacity ? list->capacity * 2 : 16;
+    UrlBlacklistRedundant *grown = realloc(list->items, grown_capacity * sizeof(*grown));
+    if (!grown)
+      return 0;
+
+    list->items = grown;
+    list->capacity = grown_capacity;
+  }
+
+  list->items[list->count++] = (UrlBlacklistRedundant){rule, by, reason};
+
+  return 1;
+}
+
+static int _redundant_compare(const void *a, const void *b)
+{
+  const UrlBlacklistRedundant *x = a, *y = b;
+
+  return x->rule < y->rule ? -1 : x->rule > y->rule;
+}
+
+int UrlBlacklist_redundant(UrlBlacklist *bl, char alone, UrlBlacklistRedundant **redundant)
+{
+  RedundantList list = {0};
+  RuleList globs = {0};
+  char *end = bl->file + bl->file_size, *entry, *rule, *rule_end;
+
+  for (char *cursor = bl->file; _next_rule(bl, &cursor, end, &entry, &rule, &rule_end);)
+  {
+    u_int64_t address[2];
+    unsigned int prefix_length;
+    if (IpRadix_parse(rule, rule_end - rule, address, &prefix_length) || memchr(rule, '/', rule_end - rule))
+      continue;
+
+    if (memchr(rule, '*', rule_end - rule))
+    {
+      if (!_rule_push(&globs, (GlobRule){entry, rule, rule_end - rule, entry - bl->file}))
+        goto fail;
+      continue;
+    }
+
+    // down from the top level domain, remembering the closest parent with a
+    // rule and whether a domain with path rules comes after it
+    unsigned int node = 0, parent = 0;
+    char paths = 0;
+    for (char *label_end = rule_end;;)
+    {
+      char *label_start = label_end;
+      while (label_start > rule && label_start[-1] != '.')
+        label_start--;
+
+      if (!(node = _trie_child(bl, node, label_start, label_end - label_start)) || label_start == rule)
+        break;
+
+      if (bl->nodes[node])
+      {
+        parent = bl->nodes[node];
+        paths = 0;
+      }
+      paths |= bl->path_host_count && _path_host(bl, node);
+
+      label_end = label_start - 1;
+    }
+
+    // labels too long for the trie never match anything
+    if (!node || !bl->nodes[node])
+      continue;
+
+    unsigned int offset = entry - bl->file;
+    char whitelist = *entry == '!';
+    char ok = 1;
+
+    if (bl->nodes[node] != offset + 1)
+    {
+      ok = _redundant_push(&list, offset, bl->nodes[node] - 1, URL_BLACKLIST_DUPLICATE);
+    }
+    else if (paths)
+    {
+      // a path rule above would decide for the hosts of this one
+      continue;
+    }
+    else if (parent)
+    {
+      if ((bl->file[parent - 1] == '!') == whitelist)
+        ok = _redundant_push(&list, offset, parent - 1, URL_BLACKLIST_PARENT);
+    }
+    else
+    {
+      // every host under the rule gets what the rule itself gets
+      char *glob = _glob_find(bl, rule, rule_end);
+
+      if (glob && (*glob == '!') == whitelist)
+        ok = _redundant_push(&list, offset, glob - bl->file, URL_BLACKLIST_WILDCARD);
+      else if (!glob && whitelist && alone && _glob_never(bl, rule, rule_end))
+        ok = _redundant_push(&list, offset, offset, URL_BLACKLIST_UNBLOCKS_NOTHING);
+    }
+
+    if (!ok)
+      goto fail;
+  }
+
+  // of identical wildcard rules only the last line counts
+  if (globs.count)
+    qsort(globs.rules, globs.count, sizeof(*globs.rules), _glob_text_compare);
+  for (unsigned int i = 0, last; i < globs.count; i = last + 1)
+  {
+    GlobRule *first = &globs.rules[i];
+
+    for (last = i; last + 1 < globs.count && globs.rules[last + 1].length == first->length && !memcmp(globs.rules[last + 1].text, first->text, first->length);)
+      last++;
+
+    for (unsigned int j = i; j < last; j++)
+    {
+      if (!_redundant_push(&list, globs.rules[j].line, globs.rules[last].line, URL_BLACKLIST_DUPLICATE))
+        goto fail;
+    }
+  }
+
+  free(globs.rules);
+
+  if (list.count)
+    qsort(list.items, list.count, sizeof(*list.items), _redundant_compare);
+
+  *redundant = list.items;
+
+  return list.count;
+
+fail:
+  free(globs.rules);
+  free(list.items);
+
+  return -1;
+}
+
+UrlBlacklist *UrlBlacklist_layer(UrlBlacklist *bl, const char *rule)
+{
+  for (; bl; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+  {
+    if ((rule >= bl->file && rule < bl->file + bl->file_size) || (bl->added && rule >= bl->added && rule < bl->added + bl->added_size))
+      return bl;
+  }
+
+  return NULL;
+}
+
+/**
+ * Returns an allocated string that is the copy of the rule but null terminated
+ */
+char *UrlBlacklist_get_rule(UrlBlacklist *bl, char *rule)
+{
+  unsigned int len = strchr(rule, bl->delim) - rule;
+  char *copy = malloc(len + 1);
+  strncpy(copy, rule, len);
+  copy[len] = '\0';
+  return copy;
+}
+
+void UrlBlacklist_print_table(UrlBlacklist *bl)
+{
+  const unsigned int MAX_ENTRIES = 0xf;
+
+  unsigned int rule_count = 0;
+  for (unsigned int i = 0; i < bl->node_count; i++)
+    rule_count += !!bl->nodes[i];
+
+  printf("UrlBlacklist trie: %u nodes, %u rules, %u edge slots: %p\n", bl->node_count, rule_count, bl->edge_slots, (void *)bl);
+  // keys that are not domain hashes are as good as other hostnames
+  unsigned int false_positives = 0;
+  for (unsigned int i = 1; i <= 1 << 16; i++)
+    false_positives += FuseFilter_contains(&bl->filter, i * 0x9e3779b97f4a7c15ull);
+
+  printf("UrlBlacklist filter: %u domains, %.1f bits each, %.2f%% false positives%s\n",
+         bl->filter.key_count, bl->filter.key_count ? 8.0 * bl->filter.size / bl->filter.key_count : 0,
+         100.0 * false_positives / (1 << 16), bl->filtered ? "" : ", off until reloaded");
+  printf("UrlBlacklist paths: %u domains, %u wildcard rules\n", bl->path_host_count, bl->path_glob_count);
+
+  unsigned int network_count = 0;
+  for (unsigned int i = 0; i < bl->addresses.node_count; i++)
+    network_count += !!bl->addresses.nodes[i].value;
+
+  printf("UrlBlacklist addresses: %u networks, %u nodes, %u jump slots\n", network_count, bl->addresses.node_count,
+         bl->addresses.jumps ? 1u << bl->addresses.jump_bits : 0);
+  printf("UrlBlacklist globs [%u rules, %u states, %u classes], by priority:\n", bl->glob_count, bl->glob_state_count, bl->glob_class_count);
+
+  for (unsigned int i = 0; i < bl->glob_count && i < MAX_ENTRIES; i++)
+  {
+    char *rule = UrlBlacklist_get_rule(bl, bl->file + bl->globs[i]);
+    printf("%5u %s\n", i, rule);
+    free(rule);
+  }
+
+  if (bl->glob_count > MAX_ENTRIES)
+    printf("... %d more entries\n", bl->glob_count - MAX_ENTRIES);
+
+  printf("- end of table -\n");
+}
+
+void UrlBlacklist_stats(UrlBlacklist *bl, UrlBlacklistStats *stats)
+{
+  *stats = (UrlBlacklistStats){0};
+
+  stats->file_bytes = bl->file_size + bl->added_size;
+  stats->node_bytes = (size_t)bl->node_capacity * sizeof(*bl->nodes);
+  stats->edge_slots = bl->edge_slots;
+  stats->edge_bytes = (size_t)stats->edge_slots * sizeof(*bl->edges);
+  stats->filter_bytes = bl->filter.size;
+  stats->glob_bytes = ((size_t)bl->glob_state_count * bl->glob_class_count + bl->glob_state_count + bl->glob_count) * sizeof(unsigned int);
+  stats->path_bytes = (bl->path_host_count ? (bl->path_host_mask + 1) * sizeof(*bl->path_hosts) : 0) + bl->path_glob_count * sizeof(*bl->path_globs);
+  stats->address_bytes = (size_t)bl->addresses.node_count * sizeof(*bl->addresses.nodes) + (bl->addresses.jumps ? (1u << bl->addresses.jump_bits) * sizeof(*bl->addresses.jumps) : 0);
+
+  // runs of occupied slots wrap around, start after an empty one
+  unsigned int first = 0;
+  while (first < bl->edge_slots && bl->edges[first].child)
+    first++;
+  if (first == bl->edge_slots)
+    return;
+
+  unsigned long probe_sum = 0, miss_sum = 0;
+  unsigned int run = 0;
+
+  for (unsigned int i = 1; i <= stats->edge_slots; i++)
+  {
+    unsigned int slot = (first + i) % bl->edge_slots;
+    UrlBlacklistEdge *edge = &bl->edges[slot];
+
+    if (!edge->child)
+    {
+      // a miss hashed into the run reads on to the empty slot, one hashed
+      // to the empty slot reads only that
+      miss_sum += (unsigned long)run * (run + 3) / 2 + 1;
+
+      if (run > stats->longest_run)
+      {
+        stats->longest_run = run;
+        stats->longest_run_start = (slot + bl->edge_slots - run) % bl->edge_slots;
+      }
+
+      run = 0;
+      continue;
+    }
+
+    run++;
+    stats->edges++;
+
+    unsigned int home = _edge_slot(_edge_hash(edge->parent, bl->file + edge->label, edge->length), bl->edge_slots);
+    unsigned int probes = (slot + bl->edge_slots - home) % bl->edge_slots + 1;
+
+    probe_sum += probes;
+    stats->probes[probes < URL_BLACKLIST_PROBE_BUCKETS ? probes - 1 : URL_BLACKLIST_PROBE_BUCKETS - 1]++;
+
+    // insertion into the few worst
+    for (unsigned int j = 0; j < URL_BLACKLIST_WORST_EDGES; j++)
+    {
+      if (probes <= stats->worst_probes[j])
+        continue;
+
+      memmove(&stats->worst_edges[j + 1], &stats->worst_edges[j], (URL_BLACKLIST_WORST_EDGES - j - 1) * sizeof(*stats->worst_edges));
+      memmove(&stats->worst_probes[j + 1], &stats->worst_probes[j], (URL_BLACKLIST_WORST_EDGES - j - 1) * sizeof(*stats->worst_probes));
+      stats->worst_edges[j] = slot;
+      stats->worst_probes[j] = probes;
+      break;
+    }
+  }
+
+  stats->mean_probes = stats->edges ? (double)probe_sum / stats->edges : 0;
+  stats->miss_probes = (double)miss_sum / stats->edge_slots;
+}
+
+void UrlBlacklist_print_stats(UrlBlacklist *bl)
+{
+  UrlBlacklistStats stats;
+  UrlBlacklist_stats(bl, &stats);
+
+  size_t total = stats.file_bytes + stats.node_bytes + stats.edge_bytes + stats.filter_bytes + stats.glob_bytes + stats.path_bytes + stats.address_bytes;
+  printf("UrlBlacklist memory: %.1f MiB, rules %.1f, nodes %.1f, edges %.1f, filter %.1f, globs %.1f, paths %.1f, addresses %.1f\n",
+         total / 1048576.0, stats.file_bytes / 1048576.0, stats.node_bytes / 1048576.0, stats.edge_bytes / 1048576.0,
+         stats.filter_bytes / 1048576.0, stats.glob_bytes / 1048576.0, stats.path_bytes / 1048576.0, stats.address_bytes / 1048576.0);
+  printf("UrlBlacklist edges: %u of %u slots, load factor %.3f, %.2f probes per hit, %.2f per miss\n",
+         stats.edges, stats.edge_slots, (double)stats.edges / stats.edge_slots, stats.mean_probes, stats.miss_probes);
+
+  printf("UrlBlacklist probes:");
+  for (unsigned int i = 0; i < URL_BLACKLIST_PROBE_BUCKETS; i++)
+    printf(" %u%s:%u", i + 1, i == URL_BLACKLIST_PROBE_BUCKETS - 1 ? "+" : "", stats.probes[i]);
+  printf("\n");
+
+  printf("UrlBlacklist longest run: %u slots from %u\n", stats.longest_run, stats.longest_run_start);
+
+  for (unsigned int i = 0; i < URL_BLACKLIST_WORST_EDGES && stats.worst_probes[i]; i++)
+  {
+    UrlBlacklistEdge *edge = &bl->edges[stats.worst_edges[i]];
+    printf("%5u probes: %.*s under node %u, slot %u\n", stats.worst_probes[i], edge->length, bl->file + edge->label, edge->parent, stats.worst_edges[i]);
+  }
 }
@@ -2,34 +2,488 @@
  * Extremely rudimentary set implementation for strings that are delimted by a character
  */
 #include <stdlib.h>
+#include "fuse_filter.h"
+#include "ip_radix.h"
 
 #ifndef _CHR_DELIM_SET_H
 #define _CHR_DELIM_SET_H
 
+struct RuleHits;
+
+/**
+ * Trie edge from a node to its child over one label
+ */
+typedef struct UrlBlacklistEdge
+{
+  unsigned int parent;
+  /**
+   * High bits of the edge hash, probes for other labels mostly stop here
+   * without reading the file
+   */
+  u_int16_t fingerprint;
+  u_int16_t length;
+  /**
+   * 0 marks an empty slot, the root is never a child
+   */
+  unsigned int child;
+  /**
+   * Offset of the label in the file
+   */
+  unsigned int label;
+} UrlBlacklistEdge;
+
+/**
+ * Domain with rules for some of its paths
+ */
+typedef struct UrlBlacklistPathHost
+{
+  /**
+   * Trie node of the domain, 0 marks an empty slot
+   */
+  unsigned int host;
+  /**
+   * Node under host over the label "/", plain paths hang below it one
+   * segment per node
+   */
+  unsigned int root;
+  /**
+   * Offset of one of the rules in the file, for the domain's name
+   */
+  unsigned int rule;
+  /**
+   * Rules with wildcards or a query in path_globs, by priority
+   */
+  unsigned int glob_first;
+  unsigned int glob_count;
+} UrlBlacklistPathHost;
+
+typedef struct UrlBlacklistPathGlob
+{
+  /**
+   * Offsets of the rule including a leading ! and of its path in the file
+   */
+  unsigned int entry;
+  unsigned int pattern;
+  unsigned int length;
+} UrlBlacklistPathGlob;
+
+#define URL_BLACKLIST_MAX_GLOB_STATES (1 << 16)
+
+/**
+ * Room for rules added at runtime, reserved but only backed once used
+ */
+#define URL_BLACKLIST_ADDED_SIZE (16 << 20)
+/**
+ * Trie nodes kept free after loading so rules can be added in place
+ */
+#define URL_BLACKLIST_SPARE_NODES 4096
+/**
+ * Lookups UrlBlacklist_exists_batch keeps in flight
+ */
+#define URL_BLACKLIST_BATCH 16
+/**
+ * Label boundaries a lookup tracks in a bitmap, longer hostnames are
+ * split a byte at a time. DNS names are at most 253 characters
+ */
+#define URL_BLACKLIST_HOST_MAX 256
+
+/**
+ * Smallest share of a text file a loader thread gets
+ */
+#define URL_BLACKLIST_LOAD_CHUNK (1 << 20)
+
+#define URL_BLACKLIST_IMAGE_MAGIC "UBLIMG"
+#define URL_BLACKLIST_IMAGE_VERSION 7
+#define URL_BLACKLIST_IMAGE_BYTE_ORDER 0x01020304
+#define URL_BLACKLIST_IMAGE_ALIGN 64
+
+/**
+ * Header of a compiled blacklist, the tables of a loaded UrlBlacklist
+ * written out as is. Offsets are from the start of the image, rules and
+ * labels are offsets into the pool so the image can be mapped anywhere
+ */
+typedef struct UrlBlacklistImage
+{
+  char magic[sizeof(URL_BLACKLIST_IMAGE_MAGIC)];
+  u_int32_t version;
+  /**
+   * Images are only read on machines with the same byte order
+   */
+  u_int32_t byte_order;
+  char delim;
+
+  /**
+   * The rules one per line, without addresses or comments
+   */
+  u_int32_t pool_offset;
+  u_int32_t pool_size;
+
+  u_int32_t nodes_offset;
+  u_int32_t node_count;
+  u_int32_t edges_offset;
+  u_int32_t edge_slots;
+
+  u_int32_t transitions_offset;
+  u_int32_t accepts_offset;
+  u_int32_t glob_state_count;
+  u_int32_t glob_class_count;
+  unsigned char glob_classes[256];
+  u_int32_t globs_offset;
+  u_int32_t glob_count;
+
+  u_int64_t filter_seed;
+  u_int32_t filter_segment_length;
+  u_int32_t filter_segment_count_length;
+  u_int32_t filter_key_count;
+  u_int32_t filter_offset;
+  u_int32_t filter_size;
+
+  u_int32_t path_hosts_offset;
+  u_int32_t path_host_mask;
+  u_int32_t path_host_count;
+  u_int32_t path_globs_offset;
+  u_int32_t path_glob_count;
+
+  u_int32_t address_nodes_offset;
+  u_int32_t address_node_count;
+  u_int32_t address_jumps_offset;
+  u_int32_t address_jump_bits;
+} UrlBlacklistImage;
+
 typedef struct UrlBlacklist
 {
   int fd;
   char *file;
   unsigned int file_size;
-  char **table;
   char delim;
-  unsigned int mask;
+
+  /**
+   * Mapping of a compiled image, NULL when built from text. The tables
+   * below point into it and are read only
+   */
+  char *image;
+  size_t image_size;
+
+  /**
+   * Rules added at runtime, mapped right after file so they are addressed
+   * by file offsets like the rest. NULL until an image is first changed
+   */
+  char *added;
+  unsigned int added_size;
+
+  /**
+   * Rules without wildcards as a trie of reversed labels, com -> google ->
+   * www. Nodes hold 1 + the file offset of their rule or 0
+   */
+  unsigned int *nodes;
+  unsigned int node_count;
+  unsigned int node_capacity;
+  /**
+   * At most 40% full once loaded, sized from the nodes the rules need
+   */
+  UrlBlacklistEdge *edges;
+  unsigned int edge_slots;
+
+  /**
+   * Wildcard rules compiled into one DFA over the hostname read backwards.
+   * State 0 is dead, 1 the start. Accepts hold 1 + the index in globs of
+   * the best rule a state accepts, or 0
+   */
+  unsigned char glob_classes[256];
+  unsigned int glob_class_count;
+  unsigned int glob_state_count;
+  unsigned int *glob_transitions;
+  unsigned int *glob_accepts;
+  /**
+   * File offsets of the rules by priority
+   */
+  unsigned int *globs;
+  unsigned int glob_count;
+
+  /**
+   * Domains with path rules, open addressed by trie node. Only built on
+   * load, the domain of a path rule has no wildcards
+   */
+  UrlBlacklistPathHost *path_hosts;
+  unsigned int path_host_mask;
+  unsigned int path_host_count;
+  UrlBlacklistPathGlob *path_globs;
+  unsigned int path_glob_count;
+
+  /**
+   * IPv4 and IPv6 rules, optionally with a /length, by network. Values are
+   * 1 + the file offset of the rule. Only built on load
+   */
+  IpRadix addresses;
+
+  /**
+   * Hashes of the domains of every rule in the trie, a hostname with none
+   * of its suffixes in it skips the trie. Only used while filtered is set,
+   * rules added at runtime are missing until the next load
+   */
+  FuseFilter filter;
+  char filtered;
+
+  /**
+   * Unique across all blacklists and bumped on every change, anything
+   * derived from lookups is stale once it differs
+   */
+  unsigned int generation;
+
+  /**
+   * Looked up when this one has no rule for a host, NULL for none. Set
+   * by whoever layers blacklists, base has to outlive this one or be
+   * replaced with an atomic store first. Not part of generation
+   */
+  struct UrlBlacklist *base;
+  /**
+   * Whitelist rules only cancel the rules of this list, base still decides
+   * the hosts they match
+   */
+  char whitelist_local;
+  /**
+   * Only some clients look it up, a VerdictCache looks it up every time and
+   * caches the verdicts of the lists under it
+   */
+  char uncached;
+  /**
+   * Blocks by the rules of this list, NULL when nobody counts them. Set and
+   * freed by whoever counts
+   */
+  struct RuleHits *hits;
 } UrlBlacklist;
 
 /**
- * Create a new UrlBlacklist
+ * Why a rule makes no difference to any lookup
+ */
+typedef enum UrlBlacklistRedundancy
+{
+  /**
+   * A later line has the same rule and replaces it
+   */
+  URL_BLACKLIST_DUPLICATE = 1,
+  /**
+   * The closest parent domain with a rule decides the same way
+   */
+  URL_BLACKLIST_PARENT,
+  /**
+   * No parent domain has a rule and a wildcard rule decides the same way
+   */
+  URL_BLACKLIST_WILDCARD,
+  /**
+   * A whitelist rule where no rule would block, with nothing layered under
+   * the list
+   */
+  URL_BLACKLIST_UNBLOCKS_NOTHING,
+} UrlBlacklistRedundancy;
+
+typedef struct UrlBlacklistRedundant
+{
+  /**
+   * File offsets of the rule and of the one deciding in its place, both
+   * including a leading !. by is the rule itself when nothing decides
+   */
+  unsigned int rule;
+  unsigned int by;
+  UrlBlacklistRedundancy reason;
+} UrlBlacklistRedundant;
+
+/**
+ * Probe lengths UrlBlacklistStats keeps apart, longer ones share the last
+ */
+#define URL_BLACKLIST_PROBE_BUCKETS 16
+#define URL_BLACKLIST_WORST_EDGES 5
+
+/**
+ * Sizes of the tables of a UrlBlacklist and how well its edge table is
+ * spread
+ */
+typedef struct UrlBlacklistStats
+{
+  /**
+   * Bytes of each table, file includes the rules added at runtime
+   */
+  size_t file_bytes;
+  size_t node_bytes;
+  size_t edge_bytes;
+  size_t filter_bytes;
+  size_t glob_bytes;
+  size_t path_bytes;
+  size_t address_bytes;
+
+  unsigned int edges;
+  unsigned int edge_slots;
+  /**
+   * Edges by the slots a lookup for them reads, probes[0] counts edges in
+   * their home slot
+   */
+  unsigned int probes[URL_BLACKLIST_PROBE_BUCKETS];
+  double mean_probes;
+  /**
+   * Slots a lookup for a missing edge reads, over every home slot
+   */
+  double miss_probes;
+  /**
+   * Longest run of occupied slots, every miss hashed into it reads on to
+   * its end
+   */
+  unsigned int longest_run;
+  unsigned int longest_run_start;
+  /**
+   * Slots of the edges that take the most probes, worst first
+   */
+  unsigned int worst_edges[URL_BLACKLIST_WORST_EDGES];
+  unsigned int worst_probes[URL_BLACKLIST_WORST_EDGES];
+} UrlBlacklistStats;
+
+/**
+ * Create a new UrlBlacklist, tables are sized from the number of lines
+ *
+ * Files starting with URL_BLACKLIST_IMAGE_MAGIC are compiled images and are
+ * used without parsing, delim is ignored for them
  *
  * @param filename The name of the file to read from
  * @param delim The delimiter character
- * @param table_size_2 The size of the table to use (2^table_size_2)
- *
- * 20 -> 1MB
  */
-UrlBlacklist *UrlBlacklist_new(UrlBlacklist *cds, char *filename, const char delim, u_int8_t table_size_2);
+UrlBlacklist *UrlBlacklist_new(UrlBlacklist *cds, char *filename, const char delim);
 void UrlBlacklist_free(UrlBlacklist *cds);
 
+/**
+ * Write a compiled image of bl, replaces filename atomically
+ *
+ * Returns 0 on success, -1 on failure
+ */
+int UrlBlacklist_save(UrlBlacklist *bl, char *filename);
+
+/**
+ * Apply one change, "+rule" adds a rule and "-rule" removes one, rule being
+ * a domain without wildcards or paths optionally starting with !. Address
+ * rules only change on load
+ *
+ * Lookups on other threads may run concurrently, changes must come from
+ * one thread at a time. Nothing readers use is moved or freed
+ *
+ * Returns 0 on success, -1 for a malformed change or a rule that is not
+ * there, 1 when bl has no room left and has to be rebuilt with the change
+ * replayed
+ */
+int UrlBlacklist_apply(UrlBlacklist *bl, char *change);
+
+/**
+ * Whether UrlBlacklist_apply would take change, without applying it
+ *
+ * Returns 0 when it would, -1 for a malformed change or a rule that is not
+ * there
+ */
+int UrlBlacklist_check(UrlBlacklist *bl, char *change);
+
+/**
+ * Whether bl is the way change leaves it: the rule is there after a
+ * "+rule", gone after a "-rule". Lists under bl are not looked at
+ */
+char UrlBlacklist_in_effect(UrlBlacklist *bl, char *change);
+
+/**
+ * Apply every change in filename, one per line, to a bl no other thread
+ * uses yet. Tables grow as needed
+ *
+ * With compact set filename is then replaced by one change for every rule
+ * that ended up different, changes that could not be applied are dropped
+ *
+ * Returns the number of changes applied, 0 when the file does not exist
+ */
+int UrlBlacklist_replay(UrlBlacklist *bl, char *filename, char compact);
+
 char *UrlBlacklist_exists(UrlBlacklist *cds, char *url);
+
+/**
+ * Like UrlBlacklist_exists for a request of path on url, rules for paths of
+ * the domain and its parents count too. The deepest domain still decides,
+ * a path rule beats the rule of its own domain
+ *
+ * A plain path matches whole segments, example.com/ads matches /ads and
+ * /ads/banner.gif but not /adserver. A path with * or ? matches from the
+ * start of the path, * being any run of characters. The longest rule that
+ * matches wins
+ *
+ * @param path Starts with / and may have a query, NULL for none
+ * @param paths Set when a domain of url has path rules, otherwise the
+ * verdict holds for every path. May be NULL
+ *
+ * A blacklist with a base decides what it has rules for, the base the rest
+ */
+char *UrlBlacklist_exists_path(UrlBlacklist *bl, char *url, char *path, char *paths);
+
+/**
+ * Like UrlBlacklist_exists_path on bl alone, without its base. Returns the
+ * rule entry that decides including a leading !, NULL when bl has none.
+ * whitelist_local is left to the caller
+ */
+char *UrlBlacklist_find_path(UrlBlacklist *bl, char *url, char *path, char *paths);
+
+/**
+ * UrlBlacklist_exists for count urls, results[i] is the rule for urls[i].
+ * Lookups are interleaved URL_BLACKLIST_BATCH at a time so the cache
+ * misses of one overlap with the others
+ */
+void UrlBlacklist_exists_batch(UrlBlacklist *bl, char **urls, unsigned int count, char **results);
+
+/**
+ * Rule of the longest network address is in, NULL when there is none or
+ * it is whitelisted. For the addresses a hostname resolved to, a url that
+ * is an address is looked up like this by UrlBlacklist_exists
+ */
+char *UrlBlacklist_exists_address(UrlBlacklist *bl, const struct sockaddr *address);
+
+/**
+ * The list under bl, bl included, that rule is one of the rules of, NULL
+ * when none is
+ */
+UrlBlacklist *UrlBlacklist_layer(UrlBlacklist *bl, const char *rule);
 char *UrlBlacklist_get_rule(UrlBlacklist *cds, char *url);
+
+/**
+ * Length of host in one pass, 16 bytes at a time with SSE2. With lower set
+ * host is lowercased on the way, bit i of dots is set for a . at host[i]
+ * when dots is not NULL
+ *
+ * @param dots URL_BLACKLIST_HOST_MAX bits, boundaries past them are not set
+ */
+unsigned int UrlBlacklist_scan_host(char *host, char lower, u_int64_t *dots);
+
+/**
+ * File offsets of the rules of bl in file order, including a leading !, in
+ * *offsets which the caller frees. Rules added at runtime are not included
+ *
+ * Returns the number of rules, -1 when out of memory
+ */
+int UrlBlacklist_rule_offsets(UrlBlacklist *bl, unsigned int **offsets);
 void UrlBlacklist_print_table(UrlBlacklist *bl);
 
+/**
+ * Rules of the file of bl that can be left out without changing what any
+ * lookup decides, in file order. Dropping all of them at once is safe too.
+ * Domain rules are checked against their parents and the wildcard rules,
+ * wildcard rules only for duplicates. Path and address rules are kept
+ *
+ * @param alone Nothing is layered under bl, so a host without a rule is as
+ * good as whitelisted
+ *
+ * Returns the number of rules in *redundant which the caller frees, -1 when
+ * out of memory
+ */
+int UrlBlacklist_redundant(UrlBlacklist *bl, char alone, UrlBlacklistRedundant **redundant);
+
+/**
+ * Walks every edge slot, for benchmarks and diagnostics on a list nothing
+ * changes at the same time
+ */
+void UrlBlacklist_stats(UrlBlacklist *bl, UrlBlacklistStats *stats);
+void UrlBlacklist_print_stats(UrlBlacklist *bl);
+
+/**
+ * Match a null terminated str against a rule glob of glob_len characters
+ */
+char _glob_match(char *str, char *glob, unsigned const int glob_len);
+
 #endif
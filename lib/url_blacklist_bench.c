@@ -0,0 +1,501 @@
+/*
+ * url_blacklist_bench.c
+ *
+ * Loads blacklists, real and synthetic, and measures load time, memory,
+ * lookup latency and throughput on a corpus of hits, misses and deep
+ * subdomains, then prints how the edge table is spread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <ctype.h>
+#include "url_blacklist.h"
+
+#define MAX_LISTS 16
+#define HOST_SIZE 128
+
+static const char *tlds[] = {"com", "com", "com", "com", "net", "net", "org", "io", "de", "ru", "info", "xyz", "top", "co.uk", "com.br", "cn"};
+static const char *prefixes[] = {"www", "ads", "cdn", "static", "track", "metrics", "img", "api", "m", "pixel"};
+
+#define COUNT(array) (sizeof(array) / sizeof(*array))
+
+static u_int64_t next(u_int64_t *state)
+{
+  // xorshift64
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+static char *random_label(char *out, u_int64_t *state)
+{
+  static const char letters[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+  unsigned int length = 4 + next(state) % 11;
+
+  for (unsigned int i = 0; i < length; i++)
+    out[i] = letters[next(state) % (sizeof(letters) - 1)];
+  out[length] = '\0';
+
+  return out + length;
+}
+
+static double now_ns(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+
+  return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+/**
+ * Resident memory of the process in bytes
+ */
+static size_t resident(void)
+{
+  unsigned long pages = 0, rss = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+
+  if (file)
+  {
+    if (fscanf(file, "%lu %lu", &pages, &rss) != 2)
+      rss = 0;
+    fclose(file);
+  }
+
+  return rss * sysconf(_SC_PAGESIZE);
+}
+
+static size_t parse_count(char *text)
+{
+  char *end;
+  size_t count = strtoul(text, &end, 10);
+
+  if (*end == 'K' || *end == 'k')
+    count *= 1000;
+  else if (*end == 'M' || *end == 'm')
+    count *= 1000000;
+
+  return count;
+}
+
+/**
+ * A list shaped like the public ones: registrable domains under common
+ * TLDs, some with a tracking subdomain, a few in hosts format,
+ * whitelisted or commented
+ */
+static char *synthetic(size_t count)
+{
+  static char filename[64];
+  snprintf(filename, sizeof(filename), "url_blacklist_bench.%zu.txt", count);
+
+  FILE *file = fopen(filename, "w");
+  if (!file)
+    return NULL;
+
+  u_int64_t state = 0x2545f4914f6cdd1dull ^ count;
+  char line[HOST_SIZE + 32];
+
+  for (size_t i = 0; i < count; i++)
+  {
+    u_int64_t shape = next(&state) % 100;
+    char *tail = line;
+
+    if (shape < 1)
+    {
+      fputs("# section\n", file);
+      continue;
+    }
+
+    if (shape < 10)
+      tail += sprintf(tail, "0.0.0.0 ");
+    else if (shape < 12)
+      *tail++ = '!';
+
+    if (shape >= 70)
+      tail += sprintf(tail, "%s.", prefixes[next(&state) % COUNT(prefixes)]);
+
+    tail = random_label(tail, &state);
+    sprintf(tail, ".%s\n", tlds[next(&state) % COUNT(tlds)]);
+    fputs(line, file);
+  }
+
+  fclose(file);
+
+  return filename;
+}
+
+typedef struct Corpus
+{
+  char **hosts;
+  char *pool;
+  size_t count;
+} Corpus;
+
+/**
+ * Hostnames for count lookups: rule domains as they are, under a
+ * subdomain or far below one, rule domains with a letter changed and
+ * random domains nothing blocks
+ */
+static char corpus_new(Corpus *corpus, char *filename, size_t count)
+{
+  FILE *file = fopen(filename, "r");
+  if (!file)
+    return 0;
+
+  size_t domain_count = 0, domain_capacity = 1 << 16;
+  char **domains = malloc(domain_capacity * sizeof(*domains));
+  char *line = NULL;
+  size_t line_size = 0;
+
+  while (domains && getline(&line, &line_size, file) > 0)
+  {
+    char *start = line + strspn(line, " \t");
+    char *space = strpbrk(start, " \t");
+
+    if (space && space[1] != '#')
+      start = space + 1;
+    start[strcspn(start, " \t\r\n#")] = '\0';
+    start += *start == '!';
+
+    // domains of plain rules only, others match too many or few hosts
+    if (!*start || strlen(start) >= HOST_SIZE - 32 || strpbrk(start, "*?/:"))
+      continue;
+
+    if (domain_count == domain_capacity)
+      domains = realloc(domains, (domain_capacity *= 2) * sizeof(*domains));
+    if (domains)
+      domains[domain_count++] = strdup(start);
+  }
+
+  free(line);
+  fclose(file);
+
+  corpus->hosts = malloc(count * sizeof(*corpus->hosts));
+  corpus->pool = malloc(count * HOST_SIZE);
+  corpus->count = count;
+
+  if (!domains || !corpus->hosts || !corpus->pool)
+    return 0;
+
+  u_int64_t state = 88172645463325252ull;
+  for (size_t i = 0; i < count; i++)
+  {
+    char *host = corpus->pool + i * HOST_SIZE, *tail = host;
+    char *domain = domain_count ? domains[next(&state) % domain_count] : "example.com";
+    u_int64_t shape = next(&state) % 100;
+
+    if (shape < 30)
+    {
+      strcpy(host, domain);
+    }
+    else if (shape < 50)
+    {
+      sprintf(host, "%s.%s", prefixes[next(&state) % COUNT(prefixes)], domain);
+    }
+    else if (shape < 60)
+    {
+      for (unsigned int labels = 4 + next(&state) % 6; labels; labels--)
+        tail += sprintf(tail, "%s.", prefixes[next(&state) % COUNT(prefixes)]);
+      strcpy(tail, domain);
+    }
+    else if (shape < 70)
+    {
+      strcpy(host, domain);
+      host[next(&state) % strlen(host)] ^= 0x20;
+    }
+    else
+    {
+      if (shape >= 90)
+        tail += sprintf(tail, "%s.", prefixes[next(&state) % COUNT(prefixes)]);
+      tail = random_label(tail, &state);
+      sprintf(tail, ".%s", tlds[next(&state) % COUNT(tlds)]);
+    }
+
+    corpus->hosts[i] = host;
+  }
+
+  for (size_t i = 0; i < domain_count; i++)
+    free(domains[i]);
+  free(domains);
+
+  return 1;
+}
+
+static void corpus_free(Corpus *corpus)
+{
+  free(corpus->hosts);
+  free(corpus->pool);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Every lookup timed on its own, less what reading the clock costs
+ */
+static void latency(UrlBlacklist *bl, Corpus *corpus)
+{
+  double *times = malloc(corpus->count * sizeof(*times));
+  if (!times)
+    return;
+
+  double overhead = now_ns();
+  for (unsigned int i = 0; i < 1000; i++)
+    now_ns();
+  overhead = (now_ns() - overhead) / 1001;
+
+  size_t blocked = 0;
+  for (size_t i = 0; i < corpus->count; i++)
+  {
+    double start = now_ns();
+    blocked += !!UrlBlacklist_exists(bl, corpus->hosts[i]);
+    times[i] = now_ns() - start - overhead;
+  }
+
+  qsort(times, corpus->count, sizeof(*times), compare_double);
+
+  double percentiles[] = {0.5, 0.9, 0.99, 0.999};
+  printf("latency: %zu lookups, %.1f%% blocked, ns", corpus->count, 100.0 * blocked / corpus->count);
+  for (unsigned int i = 0; i < COUNT(percentiles); i++)
+    printf(" p%g %.0f", percentiles[i] * 100, times[(size_t)(percentiles[i] * (corpus->count - 1))]);
+  printf(" max %.0f\n", times[corpus->count - 1]);
+
+  free(times);
+}
+
+/**
+ * Lowercasing the corpus and finding its labels in one vector pass and a
+ * byte at a time, then matching it against cache purge globs
+ */
+static void hosts(Corpus *corpus)
+{
+  // few enough hosts to stay cached, the lookups measure memory already
+  size_t mask = 4095;
+  static const char *globs[] = {"*.com\n", "*cdn*.*\n", "track*.*.net\n", "*z\n"};
+  char host[HOST_SIZE];
+  u_int64_t dots[URL_BLACKLIST_HOST_MAX / 64];
+  size_t checksum = 0, matched = 0;
+
+  double start = now_ns();
+  for (size_t i = 0; i < corpus->count; i++)
+  {
+    memcpy(host, corpus->hosts[i & mask], HOST_SIZE);
+    checksum += UrlBlacklist_scan_host(host, 1, dots) + __builtin_popcountll(dots[0] | dots[1]);
+  }
+  double vector = (now_ns() - start) / corpus->count;
+
+  start = now_ns();
+  for (size_t i = 0; i < corpus->count; i++)
+  {
+    memcpy(host, corpus->hosts[i & mask], HOST_SIZE);
+
+    char *p = host;
+    for (; *p; p++)
+    {
+      *p = tolower((unsigned char)*p);
+      checksum += *p == '.';
+    }
+    checksum += p - host;
+  }
+  double bytes = (now_ns() - start) / corpus->count;
+
+  start = now_ns();
+  for (size_t i = 0; i < corpus->count; i++)
+  {
+    for (unsigned int j = 0; j < COUNT(globs); j++)
+      matched += _glob_match(corpus->hosts[i & mask], (char *)globs[j], strlen(globs[j]) - 1);
+  }
+  double glob = (now_ns() - start) / (corpus->count * COUNT(globs));
+
+  printf("hosts: %.1f ns to lowercase and split, %.1f ns a byte at a time, %.1f ns per purge glob, %zu matched (%zu)\n",
+         vector, bytes, glob, matched, checksum);
+}
+
+typedef struct BenchArg
+{
+  pthread_t thread_id;
+  UrlBlacklist *bl;
+  char **hosts;
+  size_t count;
+  char batched;
+  size_t blocked;
+} BenchArg;
+
+static void *bench_thread(BenchArg *arg)
+{
+  if (arg->batched)
+  {
+    char *results[URL_BLACKLIST_BATCH];
+
+    for (size_t i = 0; i < arg->count; i += URL_BLACKLIST_BATCH)
+    {
+      unsigned int count = arg->count - i < URL_BLACKLIST_BATCH ? arg->count - i : URL_BLACKLIST_BATCH;
+      UrlBlacklist_exists_batch(arg->bl, arg->hosts + i, count, results);
+
+      for (unsigned int j = 0; j < count; j++)
+        arg->blocked += !!results[j];
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i < arg->count; i++)
+      arg->blocked += !!UrlBlacklist_exists(arg->bl, arg->hosts[i]);
+  }
+
+  return NULL;
+}
+
+/**
+ * Lookups per second with the corpus split between threads
+ */
+static double throughput(UrlBlacklist *bl, Corpus *corpus, long threads, char batched)
+{
+  BenchArg args[threads];
+  size_t share = corpus->count / threads;
+
+  double start = now_ns();
+  for (long i = 0; i < threads; i++)
+  {
+    args[i] = (BenchArg){0, bl, corpus->hosts + i * share, i == threads - 1 ? corpus->count - i * share : share, batched, 0};
+    pthread_create(&args[i].thread_id, NULL, (void *(*)(void *))bench_thread, &args[i]);
+  }
+
+  for (long i = 0; i < threads; i++)
+    pthread_join(args[i].thread_id, NULL);
+
+  return corpus->count / ((now_ns() - start) / 1e9);
+}
+
+static void bench(char *filename, size_t lookups, long max_threads)
+{
+  UrlBlacklist bl;
+
+  printf("\n== %s\n", filename);
+
+  size_t before = resident();
+  double start = now_ns();
+  if (!UrlBlacklist_new(&bl, filename, '\n'))
+  {
+    printf("could not load %s\n", filename);
+    return;
+  }
+  double text_ms = (now_ns() - start) / 1e6;
+  size_t text_resident = resident() - before;
+
+  UrlBlacklistStats stats;
+  UrlBlacklist_stats(&bl, &stats);
+  size_t tables = stats.file_bytes + stats.node_bytes + stats.edge_bytes + stats.filter_bytes + stats.glob_bytes + stats.path_bytes + stats.address_bytes;
+
+  // images open without parsing
+  double image_ms = -1;
+  UrlBlacklist image;
+  if (!UrlBlacklist_save(&bl, "url_blacklist_bench.img"))
+  {
+    start = now_ns();
+    if (UrlBlacklist_new(&image, "url_blacklist_bench.img", 0))
+    {
+      image_ms = (now_ns() - start) / 1e6;
+      UrlBlacklist_free(&image);
+    }
+    unlink("url_blacklist_bench.img");
+  }
+
+  printf("load: %.1f ms from text, %.3f ms from an image, %.1f MiB of tables, %.1f MiB resident\n",
+         text_ms, image_ms, tables / 1048576.0, text_resident / 1048576.0);
+
+  Corpus corpus;
+  if (!corpus_new(&corpus, filename, lookups))
+  {
+    printf("could not build a corpus from %s\n", filename);
+    UrlBlacklist_free(&bl);
+    return;
+  }
+
+  // once to warm up, as the proxy would be
+  throughput(&bl, &corpus, 1, 0);
+  latency(&bl, &corpus);
+  hosts(&corpus);
+
+  for (long threads = 1; threads <= max_threads; threads = threads < max_threads && threads * 2 > max_threads ? max_threads : threads * 2)
+  {
+    printf("%2ld threads: %6.2f M lookups/s, %6.2f M batched\n", threads,
+           throughput(&bl, &corpus, threads, 0) / 1e6, throughput(&bl, &corpus, threads, 1) / 1e6);
+
+    if (threads == max_threads)
+      break;
+  }
+
+  UrlBlacklist_print_stats(&bl);
+
+  corpus_free(&corpus);
+  UrlBlacklist_free(&bl);
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-j threads] [-n lookups] [-s rules]... [blacklist]...\n", name);
+  fprintf(stderr, "  counts accept K and M suffixes, default ../blacklist.txt and a synthetic 1M list\n");
+  exit(1);
+}
+
+int main(int argc, char **argv)
+{
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t lookups = 1000000;
+  size_t sizes[MAX_LISTS];
+  unsigned int size_count = 0;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:n:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'n':
+      lookups = parse_count(optarg);
+      break;
+    case 's':
+      if (size_count < MAX_LISTS)
+        sizes[size_count++] = parse_count(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+
+  if (threads < 1 || !lookups)
+    usage(argv[0]);
+
+  if (optind == argc && !size_count)
+  {
+    bench("../blacklist.txt", lookups, threads);
+    sizes[size_count++] = 1000000;
+  }
+
+  for (int i = optind; i < argc; i++)
+    bench(argv[i], lookups, threads);
+
+  for (unsigned int i = 0; i < size_count; i++)
+  {
+    char *filename = synthetic(sizes[i]);
+    if (!filename)
+    {
+      perror("url_blacklist_bench");
+      return 1;
+    }
+
+    bench(filename, lookups, threads);
+    unlink(filename);
+  }
+
+  return 0;
+}
@@ -1,11 +1,1274 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 #include "url_blacklist.h"
 
+typedef struct Rule
+{
+  char *text;
+  unsigned int length;
+  /**
+   * Rule in the file including a leading !
+   */
+  char *entry;
+  unsigned int line;
+} Rule;
+
+static Rule *rules;
+static unsigned int rule_count;
+static Rule *globs;
+static unsigned int glob_count;
+
+static int rule_compare(const void *a, const void *b)
+{
+  const Rule *x = a, *y = b;
+  int order = memcmp(x->text, y->text, x->length < y->length ? x->length : y->length);
+
+  if (order)
+    return order;
+  if (x->length != y->length)
+    return x->length < y->length ? -1 : 1;
+
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+/**
+ * Every rule without a wildcard sorted by text then line, and the wildcard
+ * rules in file order
+ */
+static void reference_load(UrlBlacklist *bl)
+{
+  rules = malloc(bl->file_size * sizeof(*rules));
+  rule_count = 0;
+  globs = malloc(bl->file_size * sizeof(*globs));
+  glob_count = 0;
+
+  char *end = bl->file + bl->file_size;
+  unsigned int line = 0;
+
+  for (char *start = bl->file, *delim; start < end && (delim = memchr(start, bl->delim, end - start)); start = delim + 1, line++)
+  {
+    char *text = start;
+    while (text < delim && (*text == ' ' || *text == '\t'))
+      text++;
+
+    if (text == delim || *start == '#')
+      continue;
+
+    char *space = memchr(start, ' ', 16);
+    if (space && space + 1 < delim && space[1] != '#')
+      start = space + 1;
+
+    text = start + (*start == '!');
+    char *text_end = text;
+    while (text_end < delim && *text_end != ' ' && *text_end != '\t' && *text_end != '\r')
+      text_end++;
+
+    if (memchr(text, '*', text_end - text))
+      globs[glob_count++] = (Rule){text, text_end - text, start, line};
+    else
+      rules[rule_count++] = (Rule){text, text_end - text, start, line};
+  }
+
+  qsort(rules, rule_count, sizeof(*rules), rule_compare);
+}
+
+/**
+ * * matches any run of characters inside one label
+ */
+static int label_match(char *glob, char *glob_end, char *str, char *str_end)
+{
+  if (glob == glob_end)
+    return str == str_end;
+
+  if (*glob == '*')
+    return label_match(glob + 1, glob_end, str, str_end) || (str < str_end && label_match(glob, glob_end, str + 1, str_end));
+
+  return str < str_end && *glob == *str && label_match(glob + 1, glob_end, str + 1, str_end);
+}
+
+/**
+ * Try every wildcard rule against the labels at the end of the host. Fewer
+ * labels win, then fewer literal labels counting from the left, then the
+ * earlier line. A repeated rule only counts at its last line
+ */
+static char *reference_globs(char *host)
+{
+  Rule *best = NULL;
+  unsigned int best_labels = 0;
+  unsigned long long best_mask = 0;
+
+  char *host_end = host + strlen(host);
+
+  for (Rule *glob = globs; glob < globs + glob_count; glob++)
+  {
+    char repeated = 0;
+    for (Rule *later = glob + 1; later < globs + glob_count; later++)
+      repeated |= later->length == glob->length && !memcmp(later->text, glob->text, glob->length);
+
+    if (repeated)
+      continue;
+
+    // walk the labels of both from the right
+    char *glob_label_end = glob->text + glob->length;
+    char *host_label_end = host_end;
+    unsigned int labels = 0;
+    unsigned long long mask = 0;
+    char matched = 1;
+
+    for (;;)
+    {
+      char *glob_label = glob_label_end;
+      while (glob_label > glob->text && glob_label[-1] != '.')
+        glob_label--;
+
+      char *host_label = host_label_end;
+      while (host_label > host && host_label[-1] != '.')
+        host_label--;
+
+      char literal = !memchr(glob_label, '*', glob_label_end - glob_label);
+      mask |= (unsigned long long)literal << labels++;
+
+      if (!label_match(glob_label, glob_label_end, host_label, host_label_end))
+      {
+        matched = 0;
+        break;
+      }
+
+      if (glob_label == glob->text)
+        break;
+
+      // the rule has more labels than the host
+      if (host_label == host)
+      {
+        matched = 0;
+        break;
+      }
+
+      glob_label_end = glob_label - 1;
+      host_label_end = host_label - 1;
+    }
+
+    if (!matched)
+      continue;
+
+    if (!best || labels < best_labels || (labels == best_labels && mask < best_mask))
+    {
+      best = glob;
+      best_labels = labels;
+      best_mask = mask;
+    }
+  }
+
+  return best ? best->entry : NULL;
+}
+
+/**
+ * The host or its closest parent domain with a rule, the last line wins
+ */
+static char *reference_exists(UrlBlacklist *bl, char *host)
+{
+  for (char *suffix = host;; suffix++)
+  {
+    Rule key = {suffix, strlen(suffix), NULL, -1};
+    unsigned int low = 0, high = rule_count;
+
+    // first rule greater than the key, the one before is the last line
+    while (low < high)
+    {
+      unsigned int mid = (low + high) / 2;
+      if (rule_compare(&rules[mid], &key) < 0)
+        low = mid + 1;
+      else
+        high = mid;
+    }
+
+    if (low && rules[low - 1].length == key.length && !memcmp(rules[low - 1].text, suffix, key.length))
+      return *rules[low - 1].entry == '!' ? NULL : rules[low - 1].entry;
+
+    if (!(suffix = strchr(suffix, '.')))
+      break;
+  }
+
+  char *glob = reference_globs(host);
+
+  return glob && *glob != '!' ? glob : NULL;
+}
+
+static char *vocabulary[] = {"www", "sex", "sexy", "porn", "prn", "google", "test", "testing", "w3", "a", "com", "net", "xxx", "c", "edu", "gg", "discord", ""};
+
+#define VOCABULARY (sizeof(vocabulary) / sizeof(*vocabulary))
+
+/**
+ * Compare the reference and real lookup for one host, prints the first few
+ * differences
+ */
+static int compare(UrlBlacklist *bl, char *host)
+{
+  static int reported;
+
+  char *expected = reference_exists(bl, host);
+  char *actual = UrlBlacklist_exists(bl, host);
+
+  if (expected == actual)
+    return 0;
+
+  if (reported++ < 10)
+    printf("mismatch for %s: %p != %p\n", host, (void *)expected, (void *)actual);
+
+  return 1;
+}
+
+/**
+ * Every host of the corpus, its parent, a subdomain and a deep subdomain
+ * plus random hosts made of labels the rules care about
+ */
+static unsigned long differential(UrlBlacklist *bl, char *corpus)
+{
+  unsigned long failures = 0, checked = 0;
+  char host[512];
+
+  reference_load(bl);
+
+  FILE *file = fopen(corpus, "r");
+  char *line = NULL;
+  size_t line_size = 0;
+
+  while (file && getline(&line, &line_size, file) > 0)
+  {
+    char *start = strchr(line, ' ');
+    start = start ? start + 1 : line;
+    start[strcspn(start, "\r\n")] = '\0';
+
+    if (*start == '#' || !*start || strlen(start) > 256)
+      continue;
+
+    char *dot = strchr(start, '.');
+
+    failures += compare(bl, start);
+    failures += dot && compare(bl, dot + 1);
+    snprintf(host, sizeof(host), "www.%s", start);
+    failures += compare(bl, host);
+    snprintf(host, sizeof(host), "a.b.c.d.%s", start);
+    failures += compare(bl, host);
+    checked += 3 + !!dot;
+  }
+
+  free(line);
+  if (file)
+    fclose(file);
+
+  srand(1);
+  for (int i = 0; i < 200000; i++)
+  {
+    char *tail = host;
+    int labels = 1 + rand() % 10;
+
+    for (int j = 0; j < labels; j++)
+      tail += sprintf(tail, "%s%s", j ? "." : "", vocabulary[rand() % VOCABULARY]);
+
+    failures += compare(bl, host);
+    checked++;
+  }
+
+  printf("%s: %lu hosts, %lu mismatches\n", corpus, checked, failures);
+
+  free(rules);
+  free(globs);
+
+  return failures;
+}
+
+/**
+ * Compile bl, load the image back and run the same comparison on it
+ */
+static unsigned long image_differential(UrlBlacklist *bl)
+{
+  UrlBlacklist image;
+
+  if (UrlBlacklist_save(bl, "url_blacklist_test.img") || !UrlBlacklist_new(&image, "url_blacklist_test.img", 0))
+  {
+    printf("image round trip failed\n");
+    return 1;
+  }
+
+  unlink("url_blacklist_test.img");
+
+  printf("image: %zu bytes, %u of %u rule bytes kept\n", image.image_size, image.file_size, bl->file_size);
+  unsigned long failures = !image.image + differential(&image, "../blacklist.txt");
+
+  UrlBlacklist_free(&image);
+
+  return failures;
+}
+
+/**
+ * Whether a and b block host with the same rule text
+ */
+static int same_verdict(UrlBlacklist *a, UrlBlacklist *b, char *host)
+{
+  char *x = UrlBlacklist_exists(a, host);
+  char *y = UrlBlacklist_exists(b, host);
+
+  if (!x || !y)
+    return !x == !y;
+
+  size_t length = strchr(x, a->delim) - x;
+
+  return length == strchr(y, b->delim) - y && !memcmp(x, y, length);
+}
+
+#define CHANGES 60000
+#define CHANGE_LOG "url_blacklist_test.changes"
+
+static char *bulk_host(char *host, int i, const char *prefix)
+{
+  sprintf(host, "%shost%d.bulk%d.example", prefix, i, i % 97);
+  return host;
+}
+
+/**
+ * Every bulk host, its subdomains, and random vocabulary hosts
+ */
+static unsigned long equivalent(UrlBlacklist *a, UrlBlacklist *b)
+{
+  unsigned long failures = 0;
+  char host[512];
+
+  for (int i = 0; i < CHANGES; i++)
+  {
+    failures += !same_verdict(a, b, bulk_host(host, i, ""));
+    failures += !same_verdict(a, b, bulk_host(host, i, "www."));
+  }
+
+  srand(2);
+  for (int i = 0; i < 100000; i++)
+  {
+    char *tail = host;
+    int labels = 1 + rand() % 6;
+
+    for (int j = 0; j < labels; j++)
+      tail += sprintf(tail, "%s%s", j ? "." : "", vocabulary[rand() % VOCABULARY]);
+
+    failures += !same_verdict(a, b, host);
+  }
+
+  failures += !same_verdict(a, b, "0310love.com");
+  failures += !same_verdict(a, b, "blocked.example");
+
+  return failures;
+}
+
+typedef struct Reader
+{
+  UrlBlacklist *bl;
+  int stop;
+  unsigned long lookups;
+  unsigned long wrong;
+} Reader;
+
+/**
+ * Bulk hosts are either unblocked or blocked by their own rule while
+ * changes land, rules nobody touches stay
+ */
+static void *reader(Reader *reader)
+{
+  char host[512];
+
+  while (!__atomic_load_n(&reader->stop, __ATOMIC_RELAXED))
+  {
+    int i = rand() % CHANGES;
+    char *rule = UrlBlacklist_exists(reader->bl, bulk_host(host, i, "www."));
+
+    reader->wrong += rule && memcmp(rule, host + 4, strlen(host + 4));
+    reader->wrong += !UrlBlacklist_exists(reader->bl, "0006666.net");
+    reader->lookups++;
+  }
+
+  return NULL;
+}
+
+/**
+ * Changes applied in place while another thread looks up, rebuilt with
+ * the change log when there is no room, then replayed from scratch and
+ * saved must all answer the same
+ */
+static unsigned long incremental(void)
+{
+  unsigned long failures = 0;
+  char host[512], change[512];
+
+  unlink(CHANGE_LOG);
+
+  UrlBlacklist *live = malloc(sizeof(*live));
+  UrlBlacklist_new(live, "../blacklist.txt", '\n');
+
+  // a domain the filter doesn't know turns it off
+  unsigned int generation = live->generation;
+  failures += !live->filtered;
+  failures += UrlBlacklist_apply(live, "+blocked.example\n");
+  failures += live->generation == generation || live->filtered;
+  failures += !UrlBlacklist_exists(live, "a.blocked.example");
+  failures += UrlBlacklist_apply(live, "+!a.blocked.example");
+  failures += UrlBlacklist_exists(live, "b.a.blocked.example") || !UrlBlacklist_exists(live, "b.blocked.example");
+  failures += UrlBlacklist_apply(live, "-!a.blocked.example");
+  failures += !UrlBlacklist_exists(live, "a.blocked.example");
+  failures += UrlBlacklist_apply(live, "-blocked.example");
+  failures += !!UrlBlacklist_exists(live, "a.blocked.example");
+
+  // from the file
+  failures += !UrlBlacklist_exists(live, "0310love.com") || UrlBlacklist_apply(live, "-0310love.com");
+  failures += !!UrlBlacklist_exists(live, "0310love.com");
+
+  // malformed, missing or wildcard
+  generation = live->generation;
+  failures += UrlBlacklist_apply(live, "-blocked.example") != -1;
+  failures += UrlBlacklist_apply(live, "-!0006666.net") != -1;
+  failures += UrlBlacklist_apply(live, "+*.wild.example") != -1;
+  failures += UrlBlacklist_apply(live, "blocked.example") != -1;
+  failures += UrlBlacklist_apply(live, "+") != -1 || UrlBlacklist_apply(live, "+!") != -1;
+  failures += live->generation != generation;
+
+  // checked without being applied
+  failures += UrlBlacklist_check(live, "+blocked.example") || UrlBlacklist_check(live, "-0006666.net");
+  failures += UrlBlacklist_check(live, "-blocked.example") != -1 || UrlBlacklist_check(live, "+*.wild.example") != -1;
+  failures += UrlBlacklist_in_effect(live, "+blocked.example") || !UrlBlacklist_in_effect(live, "-blocked.example");
+  failures += !UrlBlacklist_in_effect(live, "+0006666.net") || UrlBlacklist_in_effect(live, "+!0006666.net");
+  failures += live->generation != generation;
+
+  printf("incremental basics: %lu failures\n", failures);
+
+  FILE *log = fopen(CHANGE_LOG, "w");
+  fputs("-0310love.com\n", log);
+
+  Reader state = {live};
+  pthread_t reader_pt;
+  pthread_create(&reader_pt, NULL, (void *(*)(void *))reader, &state);
+
+  int rebuilds = 0;
+  for (int i = 0; i < CHANGES; i++)
+  {
+    // every tenth host is removed again a little later
+    if (i % 10 == 9)
+      sprintf(change, "-%s\n", bulk_host(host, i - 5, ""));
+    else
+      sprintf(change, "+%s\n", bulk_host(host, i, ""));
+
+    int status = UrlBlacklist_apply(live, change);
+    if (status < 0)
+    {
+      failures++;
+      continue;
+    }
+
+    fputs(change, log);
+    if (!status)
+      continue;
+
+    // the way the proxy does it, without readers on the old list
+    fflush(log);
+    __atomic_store_n(&state.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(reader_pt, NULL);
+
+    UrlBlacklist *next = malloc(sizeof(*next));
+    UrlBlacklist_new(next, "../blacklist.txt", '\n');
+    UrlBlacklist_replay(next, CHANGE_LOG, 0);
+    UrlBlacklist_free(live);
+    free(live);
+    live = next;
+    rebuilds++;
+
+    state.bl = live;
+    state.stop = 0;
+    pthread_create(&reader_pt, NULL, (void *(*)(void *))reader, &state);
+  }
+
+  __atomic_store_n(&state.stop, 1, __ATOMIC_RELAXED);
+  pthread_join(reader_pt, NULL);
+  fclose(log);
+
+  for (int i = 0; i < CHANGES; i++)
+  {
+    // the ninth ones are never added
+    char blocked = i % 10 != 4 && i % 10 != 9;
+    failures += (UrlBlacklist_exists(live, bulk_host(host, i, "www.")) == NULL) == blocked;
+  }
+
+  printf("%d changes, %d rebuilds, %lu concurrent lookups, %lu wrong\n", CHANGES, rebuilds, state.lookups, state.wrong);
+  failures += state.wrong + !rebuilds;
+
+  UrlBlacklist replayed;
+  UrlBlacklist_new(&replayed, "../blacklist.txt", '\n');
+  failures += UrlBlacklist_replay(&replayed, CHANGE_LOG, 0) != CHANGES + 1;
+  failures += !replayed.filtered;
+  failures += equivalent(live, &replayed);
+
+  // an image has no room, it is rebuilt with the change log
+  UrlBlacklist image;
+  failures += UrlBlacklist_save(live, "url_blacklist_test.img") || !UrlBlacklist_new(&image, "url_blacklist_test.img", 0);
+  failures += equivalent(live, &image);
+  failures += UrlBlacklist_apply(&image, "+blocked.example") != 1;
+  UrlBlacklist_free(&image);
+
+  UrlBlacklist base;
+  UrlBlacklist_save(&replayed, "url_blacklist_test.img");
+  UrlBlacklist_free(&replayed);
+  UrlBlacklist_new(&replayed, "../blacklist.txt", '\n');
+  UrlBlacklist_new(&base, "url_blacklist_test.img", 0);
+  failures += UrlBlacklist_replay(&base, CHANGE_LOG, 0) != CHANGES;
+  failures += UrlBlacklist_replay(&replayed, CHANGE_LOG, 0) != CHANGES + 1;
+  failures += UrlBlacklist_apply(&base, "+blocked.example") || UrlBlacklist_apply(&replayed, "+blocked.example");
+  failures += equivalent(&base, &replayed);
+  UrlBlacklist_free(&base);
+  UrlBlacklist_free(&replayed);
+
+  // the compacted log has one change per rule and the same outcome
+  UrlBlacklist_new(&replayed, "../blacklist.txt", '\n');
+  failures += UrlBlacklist_replay(&replayed, CHANGE_LOG, 1) != CHANGES + 1;
+  UrlBlacklist_free(&replayed);
+  UrlBlacklist_new(&replayed, "../blacklist.txt", '\n');
+  int compacted = UrlBlacklist_replay(&replayed, CHANGE_LOG, 0);
+  failures += compacted != CHANGES - CHANGES / 10 * 2 + 1;
+  failures += equivalent(live, &replayed);
+  UrlBlacklist_free(&replayed);
+
+  unlink("url_blacklist_test.img");
+  unlink(CHANGE_LOG);
+
+  UrlBlacklist_free(live);
+  free(live);
+
+  printf("incremental: %lu failures\n", failures);
+
+  return failures;
+}
+
+#define PATH_RULES "url_blacklist_test.paths"
+
+typedef struct PathCase
+{
+  char *host;
+  char *path;
+  char blocked;
+} PathCase;
+
+/**
+ * Path rules under their domains, checked on the text and on its image
+ */
+static unsigned long paths(void)
+{
+  unsigned long failures = 0;
+
+  FILE *file = fopen(PATH_RULES, "w");
+  fputs("ads.example/banner\n"
+        "example.com/ads\n"
+        "!example.com/ads/allowed/\n"
+        "example.com/track*.gif\n"
+        "!example.com/tracker.gif?opt=out\n"
+        "blocked.example\n"
+        "!blocked.example/public\n"
+        "!open.blocked.example\n"
+        "open.blocked.example/private\n"
+        "0.0.0.0 hosts.example/x # comment\n"
+        "*.wild/path\n"
+        "site.example/\n",
+        file);
+  fclose(file);
+
+  PathCase cases[] = {
+      {"example.com", "/", 0},
+      {"example.com", "/ads", 1},
+      {"example.com", "/ads/", 1},
+      {"example.com", "/ads/a.gif?x=1", 1},
+      {"www.example.com", "/ads/a.gif", 1},
+      {"example.com", "/adserver", 0},
+      {"example.com", "/ads?x", 1},
+      {"example.com", "/ads/allowed/x", 0},
+      {"example.com", "/ads/allowedx", 1},
+      {"example.com", "/tracking.gif", 1},
+      {"example.com", "/track/1/pixel.gif", 1},
+      {"example.com", "/track/1/pixel.png", 0},
+      {"example.com", "/tracker.gif?opt=out", 0},
+      {"example.com", "/tracker.gif?opt=in", 1},
+      {"ads.example", "/banner/1", 1},
+      {"ads.example", "/", 0},
+      {"blocked.example", "/", 1},
+      {"blocked.example", "/public/index.html", 0},
+      {"a.blocked.example", "/public", 0},
+      {"open.blocked.example", "/public", 0},
+      {"open.blocked.example", "/", 0},
+      {"open.blocked.example", "/private/x", 1},
+      {"hosts.example", "/x", 1},
+      {"hosts.example", "/y", 0},
+      {"a.wild", "/path", 0},
+      {"site.example", "/", 1},
+      {"site.example", "/anything", 1},
+      {"other.example", "/ads", 0},
+  };
+
+  UrlBlacklist text, image;
+  failures += !UrlBlacklist_new(&text, PATH_RULES, '\n');
+  failures += UrlBlacklist_save(&text, "url_blacklist_test.img") || !UrlBlacklist_new(&image, "url_blacklist_test.img", 0);
+  if (failures)
+    return failures;
+
+  UrlBlacklist *lists[] = {&text, &image};
+  for (int l = 0; l < 2; l++)
+  {
+    for (int i = 0; i < sizeof(cases) / sizeof(*cases); i++)
+    {
+      char with_paths;
+      char blocked = !!UrlBlacklist_exists_path(lists[l], cases[i].host, cases[i].path, &with_paths);
+
+      if (blocked != cases[i].blocked || !with_paths != !strstr("example.com www.example.com ads.example blocked.example a.blocked.example open.blocked.example hosts.example site.example", cases[i].host))
+      {
+        printf("%s %s%s: %s\n", l ? "image" : "text", cases[i].host, cases[i].path, blocked ? "blocked" : "allowed");
+        failures++;
+      }
+    }
+
+    // without a path only domains count
+    failures += UrlBlacklist_exists(lists[l], "example.com") || !UrlBlacklist_exists(lists[l], "blocked.example");
+  }
+
+  // paths are only built on load
+  failures += UrlBlacklist_apply(&text, "+example.com/more") != -1;
+
+  UrlBlacklist_free(&text);
+  UrlBlacklist_free(&image);
+  unlink(PATH_RULES);
+  unlink("url_blacklist_test.img");
+
+  printf("paths: %lu failures\n", failures);
+
+  return failures;
+}
+
+#define ADDRESS_RULES "url_blacklist_test.addresses"
+
+/**
+ * Address and network rules for hosts that are addresses and for resolved
+ * addresses, checked on the text and on its image
+ */
+static unsigned long addresses(void)
+{
+  unsigned long failures = 0;
+
+  FILE *file = fopen(ADDRESS_RULES, "w");
+  fputs("10.0.0.0/8\n"
+        "!10.1.0.0/16\n"
+        "10.1.2.3\n"
+        "2001:db8::/32\n"
+        "!2001:db8:1::/48\n"
+        "0.0.0.0 192.168.1.1\n"
+        "172.16.0.0/12 # private\n"
+        "example.com\n",
+        file);
+  fclose(file);
+
+  char *blocked[] = {"10.2.3.4", "10.1.2.3", "2001:db8::5", "192.168.1.1", "::ffff:10.0.0.1", "172.31.255.255", "example.com", "a.example.com"};
+  char *allowed[] = {"10.1.9.9", "11.0.0.1", "2001:db8:1::5", "2001:db9::1", "192.168.1.2", "172.32.0.0", "10.0.0.0.example", "0.0.0.0"};
+
+  UrlBlacklist text, image;
+  failures += !UrlBlacklist_new(&text, ADDRESS_RULES, '\n');
+  failures += UrlBlacklist_save(&text, "url_blacklist_test.img") || !UrlBlacklist_new(&image, "url_blacklist_test.img", 0);
+  if (failures)
+    return failures;
+
+  UrlBlacklist *lists[] = {&text, &image};
+  for (int l = 0; l < 2; l++)
+  {
+    for (int i = 0; i < sizeof(blocked) / sizeof(*blocked); i++)
+    {
+      if (!UrlBlacklist_exists(lists[l], blocked[i]) || UrlBlacklist_exists(lists[l], allowed[i]))
+      {
+        printf("%s %s or %s\n", l ? "image" : "text", blocked[i], allowed[i]);
+        failures++;
+      }
+    }
+
+    // resolved addresses
+    struct sockaddr_in in = {.sin_family = AF_INET};
+    struct sockaddr_in6 in6 = {.sin6_family = AF_INET6};
+
+    inet_pton(AF_INET, "10.200.0.1", &in.sin_addr);
+    char *rule = UrlBlacklist_exists_address(lists[l], (struct sockaddr *)&in);
+    failures += !rule || strncmp(rule, "10.0.0.0/8\n", 11);
+
+    inet_pton(AF_INET, "10.1.0.1", &in.sin_addr);
+    failures += !!UrlBlacklist_exists_address(lists[l], (struct sockaddr *)&in);
+
+    inet_pton(AF_INET6, "2001:db8:2::1", &in6.sin6_addr);
+    failures += !UrlBlacklist_exists_address(lists[l], (struct sockaddr *)&in6);
+
+    inet_pton(AF_INET6, "::1", &in6.sin6_addr);
+    failures += !!UrlBlacklist_exists_address(lists[l], (struct sockaddr *)&in6);
+  }
+
+  // addresses are only built on load
+  failures += UrlBlacklist_apply(&text, "+1.2.3.4") != -1;
+
+  UrlBlacklist_free(&text);
+  UrlBlacklist_free(&image);
+  unlink(ADDRESS_RULES);
+  unlink("url_blacklist_test.img");
+
+  printf("addresses: %lu failures\n", failures);
+
+  return failures;
+}
+
+#define CORRUPTIONS 11
+
+/**
+ * Break one index of a valid image, or the alignment of a table
+ */
+static void corrupt(UrlBlacklistImage *image, char *data, int kind)
+{
+  unsigned int *nodes = (unsigned int *)(data + image->nodes_offset);
+  UrlBlacklistEdge *edge = (UrlBlacklistEdge *)(data + image->edges_offset);
+  unsigned int *transitions = (unsigned int *)(data + image->transitions_offset);
+  unsigned int *accepts = (unsigned int *)(data + image->accepts_offset);
+  unsigned int *globs = (unsigned int *)(data + image->globs_offset);
+  UrlBlacklistPathHost *host = (UrlBlacklistPathHost *)(data + image->path_hosts_offset);
+  UrlBlacklistPathGlob *path_glob = (UrlBlacklistPathGlob *)(data + image->path_globs_offset);
+  IpRadixNode *address = (IpRadixNode *)(data + image->address_nodes_offset);
+
+  while (!edge->child)
+    edge++;
+  while (!host->host)
+    host++;
+
+  switch (kind)
+  {
+  case 0:
+    nodes[image->node_count - 1] = image->pool_size + 1;
+    break;
+  case 1:
+    edge->child = image->node_count;
+    break;
+  case 2:
+    edge->label = image->pool_size - edge->length + 1;
+    break;
+  case 3:
+    transitions[image->glob_class_count + 1] = image->glob_state_count;
+    break;
+  case 4:
+    image->glob_classes['a'] = image->glob_class_count;
+    break;
+  case 5:
+    accepts[1] = image->glob_count + 1;
+    break;
+  case 6:
+    globs[0] = image->pool_size;
+    break;
+  case 7:
+    host->root = image->node_count;
+    break;
+  case 8:
+    path_glob->pattern = image->pool_size;
+    break;
+  case 9:
+    address->child[0] = image->address_node_count;
+    break;
+  case 10:
+    image->nodes_offset++;
+    break;
+  }
+}
+
+/**
+ * Images with an index out of its table are not loaded
+ */
+static unsigned long corrupt_images(void)
+{
+  unsigned long failures = 0;
+
+  FILE *file = fopen("url_blacklist_test.rules", "w");
+  fputs("ads.example\n"
+        "*.tracker.example\n"
+        "site.example/ads\n"
+        "site.example/*.js\n"
+        "10.0.0.0/8\n"
+        "2001:db8::/32\n",
+        file);
+  fclose(file);
+
+  UrlBlacklist bl;
+  failures += !UrlBlacklist_new(&bl, "url_blacklist_test.rules", '\n') || UrlBlacklist_save(&bl, "url_blacklist_test.img");
+  if (failures)
+    return failures;
+  UrlBlacklist_free(&bl);
+
+  file = fopen("url_blacklist_test.img", "r");
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  rewind(file);
+  char *valid = malloc(size), *data = malloc(size);
+  failures += fread(valid, 1, size, file) != size;
+  fclose(file);
+
+  // -1 is the image as saved
+  for (int kind = -1; kind < CORRUPTIONS; kind++)
+  {
+    memcpy(data, valid, size);
+    corrupt((UrlBlacklistImage *)data, data, kind);
+
+    file = fopen("url_blacklist_test.bad", "w");
+    fwrite(data, 1, size, file);
+    fclose(file);
+
+    char *loaded = UrlBlacklist_new(&bl, "url_blacklist_test.bad", 0) ? "loaded" : NULL;
+    if (loaded)
+      UrlBlacklist_free(&bl);
+
+    if (!loaded != (kind >= 0))
+    {
+      printf("corruption %d %s\n", kind, loaded ? "loaded" : "rejected");
+      failures++;
+    }
+  }
+
+  // cut short
+  file = fopen("url_blacklist_test.bad", "w");
+  fwrite(valid, 1, size / 2, file);
+  fclose(file);
+  failures += !!UrlBlacklist_new(&bl, "url_blacklist_test.bad", 0);
+
+  free(valid);
+  free(data);
+  unlink("url_blacklist_test.rules");
+  unlink("url_blacklist_test.img");
+  unlink("url_blacklist_test.bad");
+
+  printf("corrupt images: %lu failures\n", failures);
+
+  return failures;
+}
+
+/**
+ * A rule with a label no hostname can have is skipped, not put on its
+ * parent domain
+ */
+static unsigned long long_labels(void)
+{
+  unsigned long failures = 0;
+
+  FILE *file = fopen("url_blacklist_test.long", "w");
+  for (int i = 0; i < 70000; i++)
+    fputc('a', file);
+  fputs(".example.com\nother.example\n", file);
+  fclose(file);
+
+  UrlBlacklist bl;
+  failures += !UrlBlacklist_new(&bl, "url_blacklist_test.long", '\n');
+  if (failures)
+    return failures;
+
+  // a rule missing from the filter turns it off, then only the trie decides
+  for (int filtered = 1; filtered >= 0; filtered--)
+  {
+    failures += bl.filtered != filtered;
+    failures += !!UrlBlacklist_exists(&bl, "example.com");
+    failures += !!UrlBlacklist_exists(&bl, "www.example.com");
+    failures += !!UrlBlacklist_exists(&bl, "com");
+    failures += !UrlBlacklist_exists(&bl, "other.example");
+    failures += UrlBlacklist_apply(&bl, "+new.example") < 0;
+  }
+
+  UrlBlacklist_free(&bl);
+  unlink("url_blacklist_test.long");
+
+  printf("long labels: %lu failures\n", failures);
+
+  return failures;
+}
+
+/**
+ * Threads pthread_create refuses to start before it works again
+ */
+static int refused_threads;
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*start)(void *), void *arg)
+{
+  int (*create)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *);
+  *(void **)&create = dlsym(RTLD_NEXT, "pthread_create");
+
+  if (refused_threads > 0)
+  {
+    refused_threads--;
+    return EAGAIN;
+  }
+
+  return create(thread, attr, start, arg);
+}
+
+/**
+ * A share of the file whose loader thread could not be started is loaded
+ * anyway
+ */
+static unsigned long refused_loaders(void)
+{
+  unsigned long failures = 0;
+
+  UrlBlacklist threaded, refused;
+  failures += !UrlBlacklist_new(&threaded, "../blacklist.txt", '\n');
+  refused_threads = 1 << 20;
+  failures += !UrlBlacklist_new(&refused, "../blacklist.txt", '\n');
+  refused_threads = 0;
+
+  if (!failures)
+  {
+    failures += threaded.node_count != refused.node_count;
+    failures += equivalent(&threaded, &refused);
+  }
+
+  UrlBlacklist_free(&threaded);
+  UrlBlacklist_free(&refused);
+
+  printf("refused loaders: %lu failures\n", failures);
+
+  return failures;
+}
+
+#define BATCH_HOSTS 400000
+
+static double elapsed_ns(struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  return (end.tv_sec - start->tv_sec) * 1e9 + end.tv_nsec - start->tv_nsec;
+}
+
+/**
+ * Batched lookups answer like single ones, on the corpus alone and with
+ * the small rule set layered over it, and how long both take
+ */
+static unsigned long batch(void)
+{
+  unsigned long failures = 0;
+  char **hosts = malloc(BATCH_HOSTS * sizeof(*hosts));
+  char **results = malloc(BATCH_HOSTS * sizeof(*results));
+  unsigned int count = 0;
+  char host[512];
+
+  FILE *file = fopen("../blacklist.txt", "r");
+  char *line = NULL;
+  size_t line_size = 0;
+
+  // corpus hosts and their subdomains, hosts next to them and deep ones
+  // past what the filter keys are kept for
+  srand(3);
+  while (file && count + 4 <= BATCH_HOSTS / 2 && getline(&line, &line_size, file) > 0)
+  {
+    char *start = strchr(line, ' ');
+    start = start ? start + 1 : line;
+    start[strcspn(start, "\r\n")] = '\0';
+
+    if (*start == '#' || !*start || strlen(start) > 256)
+      continue;
+
+    hosts[count++] = strdup(start);
+    snprintf(host, sizeof(host), "www.%s", start);
+    hosts[count++] = strdup(host);
+    snprintf(host, sizeof(host), "%sx.example", start);
+    hosts[count++] = strdup(host);
+    snprintf(host, sizeof(host), "a.b.c.d.e.f.g.h.%s", start);
+    hosts[count++] = strdup(host);
+  }
+
+  free(line);
+  if (file)
+    fclose(file);
+
+  while (count < BATCH_HOSTS)
+  {
+    char *tail = host;
+    int labels = 1 + rand() % 10;
+
+    for (int j = 0; j < labels; j++)
+      tail += sprintf(tail, "%s%s", j ? "." : "", vocabulary[rand() % VOCABULARY]);
+
+    hosts[count++] = strdup(host);
+  }
+
+  for (unsigned int i = count - 1; i > 0; i--)
+  {
+    unsigned int j = rand() % (i + 1);
+    char *swap = hosts[i];
+    hosts[i] = hosts[j];
+    hosts[j] = swap;
+  }
+
+  UrlBlacklist base, overlay;
+  failures += !UrlBlacklist_new(&base, "../blacklist.txt", '\n') || !UrlBlacklist_new(&overlay, "blacklist.txt", '\n');
+  if (failures)
+    return failures;
+
+  overlay.base = &base;
+
+  UrlBlacklist *lists[] = {&base, &overlay};
+  for (int l = 0; l < 2; l++)
+  {
+    // odd counts leave a partial batch at the end
+    UrlBlacklist_exists_batch(lists[l], hosts, count - 7, results);
+
+    for (unsigned int i = 0; i < count - 7; i++)
+    {
+      if (results[i] != UrlBlacklist_exists(lists[l], hosts[i]) && failures++ < 10)
+        printf("batch %s: %s\n", hosts[i], results[i] ? "blocked" : "allowed");
+    }
+  }
+
+  struct timespec start;
+  unsigned long blocked = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (unsigned int i = 0; i < count; i++)
+    blocked += !!UrlBlacklist_exists(&base, hosts[i]);
+  double single = elapsed_ns(&start) / count;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  UrlBlacklist_exists_batch(&base, hosts, count, results);
+  double batched = elapsed_ns(&start) / count;
+
+  printf("batch: %u hosts, %lu blocked, %.1f ns single, %.1f ns batched, %lu failures\n", count, blocked, single, batched, failures);
+
+  UrlBlacklist_free(&overlay);
+  UrlBlacklist_free(&base);
+  for (unsigned int i = 0; i < count; i++)
+    free(hosts[i]);
+  free(hosts);
+  free(results);
+
+  return failures;
+}
+
+/**
+ * The vector host scan against a byte loop, every length and alignment,
+ * then lookups past the bitmap and glob matches
+ */
+static unsigned long scan(void)
+{
+  static const char bytes[] = "abcxyzAZ@[`{.-09\x80\xc1\xff";
+  unsigned long failures = 0;
+  char buffer[700 + 16], expected[700];
+
+  srand(5);
+  for (unsigned int length = 0; length < 600; length += length < 64 ? 1 : 37)
+  {
+    for (unsigned int align = 0; align < 16; align++)
+    {
+      char *host = buffer + align;
+      u_int64_t dots[URL_BLACKLIST_HOST_MAX / 64], want[URL_BLACKLIST_HOST_MAX / 64] = {0};
+
+      for (unsigned int i = 0; i < length; i++)
+      {
+        host[i] = bytes[rand() % (sizeof(bytes) - 1)];
+        expected[i] = host[i] >= 'A' && host[i] <= 'Z' ? host[i] + 32 : host[i];
+        if (host[i] == '.' && i < URL_BLACKLIST_HOST_MAX)
+          want[i / 64] |= 1ull << i % 64;
+      }
+      host[length] = '\0';
+      host[length + 1] = 'A';
+
+      unsigned int found = UrlBlacklist_scan_host(host, 1, dots);
+      if ((found != length || memcmp(host, expected, length) || memcmp(dots, want, sizeof(dots)) || host[length + 1] != 'A') && failures++ < 10)
+        printf("scan: length %u at %u\n", length, align);
+    }
+  }
+
+  // label boundaries past the bitmap are found a byte at a time
+  UrlBlacklist bl;
+  failures += !UrlBlacklist_new(&bl, "blacklist.txt", '\n');
+  char host[URL_BLACKLIST_HOST_MAX * 2];
+  for (unsigned int length = URL_BLACKLIST_HOST_MAX - 20; length < sizeof(host) - 20; length += 3)
+  {
+    memset(host, 'a', length);
+    for (unsigned int i = 1; i < length; i += 7)
+      host[i] = '.';
+    strcpy(host + length, ".google.com");
+
+    char *rule = UrlBlacklist_exists(&bl, host);
+    if ((!rule || strncmp(rule, "google.com\n", 11)) && failures++ < 10)
+      printf("scan: %u byte host not blocked by google.com\n", length);
+  }
+  UrlBlacklist_free(&bl);
+
+  struct
+  {
+    char *glob, *host, match;
+  } globs[] = {
+      {"*.example.com\n", "a.example.com", 1},
+      {"*.example\n", "a.b.example", 0},
+      {"*cdn*.*\n", "x.cdn1.net", 1},
+      {"*cdn*.*\n", "x.cd.net", 0},
+      {"*x\n", "a.bx", 1},
+      {"ad*s.com\n", "adxsxs.com", 1},
+      {"ad*s.com\n", "adxxscom", 0},
+      {"*\n", "anything", 1},
+  };
+
+  for (unsigned int i = 0; i < sizeof(globs) / sizeof(*globs); i++)
+  {
+    if (_glob_match(globs[i].host, globs[i].glob, strlen(globs[i].glob) - 1) != globs[i].match && failures++ < 10)
+      printf("scan: %s against %s\n", globs[i].host, globs[i].glob);
+  }
+
+  printf("scan: %lu failures\n", failures);
+
+  return failures;
+}
+
+#define REDUNDANT_RULES "url_blacklist_test.redundant"
+#define REDUNDANT_KEPT "url_blacklist_test.kept"
+
+static char *redundant_rules[] = {
+    "ads.example",
+    "www.ads.example",
+    "x.example",
+    "0.0.0.0 x.example",
+    "!ok.ads.example",
+    "!a.ok.ads.example",
+    "*.wild.example",
+    "b.wild.example",
+    "*.wild.example # again",
+    "!c.wild.example",
+    "!nothing.example",
+    "!n.glob.example",
+    "*.deep.n.glob.example",
+    "site.example",
+    "!site.example/free",
+    "a.site.example",
+    "p.example/x",
+    "q.p.example",
+    "10.0.0.0/8",
+    "10.1.0.0/16",
+};
+
+/**
+ * Rules dropped by UrlBlacklist_redundant and the rule deciding for them,
+ * then the same verdicts for every host and path without them
+ */
+static unsigned long redundant(void)
+{
+  unsigned long failures = 0;
+  unsigned int rules = sizeof(redundant_rules) / sizeof(*redundant_rules);
+
+  FILE *file = fopen(REDUNDANT_RULES, "w");
+  for (unsigned int i = 0; i < rules; i++)
+    fprintf(file, "%s\n", redundant_rules[i]);
+  fclose(file);
+
+  char *expected[] = {
+      "2 www.ads.example ads.example",
+      "1 x.example x.example",
+      "2 !a.ok.ads.example !ok.ads.example",
+      "1 *.wild.example *.wild.example",
+      "3 b.wild.example *.wild.example",
+      "4 !nothing.example !nothing.example",
+  };
+  unsigned int expected_count = sizeof(expected) / sizeof(*expected);
+
+  UrlBlacklist bl, kept;
+  UrlBlacklistRedundant *found;
+  failures += !UrlBlacklist_new(&bl, REDUNDANT_RULES, '\n');
+  if (failures)
+    return failures;
+
+  int count = UrlBlacklist_redundant(&bl, 1, &found);
+  failures += count != expected_count;
+
+  for (int i = 0; i < count && i < expected_count; i++)
+  {
+    char line[256];
+    char *rule = bl.file + found[i].rule, *by = bl.file + found[i].by;
+    snprintf(line, sizeof(line), "%d %.*s %.*s", found[i].reason, (int)strcspn(rule, " \n"), rule, (int)strcspn(by, " \n"), by);
+
+    if (strcmp(line, expected[i]))
+    {
+      printf("redundant: %s, expected %s\n", line, expected[i]);
+      failures++;
+    }
+  }
+
+  // a whitelist matters when another list is layered under it
+  UrlBlacklistRedundant *layered;
+  failures += UrlBlacklist_redundant(&bl, 0, &layered) != expected_count - 1;
+  free(layered);
+
+  // every line of a dropped rule goes
+  file = fopen(REDUNDANT_KEPT, "w");
+  for (unsigned int i = 0, next = 0; i < rules; i++)
+  {
+    char *line = strstr(bl.file, redundant_rules[i]);
+    while (line && line > bl.file && line[-1] != '\n')
+      line = strstr(line + 1, redundant_rules[i]);
+
+    if (next < count && bl.file + found[next].rule < line + strlen(redundant_rules[i]) + 1)
+      next++;
+    else
+      fprintf(file, "%s\n", redundant_rules[i]);
+  }
+  fclose(file);
+  free(found);
+
+  failures += !UrlBlacklist_new(&kept, REDUNDANT_KEPT, '\n');
+  if (failures)
+    return failures;
+
+  char *prefixes[] = {"", "www.", "a.b.", "deep."};
+  char *paths[] = {NULL, "/", "/free", "/x", "/x/y"};
+  for (unsigned int i = 0; i < rules; i++)
+  {
+    char *rule = redundant_rules[i];
+    rule += strncmp(rule, "0.0.0.0 ", 8) ? 0 : 8;
+    rule += *rule == '!';
+
+    for (unsigned int p = 0; p < sizeof(prefixes) / sizeof(*prefixes); p++)
+    {
+      char host[256];
+      int length = snprintf(host, sizeof(host), "%s%.*s", prefixes[p], (int)strcspn(rule, " /"), rule);
+      for (int c = 0; c < length; c++)
+        host[c] = host[c] == '*' ? 'x' : host[c];
+
+      for (unsigned int q = 0; q < sizeof(paths) / sizeof(*paths); q++)
+      {
+        char a = !!UrlBlacklist_exists_path(&bl, host, paths[q], NULL);
+        char b = !!UrlBlacklist_exists_path(&kept, host, paths[q], NULL);
+
+        if (a != b)
+        {
+          printf("redundant: %s%s %s, %s without the dropped rules\n", host, paths[q] ? paths[q] : "", a ? "blocked" : "allowed", b ? "blocked" : "allowed");
+          failures++;
+        }
+      }
+    }
+  }
+
+  UrlBlacklist_free(&bl);
+  UrlBlacklist_free(&kept);
+  unlink(REDUNDANT_RULES);
+  unlink(REDUNDANT_KEPT);
+
+  printf("redundant: %d of %u rules dropped, %lu failures\n", count, rules, failures);
+
+  return failures;
+}
+
 int main(int argc, char const *argv[])
 {
+  int failed = 0;
+
   UrlBlacklist bl;
-  UrlBlacklist_new(&bl, "blacklist.txt", '\n', 8);
+  UrlBlacklist_new(&bl, "blacklist.txt", '\n');
 
   UrlBlacklist_print_table(&bl);
 
@@ -39,7 +1302,34 @@ int main(int argc, char const *argv[])
     printf("-> %-20s %s\n\n", test_strings[p], "false\0true" + 6 * !!r);
   }
 
+  // the small rule set exercises globs and whitelisting, the corpus the
+  // size of the real table
+  failed |= !!differential(&bl, "../blacklist.txt");
+  failed |= !!image_differential(&bl);
+
   UrlBlacklist_free(&bl);
 
+  UrlBlacklist corpus;
+  UrlBlacklist_new(&corpus, "../blacklist.txt", '\n');
+  failed |= !!differential(&corpus, "../blacklist.txt");
+  failed |= !!image_differential(&corpus);
+  UrlBlacklist_free(&corpus);
+
+  failed |= !!incremental();
+  failed |= !!paths();
+  failed |= !!addresses();
+  failed |= !!long_labels();
+  failed |= !!refused_loaders();
+  failed |= !!corrupt_images();
+  failed |= !!batch();
+  failed |= !!scan();
+  failed |= !!redundant();
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
   return 0;
 }
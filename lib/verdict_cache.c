@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "verdict_cache.h"
+
+#define L1_SIZE 256
+
+/**
+ * L1 hits are counted locally and published in batches so the hot path
+ * never writes to shared memory
+ */
+#define L1_FLUSH 1024
+
+char VerdictCache_paths;
+
+static __thread VerdictCacheEntry l1[L1_SIZE];
+static __thread VerdictCache *l1_owner;
+static __thread unsigned long l1_pending;
+
+/**
+ * FNV-1a, never 0 so empty entries can't match
+ */
+static inline unsigned int _hash(const char *str, size_t len)
+{
+  unsigned int hash = 2166136261u;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    hash ^= (unsigned char)str[i];
+    hash *= 16777619u;
+  }
+
+  return hash | 1;
+}
+
+static inline char _entry_match(VerdictCacheEntry *entry, unsigned int hash, unsigned int generation, const char *host, size_t len)
+{
+  return entry->hash == hash && entry->generation == generation && !memcmp(entry->host, host, len + 1);
+}
+
+static inline void _entry_set(VerdictCacheEntry *entry, unsigned int hash, unsigned int generation, char *rule, const char *host, size_t len)
+{
+  entry->hash = hash;
+  entry->generation = generation;
+  entry->rule = rule;
+  memcpy(entry->host, host, len + 1);
+}
+
+static void _l1_flush(VerdictCache *vc)
+{
+  if (!l1_pending)
+    return;
+
+  __atomic_fetch_add(&vc->l1_hits, l1_pending, __ATOMIC_RELAXED);
+  l1_pending = 0;
+}
+
+VerdictCache *VerdictCache_new(VerdictCache *vc, u_int8_t shards_2, u_int8_t entries_2)
+{
+  unsigned int shards = 1 << shards_2;
+  unsigned int entries = 1 << entries_2;
+
+  vc->shards = aligned_alloc(64, shards * sizeof(VerdictCacheShard));
+  if (!vc->shards)
+    return NULL;
+
+  for (unsigned int i = 0; i < shards; i++)
+  {
+    VerdictCacheShard *shard = &vc->shards[i];
+
+    shard->entries = calloc(entries, sizeof(VerdictCacheEntry));
+    if (!shard->entries)
+    {
+      while (i--)
+        free(vc->shards[i].entries);
+      free(vc->shards);
+      return NULL;
+    }
+
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->hits = shard->misses = 0;
+  }
+
+  vc->shard_mask = shards - 1;
+  vc->entry_mask = entries - 1;
+  vc->l1_hits = 0;
+
+  return vc;
+}
+
+void VerdictCache_free(VerdictCache *vc)
+{
+  for (unsigned int i = 0; i <= vc->shard_mask; i++)
+  {
+    pthread_mutex_destroy(&vc->shards[i].mutex);
+    free(vc->shards[i].entries);
+  }
+
+  free(vc->shards);
+}
+
+/**
+ * A host with path rules is cached as such, its verdict is not
+ */
+static inline char *_verdict(UrlBlacklist *bl, char *host, char *path, char *rule)
+{
+  return rule == VERDICT_CACHE_PATHS ? UrlBlacklist_exists_path(bl, host, path, NULL) : rule;
+}
+
+/**
+ * Changes whenever a list of the chain does, a list that replaces another
+ * has a higher generation than it so the sum only grows
+ */
+static inline unsigned int _chain_generation(UrlBlacklist *bl)
+{
+  unsigned int generation = 0;
+
+  for (; bl; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+    generation += __atomic_load_n(&bl->generation, __ATOMIC_ACQUIRE);
+
+  return generation;
+}
+
+char *VerdictCache_exists(VerdictCache *vc, UrlBlacklist *bl, char *host, char *path)
+{
+  // overlays are small and looked up every time, entries are for the chain
+  // they share
+  for (; bl && bl->uncached; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+  {
+    char *rule = UrlBlacklist_find_path(bl, host, path, NULL);
+
+    if (rule && (*rule != '!' || !bl->whitelist_local))
+      return *rule == '!' ? NULL : rule;
+  }
+
+  size_t len = strlen(host);
+
+  if (!bl || len >= VERDICT_CACHE_HOST_MAX)
+    return bl ? UrlBlacklist_exists_path(bl, host, path, NULL) : NULL;
+
+  unsigned int hash = _hash(host, len);
+  unsigned int generation = _chain_generation(bl);
+
+  // a thread only ever caches for one VerdictCache at a time
+  if (l1_owner != vc)
+  {
+    if (l1_owner)
+      _l1_flush(l1_owner);
+
+    memset(l1, 0, sizeof(l1));
+    l1_owner = vc;
+  }
+
+  VerdictCacheEntry *l1_entry = &l1[hash % L1_SIZE];
+  if (_entry_match(l1_entry, hash, generation, host, len))
+  {
+    if (++l1_pending == L1_FLUSH)
+      _l1_flush(vc);
+
+    return _verdict(bl, host, path, l1_entry->rule);
+  }
+
+  _l1_flush(vc);
+
+  // shard on the high bits, slot on the low bits
+  VerdictCacheShard *shard = &vc->shards[(hash >> 24) & vc->shard_mask];
+  VerdictCacheEntry *entry = &shard->entries[hash & vc->entry_mask];
+  char *rule;
+
+  pthread_mutex_lock(&shard->mutex);
+
+  if (_entry_match(entry, hash, generation, host, len))
+  {
+    rule = entry->rule;
+    shard->hits++;
+    pthread_mutex_unlock(&shard->mutex);
+
+    _entry_set(l1_entry, hash, generation, rule, host, len);
+    return _verdict(bl, host, path, rule);
+  }
+
+  shard->misses++;
+  pthread_mutex_unlock(&shard->mutex);
+
+  char paths;
+  char *verdict = UrlBlacklist_exists_path(bl, host, path, &paths);
+  rule = paths ? VERDICT_CACHE_PATHS : verdict;
+
+  pthread_mutex_lock(&shard->mutex);
+  _entry_set(entry, hash, generation, rule, host, len);
+  pthread_mutex_unlock(&shard->mutex);
+
+  _entry_set(l1_entry, hash, generation, rule, host, len);
+
+  return verdict;
+}
+
+/**
+ * Counts are a snapshot, L1 hits not yet flushed by other threads are missing
+ */
+void VerdictCache_stats(VerdictCache *vc, unsigned long *l1_hits, unsigned long *l2_hits, unsigned long *misses)
+{
+  if (l1_owner == vc)
+    _l1_flush(vc);
+
+  *l1_hits = __atomic_load_n(&vc->l1_hits, __ATOMIC_RELAXED);
+  *l2_hits = *misses = 0;
+
+  for (unsigned int i = 0; i <= vc->shard_mask; i++)
+  {
+    VerdictCacheShard *shard = &vc->shards[i];
+
+    pthread_mutex_lock(&shard->mutex);
+    *l2_hits += shard->hits;
+    *misses += shard->misses;
+    pthread_mutex_unlock(&shard->mutex);
+  }
+}
+
+void VerdictCache_print_stats(VerdictCache *vc)
+{
+  unsigned long l1_hits, l2_hits, misses;
+  VerdictCache_stats(vc, &l1_hits, &l2_hits, &misses);
+
+  printf("VerdictCache [%u x %u]: %p\n", vc->shard_mask + 1, vc->entry_mask + 1, (void *)vc);
+  printf("  l1 hits: %lu l2 hits: %lu misses: %lu\n", l1_hits, l2_hits, misses);
+}
@@ -0,0 +1,70 @@
+/**
+ * Bounded cache of UrlBlacklist verdicts keyed by hostname
+ *
+ * A small thread-local L1 sits in front of a shared L2 split into locked
+ * shards. Entries carry the blacklist generation they were computed for, a
+ * changed blacklist invalidates everything without touching the cache
+ */
+#include <pthread.h>
+#include "url_blacklist.h"
+
+#ifndef VERDICT_CACHE_H
+#define VERDICT_CACHE_H
+
+/**
+ * Longer hostnames are never cached
+ */
+#define VERDICT_CACHE_HOST_MAX 48
+
+extern char VerdictCache_paths;
+#define VERDICT_CACHE_PATHS (&VerdictCache_paths)
+
+typedef struct VerdictCacheEntry
+{
+  unsigned int hash;
+  unsigned int generation;
+  /**
+   * Rule that blocked the host, NULL if allowed, VERDICT_CACHE_PATHS when
+   * the host has path rules and every request is looked up
+   */
+  char *rule;
+  char host[VERDICT_CACHE_HOST_MAX];
+} VerdictCacheEntry;
+
+typedef struct VerdictCacheShard
+{
+  pthread_mutex_t mutex;
+  VerdictCacheEntry *entries;
+  unsigned long hits;
+  unsigned long misses;
+} __attribute__((aligned(64))) VerdictCacheShard;
+
+typedef struct VerdictCache
+{
+  VerdictCacheShard *shards;
+  unsigned int shard_mask;
+  unsigned int entry_mask;
+
+  unsigned long l1_hits;
+} VerdictCache;
+
+/**
+ * Create a new VerdictCache
+ *
+ * @param shards_2 Number of L2 shards (2^shards_2)
+ * @param entries_2 Entries per shard (2^entries_2)
+ */
+VerdictCache *VerdictCache_new(VerdictCache *vc, u_int8_t shards_2, u_int8_t entries_2);
+void VerdictCache_free(VerdictCache *vc);
+
+/**
+ * Same contract as UrlBlacklist_exists_path, path may be NULL. Uncached
+ * blacklists on top are looked up every time, the verdicts of everything
+ * under them are cached together
+ */
+char *VerdictCache_exists(VerdictCache *vc, UrlBlacklist *bl, char *host, char *path);
+
+void VerdictCache_stats(VerdictCache *vc, unsigned long *l1_hits, unsigned long *l2_hits, unsigned long *misses);
+void VerdictCache_print_stats(VerdictCache *vc);
+
+#endif
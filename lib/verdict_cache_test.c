@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "verdict_cache.h"
+#include "blacklist_sources.h"
+
+#define THREADS 4
+#define ROUNDS 10000
+
+static char *hosts[] = {
+    "google.com",
+    "www.google.com",
+    "sex.com",
+    "sexy.com",
+    "asex.com",
+    "test.com",
+    "testing.com",
+    "something.com",
+    "porn.xxx",
+    "porn.net",
+    "p.d.com",
+    "po.com",
+    "a-hostname-that-is-far-too-long-to-ever-be-cached.example.com",
+};
+
+#define HOSTS (sizeof(hosts) / sizeof(*hosts))
+
+static UrlBlacklist bl;
+static VerdictCache vc;
+static char *expected[HOSTS];
+
+void *worker(int *failed)
+{
+  for (int round = 0; round < ROUNDS; round++)
+  {
+    unsigned int i = (round * 7) % HOSTS;
+    *failed |= VerdictCache_exists(&vc, &bl, hosts[i], NULL) != expected[i];
+  }
+
+  return NULL;
+}
+
+int main(void)
+{
+  int failed = 0;
+
+  UrlBlacklist_new(&bl, "blacklist.txt", '\n');
+  VerdictCache_new(&vc, 2, 4);
+
+  for (unsigned int i = 0; i < HOSTS; i++)
+    expected[i] = UrlBlacklist_exists(&bl, hosts[i]);
+
+  pthread_t threads[THREADS];
+  int thread_failed[THREADS] = {0};
+  for (int i = 0; i < THREADS; i++)
+    pthread_create(&threads[i], NULL, (void *(*)(void *))worker, &thread_failed[i]);
+  for (int i = 0; i < THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+    failed |= thread_failed[i];
+  }
+
+  unsigned long l1_hits, l2_hits, misses;
+  VerdictCache_stats(&vc, &l1_hits, &l2_hits, &misses);
+  VerdictCache_print_stats(&vc);
+
+  // every thread only misses on the first sight of a host
+  failed |= misses > THREADS * HOSTS;
+
+  // a reloaded blacklist must not be answered from the cache
+  UrlBlacklist reloaded;
+  UrlBlacklist_new(&reloaded, "blacklist.txt", '\n');
+  failed |= reloaded.generation == bl.generation;
+
+  VerdictCache_exists(&vc, &reloaded, "sex.com", NULL);
+  unsigned long after;
+  VerdictCache_stats(&vc, &l1_hits, &l2_hits, &after);
+  printf("misses after reload: %lu -> %lu\n", misses, after);
+  failed |= after != misses + 1;
+
+  UrlBlacklist_free(&reloaded);
+
+  // a host with path rules is cached as such, the path still decides
+  FILE *file = fopen("verdict_cache_test.paths", "w");
+  fputs("example.com/ads\n", file);
+  fclose(file);
+
+  UrlBlacklist paths;
+  UrlBlacklist_new(&paths, "verdict_cache_test.paths", '\n');
+  for (int i = 0; i < 2; i++)
+    failed |= !VerdictCache_exists(&vc, &paths, "example.com", "/ads/1") || VerdictCache_exists(&vc, &paths, "example.com", "/");
+
+  UrlBlacklist_free(&paths);
+  unlink("verdict_cache_test.paths");
+
+  // with sources under the blacklist the verdicts of the whole chain are
+  // cached, an overlay on top is looked up every time
+  file = fopen("verdict_cache_test.upper", "w");
+  fputs("upper.example\n", file);
+  fclose(file);
+  file = fopen("verdict_cache_test.source", "w");
+  fputs("source.example\n", file);
+  fclose(file);
+  file = fopen("verdict_cache_test.sources", "w");
+  fputs("10 verdict_cache_test.source\n", file);
+  fclose(file);
+  file = fopen("verdict_cache_test.overlay", "w");
+  fputs("overlay.example\n", file);
+  fclose(file);
+
+  UrlBlacklist upper, overlay;
+  BlacklistSources sources;
+  UrlBlacklist_new(&upper, "verdict_cache_test.upper", '\n');
+  UrlBlacklist_new(&overlay, "verdict_cache_test.overlay", '\n');
+  BlacklistSources_new(&sources, "verdict_cache_test.sources");
+  BlacklistSources_attach(&sources, &upper);
+  overlay.base = &upper;
+  overlay.uncached = 1;
+
+  char *chain[] = {"upper.example", "source.example", "overlay.example", "nothing.example"};
+  unsigned long hits, before;
+  VerdictCache_stats(&vc, &l1_hits, &l2_hits, &before);
+  hits = l1_hits + l2_hits;
+
+  for (int round = 0; round < 2; round++)
+  {
+    for (unsigned int i = 0; i < sizeof(chain) / sizeof(*chain); i++)
+      failed |= VerdictCache_exists(&vc, &overlay, chain[i], NULL) != UrlBlacklist_exists(&overlay, chain[i]);
+  }
+
+  // the overlay's own host never reaches the cache
+  VerdictCache_stats(&vc, &l1_hits, &l2_hits, &after);
+  printf("chain hits: %lu misses: %lu\n", l1_hits + l2_hits - hits, after - before);
+  failed |= after - before != 3 || l1_hits + l2_hits - hits != 3;
+
+  // a reloaded source changes the verdicts of the chain
+  file = fopen("verdict_cache_test.source", "w");
+  fputs("nothing.example\n", file);
+  fclose(file);
+  UrlBlacklist *old = BlacklistSources_reload(&sources, 0);
+  failed |= !old;
+  if (old)
+  {
+    UrlBlacklist_free(old);
+    free(old);
+  }
+
+  before = after;
+  failed |= !VerdictCache_exists(&vc, &overlay, "nothing.example", NULL) || VerdictCache_exists(&vc, &overlay, "source.example", NULL);
+  VerdictCache_stats(&vc, &l1_hits, &l2_hits, &after);
+  failed |= after - before != 2;
+
+  BlacklistSources_free(&sources);
+  UrlBlacklist_free(&overlay);
+  UrlBlacklist_free(&upper);
+  unlink("verdict_cache_test.upper");
+  unlink("verdict_cache_test.source");
+  unlink("verdict_cache_test.sources");
+  unlink("verdict_cache_test.overlay");
+
+  VerdictCache_free(&vc);
+  UrlBlacklist_free(&bl);
+
+  if (failed)
+  {
+    printf("FAILED\n");
+    return 1;
+  }
+
+  return 0;
+}
@@ -9,6 +9,18 @@
 #include "bigboi.h"
 #include "safe_queue.h"
 #include "url_blacklist.h"
+#include "verdict_cache.h"
+#include "policy_set.h"
+#include "rule_hits.h"
+#include "blacklist_sources.h"
+#include "object_cache.h"
+#include "http_range.h"
+#include "splice_relay.h"
+#include "epoch.h"
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/un.h>
 
 /*
                                               _            __  _
@@ -67,9 +79,26 @@ typedef struct WorkerThreadArg
    */
   SafeQueue *log_items;
   /**
-   * Blaklist to use
+   * Published blacklist and its profiles, swapped by the reloader. Only
+   * dereference inside an epoch section
    */
-  UrlBlacklist *blacklist;
+  PolicySet **policies;
+  /**
+   * Remembers blacklist decisions per hostname
+   */
+  VerdictCache *verdicts;
+  /**
+   * Shared response cache
+   */
+  ObjectCache *cache;
+  /**
+   * Readers of blacklist, the slot is idx
+   */
+  Epoch *epoch;
+  /**
+   * Upstream lists under the blacklist, to name the one a rule is from
+   */
+  BlacklistSources *sources;
 } WorkerThreadArg;
 
 /**
@@ -172,6 +201,18 @@ typedef struct FileWriterArg
   int file_fd;
 } FileWriterArg;
 
+/**
+ * One reloader thread gets spawned by main
+ */
+typedef struct ReloaderArg
+{
+  PolicySet **policies;
+  Epoch *epoch;
+  BlacklistSources *sources;
+  ObjectCache *cache;
+  int log_fd;
+} ReloaderArg;
+
 /*
          __  _ __
   __  __/ /_(_) /
@@ -184,8 +225,7 @@ UTIL
 
 char *strlwr(char *str)
 {
-  for (char *p = str; *p; p++)
-    *p = tolower(*p);
+  UrlBlacklist_scan_host(str, 1, NULL);
 
   return str;
 }
@@ -199,7 +239,7 @@ char *strmalloccpy(const char *src)
 
 char *new_html(char *title, char *body)
 {
-  int html_len = strlen(title) + strlen(body) + 1024;
+  size_t html_len = strlen(title) + strlen(body) + 1024;
   char *html = malloc(html_len);
   snprintf(html, html_len, "<!DOCTYPE html>\n<html>\n<head>\n<title>\n%s\n</title>\n</head>\n<body>\n%s\n</body>\n</html>\n", title, body);
   return html;
@@ -207,12 +247,54 @@ char *new_html(char *title, char *body)
 
 char *new_http_html_response(char *html)
 {
-  int res_len = strlen(html) + 1024;
+  size_t res_len = strlen(html) + 1024;
   char *response = malloc(res_len);
   snprintf(response, res_len, "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\nContent-Length: %ld\r\n\r\n%s", strlen(html), html);
   return response;
 }
 
+int is_loopback(struct sockaddr_storage *addr)
+{
+  if (addr->ss_family == AF_INET)
+    return (ntohl(((struct sockaddr_in *)addr)->sin_addr.s_addr) >> 24) == 127;
+
+  if (addr->ss_family == AF_INET6)
+    return IN6_IS_ADDR_LOOPBACK(&((struct sockaddr_in6 *)addr)->sin6_addr);
+
+  return 0;
+}
+
+/**
+ * Target of a PURGE request
+ *
+ * "http://host/path"     single object
+ * "http://host/" + "*"   every object of the host
+ * "http://host/pre" + "*" every object under the prefix
+ * "http://" + "*.host/"  every object of hosts matching the glob
+ */
+unsigned int purge_uri(ObjectCache *cache, char *uri)
+{
+  size_t len = strlen(uri);
+
+  char *host = strstr(uri, "://");
+  host = host ? host + 3 : uri;
+  char *path = strchr(host, '/');
+
+  if (memchr(host, '*', (path ? path : uri + len) - host))
+    return ObjectCache_purge_glob(cache, uri);
+
+  if (len && uri[len - 1] == '*')
+  {
+    if (path == uri + len - 2)
+      return ObjectCache_purge_host(cache, uri);
+
+    uri[len - 1] = '\0';
+    return ObjectCache_purge_prefix(cache, uri);
+  }
+
+  return ObjectCache_purge(cache, uri);
+}
+
 /*
  * parse_uri - URI parser
  *
@@ -234,10 +316,17 @@ int parse_uri(char *uri, char *hostname, char *pathname, int *port)
     return -1;
   }
 
-  /* Extract the host name */
+  /* Extract the host name, an IPv6 address without its brackets */
   hostbegin = uri + 7;
-  hostend = strpbrk(hostbegin, " :/\r\n\0");
-  len = hostend - hostbegin;
+  if (*hostbegin == '[' && (hostend = strchr(hostbegin, ']')))
+  {
+    len = hostend++ - ++hostbegin;
+  }
+  else
+  {
+    hostend = strpbrk(hostbegin, " :/\r\n\0");
+    len = hostend - hostbegin;
+  }
   strncpy(hostname, hostbegin, len);
   hostname[len] = '\0';
 
@@ -388,6 +477,21 @@ void parse_args(CliArgs *cli_args, int argc, char **argv)
 /* Recommended max cache and object sizes */
 #define MAX_CACHE_SIZE 1049000
 #define MAX_OBJECT_SIZE 102400
+#define CACHE_POLICY CACHE_POLICY_LRU
+
+/* Build the image with ./blacklist compile blacklist.txt blacklist.bin */
+#define BLACKLIST_TEXT "blacklist.txt"
+#define BLACKLIST_IMAGE "blacklist.bin"
+/* Changes made through the control socket, replayed on every load */
+#define BLACKLIST_CHANGES "blacklist.changes"
+/* Client networks and the overlay of rules each gets over the blacklist */
+#define BLACKLIST_PROFILES "blacklist.profiles"
+/* Upstream lists layered under the blacklist by priority, read at start */
+#define BLACKLIST_SOURCES "blacklist.sources"
+#define BLACKLIST_SOCKET "blacklist.sock"
+/* Hits of every rule, written when the blacklist is replaced and on exit */
+#define BLACKLIST_HITS "blacklist.hits"
+#define BLACKLIST_TOP_RULES 20
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
@@ -401,6 +505,307 @@ static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64;
 
 */
 
+/*
+ * Compiled image of the blacklist when there is one at least as new as the
+ * text, the text otherwise
+ */
+char *blacklist_file(void)
+{
+  struct stat text, image;
+
+  if (stat(BLACKLIST_IMAGE, &image))
+    return BLACKLIST_TEXT;
+
+  if (!stat(BLACKLIST_TEXT, &text) && text.st_mtime > image.st_mtime)
+  {
+    printf("%s is older than %s, ignoring it\n", BLACKLIST_IMAGE, BLACKLIST_TEXT);
+    return BLACKLIST_TEXT;
+  }
+
+  return BLACKLIST_IMAGE;
+}
+
+/*
+ * Count the blocks by the rules of bl, a shard per worker. The list is fine
+ * without them
+ */
+void blacklist_hits_new(UrlBlacklist *bl)
+{
+  RuleHits *hits = malloc(sizeof(*hits));
+  if (hits && !RuleHits_new(hits, bl, MAX_WORKER_THREADS))
+  {
+    free(hits);
+    hits = NULL;
+  }
+
+  // a source is counted once it is already published
+  __atomic_store_n(&bl->hits, hits, __ATOMIC_RELEASE);
+}
+
+void blacklist_hits_free(UrlBlacklist *bl)
+{
+  if (!bl->hits)
+    return;
+
+  RuleHits_free(bl->hits);
+  free(bl->hits);
+  bl->hits = NULL;
+}
+
+/*
+ * The blacklist with the change log applied, the profiles over it and the
+ * sources under it, NULL if it can't be loaded
+ */
+PolicySet *blacklist_load(BlacklistSources *sources)
+{
+  char *file = blacklist_file();
+  UrlBlacklist *blacklist = malloc(sizeof(*blacklist));
+  PolicySet *policies = malloc(sizeof(*policies));
+
+  if (!UrlBlacklist_new(blacklist, file, '\n'))
+  {
+    printf("Could not load the blacklist from %s\n", file);
+    free(blacklist);
+    free(policies);
+    return NULL;
+  }
+
+  // the log only keeps what still differs from the file
+  int changes = UrlBlacklist_replay(blacklist, BLACKLIST_CHANGES, 1);
+  printf("Blacklist loaded from %s with %d changes from %s\n", file, changes, BLACKLIST_CHANGES);
+
+  if (!PolicySet_new(policies, blacklist, BLACKLIST_PROFILES))
+  {
+    printf("Could not load the profiles from %s\n", BLACKLIST_PROFILES);
+    UrlBlacklist_free(blacklist);
+    free(blacklist);
+    free(policies);
+    return NULL;
+  }
+
+  blacklist_hits_new(blacklist);
+  for (unsigned int i = 0; i < policies->profile_count; i++)
+    blacklist_hits_new(&policies->profiles[i].overlay);
+
+  BlacklistSources_attach(sources, blacklist);
+
+  return policies;
+}
+
+/*
+ * Write the rule hits of every list that counts them to fd, each after the
+ * name of its file: the profiles, the blacklist, then the sources. Returns
+ * the number of lists written
+ */
+int blacklist_dump_hits(PolicySet *policies, BlacklistSources *sources, int fd, unsigned int top, char unused)
+{
+  int written = 0;
+
+  for (unsigned int i = 0; i <= policies->profile_count + sources->source_count; i++)
+  {
+    UrlBlacklist *bl = i < policies->profile_count    ? &policies->profiles[i].overlay
+                       : i == policies->profile_count ? policies->base
+                                                      : sources->sources[i - policies->profile_count - 1].bl;
+    char *name = i < policies->profile_count    ? policies->profiles[i].name
+                 : i == policies->profile_count ? BLACKLIST_TEXT
+                                                : sources->sources[i - policies->profile_count - 1].filename;
+
+    if (!bl->hits)
+      continue;
+
+    dprintf(fd, "%s%s\n", written++ ? "\n" : "", name);
+    RuleHits_dump(bl->hits, fd, top, unused);
+  }
+
+  return written;
+}
+
+/*
+ * Write how often each rule blocked since its list was loaded, then every
+ * rule that never did, to BLACKLIST_HITS
+ */
+void blacklist_save_hits(PolicySet *policies, BlacklistSources *sources)
+{
+  int fd = open(BLACKLIST_HITS, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+  if (fd < 0)
+    return;
+
+  blacklist_dump_hits(policies, sources, fd, BLACKLIST_TOP_RULES, 1);
+  close(fd);
+}
+
+void blacklist_free(PolicySet *policies)
+{
+  UrlBlacklist *blacklist = policies->base;
+
+  blacklist_hits_free(blacklist);
+  for (unsigned int i = 0; i < policies->profile_count; i++)
+    blacklist_hits_free(&policies->profiles[i].overlay);
+
+  PolicySet_free(policies);
+  free(policies);
+  UrlBlacklist_free(blacklist);
+  free(blacklist);
+}
+
+/**
+ * Copy of rule, found by a lookup on blacklist, with the source it is from.
+ * Call inside the epoch section of the lookup
+ */
+char *blacklist_describe(WorkerThreadArg *arg, UrlBlacklist *blacklist, char *rule)
+{
+  char *copy = UrlBlacklist_get_rule(blacklist, rule);
+  char *source = BlacklistSources_name(arg->sources, rule);
+  char *described;
+
+  if (!source || asprintf(&described, "%s from %s", copy, source) < 0)
+    return copy;
+
+  free(copy);
+  return described;
+}
+
+/**
+ * Count a block by rule, found by a lookup on blacklist, for the list it is
+ * from. Call inside the epoch section of the lookup
+ */
+void blacklist_count(WorkerThreadArg *arg, UrlBlacklist *blacklist, char *rule)
+{
+  UrlBlacklist *layer = UrlBlacklist_layer(blacklist, rule);
+  RuleHits *hits = layer ? __atomic_load_n(&layer->hits, __ATOMIC_ACQUIRE) : NULL;
+
+  if (hits)
+    RuleHits_count(hits, arg->idx, rule);
+}
+
+/**
+ * Tell the client hostname is blocked and log why, frees rule
+ */
+void send_blocked(SafeQueue *log_sq, int connfd, struct sockaddr_storage clientaddr, char *hostname, char *rule)
+{
+  char *message;
+  LogQueueItem *log_item = malloc(sizeof(*log_item));
+  asprintf(&message, "Blacklisted %s for our client %d due to rule: %s", hostname, connfd, rule);
+  free(rule);
+  LogQueueItem_init(log_item, message, clientaddr, NULL, 0);
+  SafeQueue_push(log_sq, log_item);
+
+  asprintf(&message, "%s has been blocked by the proxy server", hostname);
+  char *html = new_html("Blocked", message);
+  free(message);
+  char *http_res = new_http_html_response(html);
+  free(html);
+  rio_writen(connfd, http_res, strlen(http_res));
+  free(http_res);
+}
+
+/**
+ * Whether the client's blacklist, or a list under it, has address rules
+ */
+char blacklist_has_addresses(WorkerThreadArg *arg, struct sockaddr_storage *clientaddr)
+{
+  char found = 0;
+
+  Epoch_enter(arg->epoch, arg->idx);
+  PolicySet *policies = __atomic_load_n(arg->policies, __ATOMIC_ACQUIRE);
+  for (UrlBlacklist *bl = PolicySet_select(policies, (SA *)clientaddr); bl && !found; bl = __atomic_load_n(&bl->base, __ATOMIC_ACQUIRE))
+    found = bl->addresses.node_count > 1;
+  Epoch_exit(arg->epoch, arg->idx);
+
+  return found;
+}
+
+/**
+ * Resolve hostname into *listp like open_clientfd, unless it resolves into
+ * a network the client's blacklist blocks. Then *rule is a copy of the rule
+ * and -3 is returned, -2 when it doesn't resolve. The caller frees *listp
+ * on success
+ */
+int resolve_origin(WorkerThreadArg *arg, struct sockaddr_storage *clientaddr, char *hostname, char *port, struct addrinfo **listp, char **rule)
+{
+  struct addrinfo hints = {0}, *p;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+
+  *rule = NULL;
+  *listp = NULL;
+  int rc = getaddrinfo(hostname, port, &hints, listp);
+  if (rc)
+  {
+    fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+    *listp = NULL;
+    return -2;
+  }
+
+  // any blocked address blocks the host, not only the one we would pick
+  Epoch_enter(arg->epoch, arg->idx);
+  PolicySet *policies = __atomic_load_n(arg->policies, __ATOMIC_ACQUIRE);
+  UrlBlacklist *blacklist = PolicySet_select(policies, (SA *)clientaddr);
+  for (p = *listp; p && !*rule; p = p->ai_next)
+  {
+    char *found = UrlBlacklist_exists_address(blacklist, p->ai_addr);
+    if (found)
+    {
+      blacklist_count(arg, blacklist, found);
+      *rule = blacklist_describe(arg, blacklist, found);
+    }
+  }
+  Epoch_exit(arg->epoch, arg->idx);
+
+  if (!*rule)
+    return 0;
+
+  freeaddrinfo(*listp);
+  *listp = NULL;
+
+  return -3;
+}
+
+/**
+ * Connect to the first address of listp that answers, -1 when none does
+ */
+int connect_origin(struct addrinfo *listp)
+{
+  int clientfd = -1;
+
+  for (struct addrinfo *p = listp; p; p = p->ai_next)
+  {
+    if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+      continue;
+
+    if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+      break;
+
+    close(clientfd);
+    clientfd = -1;
+  }
+
+  return clientfd;
+}
+
+/**
+ * Relay from until EOF through buf, like SpliceRelay_run. Returns the
+ * number of bytes relayed or -1
+ */
+ssize_t relay_copy(int from, int to, CacheFill *fill, char *buf, size_t size)
+{
+  ssize_t relayed = 0, n;
+
+  while ((n = read(from, buf, size)) != 0)
+  {
+    if (n < 0 && errno == EINTR)
+      continue;
+
+    if (n < 0 || rio_writen(to, buf, n) < 0)
+      return -1;
+
+    CacheFill_append(fill, buf, n);
+    relayed += n;
+  }
+
+  return relayed;
+}
+
 void *worker_thread(WorkerThreadArg *arg)
 {
   signal(SIGPIPE, SIG_IGN);
@@ -416,6 +821,17 @@ void *worker_thread(WorkerThreadArg *arg)
 
   BigBoi *bb = BigBoi_new(32);
 
+  // without pipes the body is copied through buf instead of spliced
+  SpliceRelay relay;
+  SpliceRelay *splice = SpliceRelay_new(&relay);
+  if (!splice)
+  {
+    log_item = malloc(sizeof(*log_item));
+    asprintf(&message, "Worker %d could not create its splice pipes: %s, copying instead", arg->uuid, strerror(errno));
+    LogQueueItem_init(log_item, message, SOCKADDR_EMPTY, NULL, 0);
+    SafeQueue_push(log_sq, log_item);
+  }
+
   while (1)
   {
     arg->busy = 0;
@@ -459,7 +875,7 @@ void *worker_thread(WorkerThreadArg *arg)
 
     sscanf(buf, "%s %s %s", method, uri, version);
 
-    if (strcmp(method, "GET"))
+    if (strcmp(method, "GET") && strcmp(method, "PURGE"))
     {
       log_item = malloc(sizeof(*log_item));
       asprintf(&message, "Method %s not implemented", method);
@@ -470,11 +886,45 @@ void *worker_thread(WorkerThreadArg *arg)
 
     // header
     char header[MAXLINE];
+    char range[MAXLINE] = {0};
+    char has_if_range = 0;
     ssize_t s;
     while ((s = rio_readlineb(&rio, header, MAXLINE)) > 2)
     {
       if (s < 0)
         goto close_fd;
+
+      if (!strncasecmp(header, "Range:", 6))
+        strcpy(range, header + 6);
+      else if (!strncasecmp(header, "If-Range:", 9))
+        has_if_range = 1;
+    }
+
+    // cache administration, only from this machine
+    if (!strcmp(method, "PURGE"))
+    {
+      char *res;
+      if (is_loopback(&clientaddr))
+      {
+        unsigned int purged = purge_uri(arg->cache, uri);
+        asprintf(&message, "Purged %u objects\n", purged);
+        asprintf(&res, "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %ld\r\n\r\n%s",
+                 purged ? "200 OK" : "404 Not Found", strlen(message), message);
+      }
+      else
+      {
+        asprintf(&message, "Refused purge of %s from a remote client", uri);
+        res = strmalloccpy("HTTP/1.0 403 Forbidden\r\nContent-Length: 0\r\n\r\n");
+      }
+
+      rio_writen(connfd, res, strlen(res));
+      free(res);
+      Close(connfd);
+
+      log_item = malloc(sizeof(*log_item));
+      LogQueueItem_init(log_item, message, clientaddr, strmalloccpy(uri), 0);
+      SafeQueue_push(log_sq, log_item);
+      continue;
     }
 
     BigBoi_reset(bb);
@@ -494,35 +944,85 @@ void *worker_thread(WorkerThreadArg *arg)
     // normalize hostname to lowercase
     strlwr(hostname);
 
-    // check blacklist
+    // check blacklist, the client's profile decides first
     char *rule;
-    if ((rule = UrlBlacklist_exists(arg->blacklist, hostname)))
+    Epoch_enter(arg->epoch, arg->idx);
+    PolicySet *policies = __atomic_load_n(arg->policies, __ATOMIC_ACQUIRE);
+    UrlBlacklist *blacklist = PolicySet_select(policies, (SA *)&clientaddr);
+    if ((rule = VerdictCache_exists(arg->verdicts, blacklist, hostname, *pathname ? pathname : "/")))
     {
-      log_item = malloc(sizeof(*log_item));
-      rule = UrlBlacklist_get_rule(arg->blacklist, rule);
-      asprintf(&message, "Blacklisted %s for our client %d due to rule: %s", hostname, connfd, rule);
-      free(rule);
-      LogQueueItem_init(log_item, message, clientaddr, NULL, 0);
-      SafeQueue_push(log_sq, log_item);
+      blacklist_count(arg, blacklist, rule);
+      rule = blacklist_describe(arg, blacklist, rule);
+    }
+    Epoch_exit(arg->epoch, arg->idx);
 
-      asprintf(&message, "%s has been blocked by the proxy server", hostname);
-      char *html = new_html("Blocked", message);
-      free(message);
-      char *http_res = new_http_html_response(html);
-      free(html);
-      if (rio_writen(connfd, http_res, strlen(http_res)) < 0)
-      {
-        free(http_res);
-        goto close_fd;
-      }
-      free(http_res);
+    if (rule)
+    {
+      send_blocked(log_sq, connfd, clientaddr, hostname, rule);
       goto close_fd;
     }
 
     sprintf(port_str, "%d", port_num);
 
+    // the addresses have rules too and decide for cached objects as well,
+    // without address rules a name is only resolved to fetch it
+    struct addrinfo *listp = NULL;
+    int resolved = blacklist_has_addresses(arg, &clientaddr) ? resolve_origin(arg, &clientaddr, hostname, port_str, &listp, &rule) : 1;
+
+    if (rule)
+    {
+      send_blocked(log_sq, connfd, clientaddr, hostname, rule);
+      goto close_fd;
+    }
+
+    // serve from cache
+    CacheObject *cached = resolved >= 0 ? ObjectCache_get(arg->cache, uri) : NULL;
+    if (cached)
+    {
+      if (listp)
+        freeaddrinfo(listp);
+
+      size_t body_length = cached->size - cached->header_length;
+      ssize_t sent;
+
+      // we keep no validators, so a conditional range always gets the full object
+      HttpRange ranges[HTTP_RANGE_MAX];
+      int n = range[0] && !has_if_range
+                  ? HttpRange_parse(range, body_length, ranges, HTTP_RANGE_MAX)
+                  : 0;
+
+      if (n)
+        sent = HttpRange_send(connfd, cached->fd, cached->header_length, body_length, cached->content_type, ranges, n);
+      else
+        sent = HttpRange_sendfile(connfd, cached->fd, 0, cached->size);
+
+      ObjectCache_release(arg->cache, cached);
+
+      if (sent < 0)
+        goto close_fd;
+
+      Close(connfd);
+
+      log_item = malloc(sizeof(*log_item));
+      asprintf(&message, "served %zd bytes from cache for %d%s", sent, connfd, n ? " (range)" : "");
+      LogQueueItem_init(log_item, message, clientaddr, strmalloccpy(uri), 0);
+      SafeQueue_push(log_sq, log_item);
+      continue;
+    }
+
+    if (resolved > 0)
+      resolved = resolve_origin(arg, &clientaddr, hostname, port_str, &listp, &rule);
+
+    if (rule)
+    {
+      send_blocked(log_sq, connfd, clientaddr, hostname, rule);
+      goto close_fd;
+    }
+
     // Open client connection
-    int clientfd = open_clientfd(hostname, port_str);
+    int clientfd = resolved < 0 ? -1 : connect_origin(listp);
+    if (listp)
+      freeaddrinfo(listp);
 
     if (clientfd < 0)
     {
@@ -543,9 +1043,15 @@ void *worker_thread(WorkerThreadArg *arg)
     BigBoi_reset(bb);
     snprintf(line, sizeof(line), "GET %s HTTP/1.0\r\n", pathname);
     BigBoi_append_str(bb, line);
-    sprintf(line, "Host: %s\r\n", hostname);
+    sprintf(line, strchr(hostname, ':') ? "Host: [%s]\r\n" : "Host: %s\r\n", hostname);
     BigBoi_append_str(bb, line);
     BigBoi_append_str(bb, user_agent_hdr);
+    // partial responses are relayed but never cached
+    if (range[0])
+    {
+      BigBoi_append_str(bb, "Range:");
+      BigBoi_append_str(bb, range);
+    }
     BigBoi_append_str(bb, "Connection: close\r\n");
     BigBoi_append_str(bb, "Proxy-Connection: close\r\n\r\n");
 
@@ -553,6 +1059,7 @@ void *worker_thread(WorkerThreadArg *arg)
     if (rio_writen(clientfd, str, bb->total_length) < 0)
     {
       free(str);
+      Close(clientfd);
       goto close_fd;
     }
     free(str);
@@ -561,19 +1068,52 @@ void *worker_thread(WorkerThreadArg *arg)
     rio_t server_rio;
     rio_readinitb(&server_rio, clientfd);
 
+    CacheFill fill;
+    CacheFill_begin(&fill, range[0] ? 0 : MAX_OBJECT_SIZE);
+
+    // headers go through rio so they can be logged, the body is spliced
     BigBoi_reset(bb);
     for (int n; (n = rio_readlineb(&server_rio, buf, MAXLINE)) > 0;)
     {
-      if (n < 0)
-        goto close_fd;
-
       BigBoi_append_strn(bb, buf, n);
+      CacheFill_append(&fill, buf, n);
       if (rio_writen(connfd, buf, n) < 0)
       {
+        CacheFill_abort(&fill);
+        Close(clientfd);
         goto close_fd;
       }
+
+      if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+        break;
+    }
+
+    // body bytes rio already buffered
+    ssize_t relayed = server_rio.rio_cnt;
+    if (relayed > 0)
+    {
+      CacheFill_append(&fill, server_rio.rio_bufptr, relayed);
+      if (rio_writen(connfd, server_rio.rio_bufptr, relayed) < 0)
+      {
+        CacheFill_abort(&fill);
+        Close(clientfd);
+        goto close_fd;
+      }
+    }
+
+    ssize_t spliced = splice ? SpliceRelay_run(splice, clientfd, connfd, &fill) : relay_copy(clientfd, connfd, &fill, buf, MAXLINE);
+    Close(clientfd);
+
+    if (spliced < 0)
+    {
+      CacheFill_abort(&fill);
+      goto close_fd;
     }
 
+    relayed += spliced + bb->total_length;
+
+    CacheFill_commit(&fill, arg->cache, uri);
+
     // Log response
     log_item = malloc(sizeof(*log_item));
     asprintf(&message, "sending payload for %d", connfd);
@@ -581,7 +1121,7 @@ void *worker_thread(WorkerThreadArg *arg)
     SafeQueue_push(log_sq, log_item);
 
     log_item = malloc(sizeof(*log_item));
-    LogQueueItem_init(log_item, BigBoi_to_str(bb), clientaddr, strmalloccpy(uri), bb->total_length);
+    LogQueueItem_init(log_item, BigBoi_to_str(bb), clientaddr, strmalloccpy(uri), relayed);
     SafeQueue_push(log_sq, log_item);
 
     Close(connfd);
@@ -608,6 +1148,8 @@ void *worker_thread(WorkerThreadArg *arg)
   SafeQueue_push(log_sq, log_item);
 
   BigBoi_free(bb);
+  if (splice)
+    SpliceRelay_free(splice);
 
   arg->busy = 0;
   pthread_exit(NULL);
@@ -714,6 +1256,372 @@ void sigint_handler(int sig)
   should_close_server = 1;
 }
 
+/*
+              __                __
+   ________  / /___  ____ _____/ /__  _____
+  / ___/ _ \/ / __ \/ __ `/ __  / _ \/ ___/
+ / /  /  __/ / /_/ / /_/ / /_/ /  __/ /
+/_/   \___/_/\____/\__,_/\__,_/\___/_/
+
+*/
+
+/*
+ * Watch the directory of every source, wds[i] is the watch of source i
+ */
+void blacklist_watch_sources(BlacklistSources *sources, int ifd, int *wds)
+{
+  for (unsigned int i = 0; i < sources->source_count; i++)
+  {
+    char *filename = sources->sources[i].filename;
+    char *slash = strrchr(filename, '/');
+    char *directory = slash ? strndup(filename, slash - filename + 1) : strdup(".");
+
+    wds[i] = ifd >= 0 && directory ? inotify_add_watch(ifd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+    free(directory);
+  }
+}
+
+/*
+ * Whether an inotify buffer mentions one of the blacklist files in the
+ * working directory, watched as wd. Marks the sources it mentions in changed
+ */
+int blacklist_changed(BlacklistSources *sources, int wd, int *wds, char *buf, ssize_t len, char *changed)
+{
+  int reload = 0;
+
+  for (char *p = buf; p < buf + len;)
+  {
+    struct inotify_event *event = (struct inotify_event *)p;
+    p += sizeof(*event) + event->len;
+
+    if (!event->len)
+      continue;
+
+    if (event->wd == wd && (!strcmp(event->name, BLACKLIST_TEXT) || !strcmp(event->name, BLACKLIST_IMAGE) || !strcmp(event->name, BLACKLIST_PROFILES)))
+      reload = 1;
+
+    for (unsigned int i = 0; i < sources->source_count; i++)
+    {
+      char *filename = sources->sources[i].filename;
+      char *slash = strrchr(filename, '/');
+
+      if (event->wd == wds[i] && !strcmp(event->name, slash ? slash + 1 : filename))
+        changed[i] = 1;
+    }
+  }
+
+  return reload;
+}
+
+/*
+ * Whether any address of hostname is blocked for some client, the overlays
+ * are checked with the base behind them
+ */
+char blacklist_blocks_addresses(PolicySet *policies, char *hostname)
+{
+  struct addrinfo hints = {0}, *listp, *p;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if (getaddrinfo(hostname, NULL, &hints, &listp))
+    return 0;
+
+  char blocked = 0;
+  for (p = listp; p && !blocked; p = p->ai_next)
+  {
+    blocked = !!UrlBlacklist_exists_address(policies->base, p->ai_addr);
+    for (unsigned int i = 0; i < policies->profile_count && !blocked; i++)
+      blocked = !!UrlBlacklist_exists_address(&policies->profiles[i].overlay, p->ai_addr);
+  }
+
+  freeaddrinfo(listp);
+
+  return blocked;
+}
+
+/*
+ * Drop the cached objects of hosts that resolve into a blocked network,
+ * they would not be served anyway. Only the reloader calls this, it can use
+ * the published lists as they are
+ */
+void blacklist_purge_cache(ReloaderArg *arg)
+{
+  PolicySet *policies = *arg->policies;
+
+  // without address rules nothing in the cache can be blocked by them
+  char addresses = 0;
+  for (UrlBlacklist *bl = policies->base; bl && !addresses; bl = bl->base)
+    addresses = bl->addresses.node_count > 1;
+  for (unsigned int i = 0; i < policies->profile_count && !addresses; i++)
+    addresses = policies->profiles[i].overlay.addresses.node_count > 1;
+
+  char **names;
+  int count = addresses ? ObjectCache_hosts(arg->cache, &names) : -1;
+  if (count < 0)
+    return;
+
+  // resolving can take a while, the cache stays unlocked meanwhile
+  unsigned int purged = 0;
+  for (int i = 0; i < count; i++)
+  {
+    if (blacklist_blocks_addresses(policies, names[i]))
+      purged += ObjectCache_purge_host(arg->cache, names[i]);
+    free(names[i]);
+  }
+  free(names);
+
+  if (purged)
+    printf("Purged %u cached objects of blocked addresses\n", purged);
+}
+
+/*
+ * Open the change log for appending again, loading the blacklist replaces
+ * it with a compacted one
+ */
+void blacklist_open_log(ReloaderArg *arg)
+{
+  if (arg->log_fd >= 0)
+    close(arg->log_fd);
+
+  arg->log_fd = open(BLACKLIST_CHANGES, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+}
+
+/*
+ * Load the blacklist again and publish it, workers keep using the old one
+ * until then. Returns 0 on success
+ */
+int blacklist_reload(ReloaderArg *arg)
+{
+  PolicySet *next = blacklist_load(arg->sources);
+  if (!next)
+  {
+    printf("Blacklist reload failed, keeping the current one\n");
+    return -1;
+  }
+
+  blacklist_open_log(arg);
+
+  PolicySet *old = Epoch_swap(arg->epoch, (void **)arg->policies, next);
+  blacklist_save_hits(old, arg->sources);
+  blacklist_free(old);
+  blacklist_purge_cache(arg);
+
+  return 0;
+}
+
+/*
+ * Load source index again and link it in place of the old one, the rest of
+ * the blacklist stays. Returns 0 on success
+ */
+int blacklist_reload_source(ReloaderArg *arg, unsigned int index)
+{
+  char *filename = arg->sources->sources[index].filename;
+
+  // the counts of the old list start over with the new one
+  blacklist_save_hits(*arg->policies, arg->sources);
+
+  UrlBlacklist *old = BlacklistSources_reload(arg->sources, index);
+  if (!old)
+  {
+    printf("Reloading %s failed, keeping the current one\n", filename);
+    return -1;
+  }
+
+  blacklist_hits_new(arg->sources->sources[index].bl);
+  Epoch_synchronize(arg->epoch);
+  blacklist_hits_free(old);
+  UrlBlacklist_free(old);
+  free(old);
+  printf("Blacklist source %s reloaded\n", filename);
+  blacklist_purge_cache(arg);
+
+  return 0;
+}
+
+/*
+ * Apply the "+rule" and "-rule" lines of one control connection, each is
+ * written to the change log first and answered with "ok" once it is in
+ * effect, "error ..." otherwise. "hits
+ * [top]" is answered with the rules that blocked the most, "unused" with
+ * the ones that never did
+ */
+void blacklist_control(ReloaderArg *arg, int connfd)
+{
+  char request[4096];
+  size_t length = 0;
+  struct pollfd pfd = {connfd, POLLIN};
+
+  // a client gets a second to send its changes
+  while (length < sizeof(request) - 1 && poll(&pfd, 1, 1000) > 0)
+  {
+    ssize_t n = read(connfd, request + length, sizeof(request) - 1 - length);
+    if (n <= 0)
+      break;
+
+    length += n;
+    if (request[length - 1] == '\n')
+      break;
+  }
+
+  request[length] = '\0';
+
+  for (char *line = strtok(request, "\n"); line; line = strtok(NULL, "\n"))
+  {
+    if (!strncmp(line, "hits", 4) || !strcmp(line, "unused"))
+    {
+      char unused = *line == 'u';
+      int top = unused ? 0 : line[4] ? atoi(line + 4) : BLACKLIST_TOP_RULES;
+
+      char *reply = "error: rule hits are not counted\n";
+
+      if (!blacklist_dump_hits(*arg->policies, arg->sources, connfd, top > 0 ? top : 0, unused))
+        write(connfd, reply, strlen(reply));
+      continue;
+    }
+
+    // the reloader is the only writer, it can use the published list as is.
+    // Profiles see the change through their base
+    UrlBlacklist *blacklist = (*arg->policies)->base;
+    char *reply = "ok\n";
+    off_t logged = arg->log_fd >= 0 ? lseek(arg->log_fd, 0, SEEK_END) : -1;
+
+    // a change is only made once a reload would make it again
+    if (arg->log_fd < 0 || logged < 0)
+      reply = "error: could not open " BLACKLIST_CHANGES "\n";
+    else if (UrlBlacklist_check(blacklist, line))
+      reply = "error: not a domain rule, or not in the blacklist\n";
+    else if (dprintf(arg->log_fd, "%s\n", line) < 0 || fdatasync(arg->log_fd))
+    {
+      // no half written line for the next replay
+      ftruncate(arg->log_fd, logged);
+      reply = "error: could not write " BLACKLIST_CHANGES "\n";
+    }
+    else if (!UrlBlacklist_apply(blacklist, line))
+    {
+      // an added rule is counted from now on
+      if (blacklist->hits)
+        RuleHits_sync(blacklist->hits);
+    }
+    else if (blacklist_reload(arg))
+    {
+      // the log is still the one the change went to
+      ftruncate(arg->log_fd, logged);
+      reply = "error: no room for the change and the reload failed\n";
+    }
+    else if (!UrlBlacklist_in_effect((*arg->policies)->base, line))
+      reply = "error: no room left for added rules\n";
+
+    printf("Blacklist change %s: %s", line, reply);
+    write(connfd, reply, strlen(reply));
+  }
+}
+
+/*
+ * Rebuilds the blacklist on SIGHUP or when its files change, and applies
+ * changes sent to the control socket
+ */
+void *reloader_thread(ReloaderArg *arg)
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGHUP);
+
+  // SIGHUP is blocked in every thread, it only ever arrives here
+  int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  int ifd = inotify_init1(IN_CLOEXEC);
+  int wd = ifd >= 0 ? inotify_add_watch(ifd, ".", IN_CLOSE_WRITE | IN_MOVED_TO) : -1;
+  if (ifd >= 0 && wd < 0)
+  {
+    close(ifd);
+    ifd = -1;
+  }
+
+  // a source in the working directory shares its watch
+  int wds[BLACKLIST_SOURCES_MAX];
+  blacklist_watch_sources(arg->sources, ifd, wds);
+
+  // only local users may change the blacklist
+  int cfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  struct sockaddr_un control = {AF_UNIX, BLACKLIST_SOCKET};
+  unlink(BLACKLIST_SOCKET);
+  mode_t umask_before = umask(077);
+  if (cfd >= 0 && (bind(cfd, (SA *)&control, sizeof(control)) || listen(cfd, 16)))
+  {
+    close(cfd);
+    cfd = -1;
+  }
+  umask(umask_before);
+
+  blacklist_open_log(arg);
+
+  struct pollfd fds[3] = {{sfd, POLLIN}, {ifd, POLLIN}, {cfd, POLLIN}};
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  while (!should_close_server)
+  {
+    if (poll(fds, 3, 100) <= 0)
+      continue;
+
+    if (fds[2].revents & POLLIN)
+    {
+      int connfd = accept4(cfd, NULL, NULL, SOCK_CLOEXEC);
+      if (connfd >= 0)
+      {
+        blacklist_control(arg, connfd);
+        close(connfd);
+      }
+    }
+
+    int reload = 0;
+    char changed[BLACKLIST_SOURCES_MAX] = {0};
+
+    // SIGHUP reloads every source too
+    if (fds[0].revents & POLLIN)
+    {
+      struct signalfd_siginfo info;
+      reload |= read(sfd, &info, sizeof(info)) == sizeof(info);
+      memset(changed, reload, sizeof(changed));
+    }
+
+    ssize_t len = fds[1].revents & POLLIN ? read(ifd, buf, sizeof(buf)) : 0;
+    reload |= len > 0 && blacklist_changed(arg->sources, wd, wds, buf, len, changed);
+
+    char sources_changed = 0;
+    for (unsigned int i = 0; i < arg->sources->source_count; i++)
+      sources_changed |= changed[i];
+
+    if (!reload && !sources_changed)
+      continue;
+
+    // editors and the compile tool touch both files, wait for them to settle
+    usleep(200 * 1000);
+    while (poll(&fds[1], 1, 0) > 0 && (len = read(ifd, buf, sizeof(buf))) > 0)
+      reload |= blacklist_changed(arg->sources, wd, wds, buf, len, changed);
+
+    for (unsigned int i = 0; i < arg->sources->source_count; i++)
+    {
+      if (changed[i])
+        blacklist_reload_source(arg, i);
+    }
+
+    if (reload)
+      blacklist_reload(arg);
+  }
+
+  if (cfd >= 0)
+  {
+    close(cfd);
+    unlink(BLACKLIST_SOCKET);
+  }
+  if (arg->log_fd >= 0)
+    close(arg->log_fd);
+  if (sfd >= 0)
+    close(sfd);
+  if (ifd >= 0)
+    close(ifd);
+
+  pthread_exit(NULL);
+}
+
 /*
                     _          __  __                        __
    ____ ___  ____ _(_)___     / /_/ /_  ________  ____ _____/ /
@@ -726,6 +1634,12 @@ int main(int argc, char **argv)
 {
   signal(SIGINT, sigint_handler);
 
+  // handled by the reloader through a signalfd, threads inherit the mask
+  sigset_t reload_mask;
+  sigemptyset(&reload_mask);
+  sigaddset(&reload_mask, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &reload_mask, NULL);
+
   CliArgs args;
   parse_args(&args, argc, argv);
 
@@ -738,10 +1652,39 @@ int main(int argc, char **argv)
 
   printf("Proxy server running on port %s\n", args.port_str);
 
-  // initialize blacklist
-  UrlBlacklist blacklist;
-  UrlBlacklist_new(&blacklist, "blacklist.txt", '\n', 20);
-  UrlBlacklist_print_table(&blacklist);
+  // initialize blacklist, sources first so it is attached to them
+  BlacklistSources sources;
+  if (!BlacklistSources_new(&sources, BLACKLIST_SOURCES))
+  {
+    printf("Could not load the sources from %s\n", BLACKLIST_SOURCES);
+    return 1;
+  }
+
+  for (unsigned int i = 0; i < sources.source_count; i++)
+    blacklist_hits_new(sources.sources[i].bl);
+
+  PolicySet *policies = blacklist_load(&sources);
+  if (!policies)
+    return 1;
+  UrlBlacklist_print_table(policies->base);
+  PolicySet_print_table(policies);
+  BlacklistSources_print_table(&sources);
+
+  // one reader slot per worker
+  Epoch epoch;
+  Epoch_new(&epoch, MAX_WORKER_THREADS);
+
+  // 16 shards of 1024 hostnames
+  VerdictCache verdicts;
+  VerdictCache_new(&verdicts, 4, 10);
+
+  // initialize cache, the reloader purges what new address rules block
+  ObjectCache cache;
+  ObjectCache_new(&cache, MAX_CACHE_SIZE, MAX_OBJECT_SIZE, 10, CACHE_POLICY);
+
+  ReloaderArg reloader_arg = {&policies, &epoch, &sources, &cache, -1};
+  pthread_t reloader_pt;
+  pthread_create(&reloader_pt, NULL, (void *(*)(void *))reloader_thread, &reloader_arg);
 
   // initialize queues
   SafeQueue connection_sq = SafeQueue_new(QUEUE_SIZE);
@@ -768,7 +1711,7 @@ int main(int argc, char **argv)
 
   // initialize worker threads
   WorkerThreadArg worker_args[MAX_WORKER_THREADS] = {0};
-  worker_args[0] = (WorkerThreadArg){0, uuid++, 0, 0, &connection_sq, &log_sq, &blacklist};
+  worker_args[0] = (WorkerThreadArg){0, uuid++, 0, 0, &connection_sq, &log_sq, &policies, &verdicts, &cache, &epoch, &sources};
   pthread_t worker_pt;
   pthread_create(&worker_pt, NULL, (void *(*)(void *))worker_thread, &worker_args[0]);
   worker_args[0].thread_id = worker_pt;
@@ -820,7 +1763,7 @@ int main(int argc, char **argv)
         if (worker_args[i].thread_id)
           continue;
 
-        worker_args[i] = (WorkerThreadArg){0, uuid++, i, 0, &connection_sq, &log_sq, &blacklist};
+        worker_args[i] = (WorkerThreadArg){0, uuid++, i, 0, &connection_sq, &log_sq, &policies, &verdicts, &cache, &epoch, &sources};
         pthread_t worker_pt;
         pthread_create(
             &worker_pt,
@@ -874,13 +1817,25 @@ int main(int argc, char **argv)
 
   pthread_join(file_writer_pt, NULL);
 
+  pthread_join(reloader_pt, NULL);
+
   close(logfile_fd);
 
   SafeQueue_free(&connection_sq);
   SafeQueue_free(&log_sq);
   SafeQueue_free(&file_write_sq);
 
-  UrlBlacklist_free(&blacklist);
+  VerdictCache_print_stats(&verdicts);
+  VerdictCache_free(&verdicts);
+  blacklist_save_hits(policies, &sources);
+  blacklist_free(policies);
+  for (unsigned int i = 0; i < sources.source_count; i++)
+    blacklist_hits_free(sources.sources[i].bl);
+  BlacklistSources_free(&sources);
+  Epoch_free(&epoch);
+
+  ObjectCache_print_stats(&cache);
+  ObjectCache_free(&cache);
 
   printf("Proxy server exited\n");
 